@@ -63,7 +63,9 @@ show_pkg_deps(struct xbps_handle *xhp, const char *pkgname)
 int
 show_pkg_reverse_deps(struct xbps_handle *xhp, const char *pkgname)
 {
+	prop_array_t revdeps;
 	prop_dictionary_t pkgd;
+	const char *rpkgname;
 	int rv = 0;
 
 	pkgd = xbps_find_virtualpkg_dict_installed(xhp, pkgname, false);
@@ -74,8 +76,14 @@ show_pkg_reverse_deps(struct xbps_handle *xhp, const char *pkgname)
 			return 0;
 		}
 	}
-	rv = xbps_callback_array_iter_in_dict(xhp, pkgd, "requiredby",
+	prop_dictionary_get_cstring_nocopy(pkgd, "pkgname", &rpkgname);
+	revdeps = xbps_pkgdb_get_pkg_revdeps(xhp, rpkgname);
+	if (revdeps == NULL)
+		return errno;
+
+	rv = xbps_callback_array_iter(xhp, revdeps,
 	    list_strings_sep_in_array, NULL);
+	prop_object_release(revdeps);
 
 	return rv;
 }
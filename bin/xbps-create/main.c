@@ -84,7 +84,9 @@ usage(void)
 	"                         e.g: 'foo>=1.0 blah<2.0').\n"
 	"    -S, --long-desc      Long description (80 cols per line).\n"
 	"    -s, --desc           Short description (max 80 characters).\n"
-	"    -V, --version        Prints XBPS release version.\n\n"
+	"    -V, --version        Prints XBPS release version.\n"
+	"    -x, --sidecar        Also write uncompressed props.plist and\n"
+	"                         files.plist next to the binary package.\n\n"
 	"  NOTE:\n"
 	"    At least three flags are required: architecture, pkgver and desc.\n\n"
 	"  EXAMPLE:\n"
@@ -489,6 +491,28 @@ process_archive(struct archive *ar, const char *pkgver, bool quiet)
 	}
 }
 
+/*
+ * Sidecar plists are only used while size and mtime match those of
+ * the binary package, see lib/plist_fetch.c.
+ */
+static void
+write_sidecar(const char *binpkg, const char *plistf, prop_dictionary_t d,
+	      const char *comptype, struct stat *st)
+{
+	char *path;
+
+	prop_dictionary_set_cstring_nocopy(d,
+	    "archive-compression-type", comptype);
+	prop_dictionary_set_uint64(d, "filename-size", (uint64_t)st->st_size);
+	prop_dictionary_set_uint64(d, "filename-mtime", (uint64_t)st->st_mtime);
+
+	path = xbps_xasprintf("%s.%s", binpkg, plistf);
+	assert(path);
+	if (!prop_dictionary_externalize_to_file(d, path))
+		die("failed to write %s:", path);
+	free(path);
+}
+
 static void
 set_build_date(void)
 {
@@ -529,6 +553,7 @@ main(int argc, char **argv)
 		{ "long-desc", required_argument, NULL, 'S' },
 		{ "desc", required_argument, NULL, 's' },
 		{ "version", no_argument, NULL, 'V' },
+		{ "sidecar", no_argument, NULL, 'x' },
 		{ 0, 0, 0, 0 }
 	};
 	struct archive *ar;
@@ -537,7 +562,8 @@ main(int argc, char **argv)
 	const char *provides, *pkgver, *replaces, *desc, *ldesc;
 	const char *arch, *config_files, *mutable_files, *version;
 	char *pkgname, *binpkg, *tname, *p, cwd[PATH_MAX-1];
-	bool quiet = false, preserve = false;
+	const char *comptype;
+	bool quiet = false, preserve = false, sidecar = false;
 	int c, pkg_fd;
 	mode_t myumask;
 
@@ -546,7 +572,7 @@ main(int argc, char **argv)
 	config_files = mutable_files = NULL;
 
 	while ((c = getopt_long(argc, argv,
-		"A:B:C:D:F:H:hl:M:m:n:P:pqR:S:s:V", longopts, &c)) != -1) {
+		"A:B:C:D:F:H:hl:M:m:n:P:pqR:S:s:Vx", longopts, &c)) != -1) {
 		if (optarg && strcmp(optarg, "") == 0)
 			optarg = NULL;
 
@@ -605,6 +631,9 @@ main(int argc, char **argv)
 		case 'V':
 			printf("%s\n", XBPS_RELVER);
 			exit(EXIT_SUCCESS);
+		case 'x':
+			sidecar = true;
+			break;
 		case '?':
 		default:
 			usage();
@@ -715,9 +744,8 @@ main(int argc, char **argv)
 		die("Failed to open %s fd for writing:", tname);
 
 	process_archive(ar, pkgver, quiet);
+	comptype = archive_filter_name(ar, 0);
 	archive_write_free(ar);
-	prop_object_release(pkg_propsd);
-	prop_object_release(pkg_filesd);
 	/*
 	 * Archive was created successfully; flush data to storage,
 	 * set permissions and rename to dest file; from the caller's
@@ -736,6 +764,15 @@ main(int argc, char **argv)
 	if (rename(tname, binpkg) == -1)
 		die("cannot rename %s to %s:", tname, binpkg);
 
+	if (sidecar) {
+		if (fstat(pkg_fd, &st) == -1)
+			die("cannot fstat() %s:", binpkg);
+		write_sidecar(binpkg, XBPS_PKGPROPS, pkg_propsd, comptype, &st);
+		write_sidecar(binpkg, XBPS_PKGFILES, pkg_filesd, comptype, &st);
+	}
+	prop_object_release(pkg_propsd);
+	prop_object_release(pkg_filesd);
+
 	/* Success, release resources */
 	if (!quiet)
 		printf("%s: binary package created successfully (%s)\n",
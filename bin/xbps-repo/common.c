@@ -39,7 +39,9 @@
 int
 repo_remove_pkg(const char *repodir, const char *arch, const char *file)
 {
+	const char *sidecars[] = { XBPS_PKGPROPS, XBPS_PKGFILES, NULL };
 	char *filepath;
+	size_t i;
 	int rv;
 
 	/* Remove real binpkg */
@@ -66,5 +68,166 @@ repo_remove_pkg(const char *repodir, const char *arch, const char *file)
 	}
 	free(filepath);
 
+	/* Remove sidecar metadata plists written by xbps-create -x */
+	for (i = 0; sidecars[i] != NULL; i++) {
+		filepath = xbps_xasprintf("%s/%s/%s.%s", repodir, arch,
+		    file, sidecars[i]);
+		assert(filepath);
+		(void)remove(filepath);
+		free(filepath);
+		filepath = xbps_xasprintf("%s/%s.%s", repodir, file,
+		    sidecars[i]);
+		assert(filepath);
+		(void)remove(filepath);
+		free(filepath);
+	}
+
+	return 0;
+}
+
+/*
+ * Map of package dictionaries keyed by a string object (pkgname or
+ * pkgver), to look up index entries in constant time. Entries with the
+ * same key are kept in insertion order, so that repo_pkgmap_find()
+ * returns the same object than a linear search in the index array.
+ */
+struct repo_pkgmap_entry {
+	const char *key;
+	prop_dictionary_t pkgd;
+	struct repo_pkgmap_entry *next;
+};
+
+struct repo_pkgmap {
+	const char *keyobj;
+	struct repo_pkgmap_entry **buckets;
+	size_t nbuckets;
+};
+
+static size_t
+pkgmap_hash(struct repo_pkgmap *map, const char *key)
+{
+	return xbps_strhash(key) & (map->nbuckets - 1);
+}
+
+struct repo_pkgmap *
+repo_pkgmap_create(const char *keyobj, size_t hint)
+{
+	struct repo_pkgmap *map;
+
+	if ((map = malloc(sizeof(*map))) == NULL)
+		return NULL;
+
+	map->keyobj = keyobj;
+	map->nbuckets = 64;
+	while (map->nbuckets < hint)
+		map->nbuckets *= 2;
+	if ((map->buckets = calloc(map->nbuckets,
+	    sizeof(*map->buckets))) == NULL) {
+		free(map);
+		return NULL;
+	}
+	return map;
+}
+
+int
+repo_pkgmap_add(struct repo_pkgmap *map, prop_dictionary_t pkgd)
+{
+	struct repo_pkgmap_entry *e, **ep;
+	const char *key;
+
+	if (!prop_dictionary_get_cstring_nocopy(pkgd, map->keyobj, &key))
+		return EINVAL;
+	if ((e = malloc(sizeof(*e))) == NULL)
+		return ENOMEM;
+
+	e->key = key;
+	e->pkgd = pkgd;
+	e->next = NULL;
+	prop_object_retain(pkgd);
+	for (ep = &map->buckets[pkgmap_hash(map, key)]; *ep; ep = &(*ep)->next)
+		;
+	*ep = e;
+
 	return 0;
 }
+
+/*
+ * Returns the first package added with `key' matching `arch', as
+ * xbps_find_pkg_in_array_by_{name,pkgver}() would do in the index.
+ */
+prop_dictionary_t
+repo_pkgmap_find(struct xbps_handle *xhp,
+		 struct repo_pkgmap *map,
+		 const char *key,
+		 const char *arch)
+{
+	struct repo_pkgmap_entry *e;
+	const char *parch;
+
+	for (e = map->buckets[pkgmap_hash(map, key)]; e; e = e->next) {
+		if (strcmp(e->key, key))
+			continue;
+		if (prop_dictionary_get_cstring_nocopy(e->pkgd,
+		    "architecture", &parch) &&
+		    !xbps_pkg_arch_match(xhp, parch, arch))
+			continue;
+		return e->pkgd;
+	}
+	return NULL;
+}
+
+bool
+repo_pkgmap_contains(struct repo_pkgmap *map, prop_dictionary_t pkgd)
+{
+	struct repo_pkgmap_entry *e;
+	const char *key;
+
+	if (!prop_dictionary_get_cstring_nocopy(pkgd, map->keyobj, &key))
+		return false;
+
+	for (e = map->buckets[pkgmap_hash(map, key)]; e; e = e->next) {
+		if (e->pkgd == pkgd)
+			return true;
+	}
+	return false;
+}
+
+void
+repo_pkgmap_remove(struct repo_pkgmap *map, prop_dictionary_t pkgd)
+{
+	struct repo_pkgmap_entry *e, **ep;
+	const char *key;
+
+	if (!prop_dictionary_get_cstring_nocopy(pkgd, map->keyobj, &key))
+		return;
+
+	for (ep = &map->buckets[pkgmap_hash(map, key)]; *ep; ep = &e->next) {
+		e = *ep;
+		if (e->pkgd == pkgd) {
+			*ep = e->next;
+			prop_object_release(e->pkgd);
+			free(e);
+			return;
+		}
+	}
+}
+
+void
+repo_pkgmap_free(struct repo_pkgmap *map)
+{
+	struct repo_pkgmap_entry *e;
+	size_t i;
+
+	if (map == NULL)
+		return;
+
+	for (i = 0; i < map->nbuckets; i++) {
+		while ((e = map->buckets[i]) != NULL) {
+			map->buckets[i] = e->next;
+			prop_object_release(e->pkgd);
+			free(e);
+		}
+	}
+	free(map->buckets);
+	free(map);
+}
@@ -37,15 +37,50 @@ struct repo_search_data {
 };
 
 /* From common.c */
+struct repo_pkgmap;
+
 int	repo_remove_pkg(const char *, const char *, const char *);
+struct repo_pkgmap *repo_pkgmap_create(const char *, size_t);
+int	repo_pkgmap_add(struct repo_pkgmap *, prop_dictionary_t);
+prop_dictionary_t repo_pkgmap_find(struct xbps_handle *,
+				   struct repo_pkgmap *,
+				   const char *,
+				   const char *);
+bool	repo_pkgmap_contains(struct repo_pkgmap *, prop_dictionary_t);
+void	repo_pkgmap_remove(struct repo_pkgmap *, prop_dictionary_t);
+void	repo_pkgmap_free(struct repo_pkgmap *);
+
+/* From index-state.c */
+struct repo_state;
+
+struct repo_state *repo_state_open(const char *);
+int	repo_state_flush(struct repo_state *);
+void	repo_state_free(struct repo_state *);
+prop_dictionary_t repo_state_pkg(struct repo_state *, const char *);
+int	repo_state_pkg_set(struct repo_state *, const char *, prop_dictionary_t);
+void	repo_state_pkg_remove(struct repo_state *, const char *);
+void	repo_state_pkg_files(struct repo_state *, const char *, bool);
+prop_array_t repo_state_plist_load(struct repo_state *,
+				   const char *,
+				   prop_dictionary_t);
+bool	repo_state_plist_segmented(struct repo_state *, const char *);
+unsigned int repo_state_plist_count(struct repo_state *, const char *);
+int	repo_state_plist_write(struct repo_state *,
+			       const char *,
+			       const char *,
+			       struct repo_pkgmap *,
+			       prop_array_t,
+			       int);
 
 /* From index.c */
-int	repo_index_add(struct xbps_handle *, int, char **);
-int	repo_index_clean(struct xbps_handle *, const char *);
+int	repo_index_add(struct xbps_handle *, int, char **, int,
+		       struct repo_state *);
+int	repo_index_clean(struct xbps_handle *, const char *, int);
 
 /* From index-files.c */
-int	repo_index_files_add(struct xbps_handle *, int, char **);
-int	repo_index_files_clean(struct xbps_handle *, const char *);
+int	repo_index_files_add(struct xbps_handle *, int, char **, int,
+			     struct repo_state *);
+int	repo_index_files_clean(struct xbps_handle *, const char *, int);
 
 /* From index-lock.c */
 int	acquire_repo_lock(const char *, char **);
@@ -30,23 +30,26 @@
 #include <errno.h>
 #include <libgen.h>
 #include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include <xbps_api.h>
 #include "defs.h"
 
 int
-repo_index_files_clean(struct xbps_handle *xhp, const char *repodir)
+repo_index_files_clean(struct xbps_handle *xhp, const char *repodir, int zlevel)
 {
 	prop_object_t obj;
-	prop_array_t idx, idxfiles, obsoletes;
-	char *plist, *plistf, *pkgver, *str;
-	const char *p, *arch, *ipkgver, *iarch;
-	size_t x, i;
+	prop_array_t idx, idxfiles, newidxfiles;
+	struct repo_pkgmap *map = NULL;
+	char *plist, *plistf;
+	const char *ipkgver, *iarch;
+	unsigned int x;
 	int rv = 0;
 	bool flush = false;
 
-	plist = plistf = pkgver = str = NULL;
-	idx = idxfiles = obsoletes = NULL;
+	plist = plistf = NULL;
+	idx = idxfiles = newidxfiles = NULL;
 
 	/* Internalize index-files.plist if found */
 	if ((plistf = xbps_pkg_index_files_plist(xhp, repodir)) == NULL)
@@ -66,65 +69,51 @@ repo_index_files_clean(struct xbps_handle *xhp, const char *repodir)
 	}
 	printf("Cleaning `%s' index-files, please wait...\n", repodir);
 	/*
-	 * Iterate over index-files array to find obsolete entries.
+	 * Map pkgver to index entries, and copy all index-files
+	 * entries still in the index into a new array.
 	 */
-	obsoletes = prop_array_create();
-	assert(obsoletes);
-
+	map = repo_pkgmap_create("pkgver", prop_array_count(idx));
+	newidxfiles = prop_array_create_with_capacity(
+	    prop_array_count(idxfiles));
+	if (map == NULL || newidxfiles == NULL) {
+		rv = ENOMEM;
+		goto out;
+	}
+	for (x = 0; x < prop_array_count(idx); x++) {
+		rv = repo_pkgmap_add(map, prop_array_get(idx, x));
+		if (rv == ENOMEM)
+			goto out;
+	}
+	rv = 0;
 	for (x = 0; x < prop_array_count(idxfiles); x++) {
 		obj = prop_array_get(idxfiles, x);
 		prop_dictionary_get_cstring_nocopy(obj, "pkgver", &ipkgver);
 		prop_dictionary_get_cstring_nocopy(obj, "architecture", &iarch);
-		if (xbps_find_pkg_in_array_by_pkgver(xhp, idx, ipkgver, iarch)) {
-			/* pkg found, do nothing */
-			continue;
-		}
-		if ((str = xbps_xasprintf("%s,%s", ipkgver, iarch)) == NULL) {
-			rv = ENOMEM;
-			goto out;
-		}
-		if (!prop_array_add_cstring(obsoletes, str)) {
-			free(str);
-			rv = EINVAL;
-			goto out;
-		}
-		free(str);
-	}
-	/*
-	 * Iterate over the obsoletes and array and remove entries
-	 * from index-files array.
-	 */
-	for (i = 0; i < prop_array_count(obsoletes); i++) {
-		prop_array_get_cstring_nocopy(obsoletes, i, &p);
-		pkgver = strdup(p);
-		for (x = 0; x < strlen(p); x++) {
-			if ((pkgver[x] = p[x]) == ',') {
-				pkgver[x] = '\0';
-				break;
+		if (repo_pkgmap_find(xhp, map, ipkgver, iarch)) {
+			/* pkg found, keep it */
+			if (!prop_array_add(newidxfiles, obj)) {
+				rv = EINVAL;
+				goto out;
 			}
-		}
-		arch = strchr(p, ',') + 1;
-		if (!xbps_remove_pkg_from_array_by_pkgver(
-		    xhp, idxfiles, pkgver, arch)) {
-			free(pkgver);
-			rv = EINVAL;
-			goto out;
+			continue;
 		}
 		printf("index-files: removed obsolete entry `%s' "
-		    "(%s)\n", pkgver, arch);
-		free(pkgver);
+		    "(%s)\n", ipkgver, iarch);
 		flush = true;
 	}
 	/* Externalize index-files array to plist when necessary */
-	if (flush && !prop_array_externalize_to_zfile(idxfiles, plistf))
+	if (flush &&
+	    !prop_array_externalize_to_zfile_level(newidxfiles, plistf, zlevel))
 		rv = errno;
 
 	printf("index-files: %u packages registered.\n",
-	    prop_array_count(idxfiles));
+	    prop_array_count(newidxfiles));
 
 out:
-	if (obsoletes)
-		prop_object_release(obsoletes);
+	if (map)
+		repo_pkgmap_free(map);
+	if (newidxfiles)
+		prop_object_release(newidxfiles);
 	if (idx)
 		prop_object_release(idx);
 	if (idxfiles)
@@ -137,24 +126,211 @@ out:
 	return rv;
 }
 
-int
-repo_index_files_add(struct xbps_handle *xhp, int argc, char **argv)
+/*
+ * Binary packages are read by up to INDEX_FILES_MAX_THREADS threads,
+ * with props.plist and files.plist in a single pass; index-files is
+ * then updated serially in argv order.
+ */
+#define INDEX_FILES_MAX_THREADS	16
+
+struct index_files_pkg {
+	prop_dictionary_t state;
+	prop_dictionary_t pkgprops;
+	prop_dictionary_t pkgd;
+	int rv;
+};
+
+struct index_files_read {
+	pthread_mutex_t mtx;
+	struct xbps_handle *xhp;
+	struct repo_pkgmap *map;
+	struct index_files_pkg *pkgs;
+	char **argv;
+	int argc;
+	int next;
+};
+
+static bool
+index_files_add_objs(prop_array_t files, prop_array_t array)
+{
+	prop_object_t obj;
+	unsigned int x;
+
+	for (x = 0; x < prop_array_count(array); x++) {
+		obj = prop_array_get(array, x);
+		if (!prop_array_add(files, prop_dictionary_get(obj, "file")))
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Creates the index-files entry for a binary package, with all its
+ * conf_files, files and links. If the package does not contain any
+ * file, pkgd is left NULL.
+ */
+static int
+index_files_pkgd(struct index_files_pkg *ip, prop_dictionary_t pkg_filesd)
 {
-	prop_array_t idxfiles = NULL;
-	prop_object_t obj, fileobj;
-	prop_dictionary_t pkgprops, pkg_filesd, pkgd;
 	prop_array_t files, pkg_cffiles, pkg_files, pkg_links;
-	const char *binpkg, *pkgver, *arch;
+	const char *pkgver, *arch;
+	unsigned int nfiles;
+
+	prop_dictionary_get_cstring_nocopy(ip->pkgprops, "pkgver", &pkgver);
+	prop_dictionary_get_cstring_nocopy(ip->pkgprops, "architecture",
+	    &arch);
+
+	pkg_cffiles = prop_dictionary_get(pkg_filesd, "conf_files");
+	pkg_files = prop_dictionary_get(pkg_filesd, "files");
+	pkg_links = prop_dictionary_get(pkg_filesd, "links");
+	nfiles = prop_array_count(pkg_cffiles) +
+	    prop_array_count(pkg_files) + prop_array_count(pkg_links);
+
+	/* If pkg does not contain any file, ignore it */
+	if (nfiles == 0)
+		return 0;
+
+	if ((ip->pkgd = prop_dictionary_create()) == NULL)
+		return EINVAL;
+	if ((files = prop_array_create_with_capacity(nfiles)) == NULL)
+		return EINVAL;
+	if (!prop_dictionary_set_cstring(ip->pkgd, "architecture", arch) ||
+	    !prop_dictionary_set_cstring(ip->pkgd, "pkgver", pkgver) ||
+	    !prop_dictionary_set(ip->pkgd, "files", files) ||
+	    !index_files_add_objs(files, pkg_cffiles) ||
+	    !index_files_add_objs(files, pkg_files) ||
+	    !index_files_add_objs(files, pkg_links)) {
+		prop_object_release(files);
+		return EINVAL;
+	}
+	prop_object_release(files);
+
+	return 0;
+}
+
+static void *
+index_files_read_thread(void *arg)
+{
+	struct index_files_read *ir = arg;
+	struct index_files_pkg *ip;
+	prop_dictionary_t plistd[2];
+	const char *plistf[] = { "./props.plist", "./files.plist", NULL };
+	const char *pkgver, *arch;
+	int i, rv;
+
+	for (;;) {
+		pthread_mutex_lock(&ir->mtx);
+		i = ir->next++;
+		pthread_mutex_unlock(&ir->mtx);
+		if (i >= ir->argc)
+			break;
+
+		ip = &ir->pkgs[i];
+		/* not modified since it was registered */
+		if (ip->state != NULL)
+			continue;
+		rv = xbps_dictionary_metadata_plists_by_url(ir->argv[i],
+		    plistf, plistd);
+		if ((ip->pkgprops = plistd[0]) == NULL) {
+			ip->rv = rv;
+			if (plistd[1] != NULL)
+				prop_object_release(plistd[1]);
+			continue;
+		}
+		prop_dictionary_get_cstring_nocopy(ip->pkgprops,
+		    "pkgver", &pkgver);
+		prop_dictionary_get_cstring_nocopy(ip->pkgprops,
+		    "architecture", &arch);
+		/* registered packages are skipped */
+		if (repo_pkgmap_find(ir->xhp, ir->map, pkgver, arch)) {
+			if (plistd[1] != NULL)
+				prop_object_release(plistd[1]);
+			continue;
+		}
+		if (plistd[1] == NULL) {
+			ip->rv = EINVAL;
+			continue;
+		}
+		ip->rv = index_files_pkgd(ip, plistd[1]);
+		prop_object_release(plistd[1]);
+	}
+	return NULL;
+}
+
+static void
+index_files_read(struct index_files_read *ir)
+{
+	pthread_t thr[INDEX_FILES_MAX_THREADS];
+	long ncpus;
+	int i, nthreads;
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	nthreads = ncpus > 0 ? (int)ncpus : 1;
+	if (nthreads > INDEX_FILES_MAX_THREADS)
+		nthreads = INDEX_FILES_MAX_THREADS;
+	if (nthreads > ir->argc)
+		nthreads = ir->argc;
+
+	/* this thread also reads packages */
+	for (i = 1; i < nthreads; i++) {
+		if (pthread_create(&thr[i], NULL, index_files_read_thread, ir))
+			break;
+	}
+	nthreads = i;
+	(void)index_files_read_thread(ir);
+
+	for (i = 1; i < nthreads; i++)
+		pthread_join(thr[i], NULL);
+}
+
+/*
+ * Loads the index-files segments with entries for the packages read.
+ */
+static prop_array_t
+index_files_state_load(struct index_files_read *ir, struct repo_state *rs)
+{
+	prop_dictionary_t keys;
+	prop_array_t idxfiles;
+	const char *pkgver;
+	int i;
+
+	if ((keys = prop_dictionary_create()) == NULL)
+		return NULL;
+	for (i = 1; i < ir->argc; i++) {
+		if (ir->pkgs[i].pkgprops == NULL ||
+		    !prop_dictionary_get_cstring_nocopy(ir->pkgs[i].pkgprops,
+		    "pkgver", &pkgver))
+			continue;
+		if (!prop_dictionary_set_bool(keys, pkgver, true)) {
+			prop_object_release(keys);
+			errno = ENOMEM;
+			return NULL;
+		}
+	}
+	idxfiles = repo_state_plist_load(rs, XBPS_PKGINDEX_FILES, keys);
+	prop_object_release(keys);
+
+	return idxfiles;
+}
+
+int
+repo_index_files_add(struct xbps_handle *xhp,
+		     int argc,
+		     char **argv,
+		     int zlevel,
+		     struct repo_state *rs)
+{
+	prop_array_t idxfiles = NULL, added = NULL;
+	struct repo_pkgmap *map = NULL;
+	struct index_files_read ir;
+	struct index_files_pkg *pkgs = NULL, *ip;
+	const char *pkgver, *arch;
 	char *plist, *repodir, *p;
-	size_t x;
+	unsigned int x, count;
 	int i, rv = 0;
-	bool found, flush;
+	bool flush = false, registered;
 
-	found = flush = false;
 	plist = repodir = p = NULL;
-	obj = fileobj = NULL;
-	pkgprops = pkg_filesd = pkgd = NULL;
-	files = NULL;
 
         if ((p = strdup(argv[1])) == NULL) {
 		rv = ENOMEM;
@@ -166,9 +342,11 @@ repo_index_files_add(struct xbps_handle *xhp, int argc, char **argv)
 		goto out;
 	}
 	/*
-	 * Internalize index-files.plist if found and process argv.
+	 * Internalize index-files.plist if found and process argv; in
+	 * incremental mode only the segments needed are loaded later.
 	 */
-	if ((idxfiles = prop_array_internalize_from_zfile(plist)) == NULL) {
+	if (rs == NULL &&
+	    (idxfiles = prop_array_internalize_from_zfile(plist)) == NULL) {
 		if (errno == ENOENT) {
 			idxfiles = prop_array_create();
 			assert(idxfiles);
@@ -177,169 +355,128 @@ repo_index_files_add(struct xbps_handle *xhp, int argc, char **argv)
 			goto out;
 		}
 	}
+	/*
+	 * Map pkgver to index-files entries, to find registered
+	 * packages in constant time.
+	 */
+	map = repo_pkgmap_create("pkgver", prop_array_count(idxfiles) + argc);
+	if (map == NULL || (pkgs = calloc(argc, sizeof(*pkgs))) == NULL ||
+	    (added = prop_array_create()) == NULL) {
+		rv = ENOMEM;
+		goto out;
+	}
+	for (x = 0; x < prop_array_count(idxfiles); x++) {
+		rv = repo_pkgmap_add(map, prop_array_get(idxfiles, x));
+		if (rv == ENOMEM)
+			goto out;
+	}
+	rv = 0;
+	for (i = 1; rs != NULL && i < argc; i++) {
+		pkgs[i].state = repo_state_pkg(rs, argv[i]);
+		if (pkgs[i].state != NULL &&
+		    !prop_dictionary_get_bool(pkgs[i].state, "index-files",
+		    &registered))
+			pkgs[i].state = NULL;
+	}
+	/*
+	 * Read props.plist and files.plist from all packages in argv.
+	 */
+	memset(&ir, 0, sizeof(ir));
+	pthread_mutex_init(&ir.mtx, NULL);
+	ir.xhp = xhp;
+	ir.map = map;
+	ir.pkgs = pkgs;
+	ir.argv = argv;
+	ir.argc = argc;
+	ir.next = 1;
+	index_files_read(&ir);
+	pthread_mutex_destroy(&ir.mtx);
+
+	if (rs != NULL) {
+		if ((idxfiles = index_files_state_load(&ir, rs)) == NULL) {
+			rv = errno;
+			goto out;
+		}
+		for (x = 0; x < prop_array_count(idxfiles); x++) {
+			rv = repo_pkgmap_add(map, prop_array_get(idxfiles, x));
+			if (rv == ENOMEM)
+				goto out;
+		}
+		rv = 0;
+	}
 
 	for (i = 1; i < argc; i++) {
-		found = false;
-		pkgprops = xbps_dictionary_metadata_plist_by_url(argv[i],
-				"./props.plist");
-		if (pkgprops == NULL) {
+		ip = &pkgs[i];
+		if (ip->state != NULL) {
+			prop_dictionary_get_bool(ip->state, "index-files",
+			    &registered);
+			if (!registered)
+				continue;
+			prop_dictionary_get_cstring_nocopy(ip->state,
+			    "pkgver", &pkgver);
+			prop_dictionary_get_cstring_nocopy(ip->state,
+			    "architecture", &arch);
+			fprintf(stderr, "index-files: skipping `%s' (%s), "
+			    "already registered.\n", pkgver, arch);
+			continue;
+		}
+		if (ip->pkgprops == NULL) {
 			fprintf(stderr, "index-files: cannot internalize "
-			    "%s props.plist: %s\n", argv[i], strerror(errno));
+			    "%s props.plist: %s\n", argv[i], strerror(ip->rv));
 			continue;
 		}
-		prop_dictionary_get_cstring_nocopy(pkgprops,
-		    "filename", &binpkg);
-		prop_dictionary_get_cstring_nocopy(pkgprops,
+		prop_dictionary_get_cstring_nocopy(ip->pkgprops,
 		    "pkgver", &pkgver);
-		prop_dictionary_get_cstring_nocopy(pkgprops,
+		prop_dictionary_get_cstring_nocopy(ip->pkgprops,
 		    "architecture", &arch);
 
-		if (xbps_find_pkg_in_array_by_pkgver(xhp, idxfiles,
-		    pkgver, arch))  {
+		if (repo_pkgmap_find(xhp, map, pkgver, arch)) {
 			fprintf(stderr, "index-files: skipping `%s' (%s), "
 			    "already registered.\n", pkgver, arch);
-			prop_object_release(pkgprops);
-			pkgprops = NULL;
+			if (rs != NULL)
+				repo_state_pkg_files(rs, argv[i], true);
 			continue;
 		}
-
-		/* internalize files.plist from binary package archive */
-		pkg_filesd = xbps_dictionary_metadata_plist_by_url(argv[i],
-				"./files.plist");
-		if (pkg_filesd == NULL) {
-			prop_object_release(pkgprops);
+		if (ip->rv != 0) {
 			rv = EINVAL;
 			goto out;
 		}
-
-		/* Find out if binary pkg stored in index contain any file */
-		pkg_cffiles = prop_dictionary_get(pkg_filesd, "conf_files");
-		if (pkg_cffiles != NULL && prop_array_count(pkg_cffiles))
-			found = true;
-		else
-			pkg_cffiles = NULL;
-
-		pkg_files = prop_dictionary_get(pkg_filesd, "files");
-		if (pkg_files != NULL && prop_array_count(pkg_files))
-			found = true;
-		else
-			pkg_files = NULL;
-
-		pkg_links = prop_dictionary_get(pkg_filesd, "links");
-		if (pkg_links != NULL && prop_array_count(pkg_links))
-			found = true;
-		else
-			pkg_links = NULL;
-
-		/* If pkg does not contain any file, ignore it */
-		if (!found) {
-			prop_object_release(pkgprops);
-			prop_object_release(pkg_filesd);
+		/* pkg does not contain any file */
+		if (ip->pkgd == NULL) {
+			if (rs != NULL)
+				repo_state_pkg_files(rs, argv[i], false);
 			continue;
 		}
-		/* create pkg dictionary */
-		if ((pkgd = prop_dictionary_create()) == NULL) {
-			prop_object_release(pkgprops);
-			prop_object_release(pkg_filesd);
-			rv = EINVAL;
-			goto out;
-		}
-		/* add pkgver and architecture objects into pkg dictionary */
-		if (!prop_dictionary_set_cstring(pkgd, "architecture", arch)) {
-			prop_object_release(pkgprops);
-			prop_object_release(pkg_filesd);
-			prop_object_release(pkgd);
-			rv = EINVAL;
-			goto out;
-		}
-		if (!prop_dictionary_set_cstring(pkgd, "pkgver", pkgver)) {
-			prop_object_release(pkgprops);
-			prop_object_release(pkg_filesd);
-			prop_object_release(pkgd);
-			rv = EINVAL;
-			goto out;
-		}
-		/* add files array obj into pkg dictionary */
-		if ((files = prop_array_create()) == NULL) {
-			prop_object_release(pkgprops);
-			prop_object_release(pkg_filesd);
-			prop_object_release(pkgd);
-			rv = EINVAL;
-			goto out;
-		}
-		if (!prop_dictionary_set(pkgd, "files", files)) {
-			prop_object_release(pkgprops);
-			prop_object_release(pkg_filesd);
-			prop_object_release(files);
-			prop_object_release(pkgd);
-			rv = EINVAL;
-			goto out;
-		}
-		/* add conf_files in pkgd */
-		if (pkg_cffiles != NULL) {
-			for (x = 0; x < prop_array_count(pkg_cffiles); x++) {
-				obj = prop_array_get(pkg_cffiles, x);
-				fileobj = prop_dictionary_get(obj, "file");
-				if (!prop_array_add(files, fileobj)) {
-					prop_object_release(pkgprops);
-					prop_object_release(pkg_filesd);
-					prop_object_release(files);
-					prop_object_release(pkgd);
-					rv = EINVAL;
-					goto out;
-				}
-			}
-		}
-		/* add files array in pkgd */
-		if (pkg_files != NULL) {
-			for (x = 0; x < prop_array_count(pkg_files); x++) {
-				obj = prop_array_get(pkg_files, x);
-				fileobj = prop_dictionary_get(obj, "file");
-				if (!prop_array_add(files, fileobj)) {
-					prop_object_release(pkgprops);
-					prop_object_release(pkg_filesd);
-					prop_object_release(files);
-					prop_object_release(pkgd);
-					rv = EINVAL;
-					goto out;
-				}
-			}
-		}
-		/* add links array in pkgd */
-		if (pkg_links != NULL) {
-			for (x = 0; x < prop_array_count(pkg_links); x++) {
-				obj = prop_array_get(pkg_links, x);
-				fileobj = prop_dictionary_get(obj, "file");
-				if (!prop_array_add(files, fileobj)) {
-					prop_object_release(pkgprops);
-					prop_object_release(pkg_filesd);
-					prop_object_release(files);
-					prop_object_release(pkgd);
-					rv = EINVAL;
-					goto out;
-				}
-			}
-		}
 		/* add pkgd into the index-files array */
-		if (!prop_array_add(idxfiles, pkgd)) {
-			prop_object_release(pkgprops);
-			prop_object_release(pkg_filesd);
-			prop_object_release(files);
-			prop_object_release(pkgd);
+		if (!prop_array_add(rs ? added : idxfiles, ip->pkgd)) {
 			rv = EINVAL;
 			goto out;
 		}
+		if ((rv = repo_pkgmap_add(map, ip->pkgd)) != 0)
+			goto out;
+
 		flush = true;
 		printf("index-files: added `%s' (%s)\n", pkgver, arch);
-		prop_object_release(pkgprops);
-		prop_object_release(pkg_filesd);
-		prop_object_release(files);
-		prop_object_release(pkgd);
-		pkgprops = pkg_filesd = pkgd = NULL;
-		files = NULL;
+		if (rs != NULL)
+			repo_state_pkg_files(rs, argv[i], true);
+	}
+
+	if (rs != NULL) {
+		/* new entries are appended in a new segment */
+		count = repo_state_plist_count(rs, XBPS_PKGINDEX_FILES);
+		if ((flush || (count > 0 &&
+		    !repo_state_plist_segmented(rs, XBPS_PKGINDEX_FILES))) &&
+		    (rv = repo_state_plist_write(rs, XBPS_PKGINDEX_FILES,
+		    "pkgver", NULL, added, zlevel)) != 0)
+			fprintf(stderr, "failed to externalize %s: %s\n",
+			    plist, strerror(rv));
+		printf("index-files: %u packages registered.\n",
+		    repo_state_plist_count(rs, XBPS_PKGINDEX_FILES));
+		goto out;
 	}
 
-	if (flush && !prop_array_externalize_to_zfile(idxfiles, plist)) {
+	if (flush &&
+	    !prop_array_externalize_to_zfile_level(idxfiles, plist, zlevel)) {
 		fprintf(stderr, "failed to externalize %s: %s\n",
 		    plist, strerror(errno));
 		rv = errno;
@@ -348,10 +485,23 @@ repo_index_files_add(struct xbps_handle *xhp, int argc, char **argv)
 	    prop_array_count(idxfiles));
 
 out:
+	if (pkgs) {
+		for (i = 1; i < argc; i++) {
+			if (pkgs[i].pkgprops)
+				prop_object_release(pkgs[i].pkgprops);
+			if (pkgs[i].pkgd)
+				prop_object_release(pkgs[i].pkgd);
+		}
+		free(pkgs);
+	}
+	if (map)
+		repo_pkgmap_free(map);
 	if (p)
 		free(p);
 	if (plist)
 		free(plist);
+	if (added)
+		prop_object_release(added);
 	if (idxfiles)
 		prop_object_release(idxfiles);
 
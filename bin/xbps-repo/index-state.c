@@ -0,0 +1,974 @@
+/*-
+ * Copyright (c) 2012 Juan Romero Pardines.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <xbps_api.h>
+#include "defs.h"
+
+/*
+ * Incremental index maintenance, used by index-add with -i.
+ *
+ * <repodir>/index-state.plist records the binary packages registered
+ * in the index, so that packages not modified since then aren't read
+ * again:
+ *
+ * 	packages	filename -> { filename-size, filename-mtime,
+ * 			filename-sha256, pkgver, architecture,
+ * 			index-files }
+ *
+ * and how index.plist and index-files.plist are split in segments:
+ * their size, mtime and inode when written, and for every segment
+ * its offset, compressed and uncompressed size, crc32 and the keys
+ * (pkgname or pkgver) of its entries.
+ *
+ * Both files are still a single gzip stream with the same contents,
+ * readable by any client. Every segment (SEGMENT_SIZE bytes of entries
+ * at least) is compressed on its own and ends at a flush point; while
+ * updating a file, segments without modified entries are copied as
+ * they are, only the modified ones and new entries are compressed
+ * again. When there are too many segments, all of them are compressed
+ * again (without parsing them) to compact the file.
+ */
+#define STATE_PLIST	"index-state.plist"
+#define SEGMENT_SIZE	(256 * 1024)
+#define SEGMENT_SLACK	8
+
+static const char plist_head[] =
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+    "<!DOCTYPE plist PUBLIC \"-//Apple Computer//DTD PLIST 1.0//EN\" "
+    "\"http://www.apple.com/DTDs/PropertyList-1.0.dtd\">\n"
+    "<plist version=\"1.0\">\n<array>\n";
+static const char plist_tail[] = "</array>\n</plist>\n";
+
+#define HEAD_LEN	(sizeof(plist_head) - 1)
+#define TAIL_LEN	(sizeof(plist_tail) - 1)
+
+/* gzip header: deflate, no file name nor mtime, unix */
+static const unsigned char gzip_head[] = {
+	0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3
+};
+
+struct repo_state {
+	char *repodir;
+	prop_dictionary_t d;
+	prop_dictionary_t pkgs;
+};
+
+/* entries to be compressed into new segments */
+struct seg_text {
+	char *buf;
+	size_t len;
+	size_t size;
+	prop_array_t keys;
+};
+
+struct seg_writer {
+	int fd;
+	int level;
+	uint64_t off;
+	uint64_t usize;
+	uLong crc;
+};
+
+static char *
+state_path(struct repo_state *rs, const char *name)
+{
+	return xbps_xasprintf("%s/%s", rs->repodir, name);
+}
+
+/*
+ * Segments of an index file are only valid if it hasn't been
+ * written by anything else since then.
+ */
+static bool
+plist_valid(struct repo_state *rs, const char *name)
+{
+	prop_dictionary_t sd;
+	struct stat st;
+	uint64_t size, mtime, inode;
+	char *path;
+	int rv;
+
+	if ((sd = prop_dictionary_get(rs->d, name)) == NULL)
+		return false;
+	if ((path = state_path(rs, name)) == NULL)
+		return false;
+	rv = stat(path, &st);
+	free(path);
+	if (rv == -1)
+		return false;
+
+	return prop_dictionary_get_uint64(sd, "size", &size) &&
+	    prop_dictionary_get_uint64(sd, "mtime", &mtime) &&
+	    prop_dictionary_get_uint64(sd, "inode", &inode) &&
+	    prop_dictionary_get(sd, "segments") != NULL &&
+	    size == (uint64_t)st.st_size && mtime == (uint64_t)st.st_mtime &&
+	    inode == (uint64_t)st.st_ino;
+}
+
+struct repo_state *
+repo_state_open(const char *repodir)
+{
+	struct repo_state *rs;
+	prop_array_t allkeys;
+	prop_dictionary_t pkgd;
+	const char *filen;
+	char *path;
+	unsigned int i;
+
+	if ((rs = calloc(1, sizeof(*rs))) == NULL)
+		return NULL;
+	if ((rs->repodir = strdup(repodir)) == NULL ||
+	    (path = state_path(rs, STATE_PLIST)) == NULL) {
+		repo_state_free(rs);
+		return NULL;
+	}
+	rs->d = prop_dictionary_internalize_from_file(path);
+	free(path);
+	if (rs->d == NULL && (rs->d = prop_dictionary_create()) == NULL) {
+		repo_state_free(rs);
+		return NULL;
+	}
+	/*
+	 * Registered packages are only known while the index
+	 * hasn't been modified by anything else.
+	 */
+	rs->pkgs = prop_dictionary_get(rs->d, "packages");
+	if (!plist_valid(rs, XBPS_PKGINDEX) || rs->pkgs == NULL) {
+		prop_dictionary_remove(rs->d, XBPS_PKGINDEX);
+		if ((rs->pkgs = prop_dictionary_create()) == NULL ||
+		    !prop_dictionary_set(rs->d, "packages", rs->pkgs)) {
+			if (rs->pkgs != NULL)
+				prop_object_release(rs->pkgs);
+			rs->pkgs = NULL;
+			repo_state_free(rs);
+			return NULL;
+		}
+		prop_object_release(rs->pkgs);
+	}
+	if (!plist_valid(rs, XBPS_PKGINDEX_FILES)) {
+		prop_dictionary_remove(rs->d, XBPS_PKGINDEX_FILES);
+		allkeys = prop_dictionary_all_keys(rs->pkgs);
+		for (i = 0; i < prop_array_count(allkeys); i++) {
+			filen = prop_dictionary_keysym_cstring_nocopy(
+			    prop_array_get(allkeys, i));
+			pkgd = prop_dictionary_get(rs->pkgs, filen);
+			prop_dictionary_remove(pkgd, "index-files");
+		}
+		if (allkeys != NULL)
+			prop_object_release(allkeys);
+	}
+	return rs;
+}
+
+int
+repo_state_flush(struct repo_state *rs)
+{
+	const char *names[] = { XBPS_PKGINDEX, XBPS_PKGINDEX_FILES, NULL };
+	prop_dictionary_t sd;
+	prop_array_t segs;
+	char *path;
+	unsigned int i, x;
+	int rv = 0;
+
+	for (i = 0; names[i] != NULL; i++) {
+		if ((sd = prop_dictionary_get(rs->d, names[i])) == NULL)
+			continue;
+		/* never written in segments */
+		if (prop_dictionary_get(sd, "inode") == NULL) {
+			prop_dictionary_remove(rs->d, names[i]);
+			continue;
+		}
+		segs = prop_dictionary_get(sd, "segments");
+		for (x = 0; x < prop_array_count(segs); x++)
+			prop_dictionary_remove(prop_array_get(segs, x),
+			    "entries");
+	}
+	if ((path = state_path(rs, STATE_PLIST)) == NULL)
+		return ENOMEM;
+	if (!prop_dictionary_externalize_binary_to_file(rs->d, path))
+		rv = errno;
+	free(path);
+
+	return rv;
+}
+
+void
+repo_state_free(struct repo_state *rs)
+{
+	if (rs == NULL)
+		return;
+	if (rs->d != NULL)
+		prop_object_release(rs->d);
+	free(rs->repodir);
+	free(rs);
+}
+
+static const char *
+pkg_filename(const char *binpkg)
+{
+	const char *p;
+
+	return (p = strrchr(binpkg, '/')) ? p + 1 : binpkg;
+}
+
+prop_dictionary_t
+repo_state_pkg(struct repo_state *rs, const char *binpkg)
+{
+	prop_dictionary_t pkgd;
+	struct stat st;
+	uint64_t size, mtime;
+
+	pkgd = prop_dictionary_get(rs->pkgs, pkg_filename(binpkg));
+	if (pkgd == NULL || stat(binpkg, &st) == -1)
+		return NULL;
+	if (!prop_dictionary_get_uint64(pkgd, "filename-size", &size) ||
+	    !prop_dictionary_get_uint64(pkgd, "filename-mtime", &mtime) ||
+	    size != (uint64_t)st.st_size || mtime != (uint64_t)st.st_mtime)
+		return NULL;
+
+	return pkgd;
+}
+
+/*
+ * Records binpkg as registered with the index entry pkgd, if it's
+ * the same file.
+ */
+int
+repo_state_pkg_set(struct repo_state *rs,
+		   const char *binpkg,
+		   prop_dictionary_t pkgd)
+{
+	prop_dictionary_t d;
+	struct stat st;
+	const char *filen, *sha256, *pkgver, *arch;
+	uint64_t size;
+	int rv = 0;
+
+	if (!prop_dictionary_get_cstring_nocopy(pkgd, "filename", &filen) ||
+	    strcmp(filen, pkg_filename(binpkg)) ||
+	    !prop_dictionary_get_cstring_nocopy(pkgd, "filename-sha256",
+	    &sha256) ||
+	    !prop_dictionary_get_uint64(pkgd, "filename-size", &size) ||
+	    !prop_dictionary_get_cstring_nocopy(pkgd, "pkgver", &pkgver) ||
+	    !prop_dictionary_get_cstring_nocopy(pkgd, "architecture", &arch))
+		return 0;
+	if (stat(binpkg, &st) == -1 || size != (uint64_t)st.st_size)
+		return 0;
+
+	if ((d = prop_dictionary_create()) == NULL)
+		return ENOMEM;
+	if (!prop_dictionary_set_uint64(d, "filename-size", size) ||
+	    !prop_dictionary_set_uint64(d, "filename-mtime",
+	    (uint64_t)st.st_mtime) ||
+	    !prop_dictionary_set_cstring(d, "filename-sha256", sha256) ||
+	    !prop_dictionary_set_cstring(d, "pkgver", pkgver) ||
+	    !prop_dictionary_set_cstring(d, "architecture", arch) ||
+	    !prop_dictionary_set(rs->pkgs, filen, d))
+		rv = EINVAL;
+	prop_object_release(d);
+
+	return rv;
+}
+
+void
+repo_state_pkg_remove(struct repo_state *rs, const char *filen)
+{
+	prop_dictionary_remove(rs->pkgs, filen);
+}
+
+/*
+ * Records if binpkg is registered in index-files, or if it doesn't
+ * contain any file.
+ */
+void
+repo_state_pkg_files(struct repo_state *rs, const char *binpkg, bool registered)
+{
+	prop_dictionary_t pkgd;
+
+	pkgd = prop_dictionary_get(rs->pkgs, pkg_filename(binpkg));
+	if (pkgd != NULL)
+		prop_dictionary_set_bool(pkgd, "index-files", registered);
+}
+
+static int
+read_all(int fd, void *buf, size_t len, off_t off)
+{
+	char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = pread(fd, p, len, off)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		} else if (n == 0) {
+			return EINVAL;
+		}
+		p += n;
+		off += n;
+		len -= (size_t)n;
+	}
+	return 0;
+}
+
+static int
+write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = write(fd, p, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		p += n;
+		len -= (size_t)n;
+	}
+	return 0;
+}
+
+/*
+ * Returns the uncompressed entries of a segment, NUL terminated.
+ */
+static char *
+seg_inflate(int fd, prop_dictionary_t seg, size_t *lenp)
+{
+	z_stream z;
+	unsigned char *in;
+	char *out;
+	uint64_t off, csize, usize, crc;
+	int rv;
+
+	if (!prop_dictionary_get_uint64(seg, "offset", &off) ||
+	    !prop_dictionary_get_uint64(seg, "csize", &csize) ||
+	    !prop_dictionary_get_uint64(seg, "usize", &usize) ||
+	    !prop_dictionary_get_uint64(seg, "crc32", &crc)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if ((in = malloc(csize)) == NULL)
+		return NULL;
+	if ((rv = read_all(fd, in, csize, (off_t)off)) != 0) {
+		free(in);
+		errno = rv;
+		return NULL;
+	}
+	if ((out = malloc(usize + 1)) == NULL) {
+		free(in);
+		return NULL;
+	}
+	memset(&z, 0, sizeof(z));
+	if (inflateInit2(&z, -MAX_WBITS) != Z_OK) {
+		free(in);
+		free(out);
+		errno = ENOMEM;
+		return NULL;
+	}
+	z.next_in = in;
+	z.avail_in = (uInt)csize;
+	z.next_out = (unsigned char *)out;
+	z.avail_out = (uInt)usize + 1;
+	rv = inflate(&z, Z_SYNC_FLUSH);
+	(void)inflateEnd(&z);
+	free(in);
+
+	if ((rv != Z_OK && rv != Z_BUF_ERROR) || z.avail_in != 0 ||
+	    z.total_out != usize ||
+	    crc32(0, (unsigned char *)out, (uInt)usize) != crc) {
+		free(out);
+		errno = EINVAL;
+		return NULL;
+	}
+	out[usize] = '\0';
+	*lenp = usize;
+
+	return out;
+}
+
+/*
+ * Compresses buf as a raw deflate stream ending at a flush point,
+ * or with the final block if flush is Z_FINISH.
+ */
+static int
+seg_deflate(struct seg_writer *w, char *buf, size_t len, int flush,
+	    uint64_t *csizep)
+{
+	z_stream z;
+	unsigned char out[32768];
+	uint64_t csize = 0;
+	size_t have;
+	int rv = 0;
+
+	memset(&z, 0, sizeof(z));
+	if (deflateInit2(&z, w->level, Z_DEFLATED, -MAX_WBITS, 8,
+	    Z_DEFAULT_STRATEGY) != Z_OK)
+		return ENOMEM;
+
+	z.next_in = (unsigned char *)buf;
+	z.avail_in = (uInt)len;
+	do {
+		z.next_out = out;
+		z.avail_out = sizeof(out);
+		if (deflate(&z, flush) == Z_STREAM_ERROR) {
+			rv = EINVAL;
+			break;
+		}
+		have = sizeof(out) - z.avail_out;
+		if ((rv = write_all(w->fd, out, have)) != 0)
+			break;
+		csize += have;
+	} while (z.avail_out == 0);
+	(void)deflateEnd(&z);
+
+	if (rv == 0) {
+		w->crc = crc32_combine(w->crc,
+		    crc32(0, (unsigned char *)buf, (uInt)len), (z_off_t)len);
+		w->usize += len;
+		w->off += csize;
+		if (csizep != NULL)
+			*csizep = csize;
+	}
+	return rv;
+}
+
+static int
+text_append(struct seg_text *t, const char *buf, size_t len)
+{
+	char *p;
+	size_t size;
+
+	if (t->len + len > t->size) {
+		size = t->size ? t->size : SEGMENT_SIZE;
+		while (size < t->len + len)
+			size *= 2;
+		if ((p = realloc(t->buf, size)) == NULL)
+			return ENOMEM;
+		t->buf = p;
+		t->size = size;
+	}
+	memcpy(t->buf + t->len, buf, len);
+	t->len += len;
+
+	return 0;
+}
+
+static int
+text_append_keys(struct seg_text *t, prop_array_t keys)
+{
+	unsigned int i;
+
+	for (i = 0; i < prop_array_count(keys); i++) {
+		if (!prop_array_add(t->keys, prop_array_get(keys, i)))
+			return EINVAL;
+	}
+	return 0;
+}
+
+/*
+ * Appends index entries still registered (all if map is NULL), as
+ * they are written by prop_array_externalize().
+ */
+static int
+text_append_entries(struct seg_text *t,
+		    prop_array_t entries,
+		    const char *keyobj,
+		    struct repo_pkgmap *map)
+{
+	prop_array_t array;
+	prop_object_t obj;
+	const char *key;
+	char *xml;
+	size_t len;
+	unsigned int i;
+	int rv = 0;
+
+	array = prop_array_create_with_capacity(prop_array_count(entries));
+	if (array == NULL)
+		return ENOMEM;
+	for (i = 0; i < prop_array_count(entries); i++) {
+		obj = prop_array_get(entries, i);
+		if (!prop_dictionary_get_cstring_nocopy(obj, keyobj, &key))
+			key = "";
+		else if (map != NULL && !repo_pkgmap_contains(map, obj))
+			continue;
+		if (!prop_array_add(array, obj) ||
+		    !prop_array_add_cstring(t->keys, key)) {
+			prop_object_release(array);
+			return EINVAL;
+		}
+	}
+	if (prop_array_count(array) == 0) {
+		prop_object_release(array);
+		return 0;
+	}
+	xml = prop_array_externalize(array);
+	prop_object_release(array);
+	if (xml == NULL)
+		return ENOMEM;
+
+	len = strlen(xml);
+	if (len < HEAD_LEN + TAIL_LEN ||
+	    strncmp(xml, plist_head, HEAD_LEN) ||
+	    strcmp(xml + len - TAIL_LEN, plist_tail))
+		rv = EINVAL;
+	else
+		rv = text_append(t, xml + HEAD_LEN, len - HEAD_LEN - TAIL_LEN);
+	free(xml);
+
+	return rv;
+}
+
+/*
+ * Returns the offset past the entry starting at pos, a dictionary
+ * in the array.
+ */
+static size_t
+entry_end(const char *buf, size_t len, size_t pos)
+{
+	const char *p, *nl;
+
+	if (len - pos >= 9 && memcmp(buf + pos, "\t<dict/>\n", 9) == 0)
+		return pos + 9;
+
+	for (p = buf + pos; p < buf + len; p = nl + 1) {
+		if ((nl = memchr(p, '\n', (size_t)(buf + len - p))) == NULL)
+			break;
+		if (nl - p == 8 && memcmp(p, "\t</dict>", 8) == 0)
+			return (size_t)(nl + 1 - buf);
+	}
+	return 0;
+}
+
+/*
+ * Compresses pending entries into segments of SEGMENT_SIZE bytes
+ * at least.
+ */
+static int
+text_flush(struct seg_writer *w, struct seg_text *t, prop_array_t segs)
+{
+	prop_dictionary_t seg;
+	prop_array_t keys;
+	size_t start, end, pos = 0;
+	uint64_t off, csize;
+	unsigned int n, k = 0;
+	int rv = 0;
+
+	while (rv == 0 && pos < t->len) {
+		start = pos;
+		n = 0;
+		do {
+			if ((end = entry_end(t->buf, t->len, pos)) == 0)
+				return EINVAL;
+			pos = end;
+			n++;
+		} while (pos < t->len && pos - start < SEGMENT_SIZE);
+
+		if (k + n > prop_array_count(t->keys))
+			return EINVAL;
+		if ((keys = prop_array_create_with_capacity(n)) == NULL)
+			return ENOMEM;
+		for (; n > 0; n--, k++)
+			prop_array_add(keys, prop_array_get(t->keys, k));
+
+		off = w->off;
+		if ((rv = seg_deflate(w, t->buf + start, pos - start,
+		    Z_SYNC_FLUSH, &csize)) != 0) {
+			prop_object_release(keys);
+			break;
+		}
+		if ((seg = prop_dictionary_create()) == NULL) {
+			prop_object_release(keys);
+			return ENOMEM;
+		}
+		if (!prop_dictionary_set_uint64(seg, "offset", off) ||
+		    !prop_dictionary_set_uint64(seg, "csize", csize) ||
+		    !prop_dictionary_set_uint64(seg, "usize", pos - start) ||
+		    !prop_dictionary_set_uint64(seg, "crc32",
+		    crc32(0, (unsigned char *)t->buf + start,
+		    (uInt)(pos - start))) ||
+		    !prop_dictionary_set(seg, "keys", keys) ||
+		    !prop_array_add(segs, seg))
+			rv = EINVAL;
+		prop_object_release(keys);
+		prop_object_release(seg);
+	}
+	if (rv == 0 && k != prop_array_count(t->keys))
+		rv = EINVAL;
+
+	t->len = 0;
+	prop_object_release(t->keys);
+	if ((t->keys = prop_array_create()) == NULL && rv == 0)
+		rv = ENOMEM;
+
+	return rv;
+}
+
+/*
+ * Copies a segment from the current file as it is.
+ */
+static int
+seg_copy(struct seg_writer *w, int fd, prop_dictionary_t seg,
+	 prop_array_t segs)
+{
+	prop_dictionary_t newseg;
+	void *buf;
+	uint64_t off, csize, usize, crc;
+	int rv;
+
+	if (!prop_dictionary_get_uint64(seg, "offset", &off) ||
+	    !prop_dictionary_get_uint64(seg, "csize", &csize) ||
+	    !prop_dictionary_get_uint64(seg, "usize", &usize) ||
+	    !prop_dictionary_get_uint64(seg, "crc32", &crc))
+		return EINVAL;
+	if ((buf = malloc(csize)) == NULL)
+		return ENOMEM;
+	if ((rv = read_all(fd, buf, csize, (off_t)off)) == 0)
+		rv = write_all(w->fd, buf, csize);
+	free(buf);
+	if (rv != 0)
+		return rv;
+
+	if ((newseg = prop_dictionary_copy(seg)) == NULL)
+		return ENOMEM;
+	if (!prop_dictionary_set_uint64(newseg, "offset", w->off) ||
+	    !prop_array_add(segs, newseg))
+		rv = EINVAL;
+	prop_object_release(newseg);
+
+	w->crc = crc32_combine(w->crc, (uLong)crc, (z_off_t)usize);
+	w->usize += usize;
+	w->off += csize;
+
+	return rv;
+}
+
+/*
+ * Returns the entries of an index file in segments containing any
+ * of the keys (all if keys is NULL). If the file wasn't written in
+ * segments, all its entries are returned.
+ */
+prop_array_t
+repo_state_plist_load(struct repo_state *rs,
+		      const char *name,
+		      prop_dictionary_t keys)
+{
+	prop_dictionary_t sd, seg;
+	prop_array_t segs, skeys, entries, array;
+	const char *key;
+	char *path, *xml, *text;
+	size_t len;
+	unsigned int i, x;
+	int fd, rv = 0;
+
+	if ((path = state_path(rs, name)) == NULL)
+		return NULL;
+
+	if ((sd = prop_dictionary_get(rs->d, name)) == NULL) {
+		array = prop_array_internalize_from_zfile(path);
+		free(path);
+		if (array == NULL) {
+			if (errno != ENOENT)
+				return NULL;
+			if ((array = prop_array_create()) == NULL)
+				return NULL;
+		}
+		/* a single segment, never written */
+		sd = prop_dictionary_create();
+		seg = prop_dictionary_create();
+		segs = prop_array_create();
+		if (sd == NULL || seg == NULL || segs == NULL ||
+		    !prop_dictionary_set(seg, "entries", array) ||
+		    !prop_array_add(segs, seg) ||
+		    !prop_dictionary_set(sd, "segments", segs) ||
+		    !prop_dictionary_set(rs->d, name, sd)) {
+			prop_object_release(array);
+			array = NULL;
+			errno = ENOMEM;
+		}
+		if (sd != NULL)
+			prop_object_release(sd);
+		if (seg != NULL)
+			prop_object_release(seg);
+		if (segs != NULL)
+			prop_object_release(segs);
+		return array;
+	}
+
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		free(path);
+		return NULL;
+	}
+	free(path);
+	if ((array = prop_array_create()) == NULL) {
+		(void)close(fd);
+		return NULL;
+	}
+	segs = prop_dictionary_get(sd, "segments");
+	for (i = 0; rv == 0 && i < prop_array_count(segs); i++) {
+		seg = prop_array_get(segs, i);
+		skeys = prop_dictionary_get(seg, "keys");
+		for (x = 0; keys != NULL && x < prop_array_count(skeys); x++) {
+			prop_array_get_cstring_nocopy(skeys, x, &key);
+			if (prop_dictionary_get(keys, key) != NULL)
+				break;
+		}
+		if (keys != NULL && x == prop_array_count(skeys))
+			continue;
+
+		if ((text = seg_inflate(fd, seg, &len)) == NULL) {
+			rv = errno;
+			break;
+		}
+		if ((xml = malloc(HEAD_LEN + len + TAIL_LEN + 1)) == NULL) {
+			free(text);
+			rv = ENOMEM;
+			break;
+		}
+		memcpy(xml, plist_head, HEAD_LEN);
+		memcpy(xml + HEAD_LEN, text, len);
+		memcpy(xml + HEAD_LEN + len, plist_tail, TAIL_LEN + 1);
+		free(text);
+		entries = prop_array_internalize(xml);
+		free(xml);
+		if (entries == NULL ||
+		    prop_array_count(entries) != prop_array_count(skeys)) {
+			if (entries != NULL)
+				prop_object_release(entries);
+			rv = EINVAL;
+			break;
+		}
+		for (x = 0; x < prop_array_count(entries); x++) {
+			if (!prop_array_add(array, prop_array_get(entries, x)))
+				rv = EINVAL;
+		}
+		if (!prop_dictionary_set(seg, "entries", entries))
+			rv = EINVAL;
+		prop_object_release(entries);
+	}
+	(void)close(fd);
+	if (rv != 0) {
+		prop_object_release(array);
+		errno = rv;
+		return NULL;
+	}
+	return array;
+}
+
+bool
+repo_state_plist_segmented(struct repo_state *rs, const char *name)
+{
+	prop_dictionary_t sd;
+
+	sd = prop_dictionary_get(rs->d, name);
+	return sd != NULL && prop_dictionary_get(sd, "inode") != NULL;
+}
+
+unsigned int
+repo_state_plist_count(struct repo_state *rs, const char *name)
+{
+	prop_dictionary_t sd, seg;
+	prop_array_t segs, keys;
+	unsigned int i, count = 0;
+
+	if ((sd = prop_dictionary_get(rs->d, name)) == NULL)
+		return 0;
+	segs = prop_dictionary_get(sd, "segments");
+	for (i = 0; i < prop_array_count(segs); i++) {
+		seg = prop_array_get(segs, i);
+		if ((keys = prop_dictionary_get(seg, "keys")) != NULL)
+			count += prop_array_count(keys);
+		else
+			count += prop_array_count(
+			    prop_dictionary_get(seg, "entries"));
+	}
+	return count;
+}
+
+/*
+ * Writes an index file: entries in loaded segments are kept if they
+ * are still registered in map (all if map is NULL), followed by the
+ * added entries.
+ */
+int
+repo_state_plist_write(struct repo_state *rs,
+		       const char *name,
+		       const char *keyobj,
+		       struct repo_pkgmap *map,
+		       prop_array_t added,
+		       int zlevel)
+{
+	struct seg_writer w;
+	struct seg_text t;
+	struct stat st;
+	prop_dictionary_t sd, seg;
+	prop_array_t segs, newsegs = NULL;
+	char head[HEAD_LEN + 1], tail[TAIL_LEN + 1];
+	char *path, *tmpf = NULL, *text;
+	unsigned char trailer[8];
+	uint64_t usize, total = 0;
+	size_t len;
+	mode_t mask;
+	unsigned int i;
+	int fd = -1, rv = 0;
+	bool compact;
+
+	if ((sd = prop_dictionary_get(rs->d, name)) == NULL)
+		return EINVAL;
+	segs = prop_dictionary_get(sd, "segments");
+
+	memset(&w, 0, sizeof(w));
+	memset(&t, 0, sizeof(t));
+	w.fd = -1;
+	w.level = zlevel;
+	w.crc = crc32(0, NULL, 0);
+
+	if ((path = state_path(rs, name)) == NULL)
+		return ENOMEM;
+	if ((t.keys = prop_array_create()) == NULL ||
+	    (newsegs = prop_array_create()) == NULL ||
+	    (tmpf = xbps_xasprintf("%s/.%s.XXXXXX", rs->repodir,
+	    name)) == NULL) {
+		rv = ENOMEM;
+		goto out;
+	}
+	/*
+	 * Compact the file if there are too many segments compared to
+	 * the number of full segments it contains.
+	 */
+	for (i = 0; i < prop_array_count(segs); i++) {
+		usize = 0;
+		prop_dictionary_get_uint64(prop_array_get(segs, i),
+		    "usize", &usize);
+		total += usize;
+	}
+	compact = prop_array_count(segs) >
+	    2 * (total / SEGMENT_SIZE + 1) + SEGMENT_SLACK;
+
+	if (repo_state_plist_segmented(rs, name) &&
+	    (fd = open(path, O_RDONLY)) == -1) {
+		rv = errno;
+		goto out;
+	}
+	if ((w.fd = mkstemp(tmpf)) == -1) {
+		rv = errno;
+		goto out;
+	}
+	if ((rv = write_all(w.fd, gzip_head, sizeof(gzip_head))) != 0)
+		goto out;
+	w.off = sizeof(gzip_head);
+	memcpy(head, plist_head, sizeof(head));
+	if ((rv = seg_deflate(&w, head, HEAD_LEN, Z_SYNC_FLUSH, NULL)) != 0)
+		goto out;
+
+	for (i = 0; i < prop_array_count(segs); i++) {
+		seg = prop_array_get(segs, i);
+		if (prop_dictionary_get(seg, "entries") != NULL) {
+			rv = text_append_entries(&t,
+			    prop_dictionary_get(seg, "entries"), keyobj, map);
+		} else if (compact) {
+			if ((text = seg_inflate(fd, seg, &len)) == NULL) {
+				rv = errno;
+				goto out;
+			}
+			rv = text_append(&t, text, len);
+			free(text);
+			if (rv == 0)
+				rv = text_append_keys(&t,
+				    prop_dictionary_get(seg, "keys"));
+		} else {
+			if ((rv = text_flush(&w, &t, newsegs)) == 0)
+				rv = seg_copy(&w, fd, seg, newsegs);
+		}
+		if (rv != 0)
+			goto out;
+	}
+	if (added != NULL &&
+	    (rv = text_append_entries(&t, added, keyobj, map)) != 0)
+		goto out;
+	if ((rv = text_flush(&w, &t, newsegs)) != 0)
+		goto out;
+
+	memcpy(tail, plist_tail, sizeof(tail));
+	if ((rv = seg_deflate(&w, tail, TAIL_LEN, Z_FINISH, NULL)) != 0)
+		goto out;
+	for (i = 0; i < 4; i++) {
+		trailer[i] = (unsigned char)(w.crc >> (8 * i));
+		trailer[i + 4] = (unsigned char)(w.usize >> (8 * i));
+	}
+	if ((rv = write_all(w.fd, trailer, sizeof(trailer))) != 0)
+		goto out;
+
+	mask = umask(0);
+	(void)umask(mask);
+	if (fchmod(w.fd, 0666 & ~mask) == -1 || fsync(w.fd) == -1 ||
+	    fstat(w.fd, &st) == -1) {
+		rv = errno;
+		goto out;
+	}
+	if (close(w.fd) == -1) {
+		w.fd = -1;
+		rv = errno;
+		goto out;
+	}
+	w.fd = -1;
+	if (rename(tmpf, path) == -1) {
+		rv = errno;
+		goto out;
+	}
+	if (!prop_dictionary_set_uint64(sd, "size", (uint64_t)st.st_size) ||
+	    !prop_dictionary_set_uint64(sd, "mtime", (uint64_t)st.st_mtime) ||
+	    !prop_dictionary_set_uint64(sd, "inode", (uint64_t)st.st_ino) ||
+	    !prop_dictionary_set(sd, "segments", newsegs))
+		rv = EINVAL;
+out:
+	if (w.fd != -1) {
+		(void)close(w.fd);
+		(void)unlink(tmpf);
+	}
+	if (fd != -1)
+		(void)close(fd);
+	if (newsegs != NULL)
+		prop_object_release(newsegs);
+	if (t.keys != NULL)
+		prop_object_release(t.keys);
+	free(t.buf);
+	free(tmpf);
+	free(path);
+
+	return rv;
+}
@@ -32,6 +32,8 @@
 #include <dirent.h>
 #include <libgen.h>
 #include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include <xbps_api.h>
 #include "defs.h"
@@ -41,7 +43,7 @@
  * binary package cannot be read (unavailable, not enough perms, etc).
  */
 int
-repo_index_clean(struct xbps_handle *xhp, const char *repodir)
+repo_index_clean(struct xbps_handle *xhp, const char *repodir, int zlevel)
 {
 	prop_array_t array;
 	prop_dictionary_t pkgd;
@@ -89,7 +91,8 @@ again:
 			goto again;
 		}
 	}
-	if (flush && !prop_array_externalize_to_zfile(array, plist)) {
+	if (flush &&
+	    !prop_array_externalize_to_zfile_level(array, plist, zlevel)) {
 		rv = errno;
 		goto out;
 	}
@@ -101,20 +104,204 @@ out:
 	return rv;
 }
 
+/*
+ * Binary packages are read and hashed by up to INDEX_MAX_THREADS
+ * threads; the index is then updated serially in argv order.
+ */
+#define INDEX_MAX_THREADS	16
+
+struct index_pkg {
+	prop_dictionary_t state;
+	prop_dictionary_t pkgd;
+	char *sha256;
+	uint64_t size;
+	int rv;
+};
+
+struct index_read {
+	pthread_mutex_t mtx;
+	struct xbps_handle *xhp;
+	struct repo_pkgmap *map;
+	struct index_pkg *pkgs;
+	char **argv;
+	int argc;
+	int next;
+};
+
+static int
+index_pkg_hash(struct index_pkg *ip, const char *binpkg)
+{
+	struct stat st;
+
+	if ((ip->sha256 = xbps_file_hash(binpkg)) == NULL)
+		return errno;
+	if (stat(binpkg, &st) == -1)
+		return errno;
+	ip->size = (uint64_t)st.st_size;
+
+	return 0;
+}
+
+static void
+index_read_pkg(struct index_read *ir, int i)
+{
+	struct index_pkg *ip = &ir->pkgs[i];
+	prop_dictionary_t curpkgd;
+	const char *pkgname, *version, *arch, *regver;
+
+	ip->pkgd = xbps_dictionary_metadata_plist_by_url(ir->argv[i],
+	    "./props.plist");
+	if (ip->pkgd == NULL)
+		return;
+	prop_dictionary_get_cstring_nocopy(ip->pkgd, "pkgname", &pkgname);
+	prop_dictionary_get_cstring_nocopy(ip->pkgd, "version", &version);
+	prop_dictionary_get_cstring_nocopy(ip->pkgd, "architecture", &arch);
+	/*
+	 * Don't hash packages not newer than the registered ones,
+	 * they are skipped; anything else is hashed again later
+	 * if needed.
+	 */
+	curpkgd = repo_pkgmap_find(ir->xhp, ir->map, pkgname, arch);
+	if (curpkgd != NULL &&
+	    prop_dictionary_get_cstring_nocopy(curpkgd, "version",
+	    &regver) && xbps_cmpver(version, regver) <= 0)
+		return;
+
+	ip->rv = index_pkg_hash(ip, ir->argv[i]);
+}
+
+static void *
+index_read_thread(void *arg)
+{
+	struct index_read *ir = arg;
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock(&ir->mtx);
+		i = ir->next++;
+		pthread_mutex_unlock(&ir->mtx);
+		if (i >= ir->argc)
+			break;
+		/* not modified since it was registered */
+		if (ir->pkgs[i].state != NULL)
+			continue;
+
+		index_read_pkg(ir, i);
+	}
+	return NULL;
+}
+
+static void
+index_read(struct index_read *ir)
+{
+	pthread_t thr[INDEX_MAX_THREADS];
+	long ncpus;
+	int i, nthreads;
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	nthreads = ncpus > 0 ? (int)ncpus : 1;
+	if (nthreads > INDEX_MAX_THREADS)
+		nthreads = INDEX_MAX_THREADS;
+	if (nthreads > ir->argc)
+		nthreads = ir->argc;
+
+	/* this thread also reads packages */
+	for (i = 1; i < nthreads; i++) {
+		if (pthread_create(&thr[i], NULL, index_read_thread, ir))
+			break;
+	}
+	nthreads = i;
+	(void)index_read_thread(ir);
+
+	for (i = 1; i < nthreads; i++)
+		pthread_join(thr[i], NULL);
+}
+
+/*
+ * Loads the index segments with entries for the packages read. Packages
+ * not modified since they were registered are read anyway if another
+ * package has the same pkgname, they may not be registered any longer.
+ */
+static prop_array_t
+index_state_load(struct index_read *ir, struct repo_state *rs)
+{
+	prop_dictionary_t keys;
+	prop_array_t idx;
+	const char *pkgname, *pkgver;
+	char *name;
+	int i;
+
+	if ((keys = prop_dictionary_create()) == NULL)
+		return NULL;
+	for (i = 1; i < ir->argc; i++) {
+		if (ir->pkgs[i].pkgd == NULL ||
+		    !prop_dictionary_get_cstring_nocopy(ir->pkgs[i].pkgd,
+		    "pkgname", &pkgname))
+			continue;
+		if (!prop_dictionary_set_bool(keys, pkgname, true)) {
+			prop_object_release(keys);
+			errno = ENOMEM;
+			return NULL;
+		}
+	}
+	for (i = 1; i < ir->argc; i++) {
+		if (ir->pkgs[i].state == NULL)
+			continue;
+		prop_dictionary_get_cstring_nocopy(ir->pkgs[i].state,
+		    "pkgver", &pkgver);
+		if ((name = xbps_pkg_name(pkgver)) == NULL)
+			continue;
+		if (prop_dictionary_get(keys, name) != NULL) {
+			ir->pkgs[i].state = NULL;
+			index_read_pkg(ir, i);
+		}
+		free(name);
+	}
+	idx = repo_state_plist_load(rs, XBPS_PKGINDEX, keys);
+	prop_object_release(keys);
+
+	return idx;
+}
+
+static int
+index_merge(struct repo_pkgmap *map, prop_array_t dst, prop_array_t src)
+{
+	prop_object_t obj;
+	unsigned int i;
+
+	for (i = 0; i < prop_array_count(src); i++) {
+		obj = prop_array_get(src, i);
+		/* objects without pkgname were never looked up */
+		if (prop_dictionary_get(obj, "pkgname") != NULL &&
+		    !repo_pkgmap_contains(map, obj))
+			continue;
+		if (!prop_array_add(dst, obj))
+			return EINVAL;
+	}
+	return 0;
+}
+
 /*
  * Adds a binary package into the index and removes old binary package
  * and entry when it's necessary.
  */
 int
-repo_index_add(struct xbps_handle *xhp, int argc, char **argv)
+repo_index_add(struct xbps_handle *xhp,
+	       int argc,
+	       char **argv,
+	       int zlevel,
+	       struct repo_state *rs)
 {
-	prop_array_t idx = NULL;
-	prop_dictionary_t newpkgd = NULL, curpkgd;
-	struct stat st;
+	prop_array_t idx = NULL, newidx = NULL, added = NULL;
+	prop_dictionary_t newpkgd, curpkgd;
+	struct repo_pkgmap *map = NULL;
+	struct index_read ir;
+	struct index_pkg *pkgs = NULL, *ip;
 	const char *pkgname, *version, *regver, *oldfilen, *oldpkgver;
 	const char *arch, *oldarch;
-	char *sha256, *filen, *repodir, *buf, *buf2;
+	char *filen, *repodir, *buf;
 	char *tmpfilen = NULL, *tmprepodir = NULL, *plist = NULL;
+	unsigned int n, count;
 	int i, ret = 0, rv = 0;
 	bool flush = false;
 
@@ -128,7 +315,12 @@ repo_index_add(struct xbps_handle *xhp, int argc, char **argv)
 	if ((plist = xbps_pkg_index_plist(xhp, repodir)) == NULL)
 		return -1;
 
-	if ((idx = prop_array_internalize_from_zfile(plist)) == NULL) {
+	/*
+	 * In incremental mode, only the index segments needed for the
+	 * packages read are loaded later.
+	 */
+	if (rs == NULL &&
+	    (idx = prop_array_internalize_from_zfile(plist)) == NULL) {
 		if (errno != ENOENT) {
 			xbps_error_printf("xbps-repo: cannot read `%s': %s\n",
 			    plist, strerror(errno));
@@ -139,21 +331,77 @@ repo_index_add(struct xbps_handle *xhp, int argc, char **argv)
 			assert(idx);
 		}
 	}
+	/*
+	 * Map pkgname to index entries, to look up packages in constant
+	 * time rather than walking the index for every package.
+	 */
+	map = repo_pkgmap_create("pkgname", prop_array_count(idx) + argc);
+	if (map == NULL) {
+		rv = ENOMEM;
+		goto out;
+	}
+	for (n = 0; n < prop_array_count(idx); n++) {
+		rv = repo_pkgmap_add(map, prop_array_get(idx, n));
+		if (rv == ENOMEM)
+			goto out;
+	}
+	rv = 0;
+	if ((added = prop_array_create()) == NULL ||
+	    (pkgs = calloc(argc, sizeof(*pkgs))) == NULL) {
+		rv = ENOMEM;
+		goto out;
+	}
+	for (i = 1; rs != NULL && i < argc; i++)
+		pkgs[i].state = repo_state_pkg(rs, argv[i]);
+	/*
+	 * Read props.plist and hash all packages specified in argv.
+	 */
+	memset(&ir, 0, sizeof(ir));
+	pthread_mutex_init(&ir.mtx, NULL);
+	ir.xhp = xhp;
+	ir.map = map;
+	ir.pkgs = pkgs;
+	ir.argv = argv;
+	ir.argc = argc;
+	ir.next = 1;
+	index_read(&ir);
+	pthread_mutex_destroy(&ir.mtx);
+
+	if (rs != NULL) {
+		if ((idx = index_state_load(&ir, rs)) == NULL) {
+			xbps_error_printf("xbps-repo: cannot read `%s': %s\n",
+			    plist, strerror(errno));
+			rv = -1;
+			goto out;
+		}
+		for (n = 0; n < prop_array_count(idx); n++) {
+			rv = repo_pkgmap_add(map, prop_array_get(idx, n));
+			if (rv == ENOMEM)
+				goto out;
+		}
+		rv = 0;
+	}
 
 	/*
 	 * Process all packages specified in argv.
 	 */
 	for (i = 1; i < argc; i++) {
+		ip = &pkgs[i];
+		if (ip->state != NULL) {
+			prop_dictionary_get_cstring_nocopy(ip->state,
+			    "pkgver", &oldpkgver);
+			prop_dictionary_get_cstring_nocopy(ip->state,
+			    "architecture", &arch);
+			fprintf(stderr, "index: skipping `%s' (%s), already "
+			    "registered.\n", oldpkgver, arch);
+			continue;
+		}
 		if ((tmpfilen = strdup(argv[i])) == NULL) {
 			rv = ENOMEM;
 			goto out;
 		}
 		filen = basename(tmpfilen);
-		/*
-		 * Read metadata props plist dictionary from binary package.
-		 */
-		newpkgd = xbps_dictionary_metadata_plist_by_url(argv[i],
-		    "./props.plist");
+		newpkgd = ip->pkgd;
 		if (newpkgd == NULL) {
 			xbps_error_printf("failed to read %s metadata for `%s',"
 			    " skipping!\n", XBPS_PKGPROPS, argv[i]);
@@ -172,16 +420,8 @@ repo_index_add(struct xbps_handle *xhp, int argc, char **argv)
 		 * than current registered package, update the index; otherwise
 		 * pass to the next one.
 		 */
-		curpkgd =
-		    xbps_find_pkg_in_array_by_name(xhp, idx, pkgname, arch);
-		if (curpkgd == NULL) {
-			if (errno && errno != ENOENT) {
-				prop_object_release(newpkgd);
-				free(tmpfilen);
-				rv = errno;
-				goto out;
-			}
-		} else {
+		curpkgd = repo_pkgmap_find(xhp, map, pkgname, arch);
+		if (curpkgd != NULL) {
 			prop_dictionary_get_cstring_nocopy(curpkgd,
 			    "filename", &oldfilen);
 			prop_dictionary_get_cstring_nocopy(curpkgd,
@@ -196,8 +436,10 @@ repo_index_add(struct xbps_handle *xhp, int argc, char **argv)
 				fprintf(stderr, "index: skipping `%s-%s' "
 				    "(%s), already registered.\n",
 				    pkgname, version, arch);
-				prop_object_release(newpkgd);
 				free(tmpfilen);
+				if (rs != NULL && (rv = repo_state_pkg_set(rs,
+				    argv[i], curpkgd)) != 0)
+					goto out;
 				continue;
 			} else if (ret == -1) {
 				/*
@@ -210,14 +452,12 @@ repo_index_add(struct xbps_handle *xhp, int argc, char **argv)
 				rv = repo_remove_pkg(repodir,
 				    oldarch, oldfilen);
 				if (rv != 0) {
-					prop_object_release(newpkgd);
 					free(tmpfilen);
 					free(buf);
 					goto out;
 				}
 				printf("index: removed obsolete binpkg %s.\n", buf);
 				free(buf);
-				prop_object_release(newpkgd);
 				free(tmpfilen);
 				continue;
 			}
@@ -227,29 +467,16 @@ repo_index_add(struct xbps_handle *xhp, int argc, char **argv)
 			 */
 			buf = xbps_xasprintf("`%s' (%s)", oldpkgver, oldarch);
 			assert(buf);
-			buf2 = strdup(oldpkgver);
-			assert(buf2);
 			rv = repo_remove_pkg(repodir, oldarch, oldfilen);
 			if (rv != 0) {
 				free(buf);
-				free(buf2);
-				prop_object_release(newpkgd);
-				free(tmpfilen);
-				goto out;
-			}
-			if (!xbps_remove_pkg_from_array_by_pkgver(xhp, idx,
-			    buf2, oldarch)) {
-				xbps_error_printf("failed to remove %s "
-				    "from plist index: %s\n", buf,
-				    strerror(errno));
-				rv = errno;
-				free(buf);
-				free(buf2);
-				prop_object_release(newpkgd);
 				free(tmpfilen);
 				goto out;
 			}
-			free(buf2);
+			/* dropped from the index when it's written */
+			if (rs != NULL)
+				repo_state_pkg_remove(rs, oldfilen);
+			repo_pkgmap_remove(map, curpkgd);
 			printf("index: removed obsolete entry/binpkg %s.\n", buf);
 			free(buf);
 		}
@@ -259,34 +486,24 @@ repo_index_add(struct xbps_handle *xhp, int argc, char **argv)
 		 */
 		if (!prop_dictionary_set_cstring(newpkgd, "filename", filen)) {
 			rv = errno;
-			prop_object_release(newpkgd);
 			free(tmpfilen);
 			goto out;
 		}
-		if ((sha256 = xbps_file_hash(argv[i])) == NULL) {
-			rv = errno;
-			prop_object_release(newpkgd);
+		if (ip->sha256 == NULL && ip->rv == 0)
+			ip->rv = index_pkg_hash(ip, argv[i]);
+		if (ip->rv != 0) {
+			rv = ip->rv;
 			free(tmpfilen);
 			goto out;
 		}
 		if (!prop_dictionary_set_cstring(newpkgd, "filename-sha256",
-		    sha256)) {
-			free(sha256);
-			prop_object_release(newpkgd);
-			free(tmpfilen);
-			rv = errno;
-			goto out;
-		}
-		free(sha256);
-		if (stat(argv[i], &st) == -1) {
-			prop_object_release(newpkgd);
+		    ip->sha256)) {
 			free(tmpfilen);
 			rv = errno;
 			goto out;
 		}
 		if (!prop_dictionary_set_uint64(newpkgd, "filename-size",
-		    (uint64_t)st.st_size)) {
-			prop_object_release(newpkgd);
+		    ip->size)) {
 			free(tmpfilen);
 			rv = errno;
 			goto out;
@@ -294,8 +511,8 @@ repo_index_add(struct xbps_handle *xhp, int argc, char **argv)
 		/*
 		 * Add new pkg dictionary into the index.
 		 */
-		if (!prop_array_add(idx, newpkgd)) {
-			prop_object_release(newpkgd);
+		if (!prop_array_add(added, newpkgd) ||
+		    (rv = repo_pkgmap_add(map, newpkgd)) != 0) {
 			free(tmpfilen);
 			rv = EINVAL;
 			goto out;
@@ -303,10 +520,46 @@ repo_index_add(struct xbps_handle *xhp, int argc, char **argv)
 		flush = true;
 		printf("index: added `%s-%s' (%s).\n", pkgname, version, arch);
 		free(tmpfilen);
-		prop_object_release(newpkgd);
+		if (rs != NULL &&
+		    (rv = repo_state_pkg_set(rs, argv[i], newpkgd)) != 0)
+			goto out;
 	}
 
-	if (flush && !prop_array_externalize_to_zfile(idx, plist)) {
+	if (rs != NULL) {
+		/*
+		 * Write the modified segments only; an index not written
+		 * in segments yet is written completely.
+		 */
+		count = repo_state_plist_count(rs, XBPS_PKGINDEX);
+		if ((flush || (count > 0 &&
+		    !repo_state_plist_segmented(rs, XBPS_PKGINDEX))) &&
+		    (rv = repo_state_plist_write(rs, XBPS_PKGINDEX, "pkgname",
+		    map, added, zlevel)) != 0)
+			xbps_error_printf("failed to externalize plist: %s\n",
+			    strerror(rv));
+		printf("index: %u packages registered.\n",
+		    repo_state_plist_count(rs, XBPS_PKGINDEX));
+		goto out;
+	}
+	if (flush) {
+		/*
+		 * Registered packages in the same order, without the
+		 * replaced ones, followed by the new packages.
+		 */
+		if ((newidx = prop_array_create_with_capacity(
+		    prop_array_count(idx) + prop_array_count(added))) == NULL) {
+			rv = ENOMEM;
+			goto out;
+		}
+		if ((rv = index_merge(map, newidx, idx)) != 0 ||
+		    (rv = index_merge(map, newidx, added)) != 0)
+			goto out;
+		prop_object_release(idx);
+		idx = newidx;
+		newidx = NULL;
+	}
+	if (flush &&
+	    !prop_array_externalize_to_zfile_level(idx, plist, zlevel)) {
 		xbps_error_printf("failed to externalize plist: %s\n",
 		    strerror(errno));
 		rv = errno;
@@ -314,10 +567,23 @@ repo_index_add(struct xbps_handle *xhp, int argc, char **argv)
 	printf("index: %u packages registered.\n", prop_array_count(idx));
 
 out:
+	if (pkgs) {
+		for (i = 1; i < argc; i++) {
+			if (pkgs[i].pkgd)
+				prop_object_release(pkgs[i].pkgd);
+			free(pkgs[i].sha256);
+		}
+		free(pkgs);
+	}
 	if (tmprepodir)
 		free(tmprepodir);
 	if (plist)
 		free(plist);
+	if (newidx)
+		prop_object_release(newidx);
+	if (added)
+		prop_object_release(added);
+	repo_pkgmap_free(map);
 	if (idx)
 		prop_object_release(idx);
 
@@ -49,9 +49,11 @@ usage(bool fail)
 	    " -c cachedir  Full path to cachedir to store downloaded binpkgs\n"
 	    " -d           Debug mode shown to stderr\n"
 	    " -h           Print usage help\n"
+	    " -i           Update index files incrementally in index-add\n"
 	    " -o key[,key] Print package metadata keys in show target\n"
 	    " -r rootdir   Full path to rootdir\n"
-	    " -V           Show XBPS version\n\n"
+	    " -V           Show XBPS version\n"
+	    " -z level     Compression level (0-9) for index files (default 9)\n\n"
 	    "[targets]\n"
 	    " clean\n"
 	    "   Removes obsolete binary packages from cachedir.\n"
@@ -92,13 +94,17 @@ main(int argc, char **argv)
 	struct xbps_handle xh;
 	struct xferstat xfer;
 	struct repo_search_data rsd;
+	struct repo_state *rs = NULL;
 	prop_dictionary_t pkgd;
 	const char *rootdir, *cachedir, *conffile, *option, *defrepo;
-	int flags = 0, c, rv = 0;
+	char *repodir, *endp;
+	long lval;
+	int flags = 0, zlevel = 9, c, rv = 0;
+	bool incremental = false;
 
 	rootdir = cachedir = conffile = option = defrepo = NULL;
 
-	while ((c = getopt(argc, argv, "B:C:c:dho:r:V")) != -1) {
+	while ((c = getopt(argc, argv, "B:C:c:dhio:r:Vz:")) != -1) {
 		switch (c) {
 		case 'B':
 			defrepo = optarg;
@@ -115,6 +121,9 @@ main(int argc, char **argv)
 		case 'h':
 			usage(false);
 			break;
+		case 'i':
+			incremental = true;
+			break;
 		case 'o':
 			option = optarg;
 			break;
@@ -125,6 +134,14 @@ main(int argc, char **argv)
 		case 'V':
 			printf("%s\n", XBPS_RELVER);
 			exit(EXIT_SUCCESS);
+		case 'z':
+			errno = 0;
+			lval = strtol(optarg, &endp, 10);
+			if (errno || endp == optarg || *endp != '\0' ||
+			    lval < 0 || lval > 9)
+				usage(true);
+			zlevel = (int)lval;
+			break;
 		case '?':
 		default:
 			usage(true);
@@ -299,20 +316,36 @@ main(int argc, char **argv)
 		if (argc < 2)
 			usage(true);
 
-		if ((rv = repo_index_add(&xh, argc, argv)) != 0)
+		if (incremental) {
+			if ((repodir = strdup(argv[1])) == NULL) {
+				rv = ENOMEM;
+				goto out;
+			}
+			rs = repo_state_open(dirname(repodir));
+			free(repodir);
+			if (rs == NULL) {
+				rv = errno;
+				goto out;
+			}
+		}
+		if ((rv = repo_index_add(&xh, argc, argv, zlevel, rs)) != 0)
 			goto out;
-		if ((rv = repo_index_files_add(&xh, argc, argv)) != 0)
+		if ((rv = repo_index_files_add(&xh, argc, argv,
+		    zlevel, rs)) != 0)
 			goto out;
+		if (rs != NULL && (rv = repo_state_flush(rs)) != 0)
+			xbps_error_printf("xbps-repo: failed to write index "
+			    "state: %s\n", strerror(rv));
 
 	} else if (strcasecmp(argv[0], "index-clean") == 0) {
 		/* Removes obsolete pkg entries from index in a repository */
 		if (argc != 2)
 			usage(true);
 
-		if ((rv = repo_index_clean(&xh, argv[1])) != 0)
+		if ((rv = repo_index_clean(&xh, argv[1], zlevel)) != 0)
 			goto out;
 
-		rv = repo_index_files_clean(&xh, argv[1]);
+		rv = repo_index_files_clean(&xh, argv[1], zlevel);
 
 	} else if (strcasecmp(argv[0], "sync") == 0) {
 		/* Syncs the pkg index for all registered remote repos */
@@ -335,6 +368,7 @@ main(int argc, char **argv)
 	}
 
 out:
+	repo_state_free(rs);
 	xbps_end(&xh);
 	exit(rv ? EXIT_FAILURE : EXIT_SUCCESS);
 }
@@ -0,0 +1,3 @@
+/* linux */
+#include "compat.h"
+#include "compat.h"
@@ -0,0 +1,86 @@
+# Common vars used by XBPS on linux.
+TOPDIR ?=	..
+PREFIX ?=	/usr/local
+EPREFIX ?= /usr/local
+SBINDIR ?= /usr/local/sbin
+INCLUDEDIR ?=	/usr/local/include
+LIBDIR ?=	/usr/local/lib
+MANDIR ?=	/usr/local/share/man
+SHAREDIR ?= /usr/local/share
+PKGCONFIGDIR ?= /usr/local/lib/pkgconfig
+TESTSDIR ?= /usr/local/tests
+ETCDIR ?= /usr/local/etc/xbps
+CC = 		gcc
+CFLAGS = -O2 -pthread
+LDFLAGS =  	-L$(TOPDIR)/lib -L$(LIBDIR)
+CPPFLAGS = 	-I. -I$(TOPDIR) -I$(TOPDIR)/include
+CPPFLAGS +=	-DHAVE_CONFIG_H
+CPPFLAGS +=	-DXBPS_SYSCONF_PATH=\"/usr/local/etc/xbps\"
+INSTALL_STRIPPED =	-s
+CPPFLAGS += 	-D_XOPEN_SOURCE=500
+CPPFLAGS += 	-D_FILE_OFFSET_BITS=64
+CFLAGS +=	-Wall
+CFLAGS +=	-Wextra
+CFLAGS +=	-Werror
+CFLAGS +=	-Wshadow
+CFLAGS +=	-Wformat=2
+CFLAGS +=	-Wmissing-prototypes
+CFLAGS +=	-Wmissing-declarations
+CFLAGS +=	-Wnested-externs
+CFLAGS +=	-Wvla
+CFLAGS +=	-Wno-overlength-strings
+CFLAGS +=	-Wunsafe-loop-optimizations
+CFLAGS +=	-Wundef
+CFLAGS +=	-Wsign-compare
+CFLAGS +=	-Wmissing-include-dirs
+CFLAGS +=	-Wold-style-definition
+CFLAGS +=	-Winit-self
+CFLAGS +=	-Wredundant-decls
+CFLAGS +=	-Wfloat-equal
+CFLAGS +=	-Wmissing-noreturn
+CFLAGS +=	-Wcast-align
+CFLAGS +=	-Wcast-qual
+CFLAGS +=	-Wpointer-arith
+CFLAGS +=	-Wcomment
+CFLAGS +=	-Wdeclaration-after-statement
+CFLAGS +=	-Wwrite-strings
+CFLAGS +=	-Wstack-protector
+CFLAGS +=	-fPIC
+CFLAGS +=	-fstack-protector-all
+CFLAGS +=	--param ssp-buffer-size=1
+CPPFLAGS += -D_FORTIFY_SOURCE=2
+SHAREDLIB_CFLAGS +=	-fvisibility=default
+CPPFLAGS +=	-DHAVE_VISIBILITY=1
+LIBXBPS_LDFLAGS +=	-Wl,--export-dynamic
+LDFLAGS +=	-Wl,-z,relro,-z,now
+PROG_CFLAGS +=	-fPIE
+PROG_LDFLAGS +=	-pie
+CPPFLAGS +=	-DHAVE_VASPRINTF
+CPPFLAGS +=	-DHAVE_STRCASESTR
+COMPAT_SRCS +=	compat/strlcpy.o
+COMPAT_SRCS +=	compat/strlcat.o
+CPPFLAGS +=	-I$(TOPDIR)/lib/fetch
+STATIC_LIBS =	$(TOPDIR)/lib/libxbps.a
+CPPFLAGS +=       -I$(TOPDIR)/lib/portableproplib
+LDFLAGS +=	-lpthread
+STATIC_LIBS +=	-lpthread
+CPPFLAGS	+= -DHAVE_CLOCK_GETTIME
+LDFLAGS += -lrt
+STATIC_LIBS += -lrt
+LDFLAGS +=	-lz
+STATIC_LIBS +=	-lz
+CFLAGS +=	-I/tmp/stubs/include 
+LDFLAGS +=        
+STATIC_LIBS +=    
+CFLAGS += -I/tmp/stubs/include 
+LDFLAGS += 
+STATIC_LIBS += 
+CFLAGS +=	
+LDFLAGS +=        -lssl 
+STATIC_LIBS +=    -lssl -lcrypto -ldl -pthread 
+SILENT = @
+CPPFLAGS	+= -DHAVE_SYNCFS
+CPPFLAGS	+= -DHAVE_COPY_FILE_RANGE
+CPPFLAGS	+= -DHAVE_FICLONE
+CPPFLAGS	+= -DHAVE_FALLOCATE
+CPPFLAGS	+= -DHAVE_SPLICE
@@ -104,6 +104,7 @@ extern "C" {
 void		fetchIO_close(fetchIO *);
 ssize_t		fetchIO_read(fetchIO *, void *, size_t);
 ssize_t		fetchIO_write(fetchIO *, const void *, size_t);
+ssize_t		fetchIO_splice(fetchIO *, int, size_t);
 
 /* fetchIO-specific functions */
 fetchIO		*fetchXGetFile(struct url *, struct url_stat *, const char *);
@@ -118,6 +119,9 @@ fetchIO		*fetchXGetHTTP(struct url *, struct url_stat *, const char *);
 fetchIO		*fetchGetHTTP(struct url *, const char *);
 fetchIO		*fetchPutHTTP(struct url *, const char *);
 int		 fetchStatHTTP(struct url *, struct url_stat *, const char *);
+int		 fetchXGetHTTPBatch(struct url **, size_t, int,
+		    int (*)(size_t, fetchIO *, struct url_stat *, void *),
+		    void *, const char *);
 int		 fetchListHTTP(struct url_list *, struct url *, const char *,
 		    const char *);
 
@@ -162,6 +166,11 @@ char		*fetchUnquoteFilename(struct url *);
 void		 fetchConnectionCacheInit(int, int);
 void		 fetchConnectionCacheClose(void);
 
+/* TLS session caching */
+int		 fetchSessionCacheLoad(const char *);
+int		 fetchSessionCacheSave(const char *);
+void		 fetchSessionCacheClose(void);
+
 /* Authentication */
 typedef int (*auth_t)(struct url *);
 extern auth_t		 fetchAuthMethod;
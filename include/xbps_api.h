@@ -109,6 +109,12 @@
  */
 #define XBPS_PKGINDEX_FILES	"index-files.plist"
 
+/**
+ * @def XBPS_FETCH_SESSIONS
+ * Filename of the saved TLS sessions, in metadir.
+ */
+#define XBPS_FETCH_SESSIONS	"tls-sessions"
+
 /**
  * @def XBPS_SYSCONF_PATH
  * Default configuration PATH to find XBPS_CONF_PLIST.
@@ -174,6 +180,43 @@
  */
 #define XBPS_FLAG_DEBUG 		0x00000040
 
+/**
+ * @def XBPS_FLAG_BINARY_PLISTS
+ * Write the package database and the package metadata plists
+ * in the compact binary plist format rather than in XML.
+ * Reading always accepts both formats.
+ */
+#define XBPS_FLAG_BINARY_PLISTS		0x00000080
+
+/**
+ * @def XBPS_FLAG_UNPACK_SYNC
+ * Flush unpacked files to disk before renaming them into place,
+ * so that they survive a system crash.
+ */
+#define XBPS_FLAG_UNPACK_SYNC		0x00000100
+
+/**
+ * @def XBPS_FLAG_PACKAGE_STORE
+ * Keep the contents of unpacked binary packages in the package store
+ * at cachedir, and unpack packages found there without reading the
+ * binary package.
+ */
+#define XBPS_FLAG_PACKAGE_STORE		0x00000200
+
+/**
+ * @def XBPS_FLAG_PACKAGE_STORE_LINKS
+ * Hardlink files from the package store rather than copying them,
+ * if the store and rootdir are in the same filesystem.
+ */
+#define XBPS_FLAG_PACKAGE_STORE_LINKS	0x00000400
+
+/**
+ * @def XBPS_FLAG_FETCH_SESSIONS
+ * Save the TLS sessions of HTTPS servers in metadir, so that the
+ * next runs resume them rather than doing full handshakes.
+ */
+#define XBPS_FLAG_FETCH_SESSIONS	0x00000800
+
 /**
  * @def XBPS_FETCH_CACHECONN
  * Default (global) limit of cached connections used in libfetch.
@@ -192,6 +235,33 @@
  */
 #define XBPS_FETCH_TIMEOUT		30
 
+/**
+ * @def XBPS_FETCH_SEGMENTS
+ * Default maximum number of connections used to fetch a single file.
+ */
+#define XBPS_FETCH_SEGMENTS		1
+
+/**
+ * @def XBPS_FETCH_BUFSIZE
+ * Default size (in KB) of reads when fetching files.
+ */
+#define XBPS_FETCH_BUFSIZE		256
+
+/**
+ * @def XBPS_FETCH_PIPELINE
+ * Default maximum number of pipelined requests per connection when
+ * fetching binary packages. 1 means that pipelining is disabled.
+ */
+#define XBPS_FETCH_PIPELINE		1
+
+/**
+ * @def XBPS_FETCH_ASYNC
+ * Default maximum number of files downloaded at the same time by
+ * xbps_fetch_files_async(). 1 means that repositories and binary
+ * packages are downloaded one at a time with xbps_fetch_file().
+ */
+#define XBPS_FETCH_ASYNC		1
+
 /**
  * @def XBPS_TRANS_FLUSH
  * Default number of packages to be processed in a transaction to
@@ -199,6 +269,19 @@
  */
 #define XBPS_TRANS_FLUSH		5
 
+/**
+ * @def XBPS_UNPACK_THREADS
+ * Default number of threads to unpack a binary package, 1 means
+ * serial extraction and 0 one thread per online CPU.
+ */
+#define XBPS_UNPACK_THREADS		1
+
+/**
+ * @def XBPS_TRANS_PARALLEL_UNPACK
+ * Default number of packages unpacked concurrently in a transaction.
+ */
+#define XBPS_TRANS_PARALLEL_UNPACK	1
+
 __BEGIN_DECLS
 
 /** @addtogroup initend */ 
@@ -522,12 +605,24 @@ struct xbps_handle {
 	 * If NULL, defaults to \a XBPS_CACHE_PATH (relative to rootdir).
 	 */
 	const char *metadir;
+	/**
+	 * @var shared_cachedir
+	 *
+	 * Full path to a binary package cache shared by multiple
+	 * rootdirs and processes, see xbps.conf(5). If NULL (the
+	 * default) it's not used.
+	 */
+	const char *shared_cachedir;
 	/**
 	 * @private
 	 */
 	char *cachedir_priv;
 	char *metadir_priv;
 	char *un_machine;
+	struct xbps_pkgpattern_cache *pkgpattern_cache;
+	struct xbps_version_cache *version_cache;
+	struct xbps_revdeps *revdeps;
+	struct xbps_mirrors *mirrors;
 	/*
 	 * @var repository
 	 *
@@ -549,6 +644,43 @@ struct xbps_handle {
 	 * by the API from a setting in configuration file.
 	 */
 	uint16_t fetch_timeout;
+	/**
+	 * @var fetch_segments
+	 *
+	 * Maximum number of connections used to fetch a single file
+	 * from HTTP servers supporting range requests. If set to 1
+	 * (default) files are fetched with a single connection. This is
+	 * set internally by the API from a setting in configuration file.
+	 */
+	uint16_t fetch_segments;
+	/**
+	 * @var fetch_bufsize
+	 *
+	 * Size (in KB) of every read when fetching files. If not set,
+	 * it defaults to 256. This is set internally by the API from a
+	 * setting in configuration file.
+	 */
+	uint16_t fetch_bufsize;
+	/**
+	 * @var fetch_pipeline
+	 *
+	 * Maximum number of pipelined requests in flight on a single
+	 * connection, when fetching many small binary packages from the
+	 * same HTTP server in a transaction. If set to 0 or 1 packages
+	 * are requested one at a time. This is set internally by the API
+	 * from a setting in configuration file.
+	 */
+	uint16_t fetch_pipeline;
+	/**
+	 * @var fetch_async
+	 *
+	 * Maximum number of files downloaded at the same time by
+	 * xbps_fetch_files_async(), used to synchronize repositories and
+	 * to download binary packages. If set to 1 files are downloaded
+	 * one at a time. This is set internally by the API from a
+	 * setting in configuration file.
+	 */
+	uint16_t fetch_async;
 	/**
 	 * @var transaction_frequency_flush
 	 *
@@ -556,6 +688,24 @@ struct xbps_handle {
 	 * trigger a flush to the master databases.
 	 */
 	uint16_t transaction_frequency_flush;
+	/**
+	 * @var transaction_parallel_unpack
+	 *
+	 * Maximum number of independent packages to be unpacked
+	 * concurrently in a transaction. If set to 1 (default) packages
+	 * are unpacked one at a time. This is set internally by the API
+	 * from a setting in configuration file.
+	 */
+	uint16_t transaction_parallel_unpack;
+	/**
+	 * @var unpack_threads
+	 *
+	 * Number of threads used to unpack a binary package: one reads
+	 * and decompresses the archive while the others write files to
+	 * disk. If set to 1 files are extracted serially. This is set
+	 * internally by the API from a setting in configuration file.
+	 */
+	uint16_t unpack_threads;
 	/**
 	 * @var flags
 	 *
@@ -567,6 +717,10 @@ struct xbps_handle {
 	 *  - XBPS_FLAG_SYSLOG
 	 *  - XBPS_FLAG_INSTALL_AUTO
 	 *  - XBPS_FLAG_INSTALL_MANUAL
+	 *  - XBPS_FLAG_BINARY_PLISTS
+	 *  - XBPS_FLAG_UNPACK_SYNC
+	 *  - XBPS_FLAG_PACKAGE_STORE
+	 *  - XBPS_FLAG_PACKAGE_STORE_LINKS
 	 */
 	int flags;
 	/**
@@ -659,6 +813,67 @@ int xbps_fetch_file(struct xbps_handle *xhp,
 		    bool refetch,
 		    const char *flags);
 
+/**
+ * @struct xbps_fetch_async_file xbps_api.h "xbps_api.h"
+ * @brief Structure describing a file fetched by xbps_fetch_files_async().
+ */
+struct xbps_fetch_async_file {
+	/**
+	 * @var uri
+	 *
+	 * URI of the file (set by the caller).
+	 */
+	const char *uri;
+	/**
+	 * @var outputdir
+	 *
+	 * Directory to store the file (set by the caller).
+	 */
+	const char *outputdir;
+	/**
+	 * @var rv
+	 *
+	 * Result of the transfer, as returned by xbps_fetch_file().
+	 */
+	int rv;
+	/**
+	 * @var error
+	 *
+	 * An errno value describing the error if \a rv is -1.
+	 */
+	int error;
+};
+
+/**
+ * Download many files at the same time from a single thread, with
+ * non-blocking HTTP connections and local file copies multiplexed
+ * with poll(2). Up to \a fetch_async files in xbps_handle are
+ * downloaded at once; files which can't be fetched this way
+ * (FTP, HTTPS, proxies) are downloaded with xbps_fetch_file()
+ * afterwards.
+ *
+ * @param[in] xhp Pointer to an xbps_handle struct.
+ * @param[in] files Array of files to download, their \a rv and \a error
+ * members are set when finished.
+ * @param[in] nfiles Number of files in \a files.
+ * @param[in] refetch If true, fetch again files already in outputdir
+ * if the remote files have been modified.
+ * @param[in] done_cb Function called (if set) every time a file is
+ * finished, with the file and \a arg as arguments.
+ * @param[in] arg Pointer to user data passed to \a done_cb.
+ *
+ * @return 0 on success (see the result of every file), otherwise an
+ * errno value.
+ */
+int xbps_fetch_files_async(struct xbps_handle *xhp,
+			   struct xbps_fetch_async_file *files,
+			   size_t nfiles,
+			   bool refetch,
+			   void (*done_cb)(struct xbps_handle *,
+					   struct xbps_fetch_async_file *,
+					   void *),
+			   void *arg);
+
 /**
  * Returns last error string reported by xbps_fetch_file().
  *
@@ -743,6 +958,24 @@ prop_dictionary_t xbps_pkgdb_get_pkgd(struct xbps_handle *xhp,
 prop_dictionary_t xbps_pkgdb_get_pkgd_by_pkgver(struct xbps_handle *xhp,
 						const char *pkgver);
 
+/**
+ * Returns the reverse dependencies of an installed package, i.e the
+ * packages currently requiring \a pkgname.
+ *
+ * The reverse dependency graph is built from pkgdb the first time it's
+ * needed and kept in memory while the handle is initialized.
+ *
+ * @param[in] xhp The pointer to the xbps_handle struct.
+ * @param[in] pkgname Package name to match.
+ *
+ * @return A proplib array of strings with the pkgver of all reverse
+ * dependencies (it must be released with prop_object_release()),
+ * NULL otherwise and errno is set appropiately (ENOENT if \a pkgname
+ * is not registered in pkgdb).
+ */
+prop_array_t xbps_pkgdb_get_pkg_revdeps(struct xbps_handle *xhp,
+					const char *pkgname);
+
 /**
  * Removes a package dictionary from master package database (pkgdb) plist,
  * matching pkgname or pkgver object in \a pkg.
@@ -1518,7 +1751,8 @@ int xbps_transaction_commit(struct xbps_handle *xhp);
 
 /**
  * Internalizes a plist file in a binary package file stored locally or
- * remotely as specified in the URL.
+ * remotely as specified in the URL. Files from HTTP servers supporting
+ * range requests are only read until the plist file is found.
  *
  * @param[in] url URL to binary package file (full local or remote path).
  * @param[in] plistf Plist file name to internalize.
@@ -1529,6 +1763,23 @@ int xbps_transaction_commit(struct xbps_handle *xhp);
 prop_dictionary_t xbps_dictionary_metadata_plist_by_url(const char *url,
 							const char *plistf);
 
+/**
+ * Internalizes multiple plist files in a binary package file stored
+ * locally or remotely as specified in the URL, reading the archive
+ * only once.
+ *
+ * @param[in] url URL to binary package file (full local or remote path).
+ * @param[in] plistf NULL terminated array of plist file names.
+ * @param[out] plistd Array with a dictionary for every plist file name,
+ * set to NULL if it couldn't be internalized. Dictionaries must be
+ * released by the caller, even if an error is returned.
+ *
+ * @return 0 if all plist files were internalized, otherwise an errno value.
+ */
+int xbps_dictionary_metadata_plists_by_url(const char *url,
+					   const char **plistf,
+					   prop_dictionary_t *plistd);
+
 /*@}*/
 
 /** @addtogroup repopool */
@@ -1668,6 +1919,9 @@ prop_dictionary_t xbps_rpool_find_virtualpkg_conf(struct xbps_handle *xhp,
  * When \a pattern is a pkgname, the newest package available in repositories
  * will be used. Otherwise the first repository matching \a pattern.
  *
+ * Plist files read from remote repositories are cached in
+ * <cachedir>/metadata by the package SHA256 hash.
+ *
  * @param[in] xhp Pointer to the xbps_handle struct.
  * @param[in] pattern Package name or package pattern to match, i.e `foo>=1.0'.
  * @param[in] plistf Plist file name to match, i.e XBPS_PKGPROPS or XBPS_PKGFILES.
@@ -1812,6 +2066,17 @@ int xbps_mkpath(const char *path, mode_t mode);
  */
 char *xbps_xasprintf(const char *fmt, ...);
 
+/**
+ * Returns a hash of the string \a str, as used by the hash tables of
+ * the library. Tables indexed by its low bits (i.e with a power of
+ * two number of buckets) are well distributed.
+ *
+ * @param[in] str Nul terminated string.
+ *
+ * @return The hash value.
+ */
+size_t xbps_strhash(const char *str);
+
 /**
  * Returns a string with the sha256 hash for the file specified
  * by \a file.
@@ -2007,6 +2272,55 @@ const char *xbps_pkgpattern_version(const char *pattern);
  */
 int xbps_pkgpattern_match(const char *pkgver, const char *pattern);
 
+/**
+ * @struct xbps_pkgpattern xbps_api.h "xbps_api.h"
+ * @brief Opaque structure for a precompiled package pattern.
+ *
+ * Created with xbps_pkgpattern_compile(), the pattern string and its
+ * versions are parsed only once.
+ */
+struct xbps_pkgpattern;
+
+/**
+ * Precompiles a package pattern to be used in
+ * xbps_pkgpattern_match_compiled().
+ *
+ * @param[in] pattern Package pattern, see xbps_pkgpattern_match().
+ *
+ * @return A pointer to the compiled pattern (must be freed with
+ * xbps_pkgpattern_free()), NULL on error and errno is set appropiately.
+ */
+struct xbps_pkgpattern *xbps_pkgpattern_compile(const char *pattern);
+
+/**
+ * Package pattern matching with a precompiled pattern.
+ *
+ * @param[in] pkgver Package name/version, i.e `foo-1.0'.
+ * @param[in] pattern Compiled pattern returned by xbps_pkgpattern_compile().
+ *
+ * @return 1 if \a pkgver is matched against \a pattern, 0 if no match.
+ */
+int xbps_pkgpattern_match_compiled(const char *pkgver,
+				   const struct xbps_pkgpattern *pattern);
+
+/**
+ * Returns the package name of a precompiled pattern, as returned
+ * by xbps_pkgpattern_name().
+ *
+ * @param[in] pattern Compiled pattern returned by xbps_pkgpattern_compile().
+ *
+ * @return A string with the package name, NULL if the pattern
+ * doesn't have a version component.
+ */
+const char *xbps_pkgpattern_compiled_name(const struct xbps_pkgpattern *pattern);
+
+/**
+ * Releases a precompiled pattern returned by xbps_pkgpattern_compile().
+ *
+ * @param[in] pattern Compiled pattern.
+ */
+void xbps_pkgpattern_free(struct xbps_pkgpattern *pattern);
+
 /**
  * Gets the package version revision in a package string.
  *
@@ -2066,6 +2380,25 @@ int xbps_humanize_number(char *buf, int64_t bytes);
  */
 int xbps_cmpver(const char *pkg1, const char *pkg2);
 
+/**
+ * Compares package version strings, like xbps_cmpver(), but the
+ * parsed versions are cached in \a xhp, indexed by the address of
+ * the strings. This is useful when the same strings (i.e from a
+ * repository index) are compared many times. The strings must not
+ * change until xbps_end() releases the cache, and every new address
+ * adds an entry to it; use xbps_cmpver() for short-lived strings.
+ *
+ * @param[in] xhp Pointer to an xbps_handle struct.
+ * @param[in] pkg1 a package version string.
+ * @param[in] pkg2 a package version string.
+ *
+ * @return -1, 0 or 1 depending if pkg1 is less than, equal to or
+ * greater than pkg2.
+ */
+int xbps_cmpver_cached(struct xbps_handle *xhp,
+		       const char *pkg1,
+		       const char *pkg2);
+
 /*@}*/
 
 __END_DECLS
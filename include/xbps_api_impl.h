@@ -46,6 +46,13 @@
 
 #define ARCHIVE_READ_BLOCKSIZE	10240
 
+/*
+ * Maximum amount of decompressed data queued to the writer threads
+ * while unpacking; entries bigger than a quarter of it are extracted
+ * by the reading thread.
+ */
+#define UNPACK_PIPELINE_MAXBYTES	(32 * 1024 * 1024)
+
 #define EXTRACT_FLAGS	ARCHIVE_EXTRACT_SECURE_NODOTDOT | \
 			ARCHIVE_EXTRACT_SECURE_SYMLINKS
 #define FEXTRACT_FLAGS	ARCHIVE_EXTRACT_OWNER | ARCHIVE_EXTRACT_PERM | \
@@ -56,6 +63,10 @@
 #define __UNCONST(a)	((void *)(unsigned long)(const void *)(a))
 #endif
 
+struct xbps_strmap;
+struct xbps_unpack_pipeline;
+struct xbps_unpack_sync;
+
 __BEGIN_DECLS
 
 /**
@@ -63,6 +74,9 @@ __BEGIN_DECLS
  * From lib/external/dewey.c
  */
 int HIDDEN dewey_match(const char *, const char *);
+const char HIDDEN *xbps_pkgpattern_compiled_pattern(
+				const struct xbps_pkgpattern *);
+void HIDDEN xbps_version_cache_release(struct xbps_handle *);
 
 /**
  * @private
@@ -84,18 +98,60 @@ void HIDDEN xbps_rpool_release(struct xbps_handle *);
  */
 void HIDDEN xbps_fetch_set_cache_connection(int, int);
 void HIDDEN xbps_fetch_unset_cache_connection(void);
+void HIDDEN xbps_fetch_load_sessions(struct xbps_handle *);
+void HIDDEN xbps_fetch_release_sessions(struct xbps_handle *);
+size_t HIDDEN xbps_fetch_bufsize(struct xbps_handle *);
+void HIDDEN xbps_fetch_preallocate(int, off_t, off_t);
+int HIDDEN xbps_fetch_transfer(struct xbps_handle *, fetchIO *, int,
+			       off_t, off_t, const char *);
+int HIDDEN xbps_fetch_file_sized(struct xbps_handle *, const char *,
+				 const char *, bool, const char *, uint64_t);
+
+/**
+ * @private
+ * From lib/util_hash.c
+ */
+int HIDDEN xbps_file_hash_check_rootdir(struct xbps_handle *, const char *,
+					const char *);
 
 /**
  * @private
  * From lib/package_config_files.c
  */
-int HIDDEN xbps_entry_is_a_conf_file(prop_dictionary_t, const char *);
+int HIDDEN xbps_entry_is_a_conf_file(struct xbps_strmap *, const char *);
 int HIDDEN xbps_entry_install_conf_file(struct xbps_handle *,
 					prop_dictionary_t,
 					struct archive_entry *,
 					const char *,
 					const char *,
 					const char *);
+/**
+ * @private
+ * From lib/util.c
+ */
+const struct xbps_pkgpattern HIDDEN *
+	xbps_pkgpattern_cached(struct xbps_handle *, const char *);
+void HIDDEN xbps_pkgpattern_cache_release(struct xbps_handle *);
+struct xbps_strmap HIDDEN *xbps_strmap_create(size_t);
+int HIDDEN xbps_strmap_add(struct xbps_strmap *, const char *, const void *);
+bool HIDDEN xbps_strmap_find(struct xbps_strmap *, const char *,
+			     const void **);
+void HIDDEN xbps_strmap_free(struct xbps_strmap *);
+struct xbps_strmap HIDDEN *xbps_strmap_from_array(prop_array_t,
+						  const char *, const char *);
+
+/**
+ * @private
+ * From lib/plist.c
+ */
+bool HIDDEN xbps_array_externalize_to_file(struct xbps_handle *,
+					   prop_array_t,
+					   const char *);
+bool HIDDEN xbps_dictionary_externalize_to_file(struct xbps_handle *,
+						prop_dictionary_t,
+						const char *,
+						bool);
+
 /**
  * @private
  * From lib/plist_archive_entry.c
@@ -122,6 +178,27 @@ int HIDDEN xbps_remove_obsoletes(struct xbps_handle *xhp,
 int HIDDEN xbps_repository_find_pkg_deps(struct xbps_handle *,
 					 prop_dictionary_t);
 
+/**
+ * @private
+ * From lib/package_revdeps.c
+ */
+int HIDDEN xbps_revdeps_init(struct xbps_handle *);
+void HIDDEN xbps_revdeps_release(struct xbps_handle *);
+void HIDDEN xbps_revdeps_rebind(struct xbps_handle *);
+void HIDDEN xbps_revdeps_set_pkgd(struct xbps_handle *, prop_dictionary_t);
+void HIDDEN xbps_revdeps_unset_pkgd(struct xbps_handle *, prop_dictionary_t);
+prop_dictionary_t HIDDEN
+	xbps_revdeps_resolve(struct xbps_handle *, const char *);
+void HIDDEN xbps_revdeps_link(struct xbps_handle *, const char *,
+			      prop_dictionary_t);
+void HIDDEN xbps_revdeps_unlink(struct xbps_handle *, const char *);
+int HIDDEN xbps_revdeps_foreach_dep_cb(struct xbps_handle *, const char *,
+		int (*)(struct xbps_handle *, const char *,
+			prop_dictionary_t, void *, bool *), void *);
+int HIDDEN xbps_revdeps_mark(struct xbps_handle *, prop_array_t,
+		int (*)(struct xbps_handle *, prop_dictionary_t, bool *));
+bool HIDDEN xbps_revdeps_marked(struct xbps_handle *, const char *);
+
 /**
  * @private
  * From lib/package_requiredby.c
@@ -159,6 +236,21 @@ int HIDDEN xbps_transaction_init(struct xbps_handle *);
  * From lib/repository_sync_index.c
  */
 char HIDDEN *xbps_get_remote_repo_string(const char *);
+void HIDDEN xbps_repository_sync_async(struct xbps_handle *, const char **,
+				       size_t, bool *);
+
+/**
+ * @private
+ * From lib/repository_mirrors.c
+ */
+uint64_t HIDDEN xbps_mirror_clock(void);
+prop_array_t HIDDEN xbps_mirror_group(struct xbps_handle *, const char *);
+void HIDDEN xbps_mirror_update(struct xbps_handle *, const char *,
+			       uint64_t, uint64_t, bool);
+void HIDDEN xbps_mirror_update_transfer(struct xbps_handle *, const char *,
+					uint64_t, uint64_t);
+void HIDDEN xbps_mirror_probe(struct xbps_handle *, const char *);
+void HIDDEN xbps_mirrors_release(struct xbps_handle *);
 
 /**
  * @private
@@ -172,6 +264,15 @@ int HIDDEN xbps_file_exec(struct xbps_handle *, const char *, ...);
  */
 int HIDDEN xbps_transaction_package_replace(struct xbps_handle *);
 
+/**
+ * @private
+ * From lib/transaction_unpack.c
+ */
+int HIDDEN xbps_transaction_unpack_batch(struct xbps_handle *, prop_array_t,
+					 unsigned int, unsigned int *);
+int HIDDEN xbps_transaction_unpack_batch_size(struct xbps_handle *,
+		prop_array_t, unsigned int, unsigned int, unsigned int *);
+
 /**
  * @private
  * From lib/cb_util.c
@@ -180,12 +281,99 @@ void HIDDEN xbps_set_cb_fetch(struct xbps_handle *, off_t, off_t, off_t,
 			      const char *, bool, bool, bool);
 void HIDDEN xbps_set_cb_state(struct xbps_handle *, xbps_state_t, int,
 			      const char *, const char *, const char *, ...);
+void HIDDEN xbps_set_cb_unpack(struct xbps_handle *,
+			       struct xbps_unpack_cb_data *);
 
 /**
  * @private
  * From lib/package_unpack.c
  */
 int HIDDEN xbps_unpack_binary_pkg(struct xbps_handle *, prop_dictionary_t);
+int HIDDEN xbps_unpack_entry_hash_check(struct xbps_handle *,
+					struct xbps_strmap *,
+					struct archive_entry *,
+					const char *,
+					const char *,
+					bool *);
+
+/**
+ * @private
+ * From lib/package_unpack_pipeline.c
+ */
+struct xbps_unpack_pipeline HIDDEN *
+	xbps_unpack_pipeline_create(struct xbps_handle *,
+				    const char *, const char *,
+				    struct xbps_strmap *,
+				    struct xbps_unpack_sync *, int, size_t);
+int HIDDEN xbps_unpack_pipeline_add(struct xbps_unpack_pipeline *,
+				    struct archive *, struct archive_entry *);
+int HIDDEN xbps_unpack_pipeline_wait(struct xbps_unpack_pipeline *,
+				     const char **);
+void HIDDEN xbps_unpack_pipeline_destroy(struct xbps_unpack_pipeline *);
+
+/**
+ * @private
+ * From lib/package_unpack_sync.c
+ */
+struct xbps_unpack_sync HIDDEN *xbps_unpack_sync_create(struct xbps_handle *);
+int HIDDEN xbps_unpack_sync_clean(struct xbps_unpack_sync *,
+				  prop_dictionary_t);
+int HIDDEN xbps_unpack_sync_entry(struct xbps_unpack_sync *,
+				  struct archive_entry *);
+int HIDDEN xbps_unpack_sync_commit(struct xbps_unpack_sync *, const char **);
+void HIDDEN xbps_unpack_sync_destroy(struct xbps_unpack_sync *);
+
+/**
+ * @private
+ * From lib/package_store.c
+ */
+int HIDDEN xbps_store_add_file(struct xbps_handle *, const char *,
+			       const char *, const struct stat *);
+int HIDDEN xbps_store_copy_file(struct xbps_handle *, const char *,
+				const char *, const struct stat *, bool);
+int HIDDEN xbps_store_add_entry(prop_array_t, struct archive_entry *);
+struct archive_entry HIDDEN *xbps_store_archive_entry(prop_dictionary_t);
+int HIDDEN xbps_store_extract_entry(struct xbps_handle *,
+				    prop_dictionary_t,
+				    struct archive_entry *,
+				    bool);
+prop_dictionary_t HIDDEN xbps_store_get_manifest(struct xbps_handle *,
+						 prop_dictionary_t);
+int HIDDEN xbps_store_add_pkg(struct xbps_handle *,
+			      prop_dictionary_t,
+			      prop_array_t,
+			      prop_dictionary_t,
+			      prop_dictionary_t);
+
+/**
+ * @private
+ * From lib/download_batch.c
+ */
+int HIDDEN xbps_fetch_batch(struct xbps_handle *,
+			    const char **,
+			    size_t,
+			    const char *,
+			    bool *);
+
+/**
+ * @private
+ * From lib/download_segmented.c
+ */
+int HIDDEN xbps_fetch_segmented(struct xbps_handle *,
+				struct url *,
+				const char *,
+				const char *,
+				const char *,
+				uint64_t);
+
+/**
+ * @private
+ * From lib/download_shared.c
+ */
+char HIDDEN *xbps_shared_cache_path(struct xbps_handle *, prop_dictionary_t);
+int HIDDEN xbps_shared_cache_fetch(struct xbps_handle *,
+				   prop_dictionary_t,
+				   const char *);
 
 /**
  * @private
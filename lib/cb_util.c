@@ -33,6 +33,7 @@
 #include <string.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <pthread.h>
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
@@ -40,6 +41,12 @@
 
 #include "xbps_api_impl.h"
 
+/*
+ * Packages may be unpacked by multiple threads, client callbacks
+ * are serialized.
+ */
+static pthread_mutex_t cb_mtx = PTHREAD_MUTEX_INITIALIZER;
+
 void HIDDEN
 xbps_set_cb_fetch(struct xbps_handle *xhp,
 		  off_t file_size,
@@ -95,7 +102,20 @@ xbps_set_cb_state(struct xbps_handle *xhp,
 		else
 			xscd.desc = buf;
 	}
+	pthread_mutex_lock(&cb_mtx);
 	(*xhp->state_cb)(xhp, &xscd, xhp->fetch_cb_data);
+	pthread_mutex_unlock(&cb_mtx);
 	if (buf != NULL)
 		free(buf);
 }
+
+void HIDDEN
+xbps_set_cb_unpack(struct xbps_handle *xhp, struct xbps_unpack_cb_data *xucd)
+{
+	if (xhp->unpack_cb == NULL)
+		return;
+
+	pthread_mutex_lock(&cb_mtx);
+	(*xhp->unpack_cb)(xhp, xucd, xhp->unpack_cb_data);
+	pthread_mutex_unlock(&cb_mtx);
+}
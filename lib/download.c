@@ -30,6 +30,10 @@
  * $FreeBSD: src/usr.bin/fetch/fetch.c,v 1.84.2.1 2009/08/03 08:13:06 kensmith Exp $
  */
 
+#ifdef HAVE_FALLOCATE
+# define _GNU_SOURCE	/* for fallocate(2) */
+#endif
+
 #include <sys/param.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -39,6 +43,7 @@
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <unistd.h>
 
 #include "xbps_api_impl.h"
 #include "fetch.h"
@@ -61,6 +66,110 @@ print_time(time_t *t)
 	return buf;
 }
 
+size_t HIDDEN
+xbps_fetch_bufsize(struct xbps_handle *xhp)
+{
+	if (xhp->fetch_bufsize == 0)
+		return XBPS_FETCH_BUFSIZE * 1024;
+
+	return (size_t)xhp->fetch_bufsize * 1024;
+}
+
+void HIDDEN
+xbps_fetch_preallocate(int fd, off_t offset, off_t len)
+{
+#ifdef HAVE_FALLOCATE
+	/*
+	 * Reserve the blocks without changing the file size, so that
+	 * an interrupted transfer is resumed from its real size.
+	 */
+	if (len > 0)
+		(void)fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, len);
+#else
+	(void)fd;
+	(void)offset;
+	(void)len;
+#endif
+}
+
+int HIDDEN
+xbps_fetch_transfer(struct xbps_handle *xhp,
+		    fetchIO *fio,
+		    int fd,
+		    off_t size,
+		    off_t offset,
+		    const char *filename)
+{
+	off_t bytes_dload = -1;
+	ssize_t bytes_read = -1, bytes_written;
+	size_t bufsize;
+	char *buf;
+	bool splice = true;
+
+	if (size > 0)
+		xbps_fetch_preallocate(fd, offset, size - offset);
+
+	bufsize = xbps_fetch_bufsize(xhp);
+	if ((buf = malloc(bufsize)) == NULL)
+		return -1;
+	/*
+	 * Initialize data for the fetch progress function callback
+	 * and let the user know that the transfer is going to start
+	 * immediately.
+	 */
+	xbps_set_cb_fetch(xhp, size, offset, offset,
+	    filename, true, false, false);
+	/*
+	 * Start fetching requested file, moving the data straight from
+	 * the socket to the file if the stream supports it.
+	 */
+	for (;;) {
+		if (splice) {
+			bytes_read = fetchIO_splice(fio, fd, bufsize);
+			if (bytes_read == -1 && errno == EOPNOTSUPP) {
+				splice = false;
+				continue;
+			}
+			if (bytes_read <= 0)
+				break;
+		} else {
+			bytes_read = fetchIO_read(fio, buf, bufsize);
+			if (bytes_read <= 0)
+				break;
+			bytes_written = write(fd, buf, (size_t)bytes_read);
+			if (bytes_written != bytes_read) {
+				xbps_dbg_printf(xhp, "Couldn't write to %s!\n",
+				    filename);
+				free(buf);
+				return -1;
+			}
+		}
+		bytes_dload += bytes_read;
+		/*
+		 * Let the fetch progress callback know that
+		 * we are sucking more bytes from it.
+		 */
+		xbps_set_cb_fetch(xhp, size, offset, offset + bytes_dload,
+		    filename, false, true, false);
+	}
+	free(buf);
+
+	if (bytes_read == -1) {
+		xbps_dbg_printf(xhp, "IO error while fetching %s: %s\n", filename,
+		    fetchLastErrString);
+		errno = EIO;
+		return -1;
+	}
+	/*
+	 * Let the fetch progress callback know that the file
+	 * has been fetched.
+	 */
+	xbps_set_cb_fetch(xhp, size, offset, bytes_dload,
+	    filename, false, false, true);
+
+	return 0;
+}
+
 void HIDDEN
 xbps_fetch_set_cache_connection(int global, int per_host)
 {
@@ -78,6 +187,40 @@ xbps_fetch_unset_cache_connection(void)
 	fetchConnectionCacheClose();
 }
 
+void HIDDEN
+xbps_fetch_load_sessions(struct xbps_handle *xhp)
+{
+	char *path;
+
+	if ((xhp->flags & XBPS_FLAG_FETCH_SESSIONS) == 0)
+		return;
+
+	if ((path = xbps_xasprintf("%s/%s", xhp->metadir,
+	    XBPS_FETCH_SESSIONS)) == NULL)
+		return;
+	if (fetchSessionCacheLoad(path) == -1 && errno != ENOENT)
+		xbps_dbg_printf(xhp, "failed to load TLS sessions from "
+		    "`%s': %s\n", path, strerror(errno));
+	free(path);
+}
+
+void HIDDEN
+xbps_fetch_release_sessions(struct xbps_handle *xhp)
+{
+	char *path;
+
+	if ((xhp->flags & XBPS_FLAG_FETCH_SESSIONS) &&
+	    (path = xbps_xasprintf("%s/%s", xhp->metadir,
+	    XBPS_FETCH_SESSIONS)) != NULL) {
+		if (xbps_mkpath(xhp->metadir, 0755) == -1 ||
+		    fetchSessionCacheSave(path) == -1)
+			xbps_dbg_printf(xhp, "failed to save TLS sessions to "
+			    "`%s': %s\n", path, strerror(errno));
+		free(path);
+	}
+	fetchSessionCacheClose();
+}
+
 const char *
 xbps_fetch_error_string(void)
 {
@@ -93,15 +236,28 @@ xbps_fetch_file(struct xbps_handle *xhp,
 		const char *outputdir,
 		bool refetch,
 		const char *flags)
+{
+	return xbps_fetch_file_sized(xhp, uri, outputdir, refetch, flags, 0);
+}
+
+/*
+ * Same as xbps_fetch_file(), size is the expected size of the file
+ * if known (e.g "filename-size" of a binary package) or 0.
+ */
+int HIDDEN
+xbps_fetch_file_sized(struct xbps_handle *xhp,
+		      const char *uri,
+		      const char *outputdir,
+		      bool refetch,
+		      const char *flags,
+		      uint64_t size)
 {
 	struct stat st;
 	struct url *url = NULL;
 	struct url_stat url_st;
 	struct fetchIO *fio = NULL;
 	struct timeval tv[2];
-	off_t bytes_dload = -1;
-	ssize_t bytes_read = -1, bytes_written;
-	char buf[4096], *filename, *destfile = NULL;
+	char *filename, *destfile = NULL;
 	int fd = -1, rv = 0;
 	bool restart = false;
 
@@ -186,6 +342,23 @@ xbps_fetch_file(struct xbps_handle *xhp,
 		 */
 		fio = fetchGet(url, flags);
 	} else {
+		/*
+		 * Big files are fetched with multiple connections
+		 * if enabled and supported by the server.
+		 */
+		if (xhp->fetch_segments > 1 && !restart) {
+			rv = xbps_fetch_segmented(xhp, url, destfile,
+			    filename, flags, size);
+			if (rv == 0) {
+				rv = 1;
+				goto out;
+			} else if (rv != ENOTSUP) {
+				errno = rv;
+				rv = -1;
+				goto out;
+			}
+			rv = 0;
+		}
 		/*
 		 * Issue a GET and skip the HEAD request, some servers
 		 * (googlecode.com) return a 404 in HEAD requests!
@@ -242,60 +415,23 @@ xbps_fetch_file(struct xbps_handle *xhp,
 		goto out;
 	}
 	/*
-	 * If restarting, open the file for appending otherwise create it.
+	 * If restarting, open the file and append to it otherwise create it.
+	 * O_APPEND is not used because splice(2) doesn't support it.
 	 */
 	if (restart)
-		fd = open(destfile, O_WRONLY|O_APPEND);
+		fd = open(destfile, O_WRONLY);
 	else
 		fd = open(destfile, O_WRONLY|O_CREAT|O_TRUNC, 0644);
 
-	if (fd == -1) {
-		rv = -1;
-		goto out;
-	}
-	/*
-	 * Initialize data for the fetch progress function callback
-	 * and let the user know that the transfer is going to start
-	 * immediately.
-	 */
-	xbps_set_cb_fetch(xhp, url_st.size, url->offset, url->offset,
-	    filename, true, false, false);
-	/*
-	 * Start fetching requested file.
-	 */
-	while ((bytes_read = fetchIO_read(fio, buf, sizeof(buf))) > 0) {
-		bytes_written = write(fd, buf, (size_t)bytes_read);
-		if (bytes_written != bytes_read) {
-			xbps_dbg_printf(xhp, "Couldn't write to %s!\n", destfile);
-			rv = -1;
-			goto out;
-		}
-		bytes_dload += bytes_read;
-		/*
-		 * Let the fetch progress callback know that
-		 * we are sucking more bytes from it.
-		 */
-		xbps_set_cb_fetch(xhp, url_st.size, url->offset,
-		    url->offset + bytes_dload,
-		    filename, false, true, false);
-	}
-	if (bytes_read == -1) {
-		xbps_dbg_printf(xhp, "IO error while fetching %s: %s\n", filename,
-		    fetchLastErrString);
-		errno = EIO;
+	if (fd == -1 || (restart && lseek(fd, 0, SEEK_END) == -1)) {
 		rv = -1;
 		goto out;
 	}
-	if (fd == -1) {
+	if (xbps_fetch_transfer(xhp, fio, fd, url_st.size,
+	    url->offset, filename) == -1) {
 		rv = -1;
 		goto out;
 	}
-	/*
-	 * Let the fetch progress callback know that the file
-	 * has been fetched.
-	 */
-	xbps_set_cb_fetch(xhp, url_st.size, url->offset, bytes_dload,
-	    filename, false, false, true);
 	/*
 	 * Update mtime in local file to match remote file if transfer
 	 * was successful.
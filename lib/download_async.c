@@ -0,0 +1,806 @@
+/*-
+ * Copyright (c) 2012 Juan Romero Pardines.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE	/* for getaddrinfo(3), memmem(3) and timegm(3) */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "xbps_api_impl.h"
+#include "fetch.h"
+
+/*
+ * Asynchronous downloads.
+ *
+ * xbps_fetch_files_async() drives many transfers from a single thread.
+ * Every HTTP transfer is a small state machine over a non-blocking
+ * socket (connect, send the request, read the reply headers, read the
+ * body), all of them multiplexed with poll(2); local (file://) files
+ * are copied a block at a time from the same loop.
+ *
+ * Requests are sent as HTTP/1.0 with "Connection: close", so that the
+ * body is never chunk encoded and ends with the connection. Files are
+ * written to "<file>.part" and renamed when complete; in refetch mode
+ * "If-Modified-Since" replaces the HEAD request of xbps_fetch_file().
+ *
+ * Anything else (FTP, HTTPS, proxies, authentication) is fetched with
+ * xbps_fetch_file() once the rest of the transfers have finished.
+ */
+#define ASYNC_HDRSIZE		8192
+#define ASYNC_MAXREDIRS		5
+
+enum {
+	XFER_PENDING = 0,
+	XFER_CONNECT,
+	XFER_REQUEST,
+	XFER_REPLY,
+	XFER_BODY,
+	XFER_FILE,
+	XFER_FALLBACK,
+	XFER_DONE
+};
+
+struct xfer {
+	struct xbps_fetch_async_file *f;
+	struct url *url;
+	struct addrinfo *res, *ai;
+	char *destfile, *partfile;
+	char *req;
+	size_t reqlen, reqoff;
+	char hdr[ASYNC_HDRSIZE];
+	size_t hdrlen;
+	int state, sd, fd, srcfd;
+	int redirects;
+	off_t offset, size, got;
+	time_t lmtime, mtime, deadline;
+	bool retried;
+};
+
+struct async {
+	struct xbps_handle *xhp;
+	struct xfer *xfers;
+	size_t nxfers;
+	char *buf;
+	size_t bufsize;
+	bool refetch;
+	void (*cb)(struct xbps_handle *, struct xbps_fetch_async_file *,
+	    void *);
+	void *arg;
+};
+
+static void
+xfer_close(struct xfer *x)
+{
+	if (x->sd != -1)
+		(void)close(x->sd);
+	if (x->fd != -1)
+		(void)close(x->fd);
+	if (x->srcfd != -1)
+		(void)close(x->srcfd);
+	x->sd = x->fd = x->srcfd = -1;
+	if (x->res != NULL)
+		freeaddrinfo(x->res);
+	x->res = x->ai = NULL;
+	free(x->req);
+	x->req = NULL;
+	x->reqlen = x->reqoff = x->hdrlen = 0;
+}
+
+static void
+xfer_finish(struct async *a, struct xfer *x, int rv, int error)
+{
+	struct timeval tv[2];
+
+	xfer_close(x);
+
+	if (rv == 1) {
+		if (x->mtime) {
+			tv[0].tv_sec = tv[1].tv_sec = x->mtime;
+			tv[0].tv_usec = tv[1].tv_usec = 0;
+			(void)utimes(x->partfile, tv);
+		}
+		if (rename(x->partfile, x->destfile) == -1) {
+			error = errno;
+			rv = -1;
+		}
+	} else if (rv == -1 && (a->refetch || x->got == 0)) {
+		/* nothing worth resuming */
+		(void)unlink(x->partfile);
+	}
+	xbps_dbg_printf(a->xhp, "[async] %s: %s\n", x->f->uri,
+	    rv == 1 ? "downloaded" : rv == 0 ? "not modified" :
+	    strerror(error));
+
+	x->f->rv = rv;
+	x->f->error = rv == -1 ? error : 0;
+	x->state = XFER_DONE;
+	if (a->cb != NULL)
+		(*a->cb)(a->xhp, x->f, a->arg);
+}
+
+static time_t
+parse_mtime(const char *p)
+{
+	struct tm tm;
+
+	memset(&tm, 0, sizeof(tm));
+	if (strptime(p, "%a, %d %b %Y %H:%M:%S GMT", &tm) == NULL)
+		return 0;
+
+	return timegm(&tm);
+}
+
+static int
+http_request(struct xfer *x, bool refetch)
+{
+	struct tm tm;
+	char range[64], ims[128], port[16];
+	const char *ua;
+
+	range[0] = ims[0] = port[0] = '\0';
+	if (x->offset > 0)
+		snprintf(range, sizeof(range), "Range: bytes=%lld-\r\n",
+		    (long long)x->offset);
+	if (refetch && x->lmtime && gmtime_r(&x->lmtime, &tm) != NULL)
+		strftime(ims, sizeof(ims),
+		    "If-Modified-Since: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+	if (x->url->port != 0 && x->url->port != 80)
+		snprintf(port, sizeof(port), ":%d", x->url->port);
+	if ((ua = getenv("HTTP_USER_AGENT")) == NULL || *ua == '\0')
+		ua = "libxbps/" XBPS_VERSION;
+
+	free(x->req);
+	x->req = xbps_xasprintf("GET %s HTTP/1.0\r\n"
+	    "Host: %s%s\r\nUser-Agent: %s\r\nConnection: close\r\n"
+	    "%s%s\r\n", *x->url->doc ? x->url->doc : "/",
+	    x->url->host, port, ua, range, ims);
+	if (x->req == NULL)
+		return ENOMEM;
+
+	x->reqlen = strlen(x->req);
+	x->reqoff = 0;
+	return 0;
+}
+
+static int
+http_connect(struct async *a, struct xfer *x)
+{
+	int error = ECONNREFUSED;
+
+	for (; x->ai != NULL; x->ai = x->ai->ai_next) {
+		x->sd = socket(x->ai->ai_family, x->ai->ai_socktype,
+		    x->ai->ai_protocol);
+		if (x->sd == -1) {
+			error = errno;
+			continue;
+		}
+		if (fcntl(x->sd, F_SETFL,
+		    fcntl(x->sd, F_GETFL) | O_NONBLOCK) == -1) {
+			error = errno;
+			(void)close(x->sd);
+			x->sd = -1;
+			continue;
+		}
+		if (connect(x->sd, x->ai->ai_addr, x->ai->ai_addrlen) == 0) {
+			x->state = XFER_REQUEST;
+			return 0;
+		} else if (errno == EINPROGRESS) {
+			x->state = XFER_CONNECT;
+			return 0;
+		}
+		error = errno;
+		(void)close(x->sd);
+		x->sd = -1;
+	}
+	xbps_dbg_printf(a->xhp, "[async] %s: cannot connect to %s: %s\n",
+	    x->f->uri, x->url->host, strerror(error));
+	return error;
+}
+
+static int
+http_start(struct async *a, struct xfer *x)
+{
+	struct addrinfo hints;
+	char port[16];
+	int rv;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf(port, sizeof(port), "%d", x->url->port ? x->url->port : 80);
+
+	if ((rv = getaddrinfo(x->url->host, port, &hints, &x->res)) != 0) {
+		xbps_dbg_printf(a->xhp, "[async] %s: cannot resolve %s: %s\n",
+		    x->f->uri, x->url->host, gai_strerror(rv));
+		x->res = NULL;
+		return EADDRNOTAVAIL;
+	}
+	x->ai = x->res;
+	if ((rv = http_request(x, a->refetch)) != 0)
+		return rv;
+
+	return http_connect(a, x);
+}
+
+/*
+ * Restarts a transfer with a new URL (redirections) or from the
+ * beginning of the file.
+ */
+static int
+http_restart(struct async *a, struct xfer *x, struct url *url)
+{
+	xfer_close(x);
+	if (url != NULL) {
+		fetchFreeURL(x->url);
+		x->url = url;
+		if (strcmp(url->scheme, SCHEME_HTTP)) {
+			x->state = XFER_FALLBACK;
+			return 0;
+		}
+	}
+	return http_start(a, x);
+}
+
+static int
+http_redirect(struct async *a, struct xfer *x, const char *loc)
+{
+	struct url *url;
+	char *uri;
+
+	if (++x->redirects > ASYNC_MAXREDIRS)
+		return ELOOP;
+
+	if (*loc == '/') {
+		uri = xbps_xasprintf("%s://%s:%d%s", x->url->scheme,
+		    x->url->host, x->url->port ? x->url->port : 80, loc);
+		if (uri == NULL)
+			return ENOMEM;
+		url = fetchParseURL(uri);
+		free(uri);
+	} else {
+		url = fetchParseURL(loc);
+	}
+	if (url == NULL)
+		return EINVAL;
+
+	xbps_dbg_printf(a->xhp, "[async] %s: redirected to %s://%s%s\n",
+	    x->f->uri, url->scheme, url->host, url->doc);
+	return http_restart(a, x, url);
+}
+
+static int
+xfer_write(struct xfer *x, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = write(x->fd, buf, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		buf += n;
+		len -= (size_t)n;
+		x->got += n;
+	}
+	return 0;
+}
+
+/*
+ * Parses the reply headers, returns -1 if the transfer continues
+ * with the body, otherwise the result to finish it.
+ */
+static int
+http_reply(struct async *a, struct xfer *x, char *end, int *error)
+{
+	char *p, *line, *next, *loc = NULL;
+	long long clen = -1, rstart = -1, rtotal = -1;
+	int code;
+
+	*end = '\0';
+	if (sscanf(x->hdr, "HTTP/%*d.%*d %d", &code) != 1) {
+		*error = EPROTO;
+		return -1;
+	}
+	x->mtime = 0;
+	for (line = strstr(x->hdr, "\r\n"); line; line = next) {
+		line += 2;
+		if ((next = strstr(line, "\r\n")) != NULL)
+			*next = '\0';
+		if ((p = strchr(line, ':')) == NULL)
+			continue;
+		*p++ = '\0';
+		p += strspn(p, " \t");
+		if (strcasecmp(line, "Content-Length") == 0)
+			clen = strtoll(p, NULL, 10);
+		else if (strcasecmp(line, "Content-Range") == 0)
+			(void)sscanf(p, "bytes %lld-%*d/%lld", &rstart, &rtotal);
+		else if (strcasecmp(line, "Last-Modified") == 0)
+			x->mtime = parse_mtime(p);
+		else if (strcasecmp(line, "Location") == 0)
+			loc = p;
+	}
+	xbps_dbg_printf(a->xhp, "[async] %s: HTTP %d\n", x->f->uri, code);
+
+	switch (code) {
+	case 200:
+		x->offset = 0;
+		x->size = clen;
+		x->fd = open(x->partfile, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+		break;
+	case 206:
+		if (rstart != x->offset) {
+			*error = EPROTO;
+			return -1;
+		}
+		x->size = rtotal != -1 ? rtotal :
+		    clen != -1 ? x->offset + clen : -1;
+		if ((x->fd = open(x->partfile, O_WRONLY)) != -1 &&
+		    lseek(x->fd, x->offset, SEEK_SET) == -1) {
+			(void)close(x->fd);
+			x->fd = -1;
+		}
+		break;
+	case 304:
+		return 0;
+	case 301:
+	case 302:
+	case 303:
+	case 307:
+	case 308:
+		if (loc == NULL) {
+			*error = EPROTO;
+			return -1;
+		}
+		*error = http_redirect(a, x, loc);
+		return *error ? -1 : 2;
+	case 416:
+		if (x->offset > 0 && !x->retried) {
+			/* stale partial file, start again */
+			(void)unlink(x->partfile);
+			x->offset = 0;
+			x->retried = true;
+			*error = http_restart(a, x, NULL);
+			return *error ? -1 : 2;
+		}
+		*error = EIO;
+		return -1;
+	case 401:
+	case 403:
+		*error = EACCES;
+		return -1;
+	case 404:
+	case 410:
+		*error = ENOENT;
+		return -1;
+	default:
+		*error = EIO;
+		return -1;
+	}
+	if (x->fd == -1) {
+		*error = errno;
+		return -1;
+	}
+	x->got = x->offset;
+	if (x->size > x->offset)
+		xbps_fetch_preallocate(x->fd, x->offset, x->size - x->offset);
+	/* the rest of the buffer is the beginning of the body */
+	end += 4;
+	if ((*error = xfer_write(x, end,
+	    x->hdrlen - (size_t)(end - x->hdr))) != 0)
+		return -1;
+	if (x->size != -1 && x->got >= x->size)
+		return 1;
+
+	x->state = XFER_BODY;
+	return 2;
+}
+
+/*
+ * Handles poll(2) events of a HTTP transfer, returns the result
+ * to finish it with or 2 if it continues.
+ */
+static int
+http_events(struct async *a, struct xfer *x, int *error)
+{
+	char *end;
+	socklen_t slen;
+	ssize_t n;
+	int err;
+
+	switch (x->state) {
+	case XFER_CONNECT:
+		err = 0;
+		slen = sizeof(err);
+		if (getsockopt(x->sd, SOL_SOCKET, SO_ERROR, &err, &slen) == -1)
+			err = errno;
+		if (err != 0) {
+			/* try the next address */
+			(void)close(x->sd);
+			x->sd = -1;
+			x->ai = x->ai->ai_next;
+			if ((*error = http_connect(a, x)) != 0)
+				return -1;
+			return 2;
+		}
+		x->state = XFER_REQUEST;
+		/* FALLTHROUGH */
+	case XFER_REQUEST:
+		n = send(x->sd, x->req + x->reqoff, x->reqlen - x->reqoff,
+		    MSG_NOSIGNAL);
+		if (n == -1) {
+			if (errno == EAGAIN || errno == EINTR)
+				return 2;
+			*error = errno;
+			return -1;
+		}
+		x->reqoff += (size_t)n;
+		if (x->reqoff == x->reqlen)
+			x->state = XFER_REPLY;
+		return 2;
+	case XFER_REPLY:
+		n = recv(x->sd, x->hdr + x->hdrlen,
+		    sizeof(x->hdr) - x->hdrlen - 1, 0);
+		if (n == -1) {
+			if (errno == EAGAIN || errno == EINTR)
+				return 2;
+			*error = errno;
+			return -1;
+		} else if (n == 0) {
+			*error = ECONNRESET;
+			return -1;
+		}
+		x->hdrlen += (size_t)n;
+		x->hdr[x->hdrlen] = '\0';
+		if ((end = memmem(x->hdr, x->hdrlen, "\r\n\r\n", 4)) == NULL) {
+			if (x->hdrlen == sizeof(x->hdr) - 1) {
+				*error = EPROTO;
+				return -1;
+			}
+			return 2;
+		}
+		return http_reply(a, x, end, error);
+	case XFER_BODY:
+		n = recv(x->sd, a->buf, a->bufsize, 0);
+		if (n == -1) {
+			if (errno == EAGAIN || errno == EINTR)
+				return 2;
+			*error = errno;
+			return -1;
+		} else if (n == 0) {
+			if (x->size == -1)
+				return 1;
+			*error = ECONNRESET;
+			return -1;
+		}
+		if ((*error = xfer_write(x, a->buf, (size_t)n)) != 0)
+			return -1;
+		if (x->size != -1 && x->got >= x->size)
+			return 1;
+		return 2;
+	}
+	return 2;
+}
+
+/*
+ * Copies a block of a local file, returns the result to finish
+ * the transfer with or 2 if it continues.
+ */
+static int
+file_copy(struct async *a, struct xfer *x, int *error)
+{
+	ssize_t n;
+
+	if ((n = read(x->srcfd, a->buf, a->bufsize)) == -1) {
+		if (errno == EINTR)
+			return 2;
+		*error = errno;
+		return -1;
+	} else if (n == 0) {
+		return x->got == x->size ? 1 : (*error = EIO, -1);
+	}
+	if ((*error = xfer_write(x, a->buf, (size_t)n)) != 0)
+		return -1;
+
+	return 2;
+}
+
+static int
+file_start(struct async *a, struct xfer *x)
+{
+	struct stat st;
+
+	if ((x->srcfd = open(x->url->doc, O_RDONLY)) == -1 ||
+	    fstat(x->srcfd, &st) == -1)
+		return errno;
+
+	if (a->refetch && x->lmtime == st.st_mtime) {
+		/* same as xbps_fetch_file(), local file is up to date */
+		x->size = st.st_size;
+		return -1;
+	}
+	x->mtime = st.st_mtime;
+	x->size = st.st_size;
+	if (x->offset > st.st_size)
+		x->offset = 0;
+	if (x->offset > 0) {
+		if ((x->fd = open(x->partfile, O_WRONLY)) == -1)
+			return errno;
+	} else {
+		x->fd = open(x->partfile, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+		if (x->fd == -1)
+			return errno;
+	}
+	if (lseek(x->fd, x->offset, SEEK_SET) == -1 ||
+	    lseek(x->srcfd, x->offset, SEEK_SET) == -1)
+		return errno;
+
+	x->got = x->offset;
+	if (x->size > x->offset)
+		xbps_fetch_preallocate(x->fd, x->offset, x->size - x->offset);
+	x->state = XFER_FILE;
+
+	return 0;
+}
+
+static bool
+http_proxy_set(void)
+{
+	const char *p;
+
+	return ((p = getenv("HTTP_PROXY")) != NULL && *p != '\0') ||
+	    ((p = getenv("http_proxy")) != NULL && *p != '\0');
+}
+
+static void
+xfer_start(struct async *a, struct xfer *x)
+{
+	struct stat st;
+	const char *filename;
+	int rv;
+
+	x->sd = x->fd = x->srcfd = -1;
+	x->size = -1;
+
+	if ((filename = strrchr(x->f->uri, '/')) == NULL) {
+		x->f->rv = -1;
+		x->f->error = EINVAL;
+		x->state = XFER_DONE;
+		if (a->cb != NULL)
+			(*a->cb)(a->xhp, x->f, a->arg);
+		return;
+	}
+	x->destfile = xbps_xasprintf("%s/%s", x->f->outputdir, filename + 1);
+	x->partfile = xbps_xasprintf("%s/%s.part", x->f->outputdir,
+	    filename + 1);
+	if (x->destfile == NULL || x->partfile == NULL) {
+		xfer_finish(a, x, -1, ENOMEM);
+		return;
+	}
+	if (stat(x->destfile, &st) == 0 && st.st_size > 0) {
+		if (!a->refetch) {
+			/* resumed by xbps_fetch_file() */
+			x->state = XFER_FALLBACK;
+			return;
+		}
+		x->lmtime = st.st_mtime;
+	}
+	if (stat(x->partfile, &st) == 0 && st.st_size > 0) {
+		/* the remote file may have changed when refetching */
+		if (a->refetch)
+			(void)unlink(x->partfile);
+		else
+			x->offset = st.st_size;
+	}
+	if ((x->url = fetchParseURL(x->f->uri)) == NULL) {
+		xfer_finish(a, x, -1, EINVAL);
+		return;
+	}
+	if (strcmp(x->url->scheme, SCHEME_FILE) == 0) {
+		if ((rv = file_start(a, x)) == -1)
+			xfer_finish(a, x, 0, 0);
+		else if (rv != 0)
+			xfer_finish(a, x, -1, rv);
+	} else if (strcmp(x->url->scheme, SCHEME_HTTP) == 0 &&
+	    *x->url->user == '\0' && !http_proxy_set()) {
+		if ((rv = http_start(a, x)) != 0)
+			xfer_finish(a, x, -1, rv);
+	} else {
+		x->state = XFER_FALLBACK;
+	}
+	x->deadline = time(NULL) + a->xhp->fetch_timeout;
+}
+
+static void
+async_loop(struct async *a, size_t max)
+{
+	struct pollfd *pfds;
+	struct xfer *x, **px;
+	time_t now;
+	size_t i, next = 0, nactive, npfds;
+	int rv, error, timeout;
+	bool local;
+
+	if ((pfds = calloc(a->nxfers, sizeof(*pfds))) == NULL ||
+	    (px = calloc(a->nxfers, sizeof(*px))) == NULL) {
+		free(pfds);
+		for (i = 0; i < a->nxfers; i++)
+			a->xfers[i].state = XFER_FALLBACK;
+		return;
+	}
+	for (;;) {
+		/* start new transfers until reaching the limit */
+		for (nactive = i = 0; i < next; i++) {
+			if (a->xfers[i].state > XFER_PENDING &&
+			    a->xfers[i].state < XFER_FALLBACK)
+				nactive++;
+		}
+		while (nactive < max && next < a->nxfers) {
+			x = &a->xfers[next++];
+			xfer_start(a, x);
+			if (x->state < XFER_FALLBACK)
+				nactive++;
+		}
+		if (nactive == 0)
+			break;
+
+		local = false;
+		for (npfds = i = 0; i < next; i++) {
+			x = &a->xfers[i];
+			if (x->state == XFER_FILE) {
+				local = true;
+				continue;
+			} else if (x->state < XFER_CONNECT ||
+			    x->state > XFER_BODY) {
+				continue;
+			}
+			pfds[npfds].fd = x->sd;
+			pfds[npfds].events = x->state <= XFER_REQUEST ?
+			    POLLOUT : POLLIN;
+			pfds[npfds].revents = 0;
+			px[npfds++] = x;
+		}
+		/* local files are always ready */
+		timeout = local ? 0 : 1000;
+		if (poll(pfds, npfds, timeout) == -1 && errno != EINTR)
+			break;
+
+		now = time(NULL);
+		for (i = 0; i < npfds; i++) {
+			x = px[i];
+			if (pfds[i].revents == 0) {
+				if (a->xhp->fetch_timeout && now > x->deadline)
+					xfer_finish(a, x, -1, ETIMEDOUT);
+				continue;
+			}
+			x->deadline = now + a->xhp->fetch_timeout;
+			error = 0;
+			if ((rv = http_events(a, x, &error)) != 2)
+				xfer_finish(a, x, rv, error);
+			else if (x->state == XFER_FALLBACK)
+				xfer_close(x);
+		}
+		for (i = 0; local && i < next; i++) {
+			x = &a->xfers[i];
+			if (x->state != XFER_FILE)
+				continue;
+			error = 0;
+			if ((rv = file_copy(a, x, &error)) != 2)
+				xfer_finish(a, x, rv, error);
+		}
+	}
+	/* anything not finished is left to xbps_fetch_file() */
+	for (i = 0; i < a->nxfers; i++) {
+		x = &a->xfers[i];
+		if (x->state != XFER_DONE) {
+			xfer_close(x);
+			x->state = XFER_FALLBACK;
+		}
+	}
+	free(pfds);
+	free(px);
+}
+
+int
+xbps_fetch_files_async(struct xbps_handle *xhp,
+		       struct xbps_fetch_async_file *files,
+		       size_t nfiles,
+		       bool refetch,
+		       void (*done_cb)(struct xbps_handle *,
+				       struct xbps_fetch_async_file *,
+				       void *),
+		       void *arg)
+{
+	struct async a;
+	struct xfer *x;
+	size_t i, max;
+
+	assert(xhp != NULL);
+	assert(files != NULL);
+
+	if (nfiles == 0)
+		return 0;
+
+	memset(&a, 0, sizeof(a));
+	a.xhp = xhp;
+	a.nxfers = nfiles;
+	a.refetch = refetch;
+	a.cb = done_cb;
+	a.arg = arg;
+	a.bufsize = xbps_fetch_bufsize(xhp);
+	if ((a.buf = malloc(a.bufsize)) == NULL)
+		return ENOMEM;
+	if ((a.xfers = calloc(nfiles, sizeof(*a.xfers))) == NULL) {
+		free(a.buf);
+		return ENOMEM;
+	}
+	for (i = 0; i < nfiles; i++) {
+		assert(files[i].uri != NULL);
+		assert(files[i].outputdir != NULL);
+		files[i].rv = -1;
+		files[i].error = 0;
+		a.xfers[i].f = &files[i];
+		a.xfers[i].sd = a.xfers[i].fd = a.xfers[i].srcfd = -1;
+	}
+	max = xhp->fetch_async ? xhp->fetch_async : XBPS_FETCH_ASYNC;
+	async_loop(&a, max);
+	/*
+	 * Transfers not supported by the engine.
+	 */
+	for (i = 0; i < nfiles; i++) {
+		x = &a.xfers[i];
+		if (x->state == XFER_FALLBACK) {
+			x->f->rv = xbps_fetch_file(xhp, x->f->uri,
+			    x->f->outputdir, refetch, NULL);
+			x->f->error = 0;
+			if (x->f->rv == -1)
+				x->f->error = fetchLastErrCode ? EIO : errno;
+			if (done_cb != NULL)
+				(*done_cb)(xhp, x->f, arg);
+		}
+		if (x->url != NULL)
+			fetchFreeURL(x->url);
+		free(x->destfile);
+		free(x->partfile);
+	}
+	free(a.xfers);
+	free(a.buf);
+
+	return 0;
+}
@@ -0,0 +1,185 @@
+/*-
+ * Copyright (c) 2012 Juan Romero Pardines.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "xbps_api_impl.h"
+#include "fetch.h"
+
+/*
+ * Pipelined downloads.
+ *
+ * Files coming from the same HTTP server are requested with
+ * fetchXGetHTTPBatch(), keeping up to xhp->fetch_pipeline requests in
+ * flight on a single connection, so that fetching many small files
+ * doesn't cost a round trip for each one.
+ */
+struct fetch_batch {
+	struct xbps_handle *xhp;
+	const char *outputdir;
+	const char **uris;
+	size_t *idx;
+	bool *done;
+};
+
+static int
+batch_cb(size_t n, fetchIO *fio, struct url_stat *us, void *arg)
+{
+	struct fetch_batch *fb = arg;
+	struct stat st;
+	struct timeval tv[2];
+	const char *filename;
+	char *destfile;
+	size_t i;
+	int fd, rv;
+
+	i = fb->idx[n];
+	filename = strrchr(fb->uris[i], '/') + 1;
+	if ((destfile = xbps_xasprintf("%s/%s",
+	    fb->outputdir, filename)) == NULL)
+		return -1;
+
+	if ((fd = open(destfile, O_WRONLY|O_CREAT|O_TRUNC, 0644)) == -1) {
+		free(destfile);
+		return -1;
+	}
+	rv = xbps_fetch_transfer(fb->xhp, fio, fd, us->size, 0, filename);
+	(void)close(fd);
+	if (rv == 0 && us->size != -1 &&
+	    (stat(destfile, &st) == -1 || st.st_size != us->size))
+		rv = -1;
+	if (rv == -1) {
+		/*
+		 * The caller fetches it again; the connection is left
+		 * in an unknown state, so stop the batch.
+		 */
+		(void)unlink(destfile);
+	} else if (us->mtime) {
+		tv[0].tv_sec = us->atime ? us->atime : us->mtime;
+		tv[1].tv_sec = us->mtime;
+		tv[0].tv_usec = tv[1].tv_usec = 0;
+		(void)utimes(destfile, tv);
+	}
+	if (rv == 0)
+		fb->done[i] = true;
+
+	free(destfile);
+	return rv;
+}
+
+int HIDDEN
+xbps_fetch_batch(struct xbps_handle *xhp,
+		 const char **uris,
+		 size_t nuris,
+		 const char *outputdir,
+		 bool *done)
+{
+	struct fetch_batch fb;
+	struct url **urls, **gurls = NULL;
+	size_t i, j, n, *idx = NULL;
+	bool *grouped = NULL;
+	int rv = 0;
+
+	assert(uris != NULL);
+	assert(outputdir != NULL);
+	assert(done != NULL);
+
+	if ((urls = calloc(nuris, sizeof(*urls))) == NULL ||
+	    (gurls = calloc(nuris, sizeof(*gurls))) == NULL ||
+	    (idx = calloc(nuris, sizeof(*idx))) == NULL ||
+	    (grouped = calloc(nuris, sizeof(*grouped))) == NULL) {
+		rv = ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < nuris; i++) {
+		done[i] = false;
+		if (strrchr(uris[i], '/') == NULL ||
+		    (urls[i] = fetchParseURL(uris[i])) == NULL)
+			continue;
+		if (strcasecmp(urls[i]->scheme, SCHEME_HTTP) &&
+		    strcasecmp(urls[i]->scheme, SCHEME_HTTPS)) {
+			fetchFreeURL(urls[i]);
+			urls[i] = NULL;
+			continue;
+		}
+	}
+
+	fetchLastErrCode = 0;
+	fetchTimeout = xhp->fetch_timeout;
+
+	fb.xhp = xhp;
+	fb.outputdir = outputdir;
+	fb.uris = uris;
+	fb.idx = idx;
+	fb.done = done;
+
+	for (i = 0; i < nuris; i++) {
+		if (urls[i] == NULL || grouped[i])
+			continue;
+		/* all remaining files from the same server */
+		for (n = 0, j = i; j < nuris; j++) {
+			if (urls[j] == NULL || grouped[j] ||
+			    strcmp(urls[j]->scheme, urls[i]->scheme) ||
+			    strcmp(urls[j]->host, urls[i]->host) ||
+			    urls[j]->port != urls[i]->port)
+				continue;
+			grouped[j] = true;
+			gurls[n] = urls[j];
+			idx[n++] = j;
+		}
+		if (n < 2)
+			continue;
+
+		xbps_dbg_printf(xhp, "%s: pipelining %zu requests.\n",
+		    urls[i]->host, n);
+		if (fetchXGetHTTPBatch(gurls, n, xhp->fetch_pipeline,
+		    batch_cb, &fb, NULL) == -1)
+			xbps_dbg_printf(xhp, "%s: pipelined requests failed: "
+			    "%s\n", urls[i]->host, fetchLastErrString);
+	}
+out:
+	if (urls != NULL) {
+		for (i = 0; i < nuris; i++) {
+			if (urls[i] != NULL)
+				fetchFreeURL(urls[i]);
+		}
+	}
+	free(urls);
+	free(gurls);
+	free(idx);
+	free(grouped);
+
+	return rv;
+}
@@ -0,0 +1,472 @@
+/*-
+ * Copyright (c) 2012 Juan Romero Pardines.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "xbps_api_impl.h"
+#include "fetch.h"
+
+/*
+ * Segmented downloads.
+ *
+ * Big files from HTTP servers supporting range requests are split in
+ * up to xhp->fetch_segments segments of FETCH_SEGMENT_MINSIZE bytes at
+ * least, and every segment is fetched by its own thread and connection
+ * into a preallocated <file>.part file.
+ *
+ * The progress of every segment is saved into <file>.seg (a plist)
+ * every FETCH_SEGMENT_SAVE bytes, so that an interrupted download is
+ * resumed where every segment stopped. Once all segments are complete
+ * <file>.part is renamed to <file>.
+ */
+#define FETCH_SEGMENT_MINSIZE	(4 * 1024 * 1024)
+#define FETCH_SEGMENT_SAVE	(1024 * 1024)
+
+struct fetch_segment {
+	struct fetch_segmented *fs;
+	pthread_t thread;
+	off_t start;
+	off_t end;
+	off_t done;
+	int error;
+};
+
+struct fetch_segmented {
+	struct xbps_handle *xhp;
+	struct url *url;
+	const char *flags;
+	char *partfile;
+	char *statefile;
+	struct fetch_segment *segs;
+	size_t nsegs;
+	size_t running;
+	off_t size;
+	off_t unsaved;
+	time_t mtime;
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;
+	int fd;
+	bool quit;
+};
+
+static int
+state_save(struct fetch_segmented *fs)
+{
+	prop_dictionary_t d, segd;
+	prop_array_t array;
+	size_t i;
+	int rv = 0;
+
+	d = prop_dictionary_create();
+	array = prop_array_create();
+	if (d == NULL || array == NULL) {
+		rv = ENOMEM;
+		goto out;
+	}
+	prop_dictionary_set_uint64(d, "size", (uint64_t)fs->size);
+	prop_dictionary_set_uint64(d, "mtime", (uint64_t)fs->mtime);
+
+	pthread_mutex_lock(&fs->mtx);
+	for (i = 0; i < fs->nsegs; i++) {
+		if ((segd = prop_dictionary_create()) == NULL) {
+			rv = ENOMEM;
+			break;
+		}
+		prop_dictionary_set_uint64(segd, "start",
+		    (uint64_t)fs->segs[i].start);
+		prop_dictionary_set_uint64(segd, "end",
+		    (uint64_t)fs->segs[i].end);
+		prop_dictionary_set_uint64(segd, "done",
+		    (uint64_t)fs->segs[i].done);
+		if (!prop_array_add(array, segd))
+			rv = EINVAL;
+		prop_object_release(segd);
+		if (rv != 0)
+			break;
+	}
+	fs->unsaved = 0;
+	pthread_mutex_unlock(&fs->mtx);
+
+	if (rv == 0 && !prop_dictionary_set(d, "segments", array))
+		rv = EINVAL;
+	if (rv == 0 && !xbps_dictionary_externalize_to_file(fs->xhp, d,
+	    fs->statefile, false))
+		rv = errno;
+out:
+	if (array != NULL)
+		prop_object_release(array);
+	if (d != NULL)
+		prop_object_release(d);
+
+	return rv;
+}
+
+/*
+ * Restores the segments of an interrupted download, if it's still
+ * the same remote file.
+ */
+static bool
+state_restore(struct fetch_segmented *fs)
+{
+	prop_dictionary_t d, segd;
+	prop_array_t array;
+	struct stat st;
+	uint64_t size = 0, mtime = 0, start, end, done;
+	unsigned int i, n;
+	bool rv = false;
+
+	if (stat(fs->partfile, &st) == -1 || st.st_size != fs->size)
+		return false;
+	if ((d = prop_dictionary_internalize_from_zfile(fs->statefile)) == NULL)
+		return false;
+
+	prop_dictionary_get_uint64(d, "size", &size);
+	prop_dictionary_get_uint64(d, "mtime", &mtime);
+	array = prop_dictionary_get(d, "segments");
+	n = prop_array_count(array);
+	if (size != (uint64_t)fs->size || mtime != (uint64_t)fs->mtime || n == 0)
+		goto out;
+	if ((fs->segs = calloc(n, sizeof(*fs->segs))) == NULL)
+		goto out;
+
+	for (i = 0; i < n; i++) {
+		segd = prop_array_get(array, i);
+		start = end = done = 0;
+		prop_dictionary_get_uint64(segd, "start", &start);
+		prop_dictionary_get_uint64(segd, "end", &end);
+		prop_dictionary_get_uint64(segd, "done", &done);
+		if (start > end || end > size || done > end - start) {
+			free(fs->segs);
+			fs->segs = NULL;
+			goto out;
+		}
+		fs->segs[i].start = (off_t)start;
+		fs->segs[i].end = (off_t)end;
+		fs->segs[i].done = (off_t)done;
+	}
+	fs->nsegs = n;
+	rv = true;
+out:
+	prop_object_release(d);
+	return rv;
+}
+
+static void *
+segment_thread(void *arg)
+{
+	struct fetch_segment *seg = arg;
+	struct fetch_segmented *fs = seg->fs;
+	struct url *url = NULL;
+	struct url_stat us;
+	fetchIO *fio = NULL;
+	char *buf = NULL;
+	off_t pos;
+	ssize_t r = 0;
+	size_t bufsize, len;
+	int rv = 0;
+
+	pos = seg->start + seg->done;
+	if (pos == seg->end)
+		goto out;
+
+	bufsize = xbps_fetch_bufsize(fs->xhp);
+	if ((buf = malloc(bufsize)) == NULL ||
+	    (url = fetchCopyURL(fs->url)) == NULL) {
+		rv = ENOMEM;
+		goto out;
+	}
+	url->offset = pos;
+	url->length = seg->end - pos;
+	if ((fio = fetchXGet(url, &us, fs->flags)) == NULL) {
+		rv = EIO;
+		goto out;
+	}
+	/*
+	 * The server must send exactly the requested range
+	 * of the same file.
+	 */
+	if (url->offset != pos || (off_t)url->length != seg->end - pos ||
+	    us.size != fs->size) {
+		rv = ENOTSUP;
+		goto out;
+	}
+	while (pos < seg->end) {
+		len = bufsize;
+		if ((off_t)len > seg->end - pos)
+			len = (size_t)(seg->end - pos);
+		if ((r = fetchIO_read(fio, buf, len)) <= 0)
+			break;
+		if (pwrite(fs->fd, buf, (size_t)r, pos) != r) {
+			rv = errno;
+			goto out;
+		}
+		pos += r;
+
+		pthread_mutex_lock(&fs->mtx);
+		seg->done += r;
+		fs->unsaved += r;
+		pthread_cond_signal(&fs->cond);
+		if (fs->quit)
+			rv = EINTR;
+		pthread_mutex_unlock(&fs->mtx);
+		if (rv != 0)
+			goto out;
+	}
+	if (pos < seg->end)
+		rv = EIO;
+out:
+	if (fio != NULL)
+		fetchIO_close(fio);
+	if (url != NULL)
+		fetchFreeURL(url);
+	free(buf);
+
+	pthread_mutex_lock(&fs->mtx);
+	seg->error = rv;
+	if (rv != 0)
+		fs->quit = true;
+	fs->running--;
+	pthread_cond_signal(&fs->cond);
+	pthread_mutex_unlock(&fs->mtx);
+
+	return NULL;
+}
+
+static off_t
+segments_done(struct fetch_segmented *fs)
+{
+	off_t done = 0;
+	size_t i;
+
+	for (i = 0; i < fs->nsegs; i++)
+		done += fs->segs[i].done;
+
+	return done;
+}
+
+/*
+ * Fetches all segments and waits for them, reporting progress.
+ */
+static int
+segments_fetch(struct fetch_segmented *fs, const char *filename)
+{
+	off_t resumed, done;
+	size_t i;
+	int rv = 0;
+	bool save;
+
+	resumed = segments_done(fs);
+	xbps_set_cb_fetch(fs->xhp, fs->size, resumed, resumed,
+	    filename, true, false, false);
+
+	for (i = 0; i < fs->nsegs; i++) {
+		fs->segs[i].fs = fs;
+		pthread_mutex_lock(&fs->mtx);
+		fs->running++;
+		pthread_mutex_unlock(&fs->mtx);
+		if ((rv = pthread_create(&fs->segs[i].thread, NULL,
+		    segment_thread, &fs->segs[i])) != 0) {
+			pthread_mutex_lock(&fs->mtx);
+			fs->running--;
+			fs->quit = true;
+			pthread_mutex_unlock(&fs->mtx);
+			break;
+		}
+	}
+	fs->nsegs = i;
+
+	pthread_mutex_lock(&fs->mtx);
+	while (fs->running > 0) {
+		pthread_cond_wait(&fs->cond, &fs->mtx);
+		done = segments_done(fs);
+		save = fs->unsaved >= FETCH_SEGMENT_SAVE;
+		pthread_mutex_unlock(&fs->mtx);
+
+		xbps_set_cb_fetch(fs->xhp, fs->size, resumed, done,
+		    filename, false, true, false);
+		if (save)
+			(void)state_save(fs);
+
+		pthread_mutex_lock(&fs->mtx);
+	}
+	pthread_mutex_unlock(&fs->mtx);
+
+	for (i = 0; i < fs->nsegs; i++) {
+		pthread_join(fs->segs[i].thread, NULL);
+		if (rv == 0 && fs->segs[i].error != 0)
+			rv = fs->segs[i].error;
+	}
+	/* always keep the progress of an interrupted download */
+	(void)state_save(fs);
+	if (rv == 0) {
+		xbps_set_cb_fetch(fs->xhp, fs->size, resumed,
+		    segments_done(fs), filename, false, false, true);
+	}
+	return rv;
+}
+
+/*
+ * Returns 0 if the file was downloaded into destfile, ENOTSUP if it
+ * can't or shouldn't be fetched in segments (the caller falls back to
+ * a single connection), or an errno value otherwise.
+ *
+ * If the expected size is known (size > 0) small files are rejected
+ * without the HEAD request round trip.
+ */
+int HIDDEN
+xbps_fetch_segmented(struct xbps_handle *xhp,
+		     struct url *url,
+		     const char *destfile,
+		     const char *filename,
+		     const char *flags,
+		     uint64_t size)
+{
+	struct fetch_segmented fs;
+	struct url *hurl;
+	struct url_stat us;
+	struct timeval tv[2];
+	off_t seglen;
+	size_t i, nsegs;
+	int rv = 0;
+
+	assert(url != NULL);
+	assert(destfile != NULL);
+
+	if (strcasecmp(url->scheme, SCHEME_HTTP) &&
+	    strcasecmp(url->scheme, SCHEME_HTTPS))
+		return ENOTSUP;
+	if (size > 0 && size < 2 * FETCH_SEGMENT_MINSIZE)
+		return ENOTSUP;
+	/*
+	 * Issue a HEAD request to know size and mtime.
+	 */
+	if ((hurl = fetchCopyURL(url)) == NULL)
+		return ENOMEM;
+	hurl->offset = hurl->length = 0;
+	rv = fetchStat(hurl, &us, flags);
+	fetchFreeURL(hurl);
+	if (rv == -1 || us.size <= 0 ||
+	    us.size < 2 * FETCH_SEGMENT_MINSIZE)
+		return ENOTSUP;
+
+	memset(&fs, 0, sizeof(fs));
+	fs.xhp = xhp;
+	fs.url = url;
+	fs.flags = flags;
+	fs.size = us.size;
+	fs.mtime = us.mtime;
+	fs.fd = -1;
+	pthread_mutex_init(&fs.mtx, NULL);
+	pthread_cond_init(&fs.cond, NULL);
+
+	fs.partfile = xbps_xasprintf("%s.part", destfile);
+	fs.statefile = xbps_xasprintf("%s.seg", destfile);
+	if (fs.partfile == NULL || fs.statefile == NULL) {
+		rv = ENOMEM;
+		goto out;
+	}
+	if (state_restore(&fs)) {
+		xbps_dbg_printf(xhp, "%s: resuming %zu segments.\n",
+		    filename, fs.nsegs);
+		if ((fs.fd = open(fs.partfile, O_WRONLY)) == -1) {
+			rv = errno;
+			goto out;
+		}
+	} else {
+		nsegs = (size_t)(us.size / FETCH_SEGMENT_MINSIZE);
+		if (nsegs > xhp->fetch_segments)
+			nsegs = xhp->fetch_segments;
+		if ((fs.segs = calloc(nsegs, sizeof(*fs.segs))) == NULL) {
+			rv = ENOMEM;
+			goto out;
+		}
+		seglen = us.size / (off_t)nsegs;
+		for (i = 0; i < nsegs; i++) {
+			fs.segs[i].start = (off_t)i * seglen;
+			fs.segs[i].end = (i == nsegs - 1) ?
+			    us.size : (off_t)(i + 1) * seglen;
+		}
+		fs.nsegs = nsegs;
+		xbps_dbg_printf(xhp, "%s: fetching %zu segments.\n",
+		    filename, fs.nsegs);
+
+		fs.fd = open(fs.partfile, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+		if (fs.fd == -1) {
+			rv = errno;
+			goto out;
+		}
+		xbps_fetch_preallocate(fs.fd, 0, fs.size);
+		if (ftruncate(fs.fd, fs.size) == -1 ||
+		    (rv = state_save(&fs)) != 0) {
+			rv = rv ? rv : errno;
+			goto out;
+		}
+	}
+	if ((rv = segments_fetch(&fs, filename)) != 0) {
+		if (rv == ENOTSUP) {
+			xbps_dbg_printf(xhp, "%s: range requests not "
+			    "supported.\n", filename);
+			(void)unlink(fs.partfile);
+			(void)unlink(fs.statefile);
+		}
+		goto out;
+	}
+	(void)close(fs.fd);
+	fs.fd = -1;
+	/*
+	 * Update mtime in local file to match remote file and
+	 * move it into place.
+	 */
+	tv[0].tv_sec = us.atime ? us.atime : us.mtime;
+	tv[1].tv_sec = us.mtime;
+	tv[0].tv_usec = tv[1].tv_usec = 0;
+	if (utimes(fs.partfile, tv) == -1 ||
+	    rename(fs.partfile, destfile) == -1) {
+		rv = errno;
+		goto out;
+	}
+	(void)unlink(fs.statefile);
+out:
+	if (fs.fd != -1)
+		(void)close(fs.fd);
+	pthread_cond_destroy(&fs.cond);
+	pthread_mutex_destroy(&fs.mtx);
+	free(fs.segs);
+	free(fs.partfile);
+	free(fs.statefile);
+
+	return rv;
+}
@@ -0,0 +1,159 @@
+/*-
+ * Copyright (c) 2012 Juan Romero Pardines.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "xbps_api_impl.h"
+
+/*
+ * Binary package cache shared by multiple rootdirs.
+ *
+ * Binary packages are stored in the shared cachedir by the SHA256
+ * hash of the file in the repository index ("filename-sha256"):
+ *
+ * 	<sha256>		A complete and verified binary package.
+ * 	<sha256>.lock		Lock file held while it's being downloaded.
+ * 	<sha256>.part/		Partial download, resumed by next process.
+ *
+ * A package is only downloaded while holding an exclusive lock on its
+ * lock file, verified and renamed into place; other processes block on
+ * the lock and then find it in the cache. Complete packages are never
+ * modified, so they can be read without any lock.
+ */
+char HIDDEN *
+xbps_shared_cache_path(struct xbps_handle *xhp, prop_dictionary_t pkg_repod)
+{
+	const char *sha256;
+
+	assert(prop_object_type(pkg_repod) == PROP_TYPE_DICTIONARY);
+
+	if (xhp->shared_cachedir == NULL)
+		return NULL;
+	if (!prop_dictionary_get_cstring_nocopy(pkg_repod,
+	    "filename-sha256", &sha256))
+		return NULL;
+
+	return xbps_xasprintf("%s/%s", xhp->shared_cachedir, sha256);
+}
+
+int HIDDEN
+xbps_shared_cache_fetch(struct xbps_handle *xhp,
+			prop_dictionary_t pkg_repod,
+			const char *uri)
+{
+	const char *filen, *sha256;
+	uint64_t size = 0;
+	char *binpkg, *lockfile, *partdir, *partfile;
+	int fd = -1, rv = 0;
+
+	assert(prop_object_type(pkg_repod) == PROP_TYPE_DICTIONARY);
+	assert(uri != NULL);
+	assert(xhp->shared_cachedir != NULL);
+
+	prop_dictionary_get_cstring_nocopy(pkg_repod, "filename", &filen);
+	prop_dictionary_get_cstring_nocopy(pkg_repod,
+	    "filename-sha256", &sha256);
+	prop_dictionary_get_uint64(pkg_repod, "filename-size", &size);
+
+	binpkg = xbps_shared_cache_path(xhp, pkg_repod);
+	lockfile = xbps_xasprintf("%s.lock", binpkg);
+	partdir = xbps_xasprintf("%s.part", binpkg);
+	partfile = xbps_xasprintf("%s/%s", partdir, filen);
+	if (binpkg == NULL || lockfile == NULL ||
+	    partdir == NULL || partfile == NULL) {
+		errno = ENOMEM;
+		rv = -1;
+		goto out;
+	}
+	if (xbps_mkpath(xhp->shared_cachedir, 0755) == -1 &&
+	    errno != EEXIST) {
+		rv = -1;
+		goto out;
+	}
+	/*
+	 * Wait until no other process is downloading it.
+	 */
+	if ((fd = open(lockfile, O_RDWR|O_CREAT, 0644)) == -1) {
+		rv = -1;
+		goto out;
+	}
+	if (lockf(fd, F_TEST, 0) == -1) {
+		xbps_dbg_printf(xhp, "%s: waiting for another process to "
+		    "download it...\n", filen);
+	}
+	if (lockf(fd, F_LOCK, 0) == -1) {
+		rv = -1;
+		goto out;
+	}
+	if (access(binpkg, R_OK) == 0) {
+		xbps_dbg_printf(xhp, "%s: found in shared cachedir.\n", filen);
+		goto out;
+	}
+	/*
+	 * Download it (resuming the partial file, if any), verify
+	 * and move it into the cache.
+	 */
+	if (mkdir(partdir, 0755) == -1 && errno != EEXIST) {
+		rv = -1;
+		goto out;
+	}
+	rv = xbps_fetch_file_sized(xhp, uri, partdir, false, NULL, size);
+	if (rv == -1)
+		goto out;
+
+	if ((rv = xbps_file_hash_check(partfile, sha256)) != 0) {
+		xbps_dbg_printf(xhp, "%s: downloaded file doesn't match "
+		    "its SHA256 hash, removing.\n", filen);
+		(void)unlink(partfile);
+		fetchLastErrCode = 0;
+		errno = rv;
+		rv = -1;
+		goto out;
+	}
+	if (rename(partfile, binpkg) == -1) {
+		rv = -1;
+		goto out;
+	}
+	(void)rmdir(partdir);
+	xbps_dbg_printf(xhp, "%s: added to shared cachedir.\n", filen);
+out:
+	if (fd != -1) {
+		/* releases the lock */
+		(void)close(fd);
+	}
+	free(binpkg);
+	free(lockfile);
+	free(partdir);
+	free(partfile);
+
+	return rv;
+}
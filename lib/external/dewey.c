@@ -33,6 +33,8 @@
 #include <string.h>
 #include <strings.h>
 #include <ctype.h>
+#include <fnmatch.h>
+#include <errno.h>
 
 #include "xbps_api_impl.h"
 
@@ -63,14 +65,36 @@ enum {
         Patch = 1
 };
 
+/* # of version numbers stored without allocating */
+#define DEWEY_INLINE	16
+
 /* this struct defines a version number */
 typedef struct arr_t {
 	unsigned	c;              /* # of version numbers */
 	unsigned	size;           /* size of array */
 	int	       *v;              /* array of decimal numbers */
 	int		revision;       /* any "_" suffix */
+	int		vbuf[DEWEY_INLINE]; /* inline storage for v */
 } arr_t;
 
+/* this struct defines a precompiled package pattern */
+struct xbps_pkgpattern {
+	char	       *pattern;        /* pattern string */
+	char	       *pkgname;        /* see xbps_pkgpattern_name() */
+	size_t		namelen;        /* length of name in dewey patterns */
+	int		type;           /* enumerated type of pattern */
+	int		op;             /* test against version */
+	int		op2;            /* test against version2, or -1 */
+	arr_t		version;        /* version (or lower limit) */
+	arr_t		version2;       /* upper limit */
+};
+
+enum {
+	PATTERN_EXACT,
+	PATTERN_DEWEY,
+	PATTERN_GLOB
+};
+
 /* this struct describes a test */
 typedef struct test_t {
 	const char     *s;              /* string representation */
@@ -117,6 +141,27 @@ dewey_mktest(int *op, const char *test)
 	return -1;
 }
 
+/*
+ * grow the array of a version number, the first DEWEY_INLINE
+ * components are stored in the struct itself.
+ */
+static void
+growversion(arr_t *ap)
+{
+	int *v;
+
+	if (ap->v == ap->vbuf) {
+		v = malloc(ap->size * 2 * sizeof(int));
+		assert(v != NULL);
+		memcpy(v, ap->vbuf, ap->size * sizeof(int));
+	} else {
+		v = realloc(ap->v, ap->size * 2 * sizeof(int));
+		assert(v != NULL);
+	}
+	ap->v = v;
+	ap->size *= 2;
+}
+
 /*
  * make a component of a version number.
  * '.' encodes as Dot which is '0'
@@ -134,17 +179,8 @@ mkcomponent(arr_t *ap, const char *num)
 	int                 n;
 	const char             *cp;
 
-	if (ap->c == ap->size) {
-		if (ap->size == 0) {
-			ap->size = 62;
-			ap->v = malloc(ap->size * sizeof(int));
-			assert(ap->v != NULL);
-		} else {
-			ap->size *= 2;
-			ap->v = realloc(ap->v, ap->size * sizeof(int));
-			assert(ap->v != NULL);
-		}
-	}
+	if (ap->c == ap->size)
+		growversion(ap);
 	if (isdigit((unsigned char)*num)) {
 		for (cp = num, n = 0 ; isdigit((unsigned char)*num) ; num++) {
 			n = (n * 10) + (*num - '0');
@@ -168,11 +204,8 @@ mkcomponent(arr_t *ap, const char *num)
 	if (isalpha((unsigned char)*num)) {
 		ap->v[ap->c++] = Dot;
 		cp = strchr(alphas, tolower((unsigned char)*num));
-		if (ap->c == ap->size) {
-			ap->size *= 2;
-			ap->v = realloc(ap->v, ap->size * sizeof(int));
-			assert(ap->v != NULL);
-		}
+		if (ap->c == ap->size)
+			growversion(ap);
 		ap->v[ap->c++] = (int)(cp - alphas) + 1;
 		return 1;
 	}
@@ -184,8 +217,8 @@ static int
 mkversion(arr_t *ap, const char *num)
 {
 	ap->c = 0;
-	ap->size = 0;
-	ap->v = NULL;
+	ap->size = DEWEY_INLINE;
+	ap->v = ap->vbuf;
 	ap->revision = 0;
 
 	while (*num) {
@@ -197,7 +230,8 @@ mkversion(arr_t *ap, const char *num)
 static void
 freeversion(arr_t *ap)
 {
-	free(ap->v);
+	if (ap->v != ap->vbuf)
+		free(ap->v);
 	ap->v = NULL;
 	ap->c = 0;
 	ap->size = 0;
@@ -227,19 +261,27 @@ result(int cmp, int tst)
 	}
 }
 
-/* do the test on the 2 vectors */
+/* compare the 2 vectors, returns -1, 0 or 1 */
 static int
-vtest(arr_t *lhs, int tst, arr_t *rhs)
+vcmp(const arr_t *lhs, const arr_t *rhs)
 {
 	int cmp;
 	unsigned int c, i;
 
 	for (i = 0, c = MAX(lhs->c, rhs->c) ; i < c ; i++) {
 		if ((cmp = DIGIT(lhs->v, lhs->c, i) - DIGIT(rhs->v, rhs->c, i)) != 0) {
-			return result(cmp, tst);
+			return cmp < 0 ? -1 : 1;
 		}
 	}
-	return result(lhs->revision - rhs->revision, tst);
+	cmp = lhs->revision - rhs->revision;
+	return cmp < 0 ? -1 : (cmp > 0);
+}
+
+/* do the test on the 2 vectors */
+static int
+vtest(const arr_t *lhs, int tst, const arr_t *rhs)
+{
+	return result(vcmp(lhs, rhs), tst);
 }
 
 /*
@@ -272,12 +314,155 @@ dewey_cmp(const char *lhs, int op, const char *rhs)
 int
 xbps_cmpver(const char *pkg1, const char *pkg2)
 {
-	if (dewey_cmp(pkg1, DEWEY_LT, pkg2))
-		return -1;
-	else if (dewey_cmp(pkg1, DEWEY_GT, pkg2))
-		return 1;
-	else
-		return 0;
+	arr_t left, right;
+	int rv;
+
+	mkversion(&left, pkg1);
+	mkversion(&right, pkg2);
+	rv = vcmp(&left, &right);
+	freeversion(&left);
+	freeversion(&right);
+
+	return rv;
+}
+
+/*
+ * Cache of parsed version numbers, indexed by the address of the
+ * string. The string is also copied to detect stale entries, in
+ * case the address has been reused for another string.
+ */
+struct xbps_version_cache {
+	struct version_entry **slots;
+	size_t nslots;
+	size_t nentries;
+};
+
+struct version_entry {
+	const char *key;
+	char *str;
+	arr_t version;
+};
+
+static size_t
+version_hash(const char *key)
+{
+	uintptr_t h = (uintptr_t)key;
+
+	h ^= h >> 17;
+	h *= 0x9e3779b1U;
+	return (size_t)(h ^ (h >> 15));
+}
+
+static int
+version_cache_grow(struct xbps_version_cache *vc)
+{
+	struct version_entry **slots;
+	size_t i, nslots, slot;
+
+	nslots = vc->nslots ? vc->nslots * 2 : 512;
+	if ((slots = calloc(nslots, sizeof(*slots))) == NULL)
+		return ENOMEM;
+
+	for (i = 0; i < vc->nslots; i++) {
+		if (vc->slots[i] == NULL)
+			continue;
+		slot = version_hash(vc->slots[i]->key) & (nslots - 1);
+		while (slots[slot] != NULL)
+			slot = (slot + 1) & (nslots - 1);
+		slots[slot] = vc->slots[i];
+	}
+	free(vc->slots);
+	vc->slots = slots;
+	vc->nslots = nslots;
+
+	return 0;
+}
+
+static const arr_t *
+version_cached(struct xbps_handle *xhp, const char *str)
+{
+	struct xbps_version_cache *vc;
+	struct version_entry *ve;
+	char *copy;
+	size_t slot;
+
+	if ((vc = xhp->version_cache) == NULL) {
+		if ((vc = calloc(1, sizeof(*vc))) == NULL)
+			return NULL;
+		xhp->version_cache = vc;
+	}
+	if ((vc->nentries + 1) * 2 > vc->nslots) {
+		if (version_cache_grow(vc) != 0)
+			return NULL;
+	}
+	slot = version_hash(str) & (vc->nslots - 1);
+	while ((ve = vc->slots[slot]) != NULL) {
+		if (ve->key == str) {
+			if (strcmp(ve->str, str) == 0)
+				return &ve->version;
+			/* stale entry, reparse it */
+			break;
+		}
+		slot = (slot + 1) & (vc->nslots - 1);
+	}
+	if ((copy = strdup(str)) == NULL)
+		return NULL;
+	if (ve == NULL) {
+		if ((ve = malloc(sizeof(*ve))) == NULL) {
+			free(copy);
+			return NULL;
+		}
+		ve->key = str;
+		vc->slots[slot] = ve;
+		vc->nentries++;
+	} else {
+		free(ve->str);
+		freeversion(&ve->version);
+	}
+	ve->str = copy;
+	mkversion(&ve->version, str);
+
+	return &ve->version;
+}
+
+/*
+ * Same than xbps_cmpver() but the parsed versions are cached in the
+ * handle, and reused when the same strings are compared again.
+ */
+int
+xbps_cmpver_cached(struct xbps_handle *xhp, const char *pkg1, const char *pkg2)
+{
+	const arr_t *left, *right;
+
+	assert(xhp != NULL);
+
+	if ((left = version_cached(xhp, pkg1)) == NULL ||
+	    (right = version_cached(xhp, pkg2)) == NULL)
+		return xbps_cmpver(pkg1, pkg2);
+
+	return vcmp(left, right);
+}
+
+void HIDDEN
+xbps_version_cache_release(struct xbps_handle *xhp)
+{
+	struct xbps_version_cache *vc = xhp->version_cache;
+	struct version_entry *ve;
+	size_t i;
+
+	if (vc == NULL)
+		return;
+
+	for (i = 0; i < vc->nslots; i++) {
+		if ((ve = vc->slots[i]) == NULL)
+			continue;
+		free(ve->str);
+		freeversion(&ve->version);
+		free(ve);
+	}
+	free(vc->slots);
+	free(vc);
+	xhp->version_cache = NULL;
 }
 
 /*
@@ -339,3 +524,133 @@ dewey_match(const char *pattern, const char *pkg)
 	return 0;
 }
 
+/*
+ * Precompile "pattern", so that it can be matched against many
+ * packages without parsing it (and its versions) every time.
+ */
+struct xbps_pkgpattern *
+xbps_pkgpattern_compile(const char *pattern)
+{
+	struct xbps_pkgpattern *pp;
+	const char *sep, *sep2;
+	char ver[PKG_PATTERN_MAX];
+	int n;
+
+	assert(pattern != NULL);
+
+	if ((pp = calloc(1, sizeof(*pp))) == NULL)
+		return NULL;
+	if ((pp->pattern = strdup(pattern)) == NULL) {
+		free(pp);
+		return NULL;
+	}
+	pp->pkgname = xbps_pkgpattern_name(pattern);
+	pp->type = PATTERN_EXACT;
+	pp->op2 = -1;
+
+	if ((sep = strpbrk(pattern, "<>")) != NULL) {
+		/* invalid operators only match by string */
+		if ((n = dewey_mktest(&pp->op, sep)) < 0)
+			return pp;
+		sep += n;
+		/* if greater than, look for less than */
+		sep2 = NULL;
+		if (pp->op == DEWEY_GT || pp->op == DEWEY_GE) {
+			if ((sep2 = strchr(sep, '<')) != NULL) {
+				if ((n = dewey_mktest(&pp->op2, sep2)) < 0)
+					return pp;
+				mkversion(&pp->version2, sep2 + n);
+			}
+		}
+		if (sep2 != NULL) {
+			strlcpy(ver, sep, MIN((ssize_t)sizeof(ver), sep2-sep+1));
+			mkversion(&pp->version, ver);
+		} else {
+			mkversion(&pp->version, sep);
+		}
+		pp->type = PATTERN_DEWEY;
+		pp->namelen = (size_t)(strpbrk(pattern, "<>") - pattern);
+	} else if (strpbrk(pattern, "*?[]") != NULL) {
+		pp->type = PATTERN_GLOB;
+	}
+
+	return pp;
+}
+
+/*
+ * Same than xbps_pkgpattern_match() but with a precompiled pattern,
+ * the version of "pkg" is parsed once for both limits and without
+ * allocating memory in the common case.
+ */
+int
+xbps_pkgpattern_match_compiled(const char *pkg,
+			       const struct xbps_pkgpattern *pp)
+{
+	const char *version;
+	arr_t left;
+	int rv;
+
+	assert(pkg != NULL);
+	assert(pp != NULL);
+
+	/* simple match on "pkg" against "pattern" */
+	if (strcmp(pp->pattern, pkg) == 0)
+		return 1;
+
+	switch (pp->type) {
+	case PATTERN_DEWEY:
+		/* compare names */
+		if ((version = strrchr(pkg, '-')) == NULL)
+			return 0;
+		if ((size_t)(version - pkg) != pp->namelen ||
+		    strncmp(pkg, pp->pattern, pp->namelen) != 0)
+			return 0;
+
+		mkversion(&left, version + 1);
+		/* compare upper limit */
+		if (pp->op2 != -1 && !vtest(&left, pp->op2, &pp->version2))
+			rv = 0;
+		else
+			rv = vtest(&left, pp->op, &pp->version);
+		freeversion(&left);
+		return rv;
+	case PATTERN_GLOB:
+		if (fnmatch(pp->pattern, pkg, FNM_PERIOD) == 0)
+			return 1;
+		break;
+	}
+
+	return 0;
+}
+
+const char *
+xbps_pkgpattern_compiled_name(const struct xbps_pkgpattern *pp)
+{
+	assert(pp != NULL);
+
+	return pp->pkgname;
+}
+
+const char HIDDEN *
+xbps_pkgpattern_compiled_pattern(const struct xbps_pkgpattern *pp)
+{
+	assert(pp != NULL);
+
+	return pp->pattern;
+}
+
+void
+xbps_pkgpattern_free(struct xbps_pkgpattern *pp)
+{
+	if (pp == NULL)
+		return;
+
+	if (pp->type == PATTERN_DEWEY) {
+		freeversion(&pp->version);
+		if (pp->op2 != -1)
+			freeversion(&pp->version2);
+	}
+	free(pp->pkgname);
+	free(pp->pattern);
+	free(pp);
+}
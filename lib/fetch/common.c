@@ -47,6 +47,7 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #if defined(HAVE_INTTYPES_H) || defined(NETBSD)
 #include <inttypes.h>
 #endif
@@ -55,11 +56,13 @@
 #else
 #include <netdb.h>
 #endif
+#include <pthread.h>
 #include <pwd.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #ifndef MSG_NOSIGNAL
@@ -262,6 +265,126 @@ fetch_bind(int sd, int af, const char *addr)
 }
 
 
+/*
+ * Resolver cache: addresses of every host:port looked up are kept for
+ * DNS_CACHE_TTL seconds, and handed out as private copies so that
+ * callers may use them without holding the lock.
+ */
+#define DNS_CACHE_TTL	300
+
+struct dns_entry {
+	char		*host;
+	char		 port[10];
+	int		 af;
+	struct addrinfo	*res;
+	time_t		 expires;
+	struct dns_entry *next;
+};
+
+static struct dns_entry *dns_cache;
+static pthread_mutex_t dns_cache_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+dns_free(struct addrinfo *res)
+{
+	struct addrinfo *next;
+
+	for (; res != NULL; res = next) {
+		next = res->ai_next;
+		free(res);
+	}
+}
+
+static struct addrinfo *
+dns_copy(const struct addrinfo *res)
+{
+	struct addrinfo *ai, *first = NULL, **last = &first;
+
+	for (; res != NULL; res = res->ai_next) {
+		if ((ai = malloc(sizeof(*ai) + res->ai_addrlen)) == NULL) {
+			dns_free(first);
+			return (NULL);
+		}
+		memcpy(ai, res, sizeof(*ai));
+		ai->ai_addr = (struct sockaddr *)(void *)(ai + 1);
+		memcpy(ai->ai_addr, res->ai_addr, res->ai_addrlen);
+		ai->ai_canonname = NULL;
+		ai->ai_next = NULL;
+		*last = ai;
+		last = &ai->ai_next;
+	}
+	return (first);
+}
+
+/*
+ * Look up host and port, from the cache unless flush is set. On success
+ * the addresses must be freed with dns_free(); cached is set if they
+ * came from the cache.
+ */
+static int
+fetch_resolve(const char *host, const char *port, int af, int flush,
+    struct addrinfo **res, int *cached)
+{
+	struct addrinfo hints, *res0;
+	struct dns_entry *e;
+	time_t now = time(NULL);
+	int error;
+
+	*cached = 0;
+	pthread_mutex_lock(&dns_cache_mtx);
+	for (e = dns_cache; e != NULL; e = e->next) {
+		if (e->af == af && strcmp(e->port, port) == 0 &&
+		    strcmp(e->host, host) == 0)
+			break;
+	}
+	if (e != NULL && !flush && e->expires > now) {
+		*res = dns_copy(e->res);
+		pthread_mutex_unlock(&dns_cache_mtx);
+		if (*res == NULL)
+			return (EAI_MEMORY);
+		*cached = 1;
+		return (0);
+	}
+	pthread_mutex_unlock(&dns_cache_mtx);
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = af;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = 0;
+	if ((error = getaddrinfo(host, port, &hints, &res0)) != 0)
+		return (error);
+	*res = dns_copy(res0);
+	freeaddrinfo(res0);
+	if (*res == NULL)
+		return (EAI_MEMORY);
+
+	pthread_mutex_lock(&dns_cache_mtx);
+	for (e = dns_cache; e != NULL; e = e->next) {
+		if (e->af == af && strcmp(e->port, port) == 0 &&
+		    strcmp(e->host, host) == 0)
+			break;
+	}
+	if (e == NULL && (e = calloc(1, sizeof(*e))) != NULL) {
+		if ((e->host = strdup(host)) == NULL) {
+			free(e);
+			e = NULL;
+		} else {
+			snprintf(e->port, sizeof(e->port), "%s", port);
+			e->af = af;
+			e->next = dns_cache;
+			dns_cache = e;
+		}
+	}
+	if (e != NULL) {
+		dns_free(e->res);
+		e->res = dns_copy(*res);
+		e->expires = e->res != NULL ? now + DNS_CACHE_TTL : 0;
+	}
+	pthread_mutex_unlock(&dns_cache_mtx);
+
+	return (0);
+}
+
 /*
  * Establish a TCP connection to the specified port on the specified host.
  */
@@ -271,43 +394,47 @@ fetch_connect(struct url *url, int af, int verbose)
 	conn_t *conn;
 	char pbuf[10];
 	const char *bindaddr;
-	struct addrinfo hints, *res, *res0;
-	int sd, error;
+	struct addrinfo *res, *res0;
+	int sd, error, cached, flush;
 
 	if (verbose)
 		fetch_info("looking up %s", url->host);
 
 	/* look up host name and set up socket address structure */
 	snprintf(pbuf, sizeof(pbuf), "%d", url->port);
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = af;
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_protocol = 0;
-	if ((error = getaddrinfo(url->host, pbuf, &hints, &res0)) != 0) {
-		netdb_seterr(error);
-		return (NULL);
-	}
 	bindaddr = getenv("FETCH_BIND_ADDRESS");
 
-	if (verbose)
-		fetch_info("connecting to %s:%d", url->host, url->port);
-
-	/* try to connect */
-	for (sd = -1, res = res0; res; sd = -1, res = res->ai_next) {
-		if ((sd = socket(res->ai_family, res->ai_socktype,
-			 res->ai_protocol)) == -1)
-			continue;
-		if (bindaddr != NULL && *bindaddr != '\0' &&
-		    fetch_bind(sd, res->ai_family, bindaddr) != 0) {
-			fetch_info("failed to bind to '%s'", bindaddr);
+	for (sd = -1, flush = 0; sd == -1 && flush < 2; flush++) {
+		error = fetch_resolve(url->host, pbuf, af, flush, &res0,
+		    &cached);
+		if (error != 0) {
+			netdb_seterr(error);
+			return (NULL);
+		}
+		if (verbose)
+			fetch_info("connecting to %s:%d%s", url->host,
+			    url->port, cached ? " (cached address)" : "");
+
+		/* try to connect */
+		for (sd = -1, res = res0; res; sd = -1, res = res->ai_next) {
+			if ((sd = socket(res->ai_family, res->ai_socktype,
+				 res->ai_protocol)) == -1)
+				continue;
+			if (bindaddr != NULL && *bindaddr != '\0' &&
+			    fetch_bind(sd, res->ai_family, bindaddr) != 0) {
+				fetch_info("failed to bind to '%s'", bindaddr);
+				close(sd);
+				continue;
+			}
+			if (connect(sd, res->ai_addr, res->ai_addrlen) == 0)
+				break;
 			close(sd);
-			continue;
 		}
-		if (connect(sd, res->ai_addr, res->ai_addrlen) == 0)
+		dns_free(res0);
+		/* stale cached addresses, look them up again */
+		if (!cached)
 			break;
-		close(sd);
 	}
-	freeaddrinfo(res0);
 	if (sd == -1) {
 		fetch_syserr();
 		return (NULL);
@@ -323,6 +450,7 @@ fetch_connect(struct url *url, int af, int verbose)
 }
 
 static conn_t *connection_cache;
+static pthread_mutex_t connection_cache_mtx = PTHREAD_MUTEX_INITIALIZER;
 static int cache_global_limit = 0;
 static int cache_per_host_limit = 0;
 
@@ -353,10 +481,12 @@ fetchConnectionCacheClose(void)
 {
 	conn_t *conn;
 
+	pthread_mutex_lock(&connection_cache_mtx);
 	while ((conn = connection_cache) != NULL) {
 		connection_cache = conn->next_cached;
 		(*conn->cache_close)(conn);
 	}
+	pthread_mutex_unlock(&connection_cache_mtx);
 }
 
 /*
@@ -368,6 +498,7 @@ fetch_cache_get(const struct url *url, int af)
 {
 	conn_t *conn, *last_conn = NULL;
 
+	pthread_mutex_lock(&connection_cache_mtx);
 	for (conn = connection_cache; conn; conn = conn->next_cached) {
 		if (conn->cache_url->port == url->port &&
 		    strcmp(conn->cache_url->scheme, url->scheme) == 0 &&
@@ -380,9 +511,12 @@ fetch_cache_get(const struct url *url, int af)
 				last_conn->next_cached = conn->next_cached;
 			else
 				connection_cache = conn->next_cached;
+			pthread_mutex_unlock(&connection_cache_mtx);
 			return conn;
 		}
+		last_conn = conn;
 	}
+	pthread_mutex_unlock(&connection_cache_mtx);
 
 	return NULL;
 }
@@ -403,6 +537,7 @@ fetch_cache_put(conn_t *conn, int (*closecb)(conn_t *))
 		return;
 	}
 
+	pthread_mutex_lock(&connection_cache_mtx);
 	global_count = host_count = 0;
 	last = NULL;
 	for (iter = connection_cache; iter;
@@ -424,34 +559,286 @@ fetch_cache_put(conn_t *conn, int (*closecb)(conn_t *))
 	conn->cache_close = closecb;
 	conn->next_cached = connection_cache;
 	connection_cache = conn;
+	pthread_mutex_unlock(&connection_cache_mtx);
 }
 
+#ifdef WITH_SSL
 /*
- * Enable SSL on a connection.
+ * TLS sessions of every host:port, so that new connections to the
+ * same server resume them rather than doing a full handshake. All
+ * connections share a single SSL context; new sessions (which in
+ * TLSv1.3 may arrive after the handshake) are stored by its callback.
+ */
+struct ssl_session_entry {
+	char		*key;
+	SSL_SESSION	*sess;
+	time_t		 expires;
+	struct ssl_session_entry *next;
+};
+
+static SSL_CTX *ssl_ctx;
+static pthread_once_t ssl_once = PTHREAD_ONCE_INIT;
+static struct ssl_session_entry *ssl_sessions;
+static pthread_mutex_t ssl_sessions_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static char *
+ssl_session_key(const struct url *url)
+{
+	char *key;
+	size_t len;
+
+	len = strlen(url->host) + 16;
+	if ((key = malloc(len)) != NULL)
+		snprintf(key, len, "%s:%d", url->host, url->port);
+	return (key);
+}
+
+/*
+ * Stores a session, the cache takes the reference of sess.
+ * Must be called with ssl_sessions_mtx locked.
+ */
+static void
+ssl_session_store(char *key, SSL_SESSION *sess, time_t expires)
+{
+	struct ssl_session_entry *e;
+
+	for (e = ssl_sessions; e != NULL; e = e->next) {
+		if (strcmp(e->key, key) == 0)
+			break;
+	}
+	if (e == NULL) {
+		if ((e = calloc(1, sizeof(*e))) == NULL) {
+			free(key);
+			SSL_SESSION_free(sess);
+			return;
+		}
+		e->key = key;
+		e->next = ssl_sessions;
+		ssl_sessions = e;
+	} else {
+		free(key);
+		SSL_SESSION_free(e->sess);
+	}
+	e->sess = sess;
+	e->expires = expires;
+}
+
+static int
+ssl_session_new_cb(SSL *ssl, SSL_SESSION *sess)
+{
+	conn_t *conn = SSL_get_app_data(ssl);
+	char *key;
+
+	if (conn == NULL || conn->cache_url == NULL ||
+	    (key = ssl_session_key(conn->cache_url)) == NULL)
+		return (0);
+
+	pthread_mutex_lock(&ssl_sessions_mtx);
+	ssl_session_store(key, sess,
+	    (time_t)SSL_SESSION_get_time(sess) + SSL_SESSION_get_timeout(sess));
+	pthread_mutex_unlock(&ssl_sessions_mtx);
+	/* the reference is kept in the cache */
+	return (1);
+}
+
+static void
+ssl_init(void)
+{
+	if (!SSL_library_init()) {
+		fprintf(stderr, "SSL library init failed\n");
+		return;
+	}
+	SSL_load_error_strings();
+
+	if ((ssl_ctx = SSL_CTX_new(SSLv23_client_method())) == NULL)
+		return;
+	SSL_CTX_set_mode(ssl_ctx, SSL_MODE_AUTO_RETRY);
+	SSL_CTX_set_session_cache_mode(ssl_ctx,
+	    SSL_SESS_CACHE_CLIENT|SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(ssl_ctx, ssl_session_new_cb);
+}
+#endif
+
+/*
+ * Load TLS sessions saved by fetchSessionCacheSave(), skipping
+ * the expired ones.
  */
 int
-fetch_ssl(conn_t *conn, int verbose)
+fetchSessionCacheLoad(const char *path)
 {
+#ifdef WITH_SSL
+	FILE *f;
+	SSL_SESSION *sess;
+	const unsigned char *p;
+	unsigned char *der;
+	char *line = NULL, *key, *hex, *ep;
+	size_t linesize = 0, i, len;
+	ssize_t n;
+	long long expires;
+	time_t now = time(NULL);
+
+	if ((f = fopen(path, "r")) == NULL)
+		return (-1);
 
+	while ((n = getline(&line, &linesize, f)) != -1) {
+		if (n > 0 && line[n - 1] == '\n')
+			line[n - 1] = '\0';
+		if ((key = strtok(line, " ")) == NULL ||
+		    (ep = strtok(NULL, " ")) == NULL ||
+		    (hex = strtok(NULL, " ")) == NULL)
+			continue;
+		expires = strtoll(ep, NULL, 10);
+		if (expires <= now || (len = strlen(hex) / 2) == 0)
+			continue;
+		if ((der = malloc(len)) == NULL)
+			break;
+		for (i = 0; i < len; i++) {
+			if (sscanf(hex + i * 2, "%2hhx", &der[i]) != 1)
+				break;
+		}
+		p = der;
+		sess = i == len ? d2i_SSL_SESSION(NULL, &p, (long)len) : NULL;
+		free(der);
+		if (sess == NULL || (key = strdup(key)) == NULL) {
+			if (sess != NULL)
+				SSL_SESSION_free(sess);
+			continue;
+		}
+		pthread_mutex_lock(&ssl_sessions_mtx);
+		ssl_session_store(key, sess, (time_t)expires);
+		pthread_mutex_unlock(&ssl_sessions_mtx);
+	}
+	free(line);
+	fclose(f);
+	return (0);
+#else
+	(void)path;
+	return (-1);
+#endif
+}
+
+/*
+ * Save the TLS sessions not expired yet to path, only readable by
+ * its owner: anyone able to read it could resume the sessions.
+ */
+int
+fetchSessionCacheSave(const char *path)
+{
 #ifdef WITH_SSL
-	/* Init the SSL library and context */
-	if (!SSL_library_init()){
-		fprintf(stderr, "SSL library init failed\n");
+	struct ssl_session_entry *e;
+	FILE *f;
+	unsigned char *der, *p;
+	char *tmp;
+	size_t tmplen;
+	time_t now = time(NULL);
+	int fd, len, i, rv = 0;
+
+	tmplen = strlen(path) + 5;
+	if ((tmp = malloc(tmplen)) == NULL)
+		return (-1);
+	snprintf(tmp, tmplen, "%s.tmp", path);
+	(void)unlink(tmp);
+	if ((fd = open(tmp, O_WRONLY|O_CREAT|O_EXCL, 0600)) == -1) {
+		free(tmp);
 		return (-1);
 	}
+	if ((f = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		(void)unlink(tmp);
+		free(tmp);
+		return (-1);
+	}
+	pthread_mutex_lock(&ssl_sessions_mtx);
+	for (e = ssl_sessions; e != NULL; e = e->next) {
+		if (e->expires <= now ||
+		    (len = i2d_SSL_SESSION(e->sess, NULL)) <= 0 ||
+		    (der = malloc((size_t)len)) == NULL)
+			continue;
+		p = der;
+		(void)i2d_SSL_SESSION(e->sess, &p);
+		fprintf(f, "%s %lld ", e->key, (long long)e->expires);
+		for (i = 0; i < len; i++)
+			fprintf(f, "%02x", der[i]);
+		fputc('\n', f);
+		OPENSSL_cleanse(der, (size_t)len);
+		free(der);
+	}
+	pthread_mutex_unlock(&ssl_sessions_mtx);
+	if (fclose(f) != 0 || rename(tmp, path) == -1) {
+		(void)unlink(tmp);
+		rv = -1;
+	}
+	free(tmp);
+	return (rv);
+#else
+	(void)path;
+	return (-1);
+#endif
+}
+
+/*
+ * Forget all TLS sessions.
+ */
+void
+fetchSessionCacheClose(void)
+{
+#ifdef WITH_SSL
+	struct ssl_session_entry *e;
+
+	pthread_mutex_lock(&ssl_sessions_mtx);
+	while ((e = ssl_sessions) != NULL) {
+		ssl_sessions = e->next;
+		SSL_SESSION_free(e->sess);
+		free(e->key);
+		free(e);
+	}
+	pthread_mutex_unlock(&ssl_sessions_mtx);
+#endif
+}
 
-	SSL_load_error_strings();
+/*
+ * Enable SSL on a connection.
+ */
+int
+fetch_ssl(conn_t *conn, int verbose)
+{
 
-	conn->ssl_meth = SSLv23_client_method();
-	conn->ssl_ctx = SSL_CTX_new(conn->ssl_meth);
-	SSL_CTX_set_mode(conn->ssl_ctx, SSL_MODE_AUTO_RETRY);
+#ifdef WITH_SSL
+	struct ssl_session_entry *e;
+	char *key = NULL;
+
+	/* Init the SSL library and the shared context */
+	pthread_once(&ssl_once, ssl_init);
+	if (ssl_ctx == NULL) {
+		fprintf(stderr, "SSL context creation failed\n");
+		return (-1);
+	}
+	conn->ssl_ctx = ssl_ctx;
 
 	conn->ssl = SSL_new(conn->ssl_ctx);
 	if (conn->ssl == NULL){
 		fprintf(stderr, "SSL context creation failed\n");
 		return (-1);
 	}
+	SSL_set_app_data(conn->ssl, conn);
 	SSL_set_fd(conn->ssl, conn->sd);
+	if (conn->cache_url != NULL) {
+		SSL_set_tlsext_host_name(conn->ssl, conn->cache_url->host);
+		key = ssl_session_key(conn->cache_url);
+	}
+	/* Resume the last session with this server, if any */
+	if (key != NULL) {
+		pthread_mutex_lock(&ssl_sessions_mtx);
+		for (e = ssl_sessions; e != NULL; e = e->next) {
+			if (strcmp(e->key, key) == 0) {
+				if (e->expires > time(NULL))
+					SSL_set_session(conn->ssl, e->sess);
+				break;
+			}
+		}
+		pthread_mutex_unlock(&ssl_sessions_mtx);
+		free(key);
+	}
 	if (SSL_connect(conn->ssl) == -1){
 		ERR_print_errors_fp(stderr);
 		return (-1);
@@ -461,8 +848,9 @@ fetch_ssl(conn_t *conn, int verbose)
 		X509_NAME *name;
 		char *str;
 
-		fprintf(stderr, "SSL connection established using %s\n",
-		    SSL_get_cipher(conn->ssl));
+		fprintf(stderr, "SSL connection established using %s%s\n",
+		    SSL_get_cipher(conn->ssl),
+		    SSL_session_reused(conn->ssl) ? " (resumed)" : "");
 		conn->ssl_cert = SSL_get_peer_certificate(conn->ssl);
 		name = X509_get_subject_name(conn->ssl_cert);
 		str = X509_NAME_oneline(name, 0, 0);
@@ -709,6 +1097,19 @@ fetch_close(conn_t *conn)
 {
 	int ret;
 
+#ifdef WITH_SSL
+	if (conn->ssl != NULL) {
+		/*
+		 * Mark it as cleanly shut down so that the session stays
+		 * resumable, without writing to a possibly closed socket.
+		 */
+		SSL_set_quiet_shutdown(conn->ssl, 1);
+		(void)SSL_shutdown(conn->ssl);
+		SSL_free(conn->ssl);
+	}
+	if (conn->ssl_cert != NULL)
+		X509_free(conn->ssl_cert);
+#endif
 	ret = close(conn->sd);
 	if (conn->cache_url)
 		fetchFreeURL(conn->cache_url);
@@ -999,6 +1400,7 @@ struct fetchIO {
 	ssize_t (*io_read)(void *, void *, size_t);
 	ssize_t (*io_write)(void *, const void *, size_t);
 	void (*io_close)(void *);
+	ssize_t (*io_splice)(void *, int, size_t);
 };
 
 void
@@ -1025,10 +1427,17 @@ fetchIO_unopen(void *io_cookie, ssize_t (*io_read)(void *, void *, size_t),
 	f->io_read = io_read;
 	f->io_write = io_write;
 	f->io_close = io_close;
+	f->io_splice = NULL;
 
 	return f;
 }
 
+void
+fetchIO_set_splice(fetchIO *f, ssize_t (*io_splice)(void *, int, size_t))
+{
+	f->io_splice = io_splice;
+}
+
 ssize_t
 fetchIO_read(fetchIO *f, void *buf, size_t len)
 {
@@ -1044,3 +1453,18 @@ fetchIO_write(fetchIO *f, const void *buf, size_t len)
 		return EBADF;
 	return (*f->io_write)(f->io_cookie, buf, len);
 }
+
+/*
+ * Move up to len bytes from the stream to fd, at its current offset,
+ * without copying them to userspace. Returns -1 and sets errno to
+ * EOPNOTSUPP if the stream doesn't support it.
+ */
+ssize_t
+fetchIO_splice(fetchIO *f, int fd, size_t len)
+{
+	if (f->io_splice == NULL) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	return (*f->io_splice)(f->io_cookie, fd, len);
+}
@@ -115,6 +115,8 @@ int		 fetch_urlpath_safe(char);
 
 fetchIO		*fetchIO_unopen(void *, ssize_t (*)(void *, void *, size_t),
     ssize_t (*)(void *, const void *, size_t), void (*)(void *));
+void		 fetchIO_set_splice(fetchIO *,
+    ssize_t (*)(void *, int, size_t));
 
 /*
  * I don't really like exporting http_request() and ftp_request(),
@@ -75,7 +75,9 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <locale.h>
+#include <poll.h>
 #include <stdarg.h>
 #ifndef NETBSD
 #include <nbcompat/stdio.h>
@@ -134,7 +136,7 @@ struct httpio
 {
 	conn_t		*conn;		/* connection */
 	int		 chunked;	/* chunked mode */
-	int		 keep_alive;	/* keep-alive mode */
+	int		 keep_alive;	/* keep-alive mode, -1 if batched */
 	char		*buf;		/* chunk buffer */
 	size_t		 bufsize;	/* size of chunk buffer */
 	ssize_t		 buflen;	/* amount of data currently in buffer */
@@ -143,6 +145,7 @@ struct httpio
 	int		 error;		/* error flag */
 	size_t		 chunksize;	/* remaining size of current chunk */
 	off_t		 contentlength;	/* remaining size of the content */
+	int		 pipefd[2];	/* pipe for splice(2) */
 };
 
 /*
@@ -262,6 +265,27 @@ http_fillbuf(struct httpio *io, size_t len)
 	return (io->buflen);
 }
 
+/*
+ * Read an identity encoded body directly into the caller's buffer
+ */
+static ssize_t
+http_readdirect(struct httpio *io, char *buf, size_t len)
+{
+	ssize_t rlen;
+
+	if (io->contentlength >= 0 && (off_t)len > io->contentlength)
+		len = io->contentlength;
+
+	if ((rlen = fetch_read(io->conn, buf, len)) == -1) {
+		io->error = 1;
+		return (-1);
+	}
+	if (io->contentlength)
+		io->contentlength -= rlen;
+
+	return (rlen);
+}
+
 /*
  * Read function
  */
@@ -269,6 +293,7 @@ static ssize_t
 http_readfn(void *v, void *buf, size_t len)
 {
 	struct httpio *io = (struct httpio *)v;
+	ssize_t rlen;
 	size_t l, pos;
 
 	if (io->error)
@@ -277,6 +302,14 @@ http_readfn(void *v, void *buf, size_t len)
 		return (0);
 
 	for (pos = 0; len > 0; pos += l, len -= l) {
+		/* no chunk decoding, skip the buffer */
+		if (!io->chunked && (!io->buf || io->bufpos == io->buflen)) {
+			if ((rlen = http_readdirect(io,
+			    (char *)buf + pos, len)) < 1)
+				break;
+			l = rlen;
+			continue;
+		}
 		/* empty buffer */
 		if (!io->buf || io->bufpos == io->buflen)
 			if (http_fillbuf(io, len) < 1)
@@ -293,6 +326,113 @@ http_readfn(void *v, void *buf, size_t len)
 	return (pos);
 }
 
+#ifdef HAVE_SPLICE
+/*
+ * Splice function, for identity encoded bodies without SSL
+ */
+static ssize_t
+http_splicefn(void *v, int fd, size_t len)
+{
+	struct httpio *io = (struct httpio *)v;
+	conn_t *conn = io->conn;
+	struct pollfd pfd;
+	ssize_t rlen, wlen;
+	size_t l;
+
+	if (io->error)
+		return (-1);
+	if (io->eof)
+		return (0);
+	if (io->chunked) {
+		errno = EOPNOTSUPP;
+		return (-1);
+	}
+#ifdef WITH_SSL
+	if (conn->ssl != NULL) {
+		errno = EOPNOTSUPP;
+		return (-1);
+	}
+#endif
+
+	/* data already read while parsing the headers */
+	if (io->buf && io->bufpos < io->buflen) {
+		l = io->buflen - io->bufpos;
+		if (len < l)
+			l = len;
+		if ((wlen = write(fd, io->buf + io->bufpos, l)) == -1)
+			return (-1);
+		io->bufpos += wlen;
+		return (wlen);
+	}
+	if (conn->next_len != 0) {
+		l = conn->next_len;
+		if (len < l)
+			l = len;
+		if (io->contentlength >= 0 && (off_t)l > io->contentlength)
+			l = io->contentlength;
+		if ((wlen = write(fd, conn->next_buf, l)) == -1)
+			return (-1);
+		conn->next_len -= wlen;
+		conn->next_buf += wlen;
+		if (io->contentlength)
+			io->contentlength -= wlen;
+		return (wlen);
+	}
+
+	if (io->contentlength >= 0 && (off_t)len > io->contentlength)
+		len = io->contentlength;
+	if (len == 0)
+		return (0);
+
+	if (io->pipefd[0] == -1) {
+		if (pipe(io->pipefd) == -1) {
+			io->pipefd[0] = io->pipefd[1] = -1;
+			return (-1);
+		}
+		/* as big as the requested size, if allowed */
+		(void)fcntl(io->pipefd[1], F_SETPIPE_SZ, (int)len);
+	}
+	for (;;) {
+		if (fetchTimeout) {
+			pfd.fd = conn->sd;
+			pfd.events = POLLIN;
+			switch (poll(&pfd, 1, fetchTimeout * 1000)) {
+			case 0:
+				errno = ETIMEDOUT;
+				/* FALLTHROUGH */
+			case -1:
+				if (errno == EINTR && fetchRestartCalls)
+					continue;
+				fetch_syserr();
+				io->error = 1;
+				return (-1);
+			}
+		}
+		rlen = splice(conn->sd, NULL, io->pipefd[1], NULL, len,
+		    SPLICE_F_MOVE|SPLICE_F_MORE);
+		if (rlen >= 0)
+			break;
+		if (errno != EINTR || !fetchRestartCalls) {
+			fetch_syserr();
+			io->error = 1;
+			return (-1);
+		}
+	}
+	for (l = 0; l < (size_t)rlen; l += wlen) {
+		wlen = splice(io->pipefd[0], NULL, fd, NULL, rlen - l,
+		    SPLICE_F_MOVE|SPLICE_F_MORE);
+		if (wlen <= 0) {
+			io->error = 1;
+			return (-1);
+		}
+	}
+	if (io->contentlength)
+		io->contentlength -= rlen;
+
+	return (rlen);
+}
+#endif
+
 /*
  * Write function
  */
@@ -312,7 +452,12 @@ http_closefn(void *v)
 {
 	struct httpio *io = (struct httpio *)v;
 
-	if (io->keep_alive) {
+	if (io->keep_alive == -1) {
+		/* the connection belongs to fetchXGetHTTPBatch() */
+	} else if (io->keep_alive && !io->error &&
+	    (io->chunked ? io->eof :
+	    io->contentlength == 0 && io->bufpos == io->buflen)) {
+		/* only reuse it if the whole reply has been read */
 		int val;
 
 		val = 0;
@@ -328,6 +473,10 @@ http_closefn(void *v)
 		fetch_close(io->conn);
 	}
 
+	if (io->pipefd[0] != -1) {
+		(void)close(io->pipefd[0]);
+		(void)close(io->pipefd[1]);
+	}
 	free(io->buf);
 	free(io);
 }
@@ -349,12 +498,16 @@ http_funopen(conn_t *conn, int chunked, int keep_alive, off_t clength)
 	io->chunked = chunked;
 	io->contentlength = clength;
 	io->keep_alive = keep_alive;
+	io->pipefd[0] = io->pipefd[1] = -1;
 	f = fetchIO_unopen(io, http_readfn, http_writefn, http_closefn);
 	if (f == NULL) {
 		fetch_syserr();
 		free(io);
 		return (NULL);
 	}
+#ifdef HAVE_SPLICE
+	fetchIO_set_splice(f, http_splicefn);
+#endif
 	return (f);
 }
 
@@ -781,6 +934,32 @@ http_get_proxy(struct url * url, const char *flags)
 	return (NULL);
 }
 
+/*
+ * Format the value of the Host header
+ */
+static char *
+http_host(struct url *url, char *hbuf, size_t len)
+{
+	char *host;
+
+	host = url->host;
+#ifdef INET6
+	if (strchr(url->host, ':')) {
+		snprintf(hbuf, len, "[%s]", url->host);
+		host = hbuf;
+	}
+#endif
+	if (url->port != fetch_default_port(url->scheme)) {
+		if (host != hbuf) {
+			strcpy(hbuf, host);
+			host = hbuf;
+		}
+		snprintf(hbuf + strlen(hbuf),
+		    len - strlen(hbuf), ":%d", url->port);
+	}
+	return (host);
+}
+
 static void
 set_if_modified_since(conn_t *conn, time_t last_modified)
 {
@@ -867,21 +1046,7 @@ http_request(struct url *URL, const char *op, struct url_stat *us,
 		if ((conn = http_connect(url, purl, flags, &cached)) == NULL)
 			goto ouch;
 
-		host = url->host;
-#ifdef INET6
-		if (strchr(url->host, ':')) {
-			snprintf(hbuf, sizeof(hbuf), "[%s]", url->host);
-			host = hbuf;
-		}
-#endif
-		if (url->port != fetch_default_port(url->scheme)) {
-			if (host != hbuf) {
-				strcpy(hbuf, host);
-				host = hbuf;
-			}
-			snprintf(hbuf + strlen(hbuf),
-			    sizeof(hbuf) - strlen(hbuf), ":%d", url->port);
-		}
+		host = http_host(url, hbuf, sizeof(hbuf));
 
 		/* send request */
 		if (verbose)
@@ -936,7 +1101,11 @@ http_request(struct url *URL, const char *op, struct url_stat *us,
 			http_cmd(conn, "User-Agent: %s\r\n", p);
 		else
 			http_cmd(conn, "User-Agent: %s\r\n", _LIBFETCH_VER);
-		if (url->offset > 0)
+		if (url->length > 0)
+			http_cmd(conn, "Range: bytes=%lld-%lld\r\n",
+			    (long long)url->offset,
+			    (long long)(url->offset + url->length - 1));
+		else if (url->offset > 0)
 			http_cmd(conn, "Range: bytes=%lld-\r\n", (long long)url->offset);
 		http_cmd(conn, "\r\n");
 
@@ -1133,7 +1302,9 @@ http_request(struct url *URL, const char *op, struct url_stat *us,
 		clength = length;
 	if (clength != -1)
 		length = offset + clength;
-	if (length != -1 && size != -1 && length != size) {
+	if (length != -1 && size != -1 && length != size &&
+	    (URL->length <= 0 || length > size)) {
+		/* only a bounded range may end before the document */
 		http_seterr(HTTP_PROTOCOL_ERROR);
 		goto ouch;
 	}
@@ -1239,6 +1410,188 @@ fetchPutHTTP(struct url *URL, const char *flags)
 	return (NULL);
 }
 
+/*
+ * Read the reply to a pipelined request, up to the beginning of its body
+ */
+static int
+http_batch_reply(conn_t *conn, struct url_stat *us, off_t *clength,
+    int *chunked, int *keep_alive)
+{
+	const char *p;
+	hdr_t h;
+	int code;
+
+	*clength = -1;
+	*chunked = 0;
+	us->size = -1;
+	us->atime = us->mtime = 0;
+
+	if ((code = http_get_reply(conn)) == -1 || code == HTTP_PROTOCOL_ERROR)
+		return (-1);
+	/* HTTP/1.1 connections are persistent by default */
+	*keep_alive = (strncmp(conn->buf, "HTTP/1.1", 8) == 0);
+
+	do {
+		switch ((h = http_next_header(conn, &p))) {
+		case hdr_syserror:
+		case hdr_error:
+			return (-1);
+		case hdr_connection:
+			if (strcasecmp(p, "close") == 0)
+				*keep_alive = 0;
+			else if (strcasecmp(p, "keep-alive") == 0)
+				*keep_alive = 1;
+			break;
+		case hdr_content_length:
+			http_parse_length(p, clength);
+			break;
+		case hdr_last_modified:
+			http_parse_mtime(p, &us->mtime);
+			us->atime = us->mtime;
+			break;
+		case hdr_transfer_encoding:
+			*chunked = (strcasecmp(p, "chunked") == 0);
+			break;
+		default:
+			break;
+		}
+	} while (h > hdr_end);
+
+	if (*chunked)
+		*clength = -1;
+	else if (code == HTTP_NOT_MODIFIED || code == 204 || code < 200)
+		*clength = 0;
+	else if (*clength == -1)
+		/* the body ends when the connection is closed */
+		*keep_alive = 0;
+	us->size = *clength;
+
+	return (code);
+}
+
+/*
+ * Retrieve several documents from the same server, keeping up to depth
+ * pipelined GET requests in flight on a single connection.
+ *
+ * For every document, in order, cb is called with a stream of its body;
+ * documents not returned with a 200 reply are skipped, and so are the
+ * remaining ones if the server closes the connection, so the caller
+ * must fetch again those that were not passed to cb. cb returns 0 to
+ * continue with the next document. Proxies and authentication are not
+ * supported (nothing is fetched).
+ *
+ * Returns 0, or -1 if the documents couldn't be requested at all.
+ */
+int
+fetchXGetHTTPBatch(struct url **urls, size_t nurls, int depth,
+    int (*cb)(size_t, fetchIO *, struct url_stat *, void *), void *cbarg,
+    const char *flags)
+{
+	conn_t *conn;
+	struct url *url, *purl;
+	struct url_stat us;
+	fetchIO *f;
+	off_t clength;
+	size_t i, sent, recvd;
+	ssize_t r;
+	const char *ua;
+	char buf[4096], hbuf[URL_HOSTLEN + 7], *host;
+	int cached, chunked, code, keep_alive, val, rv = 0;
+
+	if (nurls == 0)
+		return (0);
+	if (depth < 1)
+		depth = 1;
+
+	url = urls[0];
+	for (i = 0; i < nurls; i++) {
+		if (!urls[i]->port)
+			urls[i]->port = fetch_default_port(urls[i]->scheme);
+		if (strcmp(urls[i]->scheme, url->scheme) ||
+		    strcmp(urls[i]->host, url->host) ||
+		    urls[i]->port != url->port) {
+			errno = EINVAL;
+			fetch_syserr();
+			return (-1);
+		}
+		if (*urls[i]->user || *urls[i]->pwd)
+			return (0);
+	}
+	if ((purl = http_get_proxy(url, flags)) != NULL) {
+		fetchFreeURL(purl);
+		return (0);
+	}
+	if ((ua = getenv("HTTP_USER_AGENT")) == NULL || *ua == '\0')
+		ua = _LIBFETCH_VER;
+	host = http_host(url, hbuf, sizeof(hbuf));
+
+	if ((conn = http_connect(url, NULL, flags, &cached)) == NULL)
+		return (-1);
+	sent = recvd = 0;
+	keep_alive = 1;
+
+	while (recvd < nurls) {
+		/* keep the pipeline full */
+		while (keep_alive && sent < nurls && sent - recvd < (size_t)depth) {
+			if (http_cmd(conn, "GET %s HTTP/1.1\r\n"
+			    "Host: %s\r\nUser-Agent: %s\r\n"
+			    "Connection: keep-alive\r\n\r\n",
+			    urls[sent]->doc, host, ua) == -1) {
+				keep_alive = 0;
+				break;
+			}
+			if (sent++ == 0) {
+				val = 1;
+				setsockopt(conn->sd, IPPROTO_TCP, TCP_NODELAY,
+				    &val, sizeof(val));
+			}
+		}
+		if (sent == recvd)
+			break;
+
+		code = http_batch_reply(conn, &us, &clength, &chunked,
+		    &keep_alive);
+		if (code == -1) {
+			if (recvd == 0 && cached) {
+				/* stale cached connection, try a new one */
+				fetch_close(conn);
+				if ((conn = http_connect(url, NULL, flags,
+				    &cached)) == NULL)
+					return (-1);
+				sent = 0;
+				keep_alive = 1;
+				continue;
+			}
+			keep_alive = 0;
+			break;
+		}
+		if ((f = http_funopen(conn, chunked, -1, clength)) == NULL) {
+			keep_alive = 0;
+			rv = -1;
+			break;
+		}
+		if (code == HTTP_OK && (*cb)(recvd, f, &us, cbarg) != 0)
+			keep_alive = 0;
+		/* skip whatever is left of the body */
+		r = 0;
+		while (keep_alive && (r = fetchIO_read(f, buf, sizeof(buf))) > 0)
+			/* nothing */;
+		if (r == -1)
+			keep_alive = 0;
+		fetchIO_close(f);
+		recvd++;
+		/* no more replies after this one */
+		if (!keep_alive)
+			break;
+	}
+	if (keep_alive && sent == recvd)
+		fetch_cache_put(conn, fetch_close);
+	else
+		fetch_close(conn);
+
+	return (rv);
+}
+
 /*
  * Get an HTTP document's metadata
  */
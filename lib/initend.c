@@ -29,6 +29,7 @@
 #include <errno.h>
 #include <stdarg.h>
 #include <sys/utsname.h>
+#include <unistd.h>
 
 #include "xbps_api_impl.h"
 
@@ -92,28 +93,53 @@ xbps_init(struct xbps_handle *xhp)
 		CFG_STR_LIST(__UNCONST("targets"), NULL, CFGF_NONE),
 		CFG_END()
 	};
+	cfg_opt_t mirror_opts[] = {
+		CFG_STR_LIST(__UNCONST("mirrors"), NULL, CFGF_NONE),
+		CFG_END()
+	};
 	cfg_opt_t opts[] = {
 		/* Defaults if not set in configuration file */
 		CFG_STR(__UNCONST("rootdir"), __UNCONST("/"), CFGF_NONE),
 		CFG_STR(__UNCONST("cachedir"),
 		    __UNCONST(XBPS_CACHE_PATH), CFGF_NONE),
+		CFG_STR(__UNCONST("SharedCacheDir"), NULL, CFGF_NONE),
 		CFG_INT(__UNCONST("FetchCacheConnections"),
 		    XBPS_FETCH_CACHECONN, CFGF_NONE),
 		CFG_INT(__UNCONST("FetchCacheConnectionsPerHost"),
 		    XBPS_FETCH_CACHECONN_HOST, CFGF_NONE),
 		CFG_INT(__UNCONST("FetchTimeoutConnection"),
 		    XBPS_FETCH_TIMEOUT, CFGF_NONE),
+		CFG_INT(__UNCONST("FetchSegments"),
+		    XBPS_FETCH_SEGMENTS, CFGF_NONE),
+		CFG_INT(__UNCONST("FetchBufferSize"),
+		    XBPS_FETCH_BUFSIZE, CFGF_NONE),
+		CFG_INT(__UNCONST("FetchPipeline"),
+		    XBPS_FETCH_PIPELINE, CFGF_NONE),
+		CFG_INT(__UNCONST("FetchAsyncTransfers"),
+		    XBPS_FETCH_ASYNC, CFGF_NONE),
 		CFG_INT(__UNCONST("TransactionFrequencyFlush"),
 		    XBPS_TRANS_FLUSH, CFGF_NONE),
+		CFG_INT(__UNCONST("TransactionParallelUnpack"),
+		    XBPS_TRANS_PARALLEL_UNPACK, CFGF_NONE),
+		CFG_INT(__UNCONST("UnpackThreads"),
+		    XBPS_UNPACK_THREADS, CFGF_NONE),
 		CFG_BOOL(__UNCONST("syslog"), true, CFGF_NONE),
+		CFG_BOOL(__UNCONST("BinaryPlists"), false, CFGF_NONE),
+		CFG_BOOL(__UNCONST("UnpackSync"), true, CFGF_NONE),
+		CFG_BOOL(__UNCONST("PackageStore"), false, CFGF_NONE),
+		CFG_BOOL(__UNCONST("PackageStoreHardlinks"), false, CFGF_NONE),
+		CFG_BOOL(__UNCONST("FetchSessionCache"), false, CFGF_NONE),
 		CFG_STR_LIST(__UNCONST("repositories"), NULL, CFGF_MULTI),
 		CFG_STR_LIST(__UNCONST("PackagesOnHold"), NULL, CFGF_MULTI),
 		CFG_SEC(__UNCONST("virtual-package"),
 		    vpkg_opts, CFGF_MULTI|CFGF_TITLE),
+		CFG_SEC(__UNCONST("mirror-group"),
+		    mirror_opts, CFGF_MULTI|CFGF_TITLE),
 		CFG_FUNC(__UNCONST("include"), &cfg_include),
 		CFG_END()
 	};
 	struct utsname un;
+	long ncpus;
 	int rv, cc, cch;
 	bool syslog_enabled = false;
 
@@ -179,6 +205,14 @@ xbps_init(struct xbps_handle *xhp)
 		return ENOMEM;
 	xhp->cachedir = xhp->cachedir_priv;
 
+	if (xhp->shared_cachedir == NULL && xhp->cfg != NULL)
+		xhp->shared_cachedir = cfg_getstr(xhp->cfg, "SharedCacheDir");
+	if (xhp->shared_cachedir != NULL && xhp->shared_cachedir[0] != '/') {
+		xbps_dbg_printf(xhp, "SharedCacheDir must be a full path, "
+		    "ignoring `%s'.\n", xhp->shared_cachedir);
+		xhp->shared_cachedir = NULL;
+	}
+
 	if ((xhp->metadir_priv = set_metadir(xhp)) == NULL)
 		return ENOMEM;
 	xhp->metadir = xhp->metadir_priv;
@@ -189,33 +223,85 @@ xbps_init(struct xbps_handle *xhp)
 
 	if (xhp->cfg == NULL) {
 		xhp->flags |= XBPS_FLAG_SYSLOG;
+		xhp->flags |= XBPS_FLAG_UNPACK_SYNC;
 		xhp->fetch_timeout = XBPS_FETCH_TIMEOUT;
+		xhp->fetch_segments = XBPS_FETCH_SEGMENTS;
+		xhp->fetch_bufsize = XBPS_FETCH_BUFSIZE;
+		xhp->fetch_pipeline = XBPS_FETCH_PIPELINE;
+		xhp->fetch_async = XBPS_FETCH_ASYNC;
 		xhp->transaction_frequency_flush = XBPS_TRANS_FLUSH;
+		xhp->transaction_parallel_unpack = XBPS_TRANS_PARALLEL_UNPACK;
+		xhp->unpack_threads = XBPS_UNPACK_THREADS;
 		cc = XBPS_FETCH_CACHECONN;
 		cch = XBPS_FETCH_CACHECONN_HOST;
 	} else {
 		if (cfg_getbool(xhp->cfg, "syslog"))
 			xhp->flags |= XBPS_FLAG_SYSLOG;
+		if (cfg_getbool(xhp->cfg, "BinaryPlists"))
+			xhp->flags |= XBPS_FLAG_BINARY_PLISTS;
+		if (cfg_getbool(xhp->cfg, "UnpackSync"))
+			xhp->flags |= XBPS_FLAG_UNPACK_SYNC;
+		if (cfg_getbool(xhp->cfg, "PackageStore"))
+			xhp->flags |= XBPS_FLAG_PACKAGE_STORE;
+		if (cfg_getbool(xhp->cfg, "PackageStoreHardlinks"))
+			xhp->flags |= XBPS_FLAG_PACKAGE_STORE_LINKS;
+		if (cfg_getbool(xhp->cfg, "FetchSessionCache"))
+			xhp->flags |= XBPS_FLAG_FETCH_SESSIONS;
 		xhp->fetch_timeout = cfg_getint(xhp->cfg, "FetchTimeoutConnection");
+		xhp->fetch_segments = cfg_getint(xhp->cfg, "FetchSegments");
+		xhp->fetch_bufsize = cfg_getint(xhp->cfg, "FetchBufferSize");
+		xhp->fetch_pipeline = cfg_getint(xhp->cfg, "FetchPipeline");
+		xhp->fetch_async = cfg_getint(xhp->cfg, "FetchAsyncTransfers");
 		cc = cfg_getint(xhp->cfg, "FetchCacheConnections");
 		cch = cfg_getint(xhp->cfg, "FetchCacheConnectionsPerHost");
 		xhp->transaction_frequency_flush =
 		    cfg_getint(xhp->cfg, "TransactionFrequencyFlush");
+		xhp->transaction_parallel_unpack =
+		    cfg_getint(xhp->cfg, "TransactionParallelUnpack");
+		xhp->unpack_threads = cfg_getint(xhp->cfg, "UnpackThreads");
+	}
+	if (xhp->unpack_threads == 0) {
+		/*
+		 * One thread per online CPU, but always at least
+		 * two to overlap decompression with disk writes.
+		 */
+		ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+		if (ncpus < 2)
+			xhp->unpack_threads = 2;
+		else if (ncpus > 8)
+			xhp->unpack_threads = 8;
+		else
+			xhp->unpack_threads = (uint16_t)ncpus;
 	}
 	if (xhp->flags & XBPS_FLAG_SYSLOG)
 		syslog_enabled = true;
 
 	xbps_fetch_set_cache_connection(cc, cch);
+	xbps_fetch_load_sessions(xhp);
 
 	xbps_dbg_printf(xhp, "Rootdir=%s\n", xhp->rootdir);
 	xbps_dbg_printf(xhp, "Metadir=%s\n", xhp->metadir);
 	xbps_dbg_printf(xhp, "Cachedir=%s\n", xhp->cachedir);
+	if (xhp->shared_cachedir != NULL)
+		xbps_dbg_printf(xhp, "SharedCachedir=%s\n",
+		    xhp->shared_cachedir);
 	xbps_dbg_printf(xhp, "FetchTimeout=%u\n", xhp->fetch_timeout);
 	xbps_dbg_printf(xhp, "FetchCacheconn=%u\n", cc);
 	xbps_dbg_printf(xhp, "FetchCacheconnHost=%u\n", cch);
+	xbps_dbg_printf(xhp, "FetchSegments=%u\n", xhp->fetch_segments);
+	xbps_dbg_printf(xhp, "FetchBufferSize=%u\n", xhp->fetch_bufsize);
+	xbps_dbg_printf(xhp, "FetchPipeline=%u\n", xhp->fetch_pipeline);
+	xbps_dbg_printf(xhp, "FetchAsyncTransfers=%u\n", xhp->fetch_async);
+	xbps_dbg_printf(xhp, "FetchSessionCache=%u\n",
+	    (xhp->flags & XBPS_FLAG_FETCH_SESSIONS) ? 1 : 0);
 	xbps_dbg_printf(xhp, "Syslog=%u\n", syslog_enabled);
 	xbps_dbg_printf(xhp, "TransactionFrequencyFlush=%u\n",
 	    xhp->transaction_frequency_flush);
+	xbps_dbg_printf(xhp, "TransactionParallelUnpack=%u\n",
+	    xhp->transaction_parallel_unpack);
+	xbps_dbg_printf(xhp, "UnpackThreads=%u\n", xhp->unpack_threads);
+	xbps_dbg_printf(xhp, "PackageStore=%u\n",
+	    (xhp->flags & XBPS_FLAG_PACKAGE_STORE) ? 1 : 0);
 	xbps_dbg_printf(xhp, "Architecture: %s\n", xhp->un_machine);
 
 	xhp->initialized = true;
@@ -233,7 +319,11 @@ xbps_end(struct xbps_handle *xhp)
 
 	xbps_pkgdb_release(xhp);
 	xbps_rpool_release(xhp);
+	xbps_pkgpattern_cache_release(xhp);
+	xbps_version_cache_release(xhp);
+	xbps_mirrors_release(xhp);
 	xbps_fetch_unset_cache_connection();
+	xbps_fetch_release_sessions(xhp);
 
 	cfg_free(xhp->cfg);
 	free(xhp->cachedir_priv);
@@ -32,28 +32,16 @@
 
 /*
  * Returns true if entry is a configuration file, false otherwise.
+ * conf_files is a map of the "conf_files" array in props.plist.
  */
 int HIDDEN
-xbps_entry_is_a_conf_file(prop_dictionary_t propsd,
+xbps_entry_is_a_conf_file(struct xbps_strmap *conf_files,
 			  const char *entry_pname)
 {
-	prop_array_t array;
-	const char *cffile;
-	size_t i;
-
-	assert(prop_object_type(propsd) == PROP_TYPE_DICTIONARY);
+	assert(conf_files != NULL);
 	assert(entry_pname != NULL);
 
-	array = prop_dictionary_get(propsd, "conf_files");
-	if (array == NULL || prop_array_count(array) == 0)
-		return false;
-
-	for (i = 0; i < prop_array_count(array); i++) {
-		prop_array_get_cstring_nocopy(array, i, &cffile);
-		if (strcmp(cffile, entry_pname) == 0)
-			return true;
-	}
-	return false;
+	return xbps_strmap_find(conf_files, entry_pname, NULL);
 }
 
 /*
@@ -59,139 +59,74 @@
  * dictionary.
  */
 
-struct orphan_data {
-	prop_array_t array;
-	prop_array_t orphans_user;
-};
-
+/*
+ * Packages installed manually, or not fully installed or half removed,
+ * are the roots that keep their dependencies installed.
+ */
 static int
-find_orphan_pkg(struct xbps_handle *xhp,
-		prop_object_t obj,
-		void *arg,
-		bool *loop_done)
+orphan_root(struct xbps_handle *xhp, prop_dictionary_t pkgd, bool *root)
 {
-	struct orphan_data *od = arg;
-	prop_array_t reqby;
-	prop_object_t obj2;
-	prop_object_iterator_t iter;
-	const char *pkgdep, *curpkgname;
-	char *pkgdepname;
-	unsigned int ndep = 0, cnt = 0;
-	bool automatic = false;
-	size_t i;
-	int rv = 0;
 	pkg_state_t state;
+	bool automatic = false;
+	int rv;
 
 	(void)xhp;
-	(void)loop_done;
-	/*
-	 * Skip packages that were not installed automatically.
-	 */
-	prop_dictionary_get_bool(obj, "automatic-install", &automatic);
+
+	*root = true;
+
+	prop_dictionary_get_bool(pkgd, "automatic-install", &automatic);
 	if (!automatic)
 		return 0;
 
-	if ((rv = xbps_pkg_state_dictionary(obj, &state)) != 0)
+	if ((rv = xbps_pkg_state_dictionary(pkgd, &state)) != 0)
 		return rv;
-	/*
-	 * Skip packages that aren't fully installed or half removed.
-	 */
+
 	if (state != XBPS_PKG_STATE_INSTALLED &&
 	    state != XBPS_PKG_STATE_HALF_REMOVED)
 		return 0;
 
-	reqby = prop_dictionary_get(obj, "requiredby");
-	if (reqby == NULL || ((cnt = prop_array_count(reqby)) == 0)) {
-		/*
-		 * Add packages with empty or missing "requiredby" arrays.
-		 */
-		prop_array_add(od->array, obj);
-		return 0;
-	}
-	/*
-	 * Add packages that only have 1 entry matching any pkgname
-	 * object in the user supplied array of strings.
-	 */
-	if (od->orphans_user != NULL && cnt == 1) {
-		for (i = 0; i < prop_array_count(od->orphans_user); i++) {
-			prop_array_get_cstring_nocopy(od->orphans_user,
-			    i, &curpkgname);
-			if (xbps_match_pkgname_in_array(reqby, curpkgname)) {
-				prop_array_add(od->array, obj);
-				return 0;
-			}
-		}
-	}
-	iter = prop_array_iterator(reqby);
-	if (iter == NULL)
-		return ENOMEM;
-	/*
-	 * Iterate over the requiredby array and add current pkg
-	 * when all pkg dependencies are already in requiredby
-	 * or any pkgname object in the user supplied array of
-	 * strings match.
-	 */
-	while ((obj2 = prop_object_iterator_next(iter)) != NULL) {
-		pkgdep = prop_string_cstring_nocopy(obj2);
-		if (pkgdep == NULL) {
-			prop_object_iterator_release(iter);
-			return EINVAL;
-		}
-		if (xbps_find_pkg_in_array_by_pattern(xhp, od->array, pkgdep, NULL))
-			ndep++;
-		if (od->orphans_user == NULL)
-			continue;
-
-		pkgdepname = xbps_pkg_name(pkgdep);
-		if (pkgdepname == NULL) {
-			prop_object_iterator_release(iter);
-			return ENOMEM;
-		}
-		for (i = 0; i < prop_array_count(od->orphans_user); i++) {
-			prop_array_get_cstring_nocopy(od->orphans_user,
-			    i, &curpkgname);
-			if (strcmp(curpkgname, pkgdepname) == 0) {
-				ndep++;
-				break;
-			}
-		}
-		free(pkgdepname);
-	}
-	prop_object_iterator_release(iter);
-
-	if (ndep != cnt)
-		return 0;
-	if (!prop_array_add(od->array, obj))
-		return EINVAL;
-
+	*root = false;
 	return 0;
 }
 
 prop_array_t
 xbps_find_pkg_orphans(struct xbps_handle *xhp, prop_array_t orphans_user)
 {
-	prop_array_t array = NULL;
-	struct orphan_data od;
-	int rv = 0;
+	prop_array_t array;
+	prop_dictionary_t pkgd;
+	const char *pkgname;
+	unsigned int i;
+	int rv;
 
 	/*
-	 * Prepare an array with all packages previously found.
+	 * Mark all packages required directly or indirectly by the
+	 * roots; packages in orphans_user are treated as they were
+	 * already removed.
 	 */
-	if ((od.array = prop_array_create()) == NULL)
+	if ((rv = xbps_revdeps_mark(xhp, orphans_user, orphan_root)) != 0) {
+		errno = rv;
+		return NULL;
+	}
+	if ((array = prop_array_create()) == NULL)
 		return NULL;
 	/*
-	 * Find out all orphans by looking at pkgdb and iterating in reverse
+	 * Sweep: packages not marked are orphans, added in reverse
 	 * order in which packages were installed.
 	 */
-	od.orphans_user = orphans_user;
-	rv = xbps_pkgdb_foreach_reverse_cb(xhp, find_orphan_pkg, &od);
-	if (rv != 0) {
-		errno = rv;
-		prop_object_release(od.array);
-		return NULL;
+	for (i = prop_array_count(xhp->pkgdb); i > 0; i--) {
+		pkgd = prop_array_get(xhp->pkgdb, i - 1);
+		if (!prop_dictionary_get_cstring_nocopy(pkgd,
+		    "pkgname", &pkgname))
+			continue;
+		if (xbps_revdeps_marked(xhp, pkgname))
+			continue;
+		if (!prop_array_add(array, pkgd)) {
+			prop_object_release(array);
+			errno = EINVAL;
+			return NULL;
+		}
 	}
-	array = prop_array_copy(od.array);
 	prop_array_make_immutable(array);
-	prop_object_release(od.array);
+
 	return array;
 }
@@ -32,118 +32,204 @@
 #include <errno.h>
 #include <unistd.h>
 #include <libgen.h>
+#include <pthread.h>
 
 #include "xbps_api_impl.h"
 
-int HIDDEN
-xbps_remove_obsoletes(struct xbps_handle *xhp,
-		      const char *pkgname,
-		      const char *version,
-		      const char *pkgver,
-		      prop_dictionary_t oldd,
-		      prop_dictionary_t newd)
+/*
+ * Files whose hash is checked by every thread at once, and
+ * maximum number of threads to check obsolete files.
+ */
+#define OBSOLETES_PER_THREAD	32
+#define OBSOLETES_MAX_THREADS	16
+
+struct obsolete {
+	const char *file;
+	const char *sha256;
+	int rv;
+};
+
+struct obsolete_hash {
+	pthread_mutex_t mtx;
+	struct obsolete *obs;
+	size_t nobs;
+	size_t next;
+};
+
+/*
+ * Do not remove required symlinks for the system transition to /usr.
+ */
+static const char *usr_transition[] = {
+	"/bin", "/bin/", "/sbin", "/sbin/",
+	"/lib", "/lib/", "/lib64", "/lib64/", NULL
+};
+
+static void *
+obsolete_hash_thread(void *arg)
+{
+	struct obsolete_hash *oh = arg;
+	struct obsolete *ob;
+	char *file;
+	size_t i;
+
+	for (;;) {
+		pthread_mutex_lock(&oh->mtx);
+		i = oh->next++;
+		pthread_mutex_unlock(&oh->mtx);
+		if (i >= oh->nobs)
+			break;
+
+		ob = &oh->obs[i];
+		if (ob->sha256 == NULL) {
+			/* can't be verified, keep it */
+			ob->rv = ERANGE;
+			continue;
+		}
+		if ((file = xbps_xasprintf(".%s", ob->file)) == NULL) {
+			ob->rv = ENOMEM;
+			continue;
+		}
+		ob->rv = xbps_file_hash_check(file, ob->sha256);
+		free(file);
+	}
+	return NULL;
+}
+
+/*
+ * Checks the hash of all obsolete files in parallel; the result is
+ * stored in every entry.
+ */
+static void
+obsolete_hash_check(struct obsolete *obs, size_t nobs)
 {
-	prop_object_iterator_t iter, iter2;
-	prop_object_t obj, obj2;
-	prop_string_t oldstr, newstr;
+	struct obsolete_hash oh;
+	pthread_t thr[OBSOLETES_MAX_THREADS];
+	long ncpus;
+	size_t i, nthreads;
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	nthreads = nobs / OBSOLETES_PER_THREAD;
+	if (ncpus > 0 && nthreads > (size_t)ncpus)
+		nthreads = (size_t)ncpus;
+	if (nthreads > OBSOLETES_MAX_THREADS)
+		nthreads = OBSOLETES_MAX_THREADS;
+
+	memset(&oh, 0, sizeof(oh));
+	pthread_mutex_init(&oh.mtx, NULL);
+	oh.obs = obs;
+	oh.nobs = nobs;
+
+	/* this thread also checks files */
+	for (i = 1; i < nthreads; i++) {
+		if (pthread_create(&thr[i], NULL, obsolete_hash_thread, &oh))
+			break;
+	}
+	nthreads = i;
+	(void)obsolete_hash_thread(&oh);
+
+	for (i = 1; i < nthreads; i++)
+		pthread_join(thr[i], NULL);
+
+	pthread_mutex_destroy(&oh.mtx);
+}
+
+static int
+remove_obsoletes(struct xbps_handle *xhp,
+		 const char *pkgname,
+		 const char *version,
+		 const char *pkgver,
+		 prop_dictionary_t oldd,
+		 prop_dictionary_t newd,
+		 const char *key)
+{
+	prop_array_t olda, newa;
+	prop_object_t obj;
+	struct xbps_strmap *newfiles;
+	struct obsolete *obs;
 	struct stat st;
-	const char *array_str = "files";
-	const char *oldhash;
+	const char *str;
 	char *file;
+	size_t i, j, nobs = 0;
+	unsigned int cnt;
 	int rv = 0;
-	bool found, dodirs = false, dolinks = false;
-
-	assert(prop_object_type(oldd) == PROP_TYPE_DICTIONARY);
-	assert(prop_object_type(newd) == PROP_TYPE_DICTIONARY);
+	bool files = strcmp(key, "files") == 0;
 
-again:
-	iter = xbps_array_iter_from_dict(oldd, array_str);
-	if (iter == NULL)
-		goto out1;
-	iter2 = xbps_array_iter_from_dict(newd, array_str);
-	if (iter2 == NULL)
-		goto out1;
+	olda = prop_dictionary_get(oldd, key);
+	if ((cnt = prop_array_count(olda)) == 0)
+		return 0;
 
 	/*
-	 * Check for obsolete files, i.e files/links/dirs available in
-	 * the old package list not found in new package list.
+	 * Hash all files/links/dirs in the new package list, to look up
+	 * the entries in the old package list in constant time.
 	 */
-	while ((obj = prop_object_iterator_next(iter))) {
-		rv = 0;
-		found = false;
-		oldstr = prop_dictionary_get(obj, "file");
-		if (oldstr == NULL) {
-			rv = errno;
-			goto out;
+	newa = prop_dictionary_get(newd, key);
+	if ((newfiles = xbps_strmap_create(prop_array_count(newa))) == NULL)
+		return ENOMEM;
+	for (i = 0; i < prop_array_count(newa); i++) {
+		obj = prop_array_get(newa, i);
+		if (!prop_dictionary_get_cstring_nocopy(obj, "file", &str)) {
+			xbps_strmap_free(newfiles);
+			return EINVAL;
+		}
+		if ((rv = xbps_strmap_add(newfiles, str, NULL)) != 0) {
+			xbps_strmap_free(newfiles);
+			return rv;
 		}
-		file = xbps_xasprintf(".%s",
-		    prop_string_cstring_nocopy(oldstr));
-		if (file == NULL) {
-			rv = errno;
+	}
+	if ((obs = calloc(cnt, sizeof(*obs))) == NULL) {
+		xbps_strmap_free(newfiles);
+		return ENOMEM;
+	}
+	/*
+	 * Obsolete files are files/links/dirs available in the old
+	 * package list not found in the new package list.
+	 */
+	for (i = 0; i < cnt; i++) {
+		obj = prop_array_get(olda, i);
+		if (!prop_dictionary_get_cstring_nocopy(obj, "file", &str)) {
+			rv = EINVAL;
 			goto out;
 		}
-		if (strcmp(array_str, "files") == 0) {
+		if (xbps_strmap_find(newfiles, str, NULL))
+			continue;
+		for (j = 0; usr_transition[j] != NULL; j++)
+			if (strcmp(str, usr_transition[j]) == 0)
+				break;
+		if (usr_transition[j] != NULL)
+			continue;
+
+		obs[nobs].file = str;
+		if (files)
 			prop_dictionary_get_cstring_nocopy(obj,
-			    "sha256", &oldhash);
-			rv = xbps_file_hash_check(file, oldhash);
-			if (rv == ENOENT || rv == ERANGE) {
-				/*
-				 * Skip unexistent and files that do not
-				 * match the hash.
-				 */
-				free(file);
-				rv = 0;
-				continue;
-			}
-		} else if (strcmp(array_str, "links") == 0) {
+			    "sha256", &obs[nobs].sha256);
+		nobs++;
+	}
+	if (files && nobs > 0)
+		obsolete_hash_check(obs, nobs);
+
+	for (i = 0; i < nobs; i++) {
+		/*
+		 * Skip unexistent and files that do not match the hash.
+		 */
+		if (files && (obs[i].rv == ENOENT || obs[i].rv == ERANGE))
+			continue;
+
+		if ((file = xbps_xasprintf(".%s", obs[i].file)) == NULL) {
+			rv = ENOMEM;
+			goto out;
+		}
+		if (strcmp(key, "links") == 0) {
 			/*
 			 * Only remove dangling symlinks.
 			 */
-			if (stat(file, &st) == -1) {
-				if (errno != ENOENT) {
-					free(file);
-					rv = errno;
-					goto out;
-				}
-			} else {
+			if (stat(file, &st) == 0) {
 				free(file);
 				continue;
-			}
-		}
-
-		while ((obj2 = prop_object_iterator_next(iter2))) {
-			newstr = prop_dictionary_get(obj2, "file");
-			if (newstr == NULL) {
+			} else if (errno != ENOENT) {
 				rv = errno;
+				free(file);
 				goto out;
 			}
-			/*
-			 * Skip files with same path.
-			 */
-			if (prop_string_equals(oldstr, newstr)) {
-				found = true;
-				break;
-			}
-		}
-		prop_object_iterator_reset(iter2);
-		if (found) {
-			free(file);
-			continue;
-		}
-		/*
-		 * Do not remove required symlinks for the
-		 * system transition to /usr.
-		 */
-		if ((strcmp(file, "./bin") == 0) ||
-		    (strcmp(file, "./bin/") == 0) ||
-		    (strcmp(file, "./sbin") == 0) ||
-		    (strcmp(file, "./sbin/") == 0) ||
-		    (strcmp(file, "./lib") == 0) ||
-		    (strcmp(file, "./lib/") == 0) ||
-		    (strcmp(file, "./lib64/") == 0) ||
-		    (strcmp(file, "./lib64") == 0)) {
-			free(file);
-			continue;
 		}
 		/*
 		 * Obsolete obj found, remove it.
@@ -163,39 +249,34 @@ again:
 		    "%s: removed obsolete entry: %s", pkgver, file);
 		free(file);
 	}
-out1:
-	if (!dolinks) {
-		/*
-		 * Now look for obsolete links.
-		 */
-		dolinks = true;
-		array_str = "links";
-		if (iter2)
-			prop_object_iterator_release(iter2);
-		if (iter)
-			prop_object_iterator_release(iter);
-		iter2 = iter = NULL;
-		goto again;
-	}
-	if (!dodirs) {
-		/*
-		 * Look for obsolete dirs.
-		 */
-		dodirs = true;
-		array_str = "dirs";
-		if (iter2)
-			prop_object_iterator_release(iter2);
-		if (iter)
-			prop_object_iterator_release(iter);
-		iter2 = iter = NULL;
-		goto again;
-	}
-
 out:
-	if (iter2)
-		prop_object_iterator_release(iter2);
-	if (iter)
-		prop_object_iterator_release(iter);
+	free(obs);
+	xbps_strmap_free(newfiles);
+
+	return rv;
+}
+
+int HIDDEN
+xbps_remove_obsoletes(struct xbps_handle *xhp,
+		      const char *pkgname,
+		      const char *version,
+		      const char *pkgver,
+		      prop_dictionary_t oldd,
+		      prop_dictionary_t newd)
+{
+	const char *keys[] = { "files", "links", "dirs", NULL };
+	int i, rv = 0;
+
+	assert(prop_object_type(oldd) == PROP_TYPE_DICTIONARY);
+	assert(prop_object_type(newd) == PROP_TYPE_DICTIONARY);
 
+	for (i = 0; keys[i] != NULL; i++) {
+		rv = remove_obsoletes(xhp, pkgname, version, pkgver,
+		    oldd, newd, keys[i]);
+		if (rv != 0) {
+			errno = rv;
+			break;
+		}
+	}
 	return rv;
 }
@@ -98,17 +98,21 @@ add_pkg_into_reqby(struct xbps_handle *xhp,
 
 static int
 remove_pkg_from_reqby(struct xbps_handle *xhp,
-		      prop_object_t obj,
+		      const char *deppkgname,
+		      prop_dictionary_t deppkgd,
 		      void *arg,
 		      bool *loop_done)
 {
 	prop_array_t reqby;
 	const char *pkgname = arg;
 
-	(void)xhp;
+	(void)deppkgname;
 	(void)loop_done;
 
-	reqby = prop_dictionary_get(obj, "requiredby");
+	if (deppkgd == NULL)
+		return 0;
+
+	reqby = prop_dictionary_get(deppkgd, "requiredby");
 	if (reqby == NULL || prop_array_count(reqby) == 0)
 		return 0;
 
@@ -123,8 +127,20 @@ remove_pkg_from_reqby(struct xbps_handle *xhp,
 int HIDDEN
 xbps_requiredby_pkg_remove(struct xbps_handle *xhp, const char *pkgname)
 {
+	int rv;
+
 	assert(pkgname != NULL);
-	return xbps_pkgdb_foreach_cb(xhp, remove_pkg_from_reqby, __UNCONST(pkgname));
+
+	/*
+	 * Only the packages required by pkgname contain it in
+	 * their requiredby arrays.
+	 */
+	rv = xbps_revdeps_foreach_dep_cb(xhp, pkgname,
+	    remove_pkg_from_reqby, __UNCONST(pkgname));
+	if (rv == 0)
+		xbps_revdeps_unlink(xhp, pkgname);
+
+	return rv;
 }
 
 int HIDDEN
@@ -133,11 +149,12 @@ xbps_requiredby_pkg_add(struct xbps_handle *xhp, prop_dictionary_t pkgd)
 	prop_array_t pkg_rdeps;
 	prop_object_t obj, pkgd_pkgdb;
 	prop_object_iterator_t iter;
-	const char *pkgver, *str;
+	const char *pkgname, *pkgver, *str;
 	int rv = 0;
 
 	assert(prop_object_type(pkgd) == PROP_TYPE_DICTIONARY);
 
+	prop_dictionary_get_cstring_nocopy(pkgd, "pkgname", &pkgname);
 	prop_dictionary_get_cstring_nocopy(pkgd, "pkgver", &pkgver);
 	pkg_rdeps = prop_dictionary_get(pkgd, "run_depends");
 	if (pkg_rdeps == NULL || prop_array_count(pkg_rdeps) == 0)
@@ -156,27 +173,17 @@ xbps_requiredby_pkg_add(struct xbps_handle *xhp, prop_dictionary_t pkgd)
 		xbps_dbg_printf(xhp, "%s: adding reqby entry for %s\n",
 		    __func__, str);
 
-		pkgd_pkgdb = xbps_find_virtualpkg_conf_in_array_by_pattern(
-		    xhp, xhp->pkgdb, str);
+		pkgd_pkgdb = xbps_revdeps_resolve(xhp, str);
 		if (pkgd_pkgdb == NULL) {
-			pkgd_pkgdb =
-			    xbps_find_virtualpkg_in_array_by_pattern(
-			    xhp, xhp->pkgdb, str);
-			if (pkgd_pkgdb == NULL) {
-				pkgd_pkgdb = xbps_find_pkg_in_array_by_pattern(
-				    xhp, xhp->pkgdb, str, NULL);
-				if (pkgd_pkgdb == NULL) {
-					rv = ENOENT;
-					xbps_dbg_printf(xhp,
-					    "%s: couldnt find `%s' "
-					    "entry in pkgdb\n", __func__, str);
-					break;
-				}
-			}
+			rv = ENOENT;
+			xbps_dbg_printf(xhp, "%s: couldnt find `%s' "
+			    "entry in pkgdb\n", __func__, str);
+			break;
 		}
 		rv = add_pkg_into_reqby(xhp, pkgd_pkgdb, pkgver);
 		if (rv != 0)
 			break;
+		xbps_revdeps_link(xhp, pkgname, pkgd_pkgdb);
 	}
 	prop_object_iterator_release(iter);
 
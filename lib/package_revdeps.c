@@ -0,0 +1,679 @@
+/*-
+ * Copyright (c) 2012 Juan Romero Pardines.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "xbps_api_impl.h"
+
+/*
+ * In-memory reverse dependency graph of the package database.
+ *
+ * Every package in pkgdb is a node indexed by its pkgname, with the set
+ * of packages it requires and the set of packages requiring it. The
+ * graph is built once from the "requiredby" arrays stored in pkgdb,
+ * which remain the persistent representation; requiredby updates,
+ * orphan detection and reverse dependency lookups use the graph rather
+ * than matching strings against every pkgdb entry.
+ *
+ * All changes to pkgdb go through the hooks below to keep both in sync.
+ * If a hook fails the graph is released, it will be built again from
+ * pkgdb the next time it's needed.
+ */
+struct revdeps_edges {
+	struct revdeps_node **nodes;
+	size_t count;
+	size_t size;
+};
+
+#define NODE_MARKED	0x1
+#define NODE_REMOVED	0x2
+
+struct revdeps_node {
+	char *pkgname;
+	prop_dictionary_t pkgd;		/* NULL if not in pkgdb */
+	struct revdeps_edges deps;	/* packages required by pkgname */
+	struct revdeps_edges rdeps;	/* packages requiring pkgname */
+	unsigned int flags;		/* used by xbps_revdeps_mark() */
+};
+
+struct xbps_revdeps {
+	struct revdeps_node **slots;
+	size_t nslots;
+	struct revdeps_edges all;	/* all nodes, in insertion order */
+	struct revdeps_edges providers;	/* nodes providing virtual pkgs */
+};
+
+static int
+edges_add(struct revdeps_edges *e, struct revdeps_node *node)
+{
+	struct revdeps_node **nodes;
+	size_t size;
+
+	if (e->count == e->size) {
+		size = e->size ? e->size * 2 : 4;
+		nodes = realloc(e->nodes, size * sizeof(*nodes));
+		if (nodes == NULL)
+			return ENOMEM;
+		e->nodes = nodes;
+		e->size = size;
+	}
+	e->nodes[e->count++] = node;
+
+	return 0;
+}
+
+static bool
+edges_find(struct revdeps_edges *e, struct revdeps_node *node, size_t *idx)
+{
+	size_t i;
+
+	/* most removals are for the last added edge, look backwards */
+	for (i = e->count; i > 0; i--) {
+		if (e->nodes[i-1] == node) {
+			if (idx != NULL)
+				*idx = i-1;
+			return true;
+		}
+	}
+	return false;
+}
+
+static void
+edges_del(struct revdeps_edges *e, struct revdeps_node *node)
+{
+	size_t i;
+
+	if (!edges_find(e, node, &i))
+		return;
+
+	memmove(&e->nodes[i], &e->nodes[i+1],
+	    (e->count - i - 1) * sizeof(*e->nodes));
+	e->count--;
+}
+
+static struct revdeps_node *
+node_lookup(struct xbps_revdeps *rd, const char *pkgname)
+{
+	struct revdeps_node *node;
+	size_t slot;
+
+	if (rd->nslots == 0)
+		return NULL;
+
+	slot = xbps_strhash(pkgname) & (rd->nslots - 1);
+	while ((node = rd->slots[slot]) != NULL) {
+		if (strcmp(node->pkgname, pkgname) == 0)
+			return node;
+		slot = (slot + 1) & (rd->nslots - 1);
+	}
+	return NULL;
+}
+
+static int
+revdeps_grow(struct xbps_revdeps *rd)
+{
+	struct revdeps_node **slots, *node;
+	size_t i, nslots, slot;
+
+	nslots = rd->nslots ? rd->nslots * 2 : 256;
+	if ((slots = calloc(nslots, sizeof(*slots))) == NULL)
+		return ENOMEM;
+
+	for (i = 0; i < rd->all.count; i++) {
+		node = rd->all.nodes[i];
+		slot = xbps_strhash(node->pkgname) & (nslots - 1);
+		while (slots[slot] != NULL)
+			slot = (slot + 1) & (nslots - 1);
+		slots[slot] = node;
+	}
+	free(rd->slots);
+	rd->slots = slots;
+	rd->nslots = nslots;
+
+	return 0;
+}
+
+static struct revdeps_node *
+node_get(struct xbps_revdeps *rd, const char *pkgname)
+{
+	struct revdeps_node *node;
+	size_t slot;
+
+	if ((node = node_lookup(rd, pkgname)) != NULL)
+		return node;
+
+	if ((rd->all.count + 1) * 2 > rd->nslots) {
+		if ((errno = revdeps_grow(rd)) != 0)
+			return NULL;
+	}
+	if ((node = calloc(1, sizeof(*node))) == NULL)
+		return NULL;
+	if ((node->pkgname = strdup(pkgname)) == NULL) {
+		free(node);
+		return NULL;
+	}
+	if ((errno = edges_add(&rd->all, node)) != 0) {
+		free(node->pkgname);
+		free(node);
+		return NULL;
+	}
+	slot = xbps_strhash(pkgname) & (rd->nslots - 1);
+	while (rd->slots[slot] != NULL)
+		slot = (slot + 1) & (rd->nslots - 1);
+	rd->slots[slot] = node;
+
+	return node;
+}
+
+static int
+node_link(struct revdeps_node *from, struct revdeps_node *to)
+{
+	int rv;
+
+	if (edges_find(&from->deps, to, NULL))
+		return 0;
+	if ((rv = edges_add(&from->deps, to)) != 0)
+		return rv;
+	if ((rv = edges_add(&to->rdeps, from)) != 0) {
+		from->deps.count--;
+		return rv;
+	}
+	return 0;
+}
+
+static void
+node_unlink(struct revdeps_node *from, struct revdeps_node *to)
+{
+	edges_del(&from->deps, to);
+	edges_del(&to->rdeps, from);
+}
+
+static void
+revdeps_free(struct xbps_revdeps *rd)
+{
+	struct revdeps_node *node;
+	size_t i;
+
+	for (i = 0; i < rd->all.count; i++) {
+		node = rd->all.nodes[i];
+		free(node->deps.nodes);
+		free(node->rdeps.nodes);
+		free(node->pkgname);
+		free(node);
+	}
+	free(rd->all.nodes);
+	free(rd->providers.nodes);
+	free(rd->slots);
+	free(rd);
+}
+
+/*
+ * Binds pkgd to its node and syncs the incoming edges with its
+ * "requiredby" array.
+ */
+static int
+revdeps_set_pkgd(struct xbps_revdeps *rd, prop_dictionary_t pkgd)
+{
+	struct revdeps_node *node, *dep;
+	prop_array_t provides, reqby;
+	const char *pkgname, *pkgver;
+	char *rpkgname;
+	unsigned int i;
+	int rv;
+
+	if (!prop_dictionary_get_cstring_nocopy(pkgd, "pkgname", &pkgname))
+		return EINVAL;
+	if ((node = node_get(rd, pkgname)) == NULL)
+		return errno ? errno : ENOMEM;
+
+	node->pkgd = pkgd;
+
+	provides = prop_dictionary_get(pkgd, "provides");
+	if (prop_array_count(provides) == 0) {
+		edges_del(&rd->providers, node);
+	} else if (!edges_find(&rd->providers, node, NULL)) {
+		if ((rv = edges_add(&rd->providers, node)) != 0)
+			return rv;
+	}
+
+	while (node->rdeps.count > 0)
+		node_unlink(node->rdeps.nodes[node->rdeps.count-1], node);
+
+	reqby = prop_dictionary_get(pkgd, "requiredby");
+	for (i = 0; i < prop_array_count(reqby); i++) {
+		if (!prop_array_get_cstring_nocopy(reqby, i, &pkgver))
+			return EINVAL;
+		if ((rpkgname = xbps_pkg_name(pkgver)) == NULL)
+			return EINVAL;
+		dep = node_get(rd, rpkgname);
+		free(rpkgname);
+		if (dep == NULL)
+			return errno ? errno : ENOMEM;
+		if ((rv = node_link(dep, node)) != 0)
+			return rv;
+	}
+	return 0;
+}
+
+int HIDDEN
+xbps_revdeps_init(struct xbps_handle *xhp)
+{
+	struct xbps_revdeps *rd;
+	unsigned int i;
+	int rv;
+
+	assert(xhp != NULL);
+
+	if (xhp->revdeps != NULL)
+		return 0;
+
+	if ((rv = xbps_pkgdb_init(xhp)) != 0)
+		return rv;
+
+	if ((rd = calloc(1, sizeof(*rd))) == NULL)
+		return ENOMEM;
+
+	for (i = 0; i < prop_array_count(xhp->pkgdb); i++) {
+		rv = revdeps_set_pkgd(rd, prop_array_get(xhp->pkgdb, i));
+		if (rv != 0) {
+			xbps_dbg_printf(xhp, "[revdeps] failed to initialize: "
+			    "%s\n", strerror(rv));
+			revdeps_free(rd);
+			return rv;
+		}
+	}
+	xhp->revdeps = rd;
+	xbps_dbg_printf(xhp, "[revdeps] initialized ok (%zu nodes).\n",
+	    rd->all.count);
+
+	return 0;
+}
+
+void HIDDEN
+xbps_revdeps_release(struct xbps_handle *xhp)
+{
+	assert(xhp != NULL);
+
+	if (xhp->revdeps == NULL)
+		return;
+
+	revdeps_free(xhp->revdeps);
+	xhp->revdeps = NULL;
+	xbps_dbg_printf(xhp, "[revdeps] released ok.\n");
+}
+
+/*
+ * pkgdb has been internalized again with the same contents, only
+ * the package dictionaries bound to the nodes have to be updated.
+ */
+void HIDDEN
+xbps_revdeps_rebind(struct xbps_handle *xhp)
+{
+	struct xbps_revdeps *rd = xhp->revdeps;
+	struct revdeps_node *node;
+	prop_dictionary_t pkgd;
+	const char *pkgname;
+	unsigned int i;
+
+	if (rd == NULL)
+		return;
+
+	if (xhp->pkgdb == NULL) {
+		xbps_revdeps_release(xhp);
+		return;
+	}
+	for (i = 0; i < rd->all.count; i++)
+		rd->all.nodes[i]->pkgd = NULL;
+
+	for (i = 0; i < prop_array_count(xhp->pkgdb); i++) {
+		pkgd = prop_array_get(xhp->pkgdb, i);
+		if (!prop_dictionary_get_cstring_nocopy(pkgd,
+		    "pkgname", &pkgname) ||
+		    (node = node_lookup(rd, pkgname)) == NULL) {
+			xbps_revdeps_release(xhp);
+			return;
+		}
+		node->pkgd = pkgd;
+	}
+}
+
+void HIDDEN
+xbps_revdeps_set_pkgd(struct xbps_handle *xhp, prop_dictionary_t pkgd)
+{
+	int rv;
+
+	if (xhp->revdeps == NULL)
+		return;
+
+	if ((rv = revdeps_set_pkgd(xhp->revdeps, pkgd)) != 0) {
+		xbps_dbg_printf(xhp, "[revdeps] failed to update: %s\n",
+		    strerror(rv));
+		xbps_revdeps_release(xhp);
+	}
+}
+
+void HIDDEN
+xbps_revdeps_unset_pkgd(struct xbps_handle *xhp, prop_dictionary_t pkgd)
+{
+	struct revdeps_node *node;
+	const char *pkgname;
+
+	if (xhp->revdeps == NULL)
+		return;
+
+	if (!prop_dictionary_get_cstring_nocopy(pkgd, "pkgname", &pkgname))
+		return;
+	if ((node = node_lookup(xhp->revdeps, pkgname)) == NULL)
+		return;
+
+	/* its requiredby array is gone with the dictionary */
+	while (node->rdeps.count > 0)
+		node_unlink(node->rdeps.nodes[node->rdeps.count-1], node);
+
+	edges_del(&xhp->revdeps->providers, node);
+	node->pkgd = NULL;
+}
+
+/*
+ * Returns the pkgdb dictionary satisfying the dependency pattern;
+ * same order than xbps_find_virtualpkg_dict_installed() followed by
+ * xbps_find_pkg_dict_installed(), without looking at the pkg state.
+ */
+prop_dictionary_t HIDDEN
+xbps_revdeps_resolve(struct xbps_handle *xhp, const char *pattern)
+{
+	const struct xbps_pkgpattern *pp;
+	struct xbps_revdeps *rd;
+	struct revdeps_node *node;
+	prop_dictionary_t pkgd;
+	const char *pkgname, *pkgver;
+	size_t i;
+
+	assert(pattern != NULL);
+
+	if (xbps_revdeps_init(xhp) != 0)
+		return NULL;
+
+	rd = xhp->revdeps;
+
+	/* virtual package set by user in configuration file */
+	pkgd = xbps_find_virtualpkg_conf_in_array_by_pattern(xhp,
+	    xhp->pkgdb, pattern);
+	if (pkgd != NULL)
+		return pkgd;
+
+	/* any package providing a matching virtual package */
+	for (i = 0; i < rd->providers.count; i++) {
+		node = rd->providers.nodes[i];
+		if (node->pkgd != NULL &&
+		    xbps_match_virtual_pkg_in_dict(node->pkgd, pattern, true))
+			return node->pkgd;
+	}
+
+	/* real package */
+	if ((pp = xbps_pkgpattern_cached(xhp, pattern)) == NULL)
+		return NULL;
+	if ((pkgname = xbps_pkgpattern_compiled_name(pp)) == NULL)
+		return xbps_find_pkg_in_array_by_pattern(xhp,
+		    xhp->pkgdb, pattern, NULL);
+
+	if ((node = node_lookup(rd, pkgname)) == NULL || node->pkgd == NULL)
+		return NULL;
+	if (!prop_dictionary_get_cstring_nocopy(node->pkgd, "pkgver", &pkgver))
+		return NULL;
+	if (!xbps_pkgpattern_match_compiled(pkgver, pp))
+		return NULL;
+
+	return node->pkgd;
+}
+
+/*
+ * Registers that pkgname requires the package in deppkgd.
+ */
+void HIDDEN
+xbps_revdeps_link(struct xbps_handle *xhp,
+		  const char *pkgname,
+		  prop_dictionary_t deppkgd)
+{
+	struct revdeps_node *from, *to;
+	const char *deppkgname;
+	int rv = EINVAL;
+
+	if (xhp->revdeps == NULL)
+		return;
+
+	if (prop_dictionary_get_cstring_nocopy(deppkgd,
+	    "pkgname", &deppkgname)) {
+		if ((from = node_get(xhp->revdeps, pkgname)) == NULL ||
+		    (to = node_get(xhp->revdeps, deppkgname)) == NULL)
+			rv = errno ? errno : ENOMEM;
+		else
+			rv = node_link(from, to);
+	}
+	if (rv != 0) {
+		xbps_dbg_printf(xhp, "[revdeps] failed to update: %s\n",
+		    strerror(rv));
+		xbps_revdeps_release(xhp);
+	}
+}
+
+/*
+ * Unregisters all dependencies of pkgname.
+ */
+void HIDDEN
+xbps_revdeps_unlink(struct xbps_handle *xhp, const char *pkgname)
+{
+	struct revdeps_node *node;
+
+	if (xhp->revdeps == NULL)
+		return;
+
+	if ((node = node_lookup(xhp->revdeps, pkgname)) == NULL)
+		return;
+
+	while (node->deps.count > 0)
+		node_unlink(node, node->deps.nodes[node->deps.count-1]);
+}
+
+int HIDDEN
+xbps_revdeps_foreach_dep_cb(struct xbps_handle *xhp,
+			    const char *pkgname,
+			    int (*fn)(struct xbps_handle *, const char *,
+				      prop_dictionary_t, void *, bool *),
+			    void *arg)
+{
+	struct revdeps_node *node, *n;
+	size_t i;
+	int rv = 0;
+	bool done = false;
+
+	if ((rv = xbps_revdeps_init(xhp)) != 0)
+		return rv;
+
+	if ((node = node_lookup(xhp->revdeps, pkgname)) == NULL)
+		return 0;
+
+	for (i = 0; i < node->deps.count; i++) {
+		n = node->deps.nodes[i];
+		rv = (*fn)(xhp, n->pkgname, n->pkgd, arg, &done);
+		if (rv != 0 || done)
+			break;
+	}
+	return rv;
+}
+
+static struct revdeps_node *
+lookup_removed(struct xbps_handle *xhp, const char *name)
+{
+	struct xbps_revdeps *rd = xhp->revdeps;
+	struct revdeps_node *node;
+	prop_dictionary_t pkgd;
+	const char *pkgname;
+	size_t i;
+
+	if ((node = node_lookup(rd, name)) != NULL && node->pkgd != NULL)
+		return node;
+
+	/* virtual package set by user in configuration file */
+	pkgd = xbps_find_virtualpkg_conf_in_array_by_name(xhp,
+	    xhp->pkgdb, name);
+	if (pkgd != NULL) {
+		prop_dictionary_get_cstring_nocopy(pkgd, "pkgname", &pkgname);
+		return node_lookup(rd, pkgname);
+	}
+	/* any package providing the virtual package */
+	for (i = 0; i < rd->providers.count; i++) {
+		node = rd->providers.nodes[i];
+		if (node->pkgd != NULL &&
+		    xbps_match_virtual_pkg_in_dict(node->pkgd, name, false))
+			return node;
+	}
+	return NULL;
+}
+
+/*
+ * Marks all packages that are kept installed: the roots accepted by
+ * fn and all packages required by them, following the graph from the
+ * roots in linear time. Packages not in pkgdb but still registered
+ * as reverse dependencies are roots.
+ *
+ * Packages in the removed array (pkgnames or virtual package names)
+ * are treated as already removed: they can be marked but do not keep
+ * their dependencies installed.
+ */
+int HIDDEN
+xbps_revdeps_mark(struct xbps_handle *xhp,
+		  prop_array_t removed,
+		  int (*fn)(struct xbps_handle *, prop_dictionary_t, bool *))
+{
+	struct xbps_revdeps *rd;
+	struct revdeps_node *node, *dep, **stack;
+	const char *name;
+	size_t i, n = 0;
+	int rv;
+	bool root;
+
+	if ((rv = xbps_revdeps_init(xhp)) != 0)
+		return rv;
+
+	rd = xhp->revdeps;
+	for (i = 0; i < rd->all.count; i++)
+		rd->all.nodes[i]->flags = 0;
+
+	for (i = 0; i < prop_array_count(removed); i++) {
+		if (!prop_array_get_cstring_nocopy(removed, i, &name))
+			return EINVAL;
+		if ((node = lookup_removed(xhp, name)) != NULL)
+			node->flags |= NODE_REMOVED;
+	}
+
+	/* every node is pushed once, when it's marked */
+	if ((stack = malloc((rd->all.count + 1) * sizeof(*stack))) == NULL)
+		return ENOMEM;
+
+	for (i = 0; i < rd->all.count; i++) {
+		node = rd->all.nodes[i];
+		root = true;
+		if (node->pkgd != NULL &&
+		    (rv = (*fn)(xhp, node->pkgd, &root)) != 0) {
+			free(stack);
+			return rv;
+		}
+		if (!root)
+			continue;
+		node->flags |= NODE_MARKED;
+		stack[n++] = node;
+	}
+	while (n > 0) {
+		node = stack[--n];
+		if (node->flags & NODE_REMOVED)
+			continue;
+		for (i = 0; i < node->deps.count; i++) {
+			dep = node->deps.nodes[i];
+			if (dep->flags & NODE_MARKED)
+				continue;
+			dep->flags |= NODE_MARKED;
+			stack[n++] = dep;
+		}
+	}
+	free(stack);
+
+	return 0;
+}
+
+bool HIDDEN
+xbps_revdeps_marked(struct xbps_handle *xhp, const char *pkgname)
+{
+	struct revdeps_node *node;
+
+	assert(xhp->revdeps != NULL);
+
+	if ((node = node_lookup(xhp->revdeps, pkgname)) == NULL)
+		return false;
+
+	return (node->flags & NODE_MARKED);
+}
+
+prop_array_t
+xbps_pkgdb_get_pkg_revdeps(struct xbps_handle *xhp, const char *pkgname)
+{
+	struct revdeps_node *node;
+	prop_array_t array;
+	const char *pkgver;
+	size_t i;
+	int rv;
+
+	assert(pkgname != NULL);
+
+	if ((rv = xbps_revdeps_init(xhp)) != 0) {
+		errno = rv;
+		return NULL;
+	}
+	node = node_lookup(xhp->revdeps, pkgname);
+	if (node == NULL || node->pkgd == NULL) {
+		errno = ENOENT;
+		return NULL;
+	}
+	if ((array = prop_array_create()) == NULL)
+		return NULL;
+
+	for (i = 0; i < node->rdeps.count; i++) {
+		if (node->rdeps.nodes[i]->pkgd == NULL)
+			continue;
+		if (!prop_dictionary_get_cstring_nocopy(
+		    node->rdeps.nodes[i]->pkgd, "pkgver", &pkgver))
+			continue;
+		if (!prop_array_add_cstring(array, pkgver)) {
+			prop_object_release(array);
+			errno = EINVAL;
+			return NULL;
+		}
+	}
+	return array;
+}
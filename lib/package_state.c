@@ -221,6 +221,7 @@ xbps_set_pkg_state_installed(struct xbps_handle *xhp,
 				return rv;
 		}
 	}
+	xbps_revdeps_set_pkgd(xhp, pkgd);
 
 	return rv;
 }
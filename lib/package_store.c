@@ -0,0 +1,628 @@
+/*-
+ * Copyright (c) 2012 Juan Romero Pardines.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_COPY_FILE_RANGE
+# define _GNU_SOURCE	/* for copy_file_range(2) */
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+
+#ifdef HAVE_FICLONE
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+#include "xbps_api_impl.h"
+
+/*
+ * Extracted package store.
+ *
+ * If XBPS_FLAG_PACKAGE_STORE is set, the contents of every unpacked
+ * binary package are kept in <cachedir>/store:
+ *
+ * 	objects/<xx>/<sha256>	File contents, addressed by its SHA256.
+ * 	pkgs/<sha256>.plist	Manifest of a binary package, addressed
+ * 				by the SHA256 of the binary package file.
+ *
+ * The manifest contains the files.plist and props.plist dictionaries
+ * and all archive entries in order, so that the package can be
+ * unpacked again without reading (and decompressing) the binary
+ * package. Files are copied out of the store with a reflink or
+ * copy_file_range(2) if possible, or hardlinked if
+ * XBPS_FLAG_PACKAGE_STORE_LINKS is set and the object has the same
+ * mode and owner than the entry. Configuration and mutable files are
+ * always copied: they can be modified in place, and a hardlink would
+ * change the object shared by every rootdir using the store. The size
+ * and SHA256 of all objects of a package are checked before using its
+ * manifest.
+ *
+ * The store is only a cache: failing to populate it is not an error.
+ */
+#define STORE_COPY_BUFSIZ	(64 * 1024)
+
+static char *
+store_object_path(struct xbps_handle *xhp, const char *sha256)
+{
+	return xbps_xasprintf("%s/store/objects/%.2s/%s",
+	    xhp->cachedir, sha256, sha256);
+}
+
+static char *
+store_manifest_path(struct xbps_handle *xhp, prop_dictionary_t pkg_repod)
+{
+	const char *sha256;
+
+	if (!prop_dictionary_get_cstring_nocopy(pkg_repod,
+	    "filename-sha256", &sha256)) {
+		errno = ENOENT;
+		return NULL;
+	}
+	return xbps_xasprintf("%s/store/pkgs/%s.plist",
+	    xhp->cachedir, sha256);
+}
+
+static int
+store_mkparent(const char *path)
+{
+	char *dirc;
+	int rv = 0;
+
+	if ((dirc = strdup(path)) == NULL)
+		return ENOMEM;
+	if (xbps_mkpath(dirname(dirc), 0755) == -1 && errno != EEXIST)
+		rv = errno;
+	free(dirc);
+
+	return rv;
+}
+
+/*
+ * Copies all data from ifd into ofd: with a reflink if supported by
+ * the filesystem, otherwise with copy_file_range(2) or read/write.
+ */
+static int
+copy_data(int ifd, int ofd)
+{
+	char *buf;
+	ssize_t r, w, off;
+
+#ifdef HAVE_FICLONE
+	if (ioctl(ofd, FICLONE, ifd) == 0)
+		return 0;
+#endif
+#ifdef HAVE_COPY_FILE_RANGE
+	for (;;) {
+		r = copy_file_range(ifd, NULL, ofd, NULL, SSIZE_MAX, 0);
+		if (r == 0)
+			return 0;
+		else if (r == -1)
+			break;
+	}
+	if (errno != EXDEV && errno != ENOSYS &&
+	    errno != EINVAL && errno != EOPNOTSUPP)
+		return errno;
+	/* not supported, continue from current offsets */
+#endif
+	if ((buf = malloc(STORE_COPY_BUFSIZ)) == NULL)
+		return ENOMEM;
+
+	while ((r = read(ifd, buf, STORE_COPY_BUFSIZ)) > 0) {
+		for (off = 0; off < r; off += w) {
+			if ((w = write(ofd, buf + off, r - off)) == -1) {
+				free(buf);
+				return errno;
+			}
+		}
+	}
+	free(buf);
+
+	return r == -1 ? errno : 0;
+}
+
+/*
+ * Copies src into the file opened at ofd (path dst), setting the
+ * mode, owner and modification time from st.
+ */
+static int
+copy_file(const char *src, int ofd, const char *dst, const struct stat *st)
+{
+	struct timeval tv[2];
+	int ifd, rv;
+
+	if ((ifd = open(src, O_RDONLY)) == -1)
+		return errno;
+
+	rv = copy_data(ifd, ofd);
+	(void)close(ifd);
+	if (rv != 0)
+		return rv;
+
+	/* chown(2) first, it may clear the setuid/setgid bits */
+	if (geteuid() == 0 && fchown(ofd, st->st_uid, st->st_gid) == -1)
+		return errno;
+	if (fchmod(ofd, st->st_mode & 07777) == -1)
+		return errno;
+
+	tv[0].tv_sec = tv[1].tv_sec = st->st_mtime;
+	tv[0].tv_usec = tv[1].tv_usec = 0;
+	if (utimes(dst, tv) == -1)
+		return errno;
+
+	return 0;
+}
+
+int HIDDEN
+xbps_store_add_file(struct xbps_handle *xhp,
+		    const char *file,
+		    const char *sha256,
+		    const struct stat *st)
+{
+	char *obj, *tmp;
+	int fd, rv;
+
+	assert(file != NULL);
+	assert(sha256 != NULL);
+	assert(st != NULL);
+
+	if ((obj = store_object_path(xhp, sha256)) == NULL)
+		return ENOMEM;
+	if (access(obj, F_OK) == 0) {
+		/* already in the store */
+		free(obj);
+		return 0;
+	}
+	if ((rv = store_mkparent(obj)) != 0) {
+		free(obj);
+		return rv;
+	}
+	if ((tmp = xbps_xasprintf("%s.XXXXXX", obj)) == NULL) {
+		free(obj);
+		return ENOMEM;
+	}
+	if ((fd = mkstemp(tmp)) == -1) {
+		rv = errno;
+		free(tmp);
+		free(obj);
+		return rv;
+	}
+	rv = copy_file(file, fd, tmp, st);
+	(void)close(fd);
+	if (rv == 0 && rename(tmp, obj) == -1)
+		rv = errno;
+	if (rv != 0)
+		(void)unlink(tmp);
+
+	free(tmp);
+	free(obj);
+
+	return rv;
+}
+
+int HIDDEN
+xbps_store_copy_file(struct xbps_handle *xhp,
+		     const char *sha256,
+		     const char *dst,
+		     const struct stat *st,
+		     bool mutable)
+{
+	struct stat objst;
+	char *obj;
+	int fd, rv;
+
+	assert(sha256 != NULL);
+	assert(dst != NULL);
+	assert(st != NULL);
+
+	if ((obj = store_object_path(xhp, sha256)) == NULL)
+		return ENOMEM;
+	if (stat(obj, &objst) == -1) {
+		rv = errno;
+		free(obj);
+		return rv;
+	}
+	(void)unlink(dst);
+	/*
+	 * Hardlink the object if its metadata matches and the file
+	 * is not expected to be modified in place.
+	 */
+	if (!mutable && (xhp->flags & XBPS_FLAG_PACKAGE_STORE_LINKS) &&
+	    (objst.st_mode & 07777) == (st->st_mode & 07777) &&
+	    objst.st_uid == st->st_uid && objst.st_gid == st->st_gid) {
+		if (link(obj, dst) == 0) {
+			free(obj);
+			return 0;
+		}
+		xbps_dbg_printf(xhp, "store: cannot link `%s' to `%s': "
+		    "%s\n", obj, dst, strerror(errno));
+	}
+	if ((fd = open(dst, O_WRONLY|O_CREAT|O_TRUNC, 0600)) == -1) {
+		rv = errno;
+		free(obj);
+		return rv;
+	}
+	rv = copy_file(obj, fd, dst, st);
+	(void)close(fd);
+	free(obj);
+
+	return rv;
+}
+
+int HIDDEN
+xbps_store_add_entry(prop_array_t entries, struct archive_entry *entry)
+{
+	prop_dictionary_t d;
+	const char *target;
+	mode_t mode;
+	bool rv = true;
+
+	assert(prop_object_type(entries) == PROP_TYPE_ARRAY);
+	assert(entry != NULL);
+
+	if ((d = prop_dictionary_create()) == NULL)
+		return ENOMEM;
+
+	mode = archive_entry_mode(entry);
+	rv &= prop_dictionary_set_cstring(d, "file",
+	    archive_entry_pathname(entry));
+	rv &= prop_dictionary_set_uint32(d, "mode", mode);
+	rv &= prop_dictionary_set_uint32(d, "uid", archive_entry_uid(entry));
+	rv &= prop_dictionary_set_uint32(d, "gid", archive_entry_gid(entry));
+	rv &= prop_dictionary_set_uint64(d, "mtime",
+	    (uint64_t)archive_entry_mtime(entry));
+	if (archive_entry_size(entry) > 0)
+		rv &= prop_dictionary_set_uint64(d, "size",
+		    (uint64_t)archive_entry_size(entry));
+
+	if ((target = archive_entry_hardlink(entry)) != NULL) {
+		rv &= prop_dictionary_set_cstring_nocopy(d, "type", "hardlink");
+		rv &= prop_dictionary_set_cstring(d, "target", target);
+	} else if (S_ISLNK(mode)) {
+		rv &= prop_dictionary_set_cstring_nocopy(d, "type", "link");
+		rv &= prop_dictionary_set_cstring(d, "target",
+		    archive_entry_symlink(entry));
+	} else {
+		rv &= prop_dictionary_set_cstring_nocopy(d, "type", "file");
+	}
+	if (rv)
+		rv = prop_array_add(entries, d);
+
+	prop_object_release(d);
+
+	return rv ? 0 : EINVAL;
+}
+
+static void
+store_entry_stat(prop_dictionary_t d, struct stat *st)
+{
+	uint64_t mtime = 0;
+	uint32_t mode = 0, uid = 0, gid = 0;
+
+	prop_dictionary_get_uint32(d, "mode", &mode);
+	prop_dictionary_get_uint32(d, "uid", &uid);
+	prop_dictionary_get_uint32(d, "gid", &gid);
+	prop_dictionary_get_uint64(d, "mtime", &mtime);
+
+	memset(st, 0, sizeof(*st));
+	st->st_mode = (mode_t)mode;
+	st->st_uid = (uid_t)uid;
+	st->st_gid = (gid_t)gid;
+	st->st_mtime = (time_t)mtime;
+}
+
+struct archive_entry HIDDEN *
+xbps_store_archive_entry(prop_dictionary_t d)
+{
+	struct archive_entry *entry;
+	struct stat st;
+	const char *file, *type, *target = NULL;
+	uint64_t size = 0;
+
+	assert(prop_object_type(d) == PROP_TYPE_DICTIONARY);
+
+	if (!prop_dictionary_get_cstring_nocopy(d, "file", &file) ||
+	    !prop_dictionary_get_cstring_nocopy(d, "type", &type)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	prop_dictionary_get_cstring_nocopy(d, "target", &target);
+	prop_dictionary_get_uint64(d, "size", &size);
+	store_entry_stat(d, &st);
+
+	if ((entry = archive_entry_new()) == NULL)
+		return NULL;
+
+	archive_entry_set_pathname(entry, file);
+	archive_entry_set_mode(entry, st.st_mode);
+	archive_entry_set_uid(entry, st.st_uid);
+	archive_entry_set_gid(entry, st.st_gid);
+	archive_entry_set_mtime(entry, st.st_mtime, 0);
+	archive_entry_set_size(entry, (int64_t)size);
+	if (strcmp(type, "hardlink") == 0)
+		archive_entry_set_hardlink(entry, target);
+	else if (strcmp(type, "link") == 0)
+		archive_entry_set_symlink(entry, target);
+
+	return entry;
+}
+
+int HIDDEN
+xbps_store_extract_entry(struct xbps_handle *xhp,
+			 prop_dictionary_t d,
+			 struct archive_entry *entry,
+			 bool mutable)
+{
+	const struct stat *st;
+	const char *file, *target, *sha256;
+	int rv;
+
+	assert(prop_object_type(d) == PROP_TYPE_DICTIONARY);
+	assert(entry != NULL);
+
+	file = archive_entry_pathname(entry);
+	st = archive_entry_stat(entry);
+	if ((rv = store_mkparent(file)) != 0)
+		return rv;
+
+	if ((target = archive_entry_hardlink(entry)) != NULL) {
+		(void)unlink(file);
+		if (link(target, file) == -1)
+			return errno;
+	} else if ((target = archive_entry_symlink(entry)) != NULL) {
+		(void)unlink(file);
+		if (symlink(target, file) == -1)
+			return errno;
+		if (geteuid() == 0 &&
+		    lchown(file, st->st_uid, st->st_gid) == -1)
+			return errno;
+	} else {
+		if (!prop_dictionary_get_cstring_nocopy(d,
+		    "sha256", &sha256))
+			return ENOENT;
+		rv = xbps_store_copy_file(xhp, sha256, file, st, mutable);
+	}
+	return rv;
+}
+
+/*
+ * Checks the size and SHA256 of all objects used by a manifest; an
+ * object that doesn't match is removed from the store, it will be
+ * added again the next time the package is unpacked from its binary
+ * package.
+ */
+static int
+store_check_objects(struct xbps_handle *xhp, prop_array_t entries)
+{
+	prop_dictionary_t d;
+	struct stat st;
+	const char *type, *sha256;
+	char *obj, *hash;
+	uint64_t size;
+	unsigned int i, cnt;
+	int rv = 0;
+
+	cnt = prop_array_count(entries);
+	for (i = 0; i < cnt && rv == 0; i++) {
+		d = prop_array_get(entries, i);
+		if (!prop_dictionary_get_cstring_nocopy(d, "type", &type) ||
+		    strcmp(type, "file") ||
+		    !prop_dictionary_get_cstring_nocopy(d, "sha256", &sha256))
+			continue;
+
+		size = 0;
+		prop_dictionary_get_uint64(d, "size", &size);
+		if ((obj = store_object_path(xhp, sha256)) == NULL)
+			return ENOMEM;
+		if (stat(obj, &st) == -1) {
+			rv = errno;
+			xbps_dbg_printf(xhp, "store: missing object `%s': "
+			    "%s\n", obj, strerror(rv));
+			free(obj);
+			break;
+		}
+		hash = NULL;
+		if ((uint64_t)st.st_size != size ||
+		    (hash = xbps_file_hash(obj)) == NULL ||
+		    strcmp(hash, sha256)) {
+			xbps_dbg_printf(xhp, "store: object `%s' was "
+			    "modified, removing it.\n", obj);
+			(void)unlink(obj);
+			rv = ESTALE;
+		}
+		free(hash);
+		free(obj);
+	}
+	return rv;
+}
+
+prop_dictionary_t HIDDEN
+xbps_store_get_manifest(struct xbps_handle *xhp, prop_dictionary_t pkg_repod)
+{
+	prop_dictionary_t manifest;
+	char *plist;
+	int rv;
+
+	if ((plist = store_manifest_path(xhp, pkg_repod)) == NULL)
+		return NULL;
+
+	manifest = prop_dictionary_internalize_from_zfile(plist);
+	free(plist);
+	if (manifest == NULL)
+		return NULL;
+
+	if (prop_dictionary_get(manifest, "entries") == NULL ||
+	    prop_dictionary_get(manifest, XBPS_PKGFILES) == NULL ||
+	    prop_dictionary_get(manifest, XBPS_PKGPROPS) == NULL) {
+		prop_object_release(manifest);
+		errno = EINVAL;
+		return NULL;
+	}
+	if ((rv = store_check_objects(xhp,
+	    prop_dictionary_get(manifest, "entries"))) != 0) {
+		prop_object_release(manifest);
+		errno = rv;
+		return NULL;
+	}
+	return manifest;
+}
+
+/*
+ * Adds the files of an unpacked package into the store and writes
+ * its manifest. Must be called at rootdir: package files are read
+ * from their installed location and INSTALL/REMOVE from the package
+ * metadir.
+ */
+int HIDDEN
+xbps_store_add_pkg(struct xbps_handle *xhp,
+		   prop_dictionary_t pkg_repod,
+		   prop_array_t entries,
+		   prop_dictionary_t filesd,
+		   prop_dictionary_t propsd)
+{
+	prop_dictionary_t manifest = NULL, d;
+	struct xbps_strmap *files_hash = NULL, *conf_files_hash = NULL;
+	struct stat st;
+	const void *sha256;
+	const char *pkgname, *file, *type;
+	char *path = NULL, *hash = NULL, *plist = NULL, *tmp = NULL;
+	unsigned int i;
+	int fd, rv = 0;
+
+	assert(prop_object_type(entries) == PROP_TYPE_ARRAY);
+
+	prop_dictionary_get_cstring_nocopy(pkg_repod, "pkgname", &pkgname);
+
+	files_hash = xbps_strmap_from_array(
+	    prop_dictionary_get(filesd, "files"), "file", "sha256");
+	conf_files_hash = xbps_strmap_from_array(
+	    prop_dictionary_get(filesd, "conf_files"), "file", "sha256");
+	if (files_hash == NULL || conf_files_hash == NULL) {
+		rv = ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < prop_array_count(entries); i++) {
+		d = prop_array_get(entries, i);
+		prop_dictionary_get_cstring_nocopy(d, "type", &type);
+		if (strcmp(type, "file"))
+			continue;
+
+		prop_dictionary_get_cstring_nocopy(d, "file", &file);
+		sha256 = NULL;
+		if (strcmp(file, "./INSTALL") == 0 ||
+		    strcmp(file, "./REMOVE") == 0) {
+			path = xbps_xasprintf("%s/metadata/%s/%s",
+			    XBPS_META_PATH, pkgname, file + 2);
+		} else {
+			if (!xbps_strmap_find(files_hash, file + 1, &sha256))
+				xbps_strmap_find(conf_files_hash,
+				    file + 1, &sha256);
+			path = strdup(file);
+		}
+		if (path == NULL) {
+			rv = ENOMEM;
+			goto out;
+		}
+		if ((hash = xbps_file_hash(path)) == NULL) {
+			rv = errno;
+			goto out;
+		}
+		/*
+		 * Configuration files kept or modified by the user must
+		 * not be stored; check every file against its hash.
+		 */
+		if (sha256 != NULL && strcmp(sha256, hash)) {
+			xbps_dbg_printf(xhp, "store: `%s' does not match "
+			    "the package contents, not storing.\n", path);
+			rv = ERANGE;
+			goto out;
+		}
+		if (!prop_dictionary_set_cstring(d, "sha256", hash)) {
+			rv = EINVAL;
+			goto out;
+		}
+		store_entry_stat(d, &st);
+		if ((rv = xbps_store_add_file(xhp, path, hash, &st)) != 0)
+			goto out;
+
+		free(hash);
+		free(path);
+		hash = path = NULL;
+	}
+	/*
+	 * Write the manifest atomically.
+	 */
+	if ((manifest = prop_dictionary_create()) == NULL) {
+		rv = ENOMEM;
+		goto out;
+	}
+	if (!prop_dictionary_set(manifest, "entries", entries) ||
+	    !prop_dictionary_set(manifest, XBPS_PKGFILES, filesd) ||
+	    !prop_dictionary_set(manifest, XBPS_PKGPROPS, propsd)) {
+		rv = EINVAL;
+		goto out;
+	}
+	if ((plist = store_manifest_path(xhp, pkg_repod)) == NULL) {
+		rv = errno;
+		goto out;
+	}
+	if ((rv = store_mkparent(plist)) != 0)
+		goto out;
+	if ((tmp = xbps_xasprintf("%s.XXXXXX", plist)) == NULL) {
+		rv = ENOMEM;
+		goto out;
+	}
+	if ((fd = mkstemp(tmp)) == -1) {
+		rv = errno;
+		goto out;
+	}
+	(void)close(fd);
+	if (!xbps_dictionary_externalize_to_file(xhp, manifest, tmp, true) ||
+	    rename(tmp, plist) == -1) {
+		rv = errno;
+		(void)unlink(tmp);
+		goto out;
+	}
+	xbps_dbg_printf(xhp, "store: added `%s'.\n", plist);
+out:
+	if (manifest != NULL)
+		prop_object_release(manifest);
+	xbps_strmap_free(files_hash);
+	xbps_strmap_free(conf_files_hash);
+	free(hash);
+	free(path);
+	free(plist);
+	free(tmp);
+
+	return rv;
+}
@@ -32,9 +32,16 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <libgen.h>
+#include <pthread.h>
 
 #include "xbps_api_impl.h"
 
+/*
+ * Independent packages may be unpacked concurrently in a transaction:
+ * package state changes in pkgdb and INSTALL scripts are serialized.
+ */
+static pthread_mutex_t unpack_mtx = PTHREAD_MUTEX_INITIALIZER;
+
 static int
 set_extract_flags(void)
 {
@@ -48,9 +55,14 @@ set_extract_flags(void)
 	return flags;
 }
 
+/*
+ * Extracts INSTALL or REMOVE into pkg's metadir, from the archive
+ * or from the package store if ar is NULL.
+ */
 static int
 extract_metafile(struct xbps_handle *xhp,
 		 struct archive *ar,
+		 prop_dictionary_t stored,
 		 struct archive_entry *entry,
 		 const char *file,
 		 const char *pkgver,
@@ -99,8 +111,12 @@ extract_metafile(struct xbps_handle *xhp,
 	if (exec)
 		archive_entry_set_perm(entry, 0750);
 
-	if (archive_read_extract(ar, entry, flags) != 0) {
+	if (ar == NULL)
+		rv = xbps_store_extract_entry(xhp, stored, entry, false);
+	else if ((rv = archive_read_extract(ar, entry, flags)) != 0)
 		rv = archive_errno(ar);
+
+	if (rv != 0) {
 		xbps_set_cb_state(xhp, XBPS_STATE_UNPACK_FAIL,
 		    rv, pkgname, version,
 		    "%s: [unpack] failed to extract metafile `%s': %s",
@@ -154,33 +170,374 @@ remove_metafile(struct xbps_handle *xhp,
 	return 0;
 }
 
+/*
+ * Waits until all entries queued to the writer threads have been
+ * written and reports the first error, if any.
+ */
+static int
+unpack_pipeline_drain(struct xbps_handle *xhp,
+		      struct xbps_unpack_pipeline *up,
+		      const char *pkgname,
+		      const char *version,
+		      const char *pkgver)
+{
+	const char *errfile;
+	int rv;
+
+	if (up == NULL)
+		return 0;
+
+	if ((rv = xbps_unpack_pipeline_wait(up, &errfile)) != 0) {
+		xbps_set_cb_state(xhp, XBPS_STATE_UNPACK_FAIL,
+		    rv, pkgname, version,
+		    "%s: [unpack] failed to extract file `%s': %s",
+		    pkgver, errfile, strerror(rv));
+	}
+	return rv;
+}
+
+/*
+ * Renames all extracted files into place.
+ */
+static int
+unpack_sync_commit(struct xbps_handle *xhp,
+		   struct xbps_unpack_sync *sync,
+		   const char *pkgname,
+		   const char *version,
+		   const char *pkgver)
+{
+	const char *errfile = NULL;
+	int rv;
+
+	if ((rv = xbps_unpack_sync_commit(sync, &errfile)) != 0) {
+		xbps_set_cb_state(xhp, XBPS_STATE_UNPACK_FAIL,
+		    rv, pkgname, version,
+		    "%s: [unpack] failed to move file `%s' into place: %s",
+		    pkgver, errfile, strerror(rv));
+	}
+	return rv;
+}
+
+/*
+ * Records entry in the package store manifest; the package is not
+ * added to the store if that fails.
+ */
+static void
+store_add_entry(prop_array_t *entries, struct archive_entry *entry)
+{
+	if (*entries == NULL)
+		return;
+
+	if (xbps_store_add_entry(*entries, entry) != 0) {
+		prop_object_release(*entries);
+		*entries = NULL;
+	}
+}
+
+static int
+unpack_chdir(struct xbps_handle *xhp,
+	     const char *pkgname,
+	     const char *version,
+	     const char *pkgver)
+{
+	if (access(xhp->rootdir, R_OK) == -1) {
+		if (errno != ENOENT)
+			return errno;
+		if (xbps_mkpath(xhp->rootdir, 0750) == -1)
+			return errno;
+	}
+	if (chdir(xhp->rootdir) == -1) {
+		xbps_set_cb_state(xhp, XBPS_STATE_UNPACK_FAIL,
+		    errno, pkgname, version,
+		    "%s: [unpack] failed to chdir to rootdir `%s': %s",
+		    pkgver, xhp->rootdir, strerror(errno));
+		return errno;
+	}
+	return 0;
+}
+
+/*
+ * Checks the hash of the existing file of a regular file entry. If it
+ * matches only the entry perms are set, and extract is set to false.
+ * Also called by the writer threads of the unpack pipeline.
+ */
+int HIDDEN
+xbps_unpack_entry_hash_check(struct xbps_handle *xhp,
+			     struct xbps_strmap *hashes,
+			     struct archive_entry *entry,
+			     const char *pkgname,
+			     const char *version,
+			     bool *extract)
+{
+	const struct stat *entry_statp;
+	const void *sha256 = NULL;
+	const char *entry_pname, *file;
+	int rv;
+
+	*extract = true;
+	entry_statp = archive_entry_stat(entry);
+	entry_pname = archive_entry_pathname(entry);
+
+	file = strchr(entry_pname, '.') + 1;
+	xbps_strmap_find(hashes, file, &sha256);
+	if (sha256 == NULL)
+		rv = 1; /* no match, file not found */
+	else
+		rv = xbps_file_hash_check_rootdir(xhp, file, sha256);
+
+	if (rv == -1) {
+		/* error */
+		xbps_dbg_printf(xhp, "%s-%s: failed to check"
+		    " hash for `%s': %s\n", pkgname, version,
+		    entry_pname, strerror(errno));
+		return errno ? errno : EINVAL;
+	} else if (rv == 0) {
+		/*
+		 * Always set entry perms in existing
+		 * file, even when hash is matched.
+		 */
+		if (chmod(entry_pname, entry_statp->st_mode) != 0) {
+			xbps_dbg_printf(xhp, "%s-%s: failed "
+			    "to set perms %s to %s: %s\n",
+			    pkgname, version,
+			    archive_entry_strmode(entry),
+			    entry_pname, strerror(errno));
+			return EINVAL;
+		}
+		xbps_dbg_printf(xhp, "%s-%s: entry %s perms "
+		    "to %s.\n", pkgname, version, entry_pname,
+		    archive_entry_strmode(entry));
+		/*
+		 * hash match, skip extraction.
+		 */
+		xbps_dbg_printf(xhp, "%s-%s: entry %s "
+		    "matches current SHA256, skipping...\n",
+		    pkgname, version, entry_pname);
+		*extract = false;
+	}
+	return 0;
+}
+
+/*
+ * Checks if a regular file must be extracted over the existing file,
+ * and handles configuration files. Sets extract to false if the
+ * current file must be kept.
+ */
+static int
+unpack_entry_check(struct xbps_handle *xhp,
+		   prop_dictionary_t filesd,
+		   struct xbps_strmap *hashes,
+		   struct archive_entry *entry,
+		   struct xbps_unpack_cb_data *xucd,
+		   const char *pkgname,
+		   const char *version,
+		   bool conf_file,
+		   bool update,
+		   bool *extract)
+{
+	const struct stat *entry_statp;
+	const char *entry_pname;
+	char *buf;
+	struct stat st;
+	int rv;
+
+	*extract = true;
+	entry_statp = archive_entry_stat(entry);
+	entry_pname = archive_entry_pathname(entry);
+	/*
+	 * Always check that extracted file exists and hash
+	 * doesn't match, in that case overwrite the file.
+	 * Otherwise skip extracting it.
+	 */
+	if (!S_ISREG(entry_statp->st_mode) || stat(entry_pname, &st) == -1)
+		return 0;
+
+	rv = xbps_unpack_entry_hash_check(xhp, hashes, entry,
+	    pkgname, version, extract);
+	if (rv != 0 || !*extract)
+		return rv;
+	if (!conf_file)
+		return 0;
+
+	if (!update) {
+		/*
+		 * If installing new package preserve old configuration
+		 * file but renaming it to <file>.old.
+		 */
+		buf = xbps_xasprintf("%s.old", entry_pname);
+		assert(buf);
+		(void)rename(entry_pname, buf);
+		free(buf);
+		xbps_set_cb_state(xhp,
+		    XBPS_STATE_CONFIG_FILE, 0,
+		    pkgname, version,
+		    "Renamed old configuration file "
+		    "`%s' to `%s.old'.", entry_pname, entry_pname);
+	} else {
+		/*
+		 * Handle configuration files. Check if current entry is
+		 * a configuration file and take action if required. Skip
+		 * packages that don't have the "conf_files" array in
+		 * the XBPS_PKGPROPS dictionary.
+		 */
+		if (xhp->unpack_cb != NULL)
+			xucd->entry_is_conf = true;
+
+		rv = xbps_entry_install_conf_file(xhp, filesd,
+		    entry, entry_pname, pkgname, version);
+		if (rv == -1) {
+			/* error */
+			return errno ? errno : EINVAL;
+		} else if (rv == 0) {
+			/*
+			 * Keep current configuration file
+			 * as is now and pass to next entry.
+			 */
+			*extract = false;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Removes obsolete files and writes the package metadata files,
+ * once all package files have been unpacked.
+ */
+static int
+unpack_metadata(struct xbps_handle *xhp,
+		prop_dictionary_t pkg_repod,
+		prop_dictionary_t filesd,
+		prop_dictionary_t propsd)
+{
+	prop_dictionary_t old_filesd;
+	const char *transact, *pkgname, *version, *pkgver;
+	char *buf, *pkgfilesd = NULL, *pkgpropsd = NULL;
+	bool preserve, skip_obsoletes, softreplace, update;
+	int rv = 0;
+
+	preserve = skip_obsoletes = softreplace = false;
+	prop_dictionary_get_bool(pkg_repod, "preserve", &preserve);
+	prop_dictionary_get_bool(pkg_repod, "skip-obsoletes", &skip_obsoletes);
+	prop_dictionary_get_bool(pkg_repod, "softreplace", &softreplace);
+	prop_dictionary_get_cstring_nocopy(pkg_repod,
+	    "transaction", &transact);
+	prop_dictionary_get_cstring_nocopy(pkg_repod, "pkgname", &pkgname);
+	prop_dictionary_get_cstring_nocopy(pkg_repod, "version", &version);
+	prop_dictionary_get_cstring_nocopy(pkg_repod, "pkgver", &pkgver);
+	update = strcmp(transact, "update") == 0;
+
+	/*
+	 * Skip checking for obsolete files on:
+	 * 	- New package installation without "softreplace" keyword.
+	 * 	- Package with "preserve" keyword.
+	 * 	- Package with "skip-obsoletes" keyword.
+	 */
+	pkgfilesd = xbps_xasprintf("%s/metadata/%s/%s",
+	    XBPS_META_PATH, pkgname, XBPS_PKGFILES);
+	if (pkgfilesd == NULL) {
+		rv = ENOMEM;
+		goto out;
+	}
+	if (skip_obsoletes || preserve || (!softreplace && !update))
+		goto out1;
+	/*
+	 * Check for obsolete files on:
+	 * 	- Package upgrade.
+	 * 	- Package with "softreplace" keyword.
+	 */
+	old_filesd = prop_dictionary_internalize_from_zfile(pkgfilesd);
+	if (prop_object_type(old_filesd) == PROP_TYPE_DICTIONARY) {
+		rv = xbps_remove_obsoletes(xhp, pkgname, version,
+		    pkgver, old_filesd, filesd);
+		prop_object_release(old_filesd);
+		if (rv != 0) {
+			rv = errno;
+			goto out;
+		}
+	} else if (errno && errno != ENOENT) {
+		rv = errno;
+		goto out;
+	}
+out1:
+	/*
+	 * Create pkg metadata directory.
+	 */
+	buf = xbps_xasprintf("%s/metadata/%s", XBPS_META_PATH, pkgname);
+	if (buf == NULL) {
+		rv = ENOMEM;
+		goto out;
+	}
+	if (xbps_mkpath(buf, 0755) == -1) {
+		xbps_set_cb_state(xhp, XBPS_STATE_UNPACK_FAIL,
+		    errno, pkgname, version,
+		    "%s: [unpack] failed to create pkg metadir `%s': %s",
+		    buf, pkgver, strerror(errno));
+		free(buf);
+		rv = errno;
+		goto out;
+	}
+	free(buf);
+	/*
+	 * Externalize XBPS_PKGFILES and XBPS_PKGPROPS into pkg's
+	 * metadata directory.
+	 */
+	if (!xbps_dictionary_externalize_to_file(xhp, filesd,
+	    pkgfilesd, false)) {
+		rv = errno;
+		xbps_set_cb_state(xhp, XBPS_STATE_UNPACK_FAIL,
+		    errno, pkgname, version,
+		    "%s: [unpack] failed to extract metadata file `%s': %s",
+		    pkgver, XBPS_PKGFILES, strerror(errno));
+		goto out;
+	}
+	pkgpropsd = xbps_xasprintf("%s/metadata/%s/%s",
+	    XBPS_META_PATH, pkgname, XBPS_PKGPROPS);
+	if (pkgpropsd == NULL) {
+		rv = ENOMEM;
+		goto out;
+	}
+	if (!xbps_dictionary_externalize_to_file(xhp, propsd,
+	    pkgpropsd, false)) {
+		rv = errno;
+		xbps_set_cb_state(xhp, XBPS_STATE_UNPACK_FAIL,
+		    errno, pkgname, version,
+		    "%s: [unpack] failed to extract metadata file `%s': %s",
+		    pkgver, XBPS_PKGPROPS, strerror(errno));
+		goto out;
+	}
+out:
+	free(pkgfilesd);
+	free(pkgpropsd);
+
+	return rv;
+}
+
 static int
 unpack_archive(struct xbps_handle *xhp,
 	       prop_dictionary_t pkg_repod,
 	       struct archive *ar)
 {
-	prop_dictionary_t propsd = NULL, filesd = NULL, old_filesd = NULL;
-	prop_array_t array;
+	prop_dictionary_t propsd = NULL, filesd = NULL;
+	prop_array_t array, store_entries = NULL;
+	struct xbps_strmap *conf_files = NULL, *files_hash = NULL;
+	struct xbps_strmap *conf_files_hash = NULL;
+	struct xbps_unpack_pipeline *up = NULL;
+	struct xbps_unpack_sync *sync = NULL;
 	const struct stat *entry_statp;
-	struct stat st;
 	struct xbps_unpack_cb_data xucd;
 	struct archive_entry *entry;
 	size_t entry_idx = 0;
 	const char *entry_pname, *transact, *pkgname, *version, *pkgver, *fname;
-	char *buf = NULL, *pkgfilesd = NULL, *pkgpropsd = NULL;
-	int ar_rv, rv, flags;
-	bool preserve, update, conf_file, file_exists, skip_obsoletes;
-	bool softreplace;
+	char *buf = NULL;
+	int ar_rv, rv, flags, store_rv;
+	bool update, conf_file, extract, pipeline;
 
 	assert(prop_object_type(pkg_repod) == PROP_TYPE_DICTIONARY);
 	assert(ar != NULL);
 
-	preserve = update = conf_file = file_exists = false;
-	skip_obsoletes = softreplace = false;
+	update = conf_file = false;
+	pipeline = xhp->unpack_threads > 1;
 
-	prop_dictionary_get_bool(pkg_repod, "preserve", &preserve);
-	prop_dictionary_get_bool(pkg_repod, "skip-obsoletes", &skip_obsoletes);
-	prop_dictionary_get_bool(pkg_repod, "softreplace", &softreplace);
 	prop_dictionary_get_cstring_nocopy(pkg_repod,
 	    "transaction", &transact);
 	prop_dictionary_get_cstring_nocopy(pkg_repod, "pkgname", &pkgname);
@@ -192,26 +549,20 @@ unpack_archive(struct xbps_handle *xhp,
 		/* initialize data for unpack cb */
 		memset(&xucd, 0, sizeof(xucd));
 	}
-	if (access(xhp->rootdir, R_OK) == -1) {
-		if (errno != ENOENT) {
-			rv = errno;
-			goto out;
-		}
-		if (xbps_mkpath(xhp->rootdir, 0750) == -1) {
-			rv = errno;
-			goto out;
-		}
-	}
-	if (chdir(xhp->rootdir) == -1) {
-		xbps_set_cb_state(xhp, XBPS_STATE_UNPACK_FAIL,
-		    errno, pkgname, version,
-		    "%s: [unpack] failed to chdir to rootdir `%s': %s",
-		    pkgver, xhp->rootdir, strerror(errno));
-		rv = errno;
+	if ((rv = unpack_chdir(xhp, pkgname, version, pkgver)) != 0)
+		goto out;
+	if ((sync = xbps_unpack_sync_create(xhp)) == NULL) {
+		rv = ENOMEM;
 		goto out;
 	}
 	if (strcmp(transact, "update") == 0)
 		update = true;
+	/*
+	 * Record all entries to add the package to the store.
+	 */
+	if (xhp->flags & XBPS_FLAG_PACKAGE_STORE)
+		store_entries = prop_array_create();
+
 	/*
 	 * Always remove current INSTALL/REMOVE scripts in pkg's metadir,
 	 * as security measures.
@@ -255,20 +606,28 @@ unpack_archive(struct xbps_handle *xhp,
 			 * Extract the INSTALL script first to execute
 			 * the pre install target.
 			 */
+			rv = unpack_pipeline_drain(xhp, up,
+			    pkgname, version, pkgver);
+			if (rv != 0)
+				goto out;
+
 			buf = xbps_xasprintf("%s/metadata/%s/INSTALL",
 			    XBPS_META_PATH, pkgname);
 			if (buf == NULL) {
 				rv = ENOMEM;
 				goto out;
 			}
-			rv = extract_metafile(xhp, ar, entry,
+			store_add_entry(&store_entries, entry);
+			rv = extract_metafile(xhp, ar, NULL, entry,
 			    "INSTALL", pkgver, true, flags);
 			if (rv != 0)
 				goto out;
 
+			pthread_mutex_lock(&unpack_mtx);
 			rv = xbps_file_exec(xhp, buf, "pre",
 			     pkgname, version, update ? "yes" : "no",
 			     xhp->conffile, NULL);
+			pthread_mutex_unlock(&unpack_mtx);
 			free(buf);
 			buf = NULL;
 			if (rv != 0) {
@@ -283,7 +642,8 @@ unpack_archive(struct xbps_handle *xhp,
 			continue;
 
 		} else if (strcmp("./REMOVE", entry_pname) == 0) {
-			rv = extract_metafile(xhp, ar, entry,
+			store_add_entry(&store_entries, entry);
+			rv = extract_metafile(xhp, ar, NULL, entry,
 			    "REMOVE", pkgver, true, flags);
 			if (rv != 0)
 				goto out;
@@ -335,6 +695,32 @@ unpack_archive(struct xbps_handle *xhp,
 			entry_idx++;
 			continue;
 		}
+		/*
+		 * Index configuration files and the expected hash of
+		 * files by path, to check every entry in constant time.
+		 */
+		if (files_hash == NULL) {
+			conf_files = xbps_strmap_from_array(
+			    prop_dictionary_get(propsd, "conf_files"),
+			    NULL, NULL);
+			files_hash = xbps_strmap_from_array(
+			    prop_dictionary_get(filesd, "files"),
+			    "file", "sha256");
+			conf_files_hash = xbps_strmap_from_array(
+			    prop_dictionary_get(filesd, "conf_files"),
+			    "file", "sha256");
+			if (conf_files == NULL || files_hash == NULL ||
+			    conf_files_hash == NULL) {
+				rv = ENOMEM;
+				goto out;
+			}
+			/*
+			 * Remove temporary files of a previous unpack
+			 * that was interrupted before renaming them.
+			 */
+			if ((rv = xbps_unpack_sync_clean(sync, filesd)) != 0)
+				goto out;
+		}
 		/*
 		 * Compute total entries in progress data, if set.
 		 * total_entries = files + conf_files + links.
@@ -351,103 +737,80 @@ unpack_archive(struct xbps_handle *xhp,
 			xucd.entry_total_count +=
 			    (ssize_t)prop_array_count(array);
 		}
-		/*
-		 * Always check that extracted file exists and hash
-		 * doesn't match, in that case overwrite the file.
-		 * Otherwise skip extracting it.
-		 */
-		conf_file = file_exists = false;
+		store_add_entry(&store_entries, entry);
+		conf_file = false;
 		if (S_ISREG(entry_statp->st_mode)) {
 			buf = strchr(entry_pname, '.') + 1;
 			assert(buf != NULL);
-			if (xbps_entry_is_a_conf_file(propsd, buf))
+			if (xbps_entry_is_a_conf_file(conf_files, buf))
 				conf_file = true;
-			if (stat(entry_pname, &st) == 0) {
-				file_exists = true;
-				rv = xbps_file_hash_check_dictionary(xhp, filesd,
-				    conf_file ? "conf_files" : "files", buf);
-
-				if (rv == -1) {
-					/* error */
-					xbps_dbg_printf(xhp,
-					    "%s-%s: failed to check"
-					    " hash for `%s': %s\n", pkgname,
-					    version, entry_pname,
-					    strerror(errno));
-					goto out;
-				} else if (rv == 0) {
-					/*
-					 * Always set entry perms in existing
-					 * file, even when hash is matched.
-					 */
-					if (chmod(entry_pname,
-					    entry_statp->st_mode) != 0) {
-						xbps_dbg_printf(xhp,
-						    "%s-%s: failed "
-						    "to set perms %s to %s: %s\n",
-						    pkgname, version,
-						    archive_entry_strmode(entry),
-						    entry_pname,
-						    strerror(errno));
-						rv = EINVAL;
+		}
+		/*
+		 * Regular files are written by the writer threads.
+		 * Configuration files, hardlinks, big files and symlinks
+		 * are extracted by this thread, once all queued entries
+		 * have been written: a symlink to a directory must exist
+		 * before the entries below it are written by any writer.
+		 */
+		if (pipeline && !conf_file &&
+		    archive_entry_hardlink(entry) == NULL &&
+		    S_ISREG(entry_statp->st_mode) &&
+		    archive_entry_size(entry) <= UNPACK_PIPELINE_MAXBYTES / 4) {
+			if (up == NULL) {
+				up = xbps_unpack_pipeline_create(xhp,
+				    pkgname, version, files_hash, sync, flags,
+				    xhp->unpack_threads - 1);
+				if (up == NULL) {
+					xbps_dbg_printf(xhp, "%s: failed to "
+					    "start unpack threads: %s\n",
+					    pkgver, strerror(errno));
+					pipeline = false;
+				}
+			}
+			if (up != NULL) {
+				rv = xbps_unpack_pipeline_add(up, ar, entry);
+				if (rv != 0) {
+					if (unpack_pipeline_drain(xhp, up,
+					    pkgname, version, pkgver) != 0)
 						goto out;
-					}
-					xbps_dbg_printf(xhp,
-					    "%s-%s: entry %s perms "
-					    "to %s.\n", pkgname, version,
-					    entry_pname,
-					    archive_entry_strmode(entry));
-					/*
-					 * hash match, skip extraction.
-					 */
-					xbps_dbg_printf(xhp,
-					    "%s-%s: entry %s "
-					    "matches current SHA256, "
-					    "skipping...\n", pkgname,
-					    version, entry_pname);
-					archive_read_data_skip(ar);
-					continue;
+					xbps_set_cb_state(xhp,
+					    XBPS_STATE_UNPACK_FAIL,
+					    rv, pkgname, version,
+					    "%s: [unpack] failed to extract "
+					    "file `%s': %s", pkgver,
+					    entry_pname, strerror(rv));
+					goto out;
+				}
+				if (xhp->unpack_cb != NULL) {
+					xucd.entry_extract_count++;
+					xbps_set_cb_unpack(xhp, &xucd);
 				}
+				continue;
 			}
 		}
-		if (!update && conf_file && file_exists) {
-			/*
-			 * If installing new package preserve old configuration
-			 * file but renaming it to <file>.old.
-			 */
-			buf = xbps_xasprintf("%s.old", entry_pname);
-			assert(buf);
-			(void)rename(entry_pname, buf);
-			free(buf);
-			buf = NULL;
-			xbps_set_cb_state(xhp,
-			    XBPS_STATE_CONFIG_FILE, 0,
-			    pkgname, version,
-			    "Renamed old configuration file "
-			    "`%s' to `%s.old'.", entry_pname, entry_pname);
-		} else if (update && conf_file && file_exists) {
-			/*
-			 * Handle configuration files. Check if current entry is
-			 * a configuration file and take action if required. Skip
-			 * packages that don't have the "conf_files" array in
-			 * the XBPS_PKGPROPS dictionary.
-			 */
-			if (xhp->unpack_cb != NULL)
-				xucd.entry_is_conf = true;
-
-			rv = xbps_entry_install_conf_file(xhp, filesd,
-			    entry, entry_pname, pkgname, version);
-			if (rv == -1) {
-				/* error */
+		if ((rv = unpack_pipeline_drain(xhp, up,
+		    pkgname, version, pkgver)) != 0)
+			goto out;
+		rv = unpack_entry_check(xhp, filesd,
+		    conf_file ? conf_files_hash : files_hash, entry, &xucd,
+		    pkgname, version, conf_file, update, &extract);
+		if (rv != 0)
+			goto out;
+		if (!extract) {
+			archive_read_data_skip(ar);
+			continue;
+		}
+		/*
+		 * Hardlinks need their target in place; other regular
+		 * files are extracted to a temporary file.
+		 */
+		if (archive_entry_hardlink(entry) != NULL) {
+			if ((rv = unpack_sync_commit(xhp, sync,
+			    pkgname, version, pkgver)) != 0)
+				goto out;
+		} else if (S_ISREG(entry_statp->st_mode) && !conf_file) {
+			if ((rv = xbps_unpack_sync_entry(sync, entry)) != 0)
 				goto out;
-			} else if (rv == 0) {
-				/*
-				 * Keep current configuration file
-				 * as is now and pass to next entry.
-				 */
-				archive_read_data_skip(ar);
-				continue;
-			}
 		}
 		/*
 		 * Reset entry_pname again because if entry's pathname
@@ -466,12 +829,15 @@ unpack_archive(struct xbps_handle *xhp,
 		}
 		if (xhp->unpack_cb != NULL) {
 			xucd.entry_extract_count++;
-			(*xhp->unpack_cb)(xhp, &xucd, xhp->unpack_cb_data);
+			xbps_set_cb_unpack(xhp, &xucd);
 		}
 	}
 	/*
 	 * If there was any error extracting files from archive, error out.
 	 */
+	if ((rv = unpack_pipeline_drain(xhp, up,
+	    pkgname, version, pkgver)) != 0)
+		goto out;
 	if ((rv = archive_errno(ar)) != 0) {
 		xbps_set_cb_state(xhp, XBPS_STATE_UNPACK_FAIL,
 		    rv, pkgname, version,
@@ -479,88 +845,29 @@ unpack_archive(struct xbps_handle *xhp,
 		    pkgver, fname, archive_error_string(ar));
 		goto out;
 	}
-	/*
-	 * Skip checking for obsolete files on:
-	 * 	- New package installation without "softreplace" keyword.
-	 * 	- Package with "preserve" keyword.
-	 * 	- Package with "skip-obsoletes" keyword.
-	 */
-	pkgfilesd = xbps_xasprintf("%s/metadata/%s/%s",
-	    XBPS_META_PATH, pkgname, XBPS_PKGFILES);
-	if (pkgfilesd == NULL) {
-		rv = ENOMEM;
+	if ((rv = unpack_sync_commit(xhp, sync,
+	    pkgname, version, pkgver)) != 0)
 		goto out;
-	}
-	if (skip_obsoletes || preserve || (!softreplace && !update))
-		goto out1;
-	/*
-	 * Check for obsolete files on:
-	 * 	- Package upgrade.
-	 * 	- Package with "softreplace" keyword.
-	 */
-	old_filesd = prop_dictionary_internalize_from_zfile(pkgfilesd);
-	if (prop_object_type(old_filesd) == PROP_TYPE_DICTIONARY) {
-		rv = xbps_remove_obsoletes(xhp, pkgname, version,
-		    pkgver, old_filesd, filesd);
-		prop_object_release(old_filesd);
-		if (rv != 0) {
-			rv = errno;
-			goto out;
-		}
-	} else if (errno && errno != ENOENT) {
-		rv = errno;
-		goto out;
-	}
-out1:
-	/*
-	 * Create pkg metadata directory.
-	 */
-	buf = xbps_xasprintf("%s/metadata/%s", XBPS_META_PATH, pkgname);
-	if (buf == NULL) {
-		rv = ENOMEM;
-		goto out;
-	}
-	if (xbps_mkpath(buf, 0755) == -1) {
-		xbps_set_cb_state(xhp, XBPS_STATE_UNPACK_FAIL,
-		    errno, pkgname, version,
-		    "%s: [unpack] failed to create pkg metadir `%s': %s",
-		    buf, pkgver, strerror(errno));
-		free(buf);
-		rv = errno;
+	if ((rv = unpack_metadata(xhp, pkg_repod, filesd, propsd)) != 0)
 		goto out;
-	}
-	free(buf);
 	/*
-	 * Externalize XBPS_PKGFILES and XBPS_PKGPROPS into pkg's
-	 * metadata directory.
+	 * Add the package to the store, if enabled.
 	 */
-	if (!prop_dictionary_externalize_to_file(filesd, pkgfilesd)) {
-		rv = errno;
-		xbps_set_cb_state(xhp, XBPS_STATE_UNPACK_FAIL,
-		    errno, pkgname, version,
-		    "%s: [unpack] failed to extract metadata file `%s': %s",
-		    pkgver, XBPS_PKGFILES, strerror(errno));
-		goto out;
-	}
-	pkgpropsd = xbps_xasprintf("%s/metadata/%s/%s",
-	    XBPS_META_PATH, pkgname, XBPS_PKGPROPS);
-	if (pkgpropsd == NULL) {
-		rv = ENOMEM;
-		goto out;
-	}
-	if (!prop_dictionary_externalize_to_file(propsd, pkgpropsd)) {
-		rv = errno;
-		xbps_set_cb_state(xhp, XBPS_STATE_UNPACK_FAIL,
-		    errno, pkgname, version,
-		    "%s: [unpack] failed to extract metadata file `%s': %s",
-		    pkgver, XBPS_PKGPROPS, strerror(errno));
-		goto out;
+	if (store_entries != NULL) {
+		store_rv = xbps_store_add_pkg(xhp, pkg_repod, store_entries,
+		    filesd, propsd);
+		if (store_rv != 0)
+			xbps_dbg_printf(xhp, "%s: failed to add package "
+			    "to the store: %s\n", pkgver, strerror(store_rv));
 	}
 out:
-	if (pkgfilesd != NULL)
-		free(pkgfilesd);
-	if (pkgpropsd != NULL)
-		free(pkgpropsd);
+	xbps_unpack_pipeline_destroy(up);
+	xbps_unpack_sync_destroy(sync);
+	xbps_strmap_free(conf_files);
+	xbps_strmap_free(files_hash);
+	xbps_strmap_free(conf_files_hash);
+	if (store_entries != NULL)
+		prop_object_release(store_entries);
 	if (prop_object_type(filesd) == PROP_TYPE_DICTIONARY)
 		prop_object_release(filesd);
 	if (prop_object_type(propsd) == PROP_TYPE_DICTIONARY)
@@ -569,15 +876,15 @@ out:
 	return rv;
 }
 
-int HIDDEN
-xbps_unpack_binary_pkg(struct xbps_handle *xhp, prop_dictionary_t pkg_repod)
+static int
+open_binpkg(struct xbps_handle *xhp,
+	    prop_dictionary_t pkg_repod,
+	    struct archive **arp)
 {
-	struct archive *ar = NULL;
+	struct archive *ar;
 	const char *pkgname, *version, *repoloc, *pkgver, *fname;
-	char *bpkg = NULL;
-	int rv = 0;
-
-	assert(prop_object_type(pkg_repod) == PROP_TYPE_DICTIONARY);
+	char *bpkg;
+	int rv;
 
 	prop_dictionary_get_cstring_nocopy(pkg_repod, "pkgname", &pkgname);
 	prop_dictionary_get_cstring_nocopy(pkg_repod, "version", &version);
@@ -585,8 +892,6 @@ xbps_unpack_binary_pkg(struct xbps_handle *xhp, prop_dictionary_t pkg_repod)
 	prop_dictionary_get_cstring_nocopy(pkg_repod, "repository", &repoloc);
 	prop_dictionary_get_cstring_nocopy(pkg_repod, "filename", &fname);
 
-	xbps_set_cb_state(xhp, XBPS_STATE_UNPACK, 0, pkgname, version, NULL);
-
 	bpkg = xbps_path_from_repository_uri(xhp, pkg_repod, repoloc);
 	if (bpkg == NULL) {
 		xbps_set_cb_state(xhp, XBPS_STATE_UNPACK_FAIL,
@@ -619,12 +924,266 @@ xbps_unpack_binary_pkg(struct xbps_handle *xhp, prop_dictionary_t pkg_repod)
 		return rv;
 	}
 	free(bpkg);
+	*arp = ar;
 
+	return 0;
+}
+
+/*
+ * Unpacks a package from the package store without reading the
+ * binary package, see lib/package_store.c.
+ */
+static int
+unpack_store(struct xbps_handle *xhp,
+	     prop_dictionary_t pkg_repod,
+	     prop_dictionary_t manifest)
+{
+	prop_dictionary_t propsd, filesd, d;
+	prop_array_t entries, array;
+	struct xbps_strmap *conf_files = NULL, *files_hash = NULL;
+	struct xbps_strmap *conf_files_hash = NULL, *mutable_files = NULL;
+	struct xbps_unpack_sync *sync = NULL;
+	const struct stat *entry_statp;
+	struct xbps_unpack_cb_data xucd;
+	struct archive_entry *entry = NULL;
+	const char *entry_pname, *transact, *pkgname, *version, *pkgver;
+	const char *file;
+	char *buf = NULL;
+	unsigned int i, cnt;
+	int rv;
+	bool update, conf_file, extract, mutable;
+
+	assert(prop_object_type(pkg_repod) == PROP_TYPE_DICTIONARY);
+	assert(prop_object_type(manifest) == PROP_TYPE_DICTIONARY);
+
+	entries = prop_dictionary_get(manifest, "entries");
+	filesd = prop_dictionary_get(manifest, XBPS_PKGFILES);
+	propsd = prop_dictionary_get(manifest, XBPS_PKGPROPS);
+
+	prop_dictionary_get_cstring_nocopy(pkg_repod,
+	    "transaction", &transact);
+	prop_dictionary_get_cstring_nocopy(pkg_repod, "pkgname", &pkgname);
+	prop_dictionary_get_cstring_nocopy(pkg_repod, "version", &version);
+	prop_dictionary_get_cstring_nocopy(pkg_repod, "pkgver", &pkgver);
+	update = strcmp(transact, "update") == 0;
+
+	xbps_dbg_printf(xhp, "%s: unpacking from the package store.\n",
+	    pkgver);
+
+	if (xhp->unpack_cb != NULL) {
+		/*
+		 * Initialize data for unpack cb.
+		 * total_entries = files + conf_files + links.
+		 */
+		memset(&xucd, 0, sizeof(xucd));
+		xucd.pkgver = pkgver;
+		array = prop_dictionary_get(filesd, "files");
+		xucd.entry_total_count += (ssize_t)prop_array_count(array);
+		array = prop_dictionary_get(filesd, "conf_files");
+		xucd.entry_total_count += (ssize_t)prop_array_count(array);
+		array = prop_dictionary_get(filesd, "links");
+		xucd.entry_total_count += (ssize_t)prop_array_count(array);
+	}
+	if ((rv = unpack_chdir(xhp, pkgname, version, pkgver)) != 0)
+		goto out;
+	if ((sync = xbps_unpack_sync_create(xhp)) == NULL) {
+		rv = ENOMEM;
+		goto out;
+	}
+	conf_files = xbps_strmap_from_array(
+	    prop_dictionary_get(propsd, "conf_files"), NULL, NULL);
+	files_hash = xbps_strmap_from_array(
+	    prop_dictionary_get(filesd, "files"), "file", "sha256");
+	conf_files_hash = xbps_strmap_from_array(
+	    prop_dictionary_get(filesd, "conf_files"), "file", "sha256");
+	if (conf_files == NULL || files_hash == NULL ||
+	    conf_files_hash == NULL) {
+		rv = ENOMEM;
+		goto out;
+	}
+	/*
+	 * Files that can be modified in place are never hardlinked
+	 * from the store.
+	 */
+	array = prop_dictionary_get(filesd, "files");
+	cnt = prop_array_count(array);
+	if ((mutable_files = xbps_strmap_create(0)) == NULL) {
+		rv = ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < cnt; i++) {
+		d = prop_array_get(array, i);
+		mutable = false;
+		prop_dictionary_get_bool(d, "mutable", &mutable);
+		if (!mutable ||
+		    !prop_dictionary_get_cstring_nocopy(d, "file", &file))
+			continue;
+		if ((rv = xbps_strmap_add(mutable_files, file, NULL)) != 0)
+			goto out;
+	}
+	/*
+	 * Always remove current INSTALL/REMOVE scripts in pkg's metadir,
+	 * as security measures.
+	 */
+	if ((rv = remove_metafile(xhp, "INSTALL", pkgver)) != 0)
+		goto out;
+	if ((rv = remove_metafile(xhp, "REMOVE", pkgver)) != 0)
+		goto out;
+
+	for (i = 0; i < prop_array_count(entries); i++) {
+		d = prop_array_get(entries, i);
+		if ((entry = xbps_store_archive_entry(d)) == NULL) {
+			rv = errno ? errno : EINVAL;
+			goto out;
+		}
+		entry_statp = archive_entry_stat(entry);
+		entry_pname = archive_entry_pathname(entry);
+		if (xhp->unpack_cb != NULL) {
+			xucd.entry = entry_pname;
+			xucd.entry_size = archive_entry_size(entry);
+			xucd.entry_is_conf = false;
+		}
+		if (strcmp("./INSTALL", entry_pname) == 0) {
+			buf = xbps_xasprintf("%s/metadata/%s/INSTALL",
+			    XBPS_META_PATH, pkgname);
+			if (buf == NULL) {
+				rv = ENOMEM;
+				goto out;
+			}
+			rv = extract_metafile(xhp, NULL, d, entry,
+			    "INSTALL", pkgver, true, 0);
+			if (rv != 0)
+				goto out;
+
+			pthread_mutex_lock(&unpack_mtx);
+			rv = xbps_file_exec(xhp, buf, "pre",
+			     pkgname, version, update ? "yes" : "no",
+			     xhp->conffile, NULL);
+			pthread_mutex_unlock(&unpack_mtx);
+			free(buf);
+			buf = NULL;
+			if (rv != 0) {
+				xbps_set_cb_state(xhp,
+				    XBPS_STATE_UNPACK_FAIL,
+				    rv, pkgname, version,
+				    "%s: [unpack] INSTALL script failed "
+				    "to execute pre ACTION: %s",
+				    pkgver, strerror(rv));
+				goto out;
+			}
+			archive_entry_free(entry);
+			entry = NULL;
+			continue;
+
+		} else if (strcmp("./REMOVE", entry_pname) == 0) {
+			rv = extract_metafile(xhp, NULL, d, entry,
+			    "REMOVE", pkgver, true, 0);
+			if (rv != 0)
+				goto out;
+
+			archive_entry_free(entry);
+			entry = NULL;
+			continue;
+		}
+		conf_file = mutable = false;
+		if (S_ISREG(entry_statp->st_mode)) {
+			file = strchr(entry_pname, '.') + 1;
+			assert(file != NULL);
+			if (xbps_entry_is_a_conf_file(conf_files, file))
+				conf_file = true;
+			mutable = xbps_strmap_find(mutable_files, file, NULL);
+		}
+		rv = unpack_entry_check(xhp, filesd,
+		    conf_file ? conf_files_hash : files_hash, entry, &xucd,
+		    pkgname, version, conf_file, update, &extract);
+		if (rv != 0)
+			goto out;
+		if (!extract) {
+			archive_entry_free(entry);
+			entry = NULL;
+			continue;
+		}
+		/*
+		 * Hardlinks need their target in place; other regular
+		 * files are copied to a temporary file.
+		 */
+		if (archive_entry_hardlink(entry) != NULL) {
+			if ((rv = unpack_sync_commit(xhp, sync,
+			    pkgname, version, pkgver)) != 0)
+				goto out;
+		} else if (S_ISREG(entry_statp->st_mode) && !conf_file) {
+			if ((rv = xbps_unpack_sync_entry(sync, entry)) != 0)
+				goto out;
+		}
+		entry_pname = archive_entry_pathname(entry);
+		if ((rv = xbps_store_extract_entry(xhp, d, entry,
+		    conf_file || mutable)) != 0) {
+			xbps_set_cb_state(xhp, XBPS_STATE_UNPACK_FAIL,
+			    rv, pkgname, version,
+			    "%s: [unpack] failed to extract file `%s' "
+			    "from the package store: %s",
+			    pkgver, entry_pname, strerror(rv));
+			goto out;
+		}
+		if (xhp->unpack_cb != NULL) {
+			xucd.entry_extract_count++;
+			xbps_set_cb_unpack(xhp, &xucd);
+		}
+		archive_entry_free(entry);
+		entry = NULL;
+	}
+	if ((rv = unpack_sync_commit(xhp, sync,
+	    pkgname, version, pkgver)) != 0)
+		goto out;
+
+	rv = unpack_metadata(xhp, pkg_repod, filesd, propsd);
+out:
+	if (entry != NULL)
+		archive_entry_free(entry);
+	free(buf);
+	xbps_unpack_sync_destroy(sync);
+	xbps_strmap_free(conf_files);
+	xbps_strmap_free(files_hash);
+	xbps_strmap_free(conf_files_hash);
+	xbps_strmap_free(mutable_files);
+
+	return rv;
+}
+
+int HIDDEN
+xbps_unpack_binary_pkg(struct xbps_handle *xhp, prop_dictionary_t pkg_repod)
+{
+	prop_dictionary_t manifest = NULL;
+	struct archive *ar = NULL;
+	const char *pkgname, *version, *pkgver;
+	int rv = 0;
+
+	assert(prop_object_type(pkg_repod) == PROP_TYPE_DICTIONARY);
+
+	prop_dictionary_get_cstring_nocopy(pkg_repod, "pkgname", &pkgname);
+	prop_dictionary_get_cstring_nocopy(pkg_repod, "version", &version);
+	prop_dictionary_get_cstring_nocopy(pkg_repod, "pkgver", &pkgver);
+
+	xbps_set_cb_state(xhp, XBPS_STATE_UNPACK, 0, pkgname, version, NULL);
+
+	/*
+	 * Unpack from the package store if the package is there,
+	 * otherwise open the binary package.
+	 */
+	if (xhp->flags & XBPS_FLAG_PACKAGE_STORE)
+		manifest = xbps_store_get_manifest(xhp, pkg_repod);
+	if (manifest == NULL) {
+		if ((rv = open_binpkg(xhp, pkg_repod, &ar)) != 0)
+			return rv;
+	}
 	/*
 	 * Set package state to half-unpacked.
 	 */
-	if ((rv = xbps_set_pkg_state_installed(xhp, pkgname, version,
-	    XBPS_PKG_STATE_HALF_UNPACKED)) != 0) {
+	pthread_mutex_lock(&unpack_mtx);
+	rv = xbps_set_pkg_state_installed(xhp, pkgname, version,
+	    XBPS_PKG_STATE_HALF_UNPACKED);
+	pthread_mutex_unlock(&unpack_mtx);
+	if (rv != 0) {
 		xbps_set_cb_state(xhp, XBPS_STATE_UNPACK_FAIL,
 		    rv, pkgname, version,
 		    "%s: [unpack] failed to set state to half-unpacked: %s",
@@ -634,7 +1193,11 @@ xbps_unpack_binary_pkg(struct xbps_handle *xhp, prop_dictionary_t pkg_repod)
 	/*
 	 * Extract archive files.
 	 */
-	if ((rv = unpack_archive(xhp, pkg_repod, ar)) != 0) {
+	if (manifest != NULL)
+		rv = unpack_store(xhp, pkg_repod, manifest);
+	else
+		rv = unpack_archive(xhp, pkg_repod, ar);
+	if (rv != 0) {
 		xbps_set_cb_state(xhp, XBPS_STATE_UNPACK_FAIL,
 		    rv, pkgname, version,
 		    "%s: [unpack] failed to unpack files from archive: %s",
@@ -644,14 +1207,19 @@ xbps_unpack_binary_pkg(struct xbps_handle *xhp, prop_dictionary_t pkg_repod)
 	/*
 	 * Set package state to unpacked.
 	 */
-	if ((rv = xbps_set_pkg_state_installed(xhp, pkgname, version,
-	    XBPS_PKG_STATE_UNPACKED)) != 0) {
+	pthread_mutex_lock(&unpack_mtx);
+	rv = xbps_set_pkg_state_installed(xhp, pkgname, version,
+	    XBPS_PKG_STATE_UNPACKED);
+	pthread_mutex_unlock(&unpack_mtx);
+	if (rv != 0) {
 		xbps_set_cb_state(xhp, XBPS_STATE_UNPACK_FAIL,
 		    rv, pkgname, version,
 		    "%s: [unpack] failed to set state to unpacked: %s",
 		    pkgver, strerror(rv));
 	}
 out:
+	if (manifest != NULL)
+		prop_object_release(manifest);
 	if (ar) {
 		archive_read_close(ar);
 		archive_read_free(ar);
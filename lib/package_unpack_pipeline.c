@@ -0,0 +1,350 @@
+/*-
+ * Copyright (c) 2012 Juan Romero Pardines.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "xbps_api_impl.h"
+
+/*
+ * Pipelined extraction of binary packages.
+ *
+ * The thread reading the archive decompresses every entry into a
+ * memory buffer and queues it to a writer thread, which checks the
+ * hash of the existing file and writes the entry to disk with its
+ * own archive_write_disk(3) object. Regular files are written to
+ * their temporary file, see lib/package_unpack_sync.c.
+ *
+ * Entries are assigned to writers by a hash of their pathname, so
+ * that duplicated entries in the archive are still written in order.
+ * Only regular files are queued; symlinks and everything else are
+ * extracted by the reader once the queues are empty, so that files
+ * below a symlinked directory are written after the symlink.
+ * The amount of queued data is bounded by UNPACK_PIPELINE_MAXBYTES
+ * and UNPACK_PIPELINE_MAXJOBS; the reader blocks until there is room.
+ */
+#define UNPACK_PIPELINE_MAXJOBS		1024
+
+struct unpack_job {
+	TAILQ_ENTRY(unpack_job) entries;
+	struct archive_entry *entry;
+	void *data;
+	size_t size;
+};
+
+struct unpack_writer {
+	TAILQ_HEAD(unpack_jobq, unpack_job) jobs;
+	struct xbps_unpack_pipeline *up;
+	struct archive *aw;
+	pthread_t thread;
+	pthread_cond_t cond;
+};
+
+struct xbps_unpack_pipeline {
+	struct xbps_handle *xhp;
+	const char *pkgname;
+	const char *version;
+	struct xbps_strmap *files_hash;
+	struct xbps_unpack_sync *sync;
+	struct unpack_writer *writers;
+	size_t nwriters;
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;
+	size_t pending_bytes;
+	size_t pending_jobs;
+	char *errfile;
+	int error;
+	bool quit;
+};
+
+static void
+job_free(struct unpack_job *job)
+{
+	if (job->entry != NULL)
+		archive_entry_free(job->entry);
+	free(job->data);
+	free(job);
+}
+
+static int
+write_error(struct archive *aw)
+{
+	int rv;
+
+	if ((rv = archive_errno(aw)) == 0)
+		rv = EIO;
+
+	return rv;
+}
+
+static int
+write_entry(struct xbps_unpack_pipeline *up,
+	    struct archive *aw,
+	    struct unpack_job *job)
+{
+	const struct stat *entry_statp;
+	struct stat st;
+	int rv;
+	bool extract;
+
+	entry_statp = archive_entry_stat(job->entry);
+	/*
+	 * Skip existing files whose hash matches, but always
+	 * set the entry perms.
+	 */
+	if (S_ISREG(entry_statp->st_mode) &&
+	    stat(archive_entry_pathname(job->entry), &st) == 0) {
+		rv = xbps_unpack_entry_hash_check(up->xhp, up->files_hash,
+		    job->entry, up->pkgname, up->version, &extract);
+		if (rv != 0 || !extract)
+			return rv;
+	}
+	if (S_ISREG(entry_statp->st_mode) &&
+	    (rv = xbps_unpack_sync_entry(up->sync, job->entry)) != 0)
+		return rv;
+	if (archive_write_header(aw, job->entry) < ARCHIVE_WARN)
+		return write_error(aw);
+	if (job->size > 0 &&
+	    archive_write_data(aw, job->data, job->size) != (ssize_t)job->size)
+		return write_error(aw);
+	if (archive_write_finish_entry(aw) < ARCHIVE_WARN)
+		return write_error(aw);
+
+	return 0;
+}
+
+static void *
+writer_thread(void *arg)
+{
+	struct unpack_writer *uw = arg;
+	struct xbps_unpack_pipeline *up = uw->up;
+	struct unpack_job *job;
+	int rv;
+	bool skip;
+
+	for (;;) {
+		pthread_mutex_lock(&up->mtx);
+		while (TAILQ_EMPTY(&uw->jobs) && !up->quit)
+			pthread_cond_wait(&uw->cond, &up->mtx);
+		if ((job = TAILQ_FIRST(&uw->jobs)) == NULL) {
+			pthread_mutex_unlock(&up->mtx);
+			break;
+		}
+		TAILQ_REMOVE(&uw->jobs, job, entries);
+		/* stop writing files after the first error */
+		skip = up->error != 0;
+		pthread_mutex_unlock(&up->mtx);
+
+		rv = skip ? 0 : write_entry(up, uw->aw, job);
+
+		pthread_mutex_lock(&up->mtx);
+		if (rv != 0 && up->error == 0) {
+			up->error = rv;
+			up->errfile = strdup(archive_entry_pathname(job->entry));
+		}
+		up->pending_bytes -= job->size;
+		up->pending_jobs--;
+		pthread_cond_signal(&up->cond);
+		pthread_mutex_unlock(&up->mtx);
+		job_free(job);
+	}
+	return NULL;
+}
+
+struct xbps_unpack_pipeline HIDDEN *
+xbps_unpack_pipeline_create(struct xbps_handle *xhp,
+			    const char *pkgname,
+			    const char *version,
+			    struct xbps_strmap *files_hash,
+			    struct xbps_unpack_sync *sync,
+			    int flags,
+			    size_t nwriters)
+{
+	struct xbps_unpack_pipeline *up;
+	struct unpack_writer *uw;
+	size_t i;
+
+	assert(xhp != NULL);
+	assert(files_hash != NULL);
+	assert(sync != NULL);
+	assert(nwriters > 0);
+
+	if ((up = calloc(1, sizeof(*up))) == NULL)
+		return NULL;
+	if ((up->writers = calloc(nwriters, sizeof(*uw))) == NULL) {
+		free(up);
+		return NULL;
+	}
+	up->xhp = xhp;
+	up->pkgname = pkgname;
+	up->version = version;
+	up->files_hash = files_hash;
+	up->sync = sync;
+	pthread_mutex_init(&up->mtx, NULL);
+	pthread_cond_init(&up->cond, NULL);
+
+	for (i = 0; i < nwriters; i++) {
+		uw = &up->writers[i];
+		if ((uw->aw = archive_write_disk_new()) == NULL)
+			break;
+		archive_write_disk_set_options(uw->aw, flags);
+		archive_write_disk_set_standard_lookup(uw->aw);
+		TAILQ_INIT(&uw->jobs);
+		uw->up = up;
+		pthread_cond_init(&uw->cond, NULL);
+		if (pthread_create(&uw->thread, NULL, writer_thread, uw)) {
+			pthread_cond_destroy(&uw->cond);
+			archive_write_free(uw->aw);
+			break;
+		}
+		up->nwriters++;
+	}
+	if (up->nwriters == 0) {
+		xbps_unpack_pipeline_destroy(up);
+		errno = EAGAIN;
+		return NULL;
+	}
+	xbps_dbg_printf(xhp, "unpack: pipelined extraction with %zu "
+	    "writer threads.\n", up->nwriters);
+
+	return up;
+}
+
+int HIDDEN
+xbps_unpack_pipeline_add(struct xbps_unpack_pipeline *up,
+			 struct archive *ar,
+			 struct archive_entry *entry)
+{
+	struct unpack_writer *uw;
+	struct unpack_job *job;
+	ssize_t r;
+	size_t size = 0;
+	int rv;
+
+	assert(up != NULL);
+	assert(ar != NULL);
+	assert(entry != NULL);
+
+	if ((job = calloc(1, sizeof(*job))) == NULL)
+		return ENOMEM;
+	if ((job->entry = archive_entry_clone(entry)) == NULL) {
+		job_free(job);
+		return ENOMEM;
+	}
+	if (archive_entry_size(entry) > 0)
+		size = (size_t)archive_entry_size(entry);
+	if (size > 0 && (job->data = malloc(size)) == NULL) {
+		job_free(job);
+		return ENOMEM;
+	}
+	/*
+	 * Read and decompress entry data.
+	 */
+	while (job->size < size) {
+		r = archive_read_data(ar, (char *)job->data + job->size,
+		    size - job->size);
+		if (r < 0) {
+			if ((rv = archive_errno(ar)) == 0)
+				rv = EIO;
+			job_free(job);
+			return rv;
+		} else if (r == 0)
+			break;
+
+		job->size += (size_t)r;
+	}
+	/*
+	 * Wait for room in the queues and pass the job to its writer.
+	 */
+	uw = &up->writers[xbps_strhash(archive_entry_pathname(entry)) %
+	    up->nwriters];
+
+	pthread_mutex_lock(&up->mtx);
+	while ((up->pending_bytes > 0 &&
+	    up->pending_bytes + job->size > UNPACK_PIPELINE_MAXBYTES) ||
+	    up->pending_jobs >= UNPACK_PIPELINE_MAXJOBS)
+		pthread_cond_wait(&up->cond, &up->mtx);
+
+	TAILQ_INSERT_TAIL(&uw->jobs, job, entries);
+	up->pending_bytes += job->size;
+	up->pending_jobs++;
+	pthread_cond_signal(&uw->cond);
+	rv = up->error;
+	pthread_mutex_unlock(&up->mtx);
+
+	return rv;
+}
+
+int HIDDEN
+xbps_unpack_pipeline_wait(struct xbps_unpack_pipeline *up,
+			  const char **errfile)
+{
+	int rv;
+
+	assert(up != NULL);
+
+	pthread_mutex_lock(&up->mtx);
+	while (up->pending_jobs > 0)
+		pthread_cond_wait(&up->cond, &up->mtx);
+	rv = up->error;
+	if (errfile != NULL)
+		*errfile = up->errfile;
+	pthread_mutex_unlock(&up->mtx);
+
+	return rv;
+}
+
+void HIDDEN
+xbps_unpack_pipeline_destroy(struct xbps_unpack_pipeline *up)
+{
+	struct unpack_writer *uw;
+	size_t i;
+
+	if (up == NULL)
+		return;
+
+	pthread_mutex_lock(&up->mtx);
+	up->quit = true;
+	for (i = 0; i < up->nwriters; i++)
+		pthread_cond_signal(&up->writers[i].cond);
+	pthread_mutex_unlock(&up->mtx);
+
+	for (i = 0; i < up->nwriters; i++) {
+		uw = &up->writers[i];
+		pthread_join(uw->thread, NULL);
+		pthread_cond_destroy(&uw->cond);
+		archive_write_free(uw->aw);
+	}
+	pthread_cond_destroy(&up->cond);
+	pthread_mutex_destroy(&up->mtx);
+	free(up->errfile);
+	free(up->writers);
+	free(up);
+}
@@ -0,0 +1,338 @@
+/*-
+ * Copyright (c) 2012 Juan Romero Pardines.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_SYNCFS
+# define _GNU_SOURCE	/* for syncfs(2) */
+#endif
+
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "xbps_api_impl.h"
+
+/*
+ * Atomic replacement of package files.
+ *
+ * Regular files are extracted to a temporary file in the same directory
+ * and renamed into place once the whole package has been unpacked, so
+ * that a failed or interrupted unpack never leaves half written files.
+ *
+ * If XBPS_FLAG_UNPACK_SYNC is set, the data of all temporary files is
+ * flushed to disk with one syncfs(2) per filesystem holding them (or
+ * one fsync(2) per file if it's not available) before renaming them,
+ * and every directory is synced once after the renames.
+ *
+ * Temporary files left by an unpack that was interrupted before the
+ * renames are removed when the package is unpacked again.
+ */
+#define UNPACK_TMPFILE_SUFFIX	".xbps-new"
+
+struct unpack_tmpfile {
+	char *file;
+	char *tmpfile;
+};
+
+struct xbps_unpack_sync {
+	struct xbps_handle *xhp;
+	struct unpack_tmpfile *files;
+	size_t nfiles;
+	size_t size;
+	pthread_mutex_t mtx;
+};
+
+static void
+tmpfiles_release(struct xbps_unpack_sync *us, bool remove)
+{
+	size_t i;
+
+	for (i = 0; i < us->nfiles; i++) {
+		if (remove)
+			(void)unlink(us->files[i].tmpfile);
+		free(us->files[i].file);
+		free(us->files[i].tmpfile);
+	}
+	us->nfiles = 0;
+}
+
+static int
+sync_tmpfiles(struct xbps_unpack_sync *us)
+{
+	size_t i;
+	int fd, rv = 0;
+#ifdef HAVE_SYNCFS
+	struct stat st;
+	dev_t *devs;
+	size_t j, ndevs = 0;
+
+	/*
+	 * syncfs(2) only flushes the filesystem of the fd passed in,
+	 * so it's called once for every filesystem holding temporary
+	 * files (e.g /boot or /usr may be separate mounts).
+	 */
+	if ((devs = calloc(us->nfiles, sizeof(*devs))) == NULL)
+		return ENOMEM;
+	for (i = 0; i < us->nfiles; i++) {
+		if (lstat(us->files[i].tmpfile, &st) == -1) {
+			rv = errno;
+			break;
+		}
+		for (j = 0; j < ndevs; j++) {
+			if (devs[j] == st.st_dev)
+				break;
+		}
+		if (j < ndevs)
+			continue;
+		devs[ndevs++] = st.st_dev;
+		if ((fd = open(us->files[i].tmpfile, O_RDONLY)) == -1) {
+			rv = errno;
+			break;
+		}
+		if (syncfs(fd) == -1)
+			rv = errno;
+		(void)close(fd);
+		if (rv != 0)
+			break;
+	}
+	free(devs);
+#else
+	for (i = 0; i < us->nfiles; i++) {
+		if ((fd = open(us->files[i].tmpfile, O_RDONLY)) == -1)
+			return errno;
+		if (fsync(fd) == -1)
+			rv = errno;
+		(void)close(fd);
+		if (rv != 0)
+			return rv;
+	}
+#endif
+	return rv;
+}
+
+static int
+sync_dirs(struct xbps_unpack_sync *us)
+{
+	struct xbps_strmap *dirs;
+	char **dirv, *dir, *p;
+	size_t i, ndirs = 0;
+	int fd, rv = 0;
+
+	if ((dirv = calloc(us->nfiles, sizeof(*dirv))) == NULL)
+		return ENOMEM;
+	if ((dirs = xbps_strmap_create(0)) == NULL) {
+		free(dirv);
+		return ENOMEM;
+	}
+	for (i = 0; i < us->nfiles && rv == 0; i++) {
+		if ((dir = strdup(us->files[i].file)) == NULL) {
+			rv = ENOMEM;
+			break;
+		}
+		if ((p = strrchr(dir, '/')) != NULL)
+			*p = '\0';
+		else
+			strcpy(dir, ".");
+
+		if (xbps_strmap_find(dirs, dir, NULL)) {
+			free(dir);
+			continue;
+		}
+		dirv[ndirs++] = dir;
+		if ((rv = xbps_strmap_add(dirs, dir, NULL)) != 0)
+			break;
+		if ((fd = open(dir, O_RDONLY)) == -1) {
+			rv = errno;
+			break;
+		}
+		if (fsync(fd) == -1)
+			rv = errno;
+		(void)close(fd);
+	}
+	xbps_strmap_free(dirs);
+	for (i = 0; i < ndirs; i++)
+		free(dirv[i]);
+	free(dirv);
+
+	return rv;
+}
+
+struct xbps_unpack_sync HIDDEN *
+xbps_unpack_sync_create(struct xbps_handle *xhp)
+{
+	struct xbps_unpack_sync *us;
+
+	assert(xhp != NULL);
+
+	if ((us = calloc(1, sizeof(*us))) == NULL)
+		return NULL;
+
+	us->xhp = xhp;
+	pthread_mutex_init(&us->mtx, NULL);
+
+	return us;
+}
+
+int HIDDEN
+xbps_unpack_sync_clean(struct xbps_unpack_sync *us, prop_dictionary_t filesd)
+{
+	prop_array_t array;
+	prop_dictionary_t d;
+	const char *file;
+	char *tmpfile;
+	unsigned int i, cnt;
+
+	assert(us != NULL);
+	assert(filesd != NULL);
+
+	array = prop_dictionary_get(filesd, "files");
+	cnt = prop_array_count(array);
+	for (i = 0; i < cnt; i++) {
+		d = prop_array_get(array, i);
+		if (!prop_dictionary_get_cstring_nocopy(d, "file", &file))
+			continue;
+		/* unpack_archive() always runs at rootdir */
+		if ((tmpfile = xbps_xasprintf(".%s%s",
+		    file, UNPACK_TMPFILE_SUFFIX)) == NULL)
+			return ENOMEM;
+		if (unlink(tmpfile) == 0)
+			xbps_dbg_printf(us->xhp, "removed stale temporary "
+			    "file `%s'.\n", tmpfile);
+		else if (errno != ENOENT && errno != ENOTDIR)
+			xbps_dbg_printf(us->xhp, "failed to remove stale "
+			    "temporary file `%s': %s\n", tmpfile,
+			    strerror(errno));
+		free(tmpfile);
+	}
+	return 0;
+}
+
+int HIDDEN
+xbps_unpack_sync_entry(struct xbps_unpack_sync *us,
+		       struct archive_entry *entry)
+{
+	struct unpack_tmpfile *files, *tf;
+	const char *file;
+	char *tmpfile;
+	size_t size;
+
+	assert(us != NULL);
+	assert(entry != NULL);
+
+	file = archive_entry_pathname(entry);
+	if ((tmpfile = xbps_xasprintf("%s%s",
+	    file, UNPACK_TMPFILE_SUFFIX)) == NULL)
+		return ENOMEM;
+
+	pthread_mutex_lock(&us->mtx);
+	if (us->nfiles == us->size) {
+		size = us->size ? us->size * 2 : 64;
+		files = realloc(us->files, size * sizeof(*files));
+		if (files == NULL) {
+			pthread_mutex_unlock(&us->mtx);
+			free(tmpfile);
+			return ENOMEM;
+		}
+		us->files = files;
+		us->size = size;
+	}
+	tf = &us->files[us->nfiles];
+	if ((tf->file = strdup(file)) == NULL) {
+		pthread_mutex_unlock(&us->mtx);
+		free(tmpfile);
+		return ENOMEM;
+	}
+	tf->tmpfile = tmpfile;
+	us->nfiles++;
+	pthread_mutex_unlock(&us->mtx);
+
+	archive_entry_set_pathname(entry, tmpfile);
+
+	return 0;
+}
+
+int HIDDEN
+xbps_unpack_sync_commit(struct xbps_unpack_sync *us, const char **errfile)
+{
+	struct xbps_handle *xhp;
+	size_t i;
+	int rv = 0;
+
+	assert(us != NULL);
+
+	xhp = us->xhp;
+	if (us->nfiles == 0)
+		return 0;
+
+	if (xhp->flags & XBPS_FLAG_UNPACK_SYNC) {
+		if ((rv = sync_tmpfiles(us)) != 0) {
+			if (errfile != NULL)
+				*errfile = xhp->rootdir;
+			tmpfiles_release(us, true);
+			return rv;
+		}
+	}
+	for (i = 0; i < us->nfiles; i++) {
+		if (rename(us->files[i].tmpfile, us->files[i].file) == 0)
+			continue;
+		if (errno == ENOENT) {
+			/* duplicated entry, already renamed */
+			xbps_dbg_printf(xhp, "%s: already in place.\n",
+			    us->files[i].file);
+			continue;
+		}
+		rv = errno;
+		if (errfile != NULL)
+			*errfile = us->files[i].file;
+		break;
+	}
+	if (rv == 0 && (xhp->flags & XBPS_FLAG_UNPACK_SYNC)) {
+		if ((rv = sync_dirs(us)) != 0 && errfile != NULL)
+			*errfile = xhp->rootdir;
+	}
+	/* errfile must remain valid until destroyed */
+	if (rv == 0)
+		tmpfiles_release(us, false);
+
+	return rv;
+}
+
+void HIDDEN
+xbps_unpack_sync_destroy(struct xbps_unpack_sync *us)
+{
+	if (us == NULL)
+		return;
+
+	/* remove temporary files not committed */
+	tmpfiles_release(us, true);
+	pthread_mutex_destroy(&us->mtx);
+	free(us->files);
+	free(us);
+}
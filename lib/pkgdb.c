@@ -91,7 +91,7 @@ xbps_pkgdb_update(struct xbps_handle *xhp, bool flush)
 
 	if (xhp->pkgdb && flush) {
 		/* flush dictionary to storage */
-		if (!prop_array_externalize_to_file(xhp->pkgdb, plist)) {
+		if (!xbps_array_externalize_to_file(xhp, xhp->pkgdb, plist)) {
 			free(plist);
 			return errno;
 		}
@@ -103,6 +103,8 @@ xbps_pkgdb_update(struct xbps_handle *xhp, bool flush)
 	if ((xhp->pkgdb = prop_array_internalize_from_zfile(plist)) == NULL)
 		cached_rv = rv = errno;
 
+	xbps_revdeps_rebind(xhp);
+
 	free(plist);
 
 	return rv;
@@ -113,6 +115,8 @@ xbps_pkgdb_release(struct xbps_handle *xhp)
 {
 	assert(xhp != NULL);
 
+	xbps_revdeps_release(xhp);
+
 	if (xhp->pkgdb == NULL)
 		return;
 
@@ -187,11 +191,16 @@ xbps_pkgdb_remove_pkgd(struct xbps_handle *xhp,
 		       bool bypattern,
 		       bool flush)
 {
+	prop_dictionary_t pkgd;
 	bool rv = false;
 
 	if (xbps_pkgdb_init(xhp) != 0)
 		return false;
 
+	if (xhp->revdeps != NULL &&
+	    (pkgd = xbps_pkgdb_get_pkgd(xhp, pkg, bypattern)) != NULL)
+		xbps_revdeps_unset_pkgd(xhp, pkgd);
+
 	if (bypattern)
 		rv = xbps_remove_pkg_from_array_by_pattern(xhp,
 		    xhp->pkgdb, pkg, NULL);
@@ -225,6 +234,9 @@ xbps_pkgdb_replace_pkgd(struct xbps_handle *xhp,
 	else
 		rv = xbps_array_replace_dict_by_name(xhp->pkgdb, pkgd, pkg);
 
+	if (rv == 0)
+		xbps_revdeps_set_pkgd(xhp, pkgd);
+
 	if (!flush)
 		return rv != 0 ? false : true;
 
@@ -79,14 +79,28 @@ xbps_callback_array_iter(struct xbps_handle *xhp,
 	int (*fn)(struct xbps_handle *, prop_object_t, void *, bool *),
 	void *arg)
 {
+	prop_object_t const *objs;
 	prop_object_t obj;
 	prop_object_iterator_t iter;
+	unsigned int i, cnt;
 	int rv = 0;
 	bool loop_done = false;
 
 	assert(prop_object_type(array) == PROP_TYPE_ARRAY);
 	assert(fn != NULL);
 
+	if (prop_array_immutable_objects(array, &objs, &cnt)) {
+		for (i = 0; i < cnt; i++) {
+			rv = (*fn)(xhp, objs[i], arg, &loop_done);
+			if (rv != 0 || loop_done)
+				break;
+		}
+		return rv;
+	}
+	/*
+	 * Mutable arrays are walked with an iterator, which
+	 * stops if the callback modifies the array.
+	 */
 	iter = prop_array_iterator(array);
 	if (iter == NULL)
 		return ENOMEM;
@@ -309,3 +323,38 @@ xbps_dictionary_from_metadata_plist(struct xbps_handle *xhp,
 
 	return plistd;
 }
+
+bool HIDDEN
+xbps_array_externalize_to_file(struct xbps_handle *xhp,
+			       prop_array_t array,
+			       const char *file)
+{
+	assert(prop_object_type(array) == PROP_TYPE_ARRAY);
+	assert(file != NULL);
+
+	if (xhp->flags & XBPS_FLAG_BINARY_PLISTS)
+		return prop_array_externalize_binary_to_file(array, file);
+
+	return prop_array_externalize_to_file(array, file);
+}
+
+bool HIDDEN
+xbps_dictionary_externalize_to_file(struct xbps_handle *xhp,
+				    prop_dictionary_t dict,
+				    const char *file,
+				    bool compress)
+{
+	assert(prop_object_type(dict) == PROP_TYPE_DICTIONARY);
+	assert(file != NULL);
+
+	if (xhp->flags & XBPS_FLAG_BINARY_PLISTS) {
+		if (compress)
+			return prop_dictionary_externalize_binary_to_zfile(dict,
+			    file);
+		return prop_dictionary_externalize_binary_to_file(dict, file);
+	}
+	if (compress)
+		return prop_dictionary_externalize_to_zfile(dict, file);
+
+	return prop_dictionary_externalize_to_file(dict, file);
+}
@@ -34,12 +34,12 @@
 
 /*
  * Takes a compressed data buffer, decompresses it and returns the
- * new buffer uncompressed if all was right.
+ * new buffer uncompressed (and its length in outlen) if all was right.
  */
 #define _READ_CHUNK	8192
 
 static char *
-_xbps_uncompress_plist_data(char *xml, size_t len)
+_xbps_uncompress_plist_data(char *xml, size_t len, size_t *outlen)
 {
 	z_stream strm;
 	unsigned char *out;
@@ -112,6 +112,7 @@ _xbps_uncompress_plist_data(char *xml, size_t len)
 	/* we are done */
 	(void)inflateEnd(&strm);
 	free(out);
+	*outlen = (size_t)totalsize;
 
 	return uncomp_xml;
 }
@@ -122,7 +123,7 @@ xbps_dictionary_from_archive_entry(struct archive *ar,
 				   struct archive_entry *entry)
 {
 	prop_dictionary_t d = NULL;
-	size_t buflen = 0;
+	size_t buflen = 0, uncomp_buflen = 0;
 	ssize_t nbytes = -1;
 	char *buf, *uncomp_buf;
 
@@ -140,7 +141,7 @@ xbps_dictionary_from_archive_entry(struct archive *ar,
 		return NULL;
 	}
 
-	uncomp_buf = _xbps_uncompress_plist_data(buf, buflen);
+	uncomp_buf = _xbps_uncompress_plist_data(buf, buflen, &uncomp_buflen);
 	if (uncomp_buf == NULL) {
 		if (errno && errno != EAGAIN) {
 			/* Error while decompressing */
@@ -149,11 +150,19 @@ xbps_dictionary_from_archive_entry(struct archive *ar,
 		} else if (errno == EAGAIN) {
 			/* Not a compressed data, try again */
 			errno = 0;
-			d = prop_dictionary_internalize(buf);
+			if (prop_binary_detect(buf, buflen))
+				d = prop_dictionary_internalize_binary(buf,
+				    buflen);
+			else
+				d = prop_dictionary_internalize(buf);
 		}
 	} else {
 		/* We have the uncompressed data */
-		d = prop_dictionary_internalize(uncomp_buf);
+		if (prop_binary_detect(uncomp_buf, uncomp_buflen))
+			d = prop_dictionary_internalize_binary(uncomp_buf,
+			    uncomp_buflen);
+		else
+			d = prop_dictionary_internalize(uncomp_buf);
 		free(uncomp_buf);
 	}
 	free(buf);
@@ -26,9 +26,11 @@
  * From: $NetBSD: pkg_io.c,v 1.9 2009/08/16 21:10:15 joerg Exp $
  */
 
+#include <sys/stat.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
 
 #include "xbps_api_impl.h"
@@ -39,12 +41,53 @@
  * @defgroup plist_fetch Package URL metadata files handling
  */
 
+/*
+ * Package metadata is stored in the first entries of the archive, so
+ * files from HTTP servers are read in ranges: the first request asks
+ * for FETCH_RANGE_MIN bytes and the next ones double it (up to
+ * FETCH_RANGE_MAX), until libarchive has found the plist. Servers not
+ * supporting ranges return the whole file, which is streamed as usual.
+ */
+#define FETCH_RANGE_MIN		(64 * 1024)
+#define FETCH_RANGE_MAX		(1024 * 1024)
+
 struct fetch_archive {
 	struct url *url;
 	struct fetchIO *fetch;
+	off_t pos;		/* archive offset of the next read */
+	off_t size;		/* archive size */
+	off_t range;		/* size of the last requested range */
+	bool ranges;		/* reading the archive in ranges */
 	char buffer[32768];
 };
 
+static int
+fetch_archive_range(struct fetch_archive *f)
+{
+	struct url_stat us;
+
+	f->url->offset = f->pos;
+	f->url->length = f->range;
+	if (f->size > 0 && f->range > f->size - f->pos)
+		f->url->length = f->size - f->pos;
+
+	if ((f->fetch = fetchXGet(f->url, &us, NULL)) == NULL)
+		return -1;
+
+	if (f->pos == 0) {
+		f->size = us.size;
+		/* the whole file was returned */
+		if (f->size <= 0 || (off_t)f->url->length <= 0 ||
+		    (off_t)f->url->length >= f->size)
+			f->ranges = false;
+	} else if (f->url->offset != f->pos) {
+		fetchIO_close(f->fetch);
+		f->fetch = NULL;
+		return -1;
+	}
+	return 0;
+}
+
 static int
 fetch_archive_open(struct archive *a, void *client_data)
 {
@@ -52,6 +95,16 @@ fetch_archive_open(struct archive *a, void *client_data)
 
 	(void)a;
 
+	f->pos = f->size = 0;
+	f->range = FETCH_RANGE_MIN;
+	f->ranges = (strcasecmp(f->url->scheme, SCHEME_HTTP) == 0 ||
+	    strcasecmp(f->url->scheme, SCHEME_HTTPS) == 0);
+
+	if (f->ranges) {
+		if (fetch_archive_range(f) == -1)
+			return ENOENT;
+		return 0;
+	}
 	f->fetch = fetchGet(f->url, NULL);
 	if (f->fetch == NULL)
 		return ENOENT;
@@ -63,11 +116,36 @@ static ssize_t
 fetch_archive_read(struct archive *a, void *client_data, const void **buf)
 {
 	struct fetch_archive *f = client_data;
+	ssize_t n;
 
 	(void)a;
 	*buf = f->buffer;
 
-	return fetchIO_read(f->fetch, f->buffer, sizeof(f->buffer));
+	if (f->fetch == NULL)
+		return -1;
+
+	n = fetchIO_read(f->fetch, f->buffer, sizeof(f->buffer));
+	if (n != 0 || !f->ranges || f->pos >= f->size) {
+		if (n > 0)
+			f->pos += n;
+		return n;
+	}
+	/*
+	 * End of the current range, but not of the archive: ask for
+	 * the next one.
+	 */
+	fetchIO_close(f->fetch);
+	f->fetch = NULL;
+	if (f->range < FETCH_RANGE_MAX)
+		f->range *= 2;
+	if (fetch_archive_range(f) == -1)
+		return -1;
+
+	n = fetchIO_read(f->fetch, f->buffer, sizeof(f->buffer));
+	if (n > 0)
+		f->pos += n;
+
+	return n;
 }
 
 static int
@@ -79,6 +157,7 @@ fetch_archive_close(struct archive *a, void *client_data)
 
 	if (f->fetch != NULL)
 		fetchIO_close(f->fetch);
+	fetchFreeURL(f->url);
 	free(f);
 
 	return 0;
@@ -91,11 +170,14 @@ open_archive_by_url(struct url *url)
 	struct archive *a;
 
 	f = malloc(sizeof(struct fetch_archive));
-	if (f == NULL)
+	if (f == NULL) {
+		fetchFreeURL(url);
 		return NULL;
-
+	}
 	f->url = url;
+	f->fetch = NULL;
 	if ((a = archive_read_new()) == NULL) {
+		fetchFreeURL(url);
 		free(f);
 		return NULL;
 	}
@@ -139,59 +221,143 @@ open_archive(const char *url)
 	if ((u = fetchParseURL(url)) == NULL)
 		return NULL;
 
-	a = open_archive_by_url(u);
-	fetchFreeURL(u);
+	/* the url is released with the archive */
+	return open_archive_by_url(u);
+}
+
+/*
+ * xbps-create(8) -x writes the metadata plists of a binary package next
+ * to it, as <binpkg>.props.plist and <binpkg>.files.plist, with the size
+ * and mtime of the package. They are used rather than the archive
+ * while the package hasn't been modified.
+ */
+static prop_dictionary_t
+sidecar_plist(const char *binpkg, const char *plistf)
+{
+	prop_dictionary_t d;
+	struct stat st;
+	uint64_t size = 0, mtime = 0;
+	char *path, *rpath;
+
+	if (stat(binpkg, &st) == -1)
+		return NULL;
+	if (strncmp(plistf, "./", 2) == 0)
+		plistf += 2;
 
-	return a;
+	if ((path = xbps_xasprintf("%s.%s", binpkg, plistf)) == NULL)
+		return NULL;
+	d = prop_dictionary_internalize_from_file(path);
+	free(path);
+	if (d == NULL) {
+		/* repository symlinks point to <arch>/<binpkg> */
+		if ((rpath = realpath(binpkg, NULL)) == NULL)
+			return NULL;
+		path = xbps_xasprintf("%s.%s", rpath, plistf);
+		free(rpath);
+		if (path == NULL)
+			return NULL;
+		d = prop_dictionary_internalize_from_file(path);
+		free(path);
+		if (d == NULL)
+			return NULL;
+	}
+	if (!prop_dictionary_get_uint64(d, "filename-size", &size) ||
+	    !prop_dictionary_get_uint64(d, "filename-mtime", &mtime) ||
+	    size != (uint64_t)st.st_size || mtime != (uint64_t)st.st_mtime) {
+		/* stale, the package was rebuilt or copied */
+		prop_object_release(d);
+		return NULL;
+	}
+	prop_dictionary_remove(d, "filename-size");
+	prop_dictionary_remove(d, "filename-mtime");
+
+	return d;
 }
 
-prop_dictionary_t
-xbps_dictionary_metadata_plist_by_url(const char *url, const char *plistf)
+int
+xbps_dictionary_metadata_plists_by_url(const char *url,
+				       const char **plistf,
+				       prop_dictionary_t *plistd)
 {
-	prop_dictionary_t plistd = NULL;
 	struct archive *a;
 	struct archive_entry *entry;
 	const char *curpath, *comptype;
-	int i = 0;
+	size_t x, n, left = 0;
+	int i = 0, rv;
 
 	assert(url != NULL);
 	assert(plistf != NULL);
+	assert(plistd != NULL);
+
+	for (n = 0; plistf[n] != NULL; n++) {
+		plistd[n] = NULL;
+		if (!xbps_check_is_repository_uri_remote(url))
+			plistd[n] = sidecar_plist(url, plistf[n]);
+		if (plistd[n] == NULL)
+			left++;
+	}
+	if (left == 0)
+		return 0;
 
+	errno = 0;
 	if ((a = open_archive(url)) == NULL)
-		return NULL;
+		return errno ? errno : EINVAL;
 
 	/*
 	 * Save compression type string for future use.
 	 */
 	comptype = archive_compression_name(a);
 
+	rv = ENOENT;
 	while ((archive_read_next_header(a, &entry)) == ARCHIVE_OK) {
 		curpath = archive_entry_pathname(entry);
-		if (strcmp(curpath, plistf)) {
+		for (x = 0; x < n; x++) {
+			if (plistd[x] == NULL && strcmp(curpath, plistf[x]) == 0)
+				break;
+		}
+		if (x == n) {
 			archive_read_data_skip(a);
 			if (i >= 3) {
 				/*
 				 * Archive does not contain required
-				 * plist file, discard it completely.
+				 * plist files, discard it completely.
 				 */
-				errno = ENOENT;
 				break;
 			}
 			i++;
 			continue;
 		}
-		plistd = xbps_dictionary_from_archive_entry(a, entry);
-		if (plistd == NULL) {
-			errno = EINVAL;
+		plistd[x] = xbps_dictionary_from_archive_entry(a, entry);
+		if (plistd[x] == NULL) {
+			rv = EINVAL;
 			break;
 		}
-		prop_dictionary_set_cstring_nocopy(plistd,
+		prop_dictionary_set_cstring_nocopy(plistd[x],
 		    "archive-compression-type", comptype);
 
-		break;
+		if (--left == 0) {
+			rv = 0;
+			break;
+		}
 	}
 	archive_read_close(a);
 	archive_read_free(a);
 
+	return rv;
+}
+
+prop_dictionary_t
+xbps_dictionary_metadata_plist_by_url(const char *url, const char *plistf)
+{
+	prop_dictionary_t plistd;
+	const char *plists[] = { plistf, NULL };
+	int rv;
+
+	assert(plistf != NULL);
+
+	if ((rv = xbps_dictionary_metadata_plists_by_url(url, plists,
+	    &plistd)) != 0)
+		errno = rv;
+
 	return plistd;
 }
@@ -47,19 +47,30 @@ find_pkg_in_array(struct xbps_handle *xhp,
 		  bool virtual,
 		  const char *targetarch)
 {
-	prop_object_iterator_t iter;
+	const struct xbps_pkgpattern *pp = NULL;
+	prop_object_t const *objs = NULL;
 	prop_object_t obj = NULL;
 	const char *pkgver, *dpkgn, *arch;
+	unsigned int i, cnt;
 	bool chkarch;
 
 	assert(prop_object_type(array) == PROP_TYPE_ARRAY);
 	assert(str != NULL);
 
-	iter = prop_array_iterator(array);
-	if (iter == NULL)
-		return NULL;
+	if (bypattern && !virtual) {
+		if ((pp = xbps_pkgpattern_cached(xhp, str)) == NULL)
+			return NULL;
+	}
+
+	/*
+	 * Repository indexes are immutable, walk them directly;
+	 * otherwise access objects by index.
+	 */
+	if (!prop_array_immutable_objects(array, &objs, &cnt))
+		cnt = prop_array_count(array);
 
-	while ((obj = prop_object_iterator_next(iter))) {
+	for (i = 0; i < cnt; i++) {
+		obj = objs ? objs[i] : prop_array_get(array, i);
 		chkarch = prop_dictionary_get_cstring_nocopy(obj,
 		    "architecture", &arch);
 		if (chkarch && !xbps_pkg_arch_match(xhp, arch, targetarch))
@@ -80,7 +91,7 @@ find_pkg_in_array(struct xbps_handle *xhp,
 			if (!prop_dictionary_get_cstring_nocopy(obj,
 			    "pkgver", &pkgver))
 				continue;
-			if (xbps_pkgpattern_match(pkgver, str))
+			if (xbps_pkgpattern_match_compiled(pkgver, pp))
 				break;
 		} else {
 			if (!prop_dictionary_get_cstring_nocopy(obj,
@@ -90,8 +101,7 @@ find_pkg_in_array(struct xbps_handle *xhp,
 				break;
 		}
 	}
-	prop_object_iterator_release(iter);
-	if (obj == NULL) {
+	if (i == cnt) {
 		errno = ENOENT;
 		return NULL;
 	}
@@ -123,19 +133,20 @@ xbps_find_pkg_in_array_by_pkgver(struct xbps_handle *xhp,
 				 const char *pkgver,
 				 const char *targetarch)
 {
-	prop_object_iterator_t iter;
-	prop_object_t obj = NULL;
+	prop_object_t const *objs = NULL;
+	prop_object_t obj;
 	const char *rpkgver, *arch;
-	bool chkarch, found = false;
+	unsigned int i, cnt;
+	bool chkarch;
 
 	assert(prop_object_type(array) == PROP_TYPE_ARRAY);
 	assert(pkgver != NULL);
 
-	iter = prop_array_iterator(array);
-	if (iter == NULL)
-		return NULL;
+	if (!prop_array_immutable_objects(array, &objs, &cnt))
+		cnt = prop_array_count(array);
 
-	while ((obj = prop_object_iterator_next(iter))) {
+	for (i = 0; i < cnt; i++) {
+		obj = objs ? objs[i] : prop_array_get(array, i);
 		chkarch = prop_dictionary_get_cstring_nocopy(obj,
 		    "architecture", &arch);
 		if (!prop_dictionary_get_cstring_nocopy(obj,
@@ -143,14 +154,9 @@ xbps_find_pkg_in_array_by_pkgver(struct xbps_handle *xhp,
 			continue;
 		if (chkarch && !xbps_pkg_arch_match(xhp, arch, targetarch))
 			continue;
-		if (strcmp(pkgver, rpkgver) == 0) {
-			found = true;
-			break;
-		}
+		if (strcmp(pkgver, rpkgver) == 0)
+			return obj;
 	}
-	prop_object_iterator_release(iter);
-	if (found)
-		return obj;
 
 	return NULL;
 }
@@ -176,6 +182,7 @@ find_virtualpkg_user_in_conf(struct xbps_handle *xhp,
 			     const char *vpkg,
 			     bool bypattern)
 {
+	const struct xbps_pkgpattern *pp = NULL;
 	const char *vpkgver, *pkg = NULL;
 	char *vpkgname = NULL, *tmp;
 	size_t i, j, cnt;
@@ -204,7 +211,12 @@ find_virtualpkg_user_in_conf(struct xbps_handle *xhp,
 			if (vpkgname == NULL)
 				break;
 			if (bypattern) {
-				if (!xbps_pkgpattern_match(vpkgver, vpkg)) {
+				if (pp == NULL &&
+				    (pp = xbps_pkgpattern_cached(xhp, vpkg)) == NULL) {
+					free(vpkgname);
+					return NULL;
+				}
+				if (!xbps_pkgpattern_match_compiled(vpkgver, pp)) {
 					free(vpkgname);
 					continue;
 				}
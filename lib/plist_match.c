@@ -91,20 +91,21 @@ xbps_match_any_virtualpkg_in_rundeps(prop_array_t rundeps,
 static bool
 match_string_in_array(prop_array_t array, const char *str, int mode)
 {
-	prop_object_iterator_t iter;
+	prop_object_t const *objs = NULL;
 	prop_object_t obj;
 	const char *pkgdep;
 	char *curpkgname, *tmp;
+	unsigned int i, cnt;
 	bool found = false;
 
 	assert(prop_object_type(array) == PROP_TYPE_ARRAY);
 	assert(str != NULL);
 
-	iter = prop_array_iterator(array);
-	if (iter == NULL)
-		return false;
+	if (!prop_array_immutable_objects(array, &objs, &cnt))
+		cnt = prop_array_count(array);
 
-	while ((obj = prop_object_iterator_next(iter))) {
+	for (i = 0; i < cnt; i++) {
+		obj = objs ? objs[i] : prop_array_get(array, i);
 		tmp = NULL;
 		if (mode == 0) {
 			/* match by string */
@@ -166,7 +167,6 @@ match_string_in_array(prop_array_t array, const char *str, int mode)
 				free(tmp);
 		}
 	}
-	prop_object_iterator_release(iter);
 
 	return found;
 }
@@ -34,6 +34,7 @@
 
 #include <stdint.h>
 #include <prop/prop_object.h>
+#include <sys/types.h>
 
 typedef struct _prop_array *prop_array_t;
 
@@ -54,6 +55,9 @@ bool		prop_array_mutable(prop_array_t);
 prop_object_iterator_t prop_array_iterator(prop_array_t);
 
 prop_object_t	prop_array_get(prop_array_t, unsigned int);
+bool		prop_array_immutable_objects(prop_array_t,
+					     prop_object_t const **,
+					     unsigned int *);
 bool		prop_array_set(prop_array_t, unsigned int, prop_object_t);
 bool		prop_array_add(prop_array_t, prop_object_t);
 void		prop_array_remove(prop_array_t, unsigned int);
@@ -65,9 +69,18 @@ prop_array_t	prop_array_internalize(const char *);
 
 bool		prop_array_externalize_to_file(prop_array_t, const char *);
 bool		prop_array_externalize_to_zfile(prop_array_t, const char *);
+bool		prop_array_externalize_to_zfile_level(prop_array_t,
+						     const char *, int);
 prop_array_t	prop_array_internalize_from_file(const char *);
 prop_array_t	prop_array_internalize_from_zfile(const char *);
 
+void *		prop_array_externalize_binary(prop_array_t, size_t *);
+prop_array_t	prop_array_internalize_binary(const void *, size_t);
+bool		prop_array_externalize_binary_to_file(prop_array_t,
+						      const char *);
+bool		prop_array_externalize_binary_to_zfile(prop_array_t,
+						       const char *);
+
 /*
  * Utility routines to make it more convenient to work with values
  * stored in dictionaries.
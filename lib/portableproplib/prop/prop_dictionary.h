@@ -78,9 +78,18 @@ bool		prop_dictionary_externalize_to_file(prop_dictionary_t,
 						    const char *);
 bool		prop_dictionary_externalize_to_zfile(prop_dictionary_t,
 						     const char *);
+bool		prop_dictionary_externalize_to_zfile_level(prop_dictionary_t,
+							   const char *, int);
 prop_dictionary_t prop_dictionary_internalize_from_file(const char *);
 prop_dictionary_t prop_dictionary_internalize_from_zfile(const char *);
 
+void *		prop_dictionary_externalize_binary(prop_dictionary_t, size_t *);
+prop_dictionary_t prop_dictionary_internalize_binary(const void *, size_t);
+bool		prop_dictionary_externalize_binary_to_file(prop_dictionary_t,
+							   const char *);
+bool		prop_dictionary_externalize_binary_to_zfile(prop_dictionary_t,
+							    const char *);
+
 const char *	prop_dictionary_keysym_cstring_nocopy(prop_dictionary_keysym_t);
 
 bool		prop_dictionary_keysym_equals(prop_dictionary_keysym_t,
@@ -34,6 +34,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <sys/types.h>
 
 typedef void *prop_object_t;
 
@@ -54,6 +55,8 @@ void		prop_object_release(prop_object_t);
 
 prop_type_t	prop_object_type(prop_object_t);
 
+bool		prop_binary_detect(const void *, size_t);
+
 bool		prop_object_equals(prop_object_t, prop_object_t);
 bool		prop_object_equals_with_error(prop_object_t, prop_object_t, bool *);
 
@@ -576,6 +576,35 @@ prop_array_mutable(prop_array_t pa)
 	return (rv);
 }
 
+/*
+ * prop_array_immutable_objects --
+ *	If the array is immutable, store a pointer to its internal
+ *	vector of objects in `objsp' and the number of objects in
+ *	`countp', and return true.  Immutable arrays can't change, so
+ *	the vector may be walked directly by index, without allocating
+ *	an iterator and without locking the array for every object.
+ *	Returns false for mutable arrays.
+ */
+bool
+prop_array_immutable_objects(prop_array_t pa, prop_object_t const **objsp,
+			     unsigned int *countp)
+{
+	bool rv = false;
+
+	if (! prop_object_is_array(pa))
+		return (false);
+
+	_PROP_RWLOCK_RDLOCK(pa->pa_rwlock);
+	if (prop_array_is_immutable(pa)) {
+		*objsp = pa->pa_array;
+		*countp = pa->pa_count;
+		rv = true;
+	}
+	_PROP_RWLOCK_UNLOCK(pa->pa_rwlock);
+
+	return (rv);
+}
+
 /*
  * prop_array_get --
  *	Return the object stored at the specified array index.
@@ -874,26 +903,15 @@ prop_array_internalize(const char *xml)
 bool
 prop_array_externalize_to_file(prop_array_t array, const char *fname)
 {
-	char *xml;
-	bool rv;
-	int save_errno = 0;	/* XXXGCC -Wuninitialized [mips, ...] */
-
-	xml = prop_array_externalize(array);
-	if (xml == NULL)
-		return (false);
-	rv = _prop_object_externalize_write_file(fname, xml, strlen(xml), false);
-	if (rv == false)
-		save_errno = errno;
-	_PROP_FREE(xml, M_TEMP);
-	if (rv == false)
-		errno = save_errno;
 
-	return (rv);
+	return (_prop_object_externalize_write_file(fname, array,
+	    _prop_object_externalize_xml, false, 0));
 }
 
 /*
  * prop_array_internalize_from_file --
- *	Internalize an array from a file.
+ *	Internalize an array from a file, either in XML or
+ *	in the binary format.
  */
 prop_array_t
 prop_array_internalize_from_file(const char *fname)
@@ -904,7 +922,11 @@ prop_array_internalize_from_file(const char *fname)
 	mf = _prop_object_internalize_map_file(fname);
 	if (mf == NULL)
 		return (NULL);
-	array = prop_array_internalize(mf->poimf_xml);
+	if (_prop_object_binary_magic(mf->poimf_xml, mf->poimf_len))
+		array = _prop_object_internalize_binary(mf->poimf_xml,
+		    mf->poimf_len, PROP_TYPE_ARRAY);
+	else
+		array = prop_array_internalize(mf->poimf_xml);
 	_prop_object_internalize_unmap_file(mf);
 
 	return (array);
@@ -0,0 +1,564 @@
+/*-
+ * Copyright (c) 2012 Juan Romero Pardines.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Compact binary encoding for property lists.
+ *
+ * The externalized representation is composed of:
+ *
+ *	magic		8 bytes, _PROP_BINARY_MAGIC.
+ *	nstrings	varint, number of entries in the string table.
+ *	strings		nstrings x (varint length, bytes, NUL).
+ *	root		the root object (an array or a dictionary).
+ *
+ * Every object starts with a one byte type tag:
+ *
+ *	_PB_FALSE, _PB_TRUE	no payload.
+ *	_PB_UINT		varint value.
+ *	_PB_INT			zigzag encoded varint value.
+ *	_PB_STRING		varint index into the string table.
+ *	_PB_DATA		varint length, bytes.
+ *	_PB_ARRAY		varint count, count x object.
+ *	_PB_DICT		varint count, count x (varint key index, object).
+ *
+ * Varints are unsigned LEB128. Dictionary keys and string values share
+ * the string table, so every distinct string is stored only once.
+ */
+
+#include <prop/proplib.h>
+#include "prop_object_impl.h"
+
+#include <errno.h>
+
+#define	_PROP_BINARY_MAGIC	"PROPBIN\x01"
+#define	_PROP_BINARY_MAGIC_LEN	8
+#define	_PROP_BINARY_MAXDEPTH	256
+
+enum {
+	_PB_FALSE = 1,
+	_PB_TRUE,
+	_PB_UINT,
+	_PB_INT,
+	_PB_STRING,
+	_PB_DATA,
+	_PB_ARRAY,
+	_PB_DICT
+};
+
+struct _prop_binary_externalize {
+	struct _prop_object_externalize_context *pbe_body;
+	struct _prop_object_externalize_context *pbe_strings;
+	const char	**pbe_strv;	/* interned strings */
+	unsigned int	*pbe_slots;	/* hash slots, index + 1 or 0 */
+	unsigned int	pbe_nstrings;
+	unsigned int	pbe_nslots;
+};
+
+struct _prop_binary_internalize {
+	const unsigned char *pbi_cp;
+	const unsigned char *pbi_end;
+	const char	**pbi_strv;
+	unsigned int	pbi_nstrings;
+};
+
+/*
+ * _prop_binary_append_varint --
+ *	Append an unsigned LEB128 encoded integer to the buffer.
+ */
+static bool
+_prop_binary_append_varint(struct _prop_object_externalize_context *ctx,
+    uint64_t val)
+{
+	char buf[10];
+	size_t len = 0;
+
+	do {
+		buf[len] = (char)(val & 0x7f);
+		val >>= 7;
+		if (val)
+			buf[len] |= (char)0x80;
+		len++;
+	} while (val);
+
+	return _prop_object_externalize_append_data(ctx, buf, len);
+}
+
+static uint32_t
+_prop_binary_hash(const char *str, size_t len)
+{
+	uint32_t h = 2166136261U;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)str[i];
+		h *= 16777619U;
+	}
+	return h;
+}
+
+/*
+ * _prop_binary_intern --
+ *	Return the string table index for `str', adding it to the
+ *	table if it wasn't there yet.
+ */
+static bool
+_prop_binary_intern(struct _prop_binary_externalize *pbe, const char *str,
+    unsigned int *idxp)
+{
+	const char **strv;
+	unsigned int *slots, nslots, i, slot;
+	size_t len = strlen(str);
+	uint32_t h = _prop_binary_hash(str, len);
+
+	for (slot = h & (pbe->pbe_nslots - 1); pbe->pbe_slots[slot] != 0;
+	     slot = (slot + 1) & (pbe->pbe_nslots - 1)) {
+		i = pbe->pbe_slots[slot] - 1;
+		if (strcmp(pbe->pbe_strv[i], str) == 0) {
+			*idxp = i;
+			return true;
+		}
+	}
+	/* Not found, add it to the table. */
+	if ((pbe->pbe_nstrings + 1) * 2 > pbe->pbe_nslots) {
+		nslots = pbe->pbe_nslots * 2;
+		strv = _PROP_REALLOC(pbe->pbe_strv,
+		    (nslots / 2) * sizeof(*strv), M_TEMP);
+		if (strv == NULL)
+			return false;
+		pbe->pbe_strv = strv;
+		slots = _PROP_CALLOC(nslots * sizeof(*slots), M_TEMP);
+		if (slots == NULL)
+			return false;
+		for (i = 0; i < pbe->pbe_nstrings; i++) {
+			const char *s = pbe->pbe_strv[i];
+
+			slot = _prop_binary_hash(s, strlen(s)) & (nslots - 1);
+			while (slots[slot] != 0)
+				slot = (slot + 1) & (nslots - 1);
+			slots[slot] = i + 1;
+		}
+		_PROP_FREE(pbe->pbe_slots, M_TEMP);
+		pbe->pbe_slots = slots;
+		pbe->pbe_nslots = nslots;
+
+		slot = h & (nslots - 1);
+		while (slots[slot] != 0)
+			slot = (slot + 1) & (nslots - 1);
+	}
+	if (_prop_binary_append_varint(pbe->pbe_strings, len) == false ||
+	    _prop_object_externalize_append_data(pbe->pbe_strings,
+	    str, len + 1) == false)
+		return false;
+
+	i = pbe->pbe_nstrings++;
+	pbe->pbe_strv[i] = str;
+	pbe->pbe_slots[slot] = i + 1;
+	*idxp = i;
+
+	return true;
+}
+
+static bool
+_prop_binary_encode(struct _prop_binary_externalize *pbe, prop_object_t obj,
+    unsigned int depth)
+{
+	struct _prop_object_externalize_context *ctx = pbe->pbe_body;
+	prop_object_iterator_t iter;
+	prop_object_t o;
+	const char *key;
+	unsigned int i, n, idx;
+	uint64_t u;
+	int64_t v;
+	char tag;
+
+	if (depth > _PROP_BINARY_MAXDEPTH)
+		return false;
+
+	switch (prop_object_type(obj)) {
+	case PROP_TYPE_BOOL:
+		tag = prop_bool_true(obj) ? _PB_TRUE : _PB_FALSE;
+		return _prop_object_externalize_append_char(ctx,
+		    (unsigned char)tag);
+	case PROP_TYPE_NUMBER:
+		if (prop_number_unsigned(obj)) {
+			u = prop_number_unsigned_integer_value(obj);
+			tag = _PB_UINT;
+		} else {
+			v = prop_number_integer_value(obj);
+			u = ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+			tag = _PB_INT;
+		}
+		return (_prop_object_externalize_append_char(ctx,
+		    (unsigned char)tag) &&
+		    _prop_binary_append_varint(ctx, u));
+	case PROP_TYPE_STRING:
+		if (_prop_binary_intern(pbe, prop_string_cstring_nocopy(obj),
+		    &idx) == false)
+			return false;
+		return (_prop_object_externalize_append_char(ctx, _PB_STRING) &&
+		    _prop_binary_append_varint(ctx, idx));
+	case PROP_TYPE_DATA:
+		n = prop_data_size(obj);
+		if (_prop_object_externalize_append_char(ctx, _PB_DATA) == false ||
+		    _prop_binary_append_varint(ctx, n) == false)
+			return false;
+		if (n == 0)
+			return true;
+		return _prop_object_externalize_append_data(ctx,
+		    prop_data_data_nocopy(obj), n);
+	case PROP_TYPE_ARRAY:
+		n = prop_array_count(obj);
+		if (_prop_object_externalize_append_char(ctx, _PB_ARRAY) == false ||
+		    _prop_binary_append_varint(ctx, n) == false)
+			return false;
+		for (i = 0; i < n; i++) {
+			o = prop_array_get(obj, i);
+			if (_prop_binary_encode(pbe, o, depth + 1) == false)
+				return false;
+		}
+		return true;
+	case PROP_TYPE_DICTIONARY:
+		n = prop_dictionary_count(obj);
+		if (_prop_object_externalize_append_char(ctx, _PB_DICT) == false ||
+		    _prop_binary_append_varint(ctx, n) == false)
+			return false;
+		if ((iter = prop_dictionary_iterator(obj)) == NULL)
+			return false;
+		while ((o = prop_object_iterator_next(iter)) != NULL) {
+			key = prop_dictionary_keysym_cstring_nocopy(o);
+			if (_prop_binary_intern(pbe, key, &idx) == false ||
+			    _prop_binary_append_varint(ctx, idx) == false ||
+			    _prop_binary_encode(pbe,
+			    prop_dictionary_get_keysym(obj, o),
+			    depth + 1) == false) {
+				prop_object_iterator_release(iter);
+				return false;
+			}
+		}
+		prop_object_iterator_release(iter);
+		return true;
+	default:
+		return false;
+	}
+}
+
+/*
+ * _prop_object_externalize_binary --
+ *	Append the binary representation of `obj' to the externalize
+ *	context, which may be streaming to a file.
+ */
+bool
+_prop_object_externalize_binary(struct _prop_object_externalize_context *ctx,
+    prop_object_t obj)
+{
+	struct _prop_binary_externalize pbe;
+	bool rv = false;
+
+	memset(&pbe, 0, sizeof(pbe));
+	pbe.pbe_nslots = 64;
+	pbe.pbe_slots = _PROP_CALLOC(pbe.pbe_nslots * sizeof(*pbe.pbe_slots),
+	    M_TEMP);
+	pbe.pbe_strv = _PROP_MALLOC((pbe.pbe_nslots / 2) *
+	    sizeof(*pbe.pbe_strv), M_TEMP);
+	pbe.pbe_body = _prop_object_externalize_context_alloc();
+	pbe.pbe_strings = _prop_object_externalize_context_alloc();
+	if (pbe.pbe_slots == NULL || pbe.pbe_strv == NULL ||
+	    pbe.pbe_body == NULL || pbe.pbe_strings == NULL)
+		goto out;
+
+	if (_prop_binary_encode(&pbe, obj, 0) == false)
+		goto out;
+
+	rv = _prop_object_externalize_append_data(ctx, _PROP_BINARY_MAGIC,
+	    _PROP_BINARY_MAGIC_LEN) &&
+	    _prop_binary_append_varint(ctx, pbe.pbe_nstrings) &&
+	    _prop_object_externalize_append_data(ctx,
+	    pbe.pbe_strings->poec_buf, pbe.pbe_strings->poec_len) &&
+	    _prop_object_externalize_append_data(ctx,
+	    pbe.pbe_body->poec_buf, pbe.pbe_body->poec_len);
+out:
+	if (pbe.pbe_body != NULL) {
+		_PROP_FREE(pbe.pbe_body->poec_buf, M_TEMP);
+		_prop_object_externalize_context_free(pbe.pbe_body);
+	}
+	if (pbe.pbe_strings != NULL) {
+		_PROP_FREE(pbe.pbe_strings->poec_buf, M_TEMP);
+		_prop_object_externalize_context_free(pbe.pbe_strings);
+	}
+	if (pbe.pbe_strv != NULL)
+		_PROP_FREE(pbe.pbe_strv, M_TEMP);
+	if (pbe.pbe_slots != NULL)
+		_PROP_FREE(pbe.pbe_slots, M_TEMP);
+
+	return rv;
+}
+
+static bool
+_prop_binary_get_varint(struct _prop_binary_internalize *pbi, uint64_t *valp)
+{
+	uint64_t val = 0;
+	unsigned int shift = 0;
+	unsigned char c;
+
+	do {
+		if (pbi->pbi_cp >= pbi->pbi_end || shift > 63)
+			return false;
+		c = *pbi->pbi_cp++;
+		val |= (uint64_t)(c & 0x7f) << shift;
+		shift += 7;
+	} while (c & 0x80);
+
+	*valp = val;
+	return true;
+}
+
+static bool
+_prop_binary_get_index(struct _prop_binary_internalize *pbi,
+    unsigned int *idxp)
+{
+	uint64_t val;
+
+	if (_prop_binary_get_varint(pbi, &val) == false ||
+	    val >= pbi->pbi_nstrings)
+		return false;
+
+	*idxp = (unsigned int)val;
+	return true;
+}
+
+static bool
+_prop_binary_get_count(struct _prop_binary_internalize *pbi,
+    unsigned int *countp)
+{
+	uint64_t val;
+
+	/* Every element takes at least one byte. */
+	if (_prop_binary_get_varint(pbi, &val) == false ||
+	    val > (uint64_t)(pbi->pbi_end - pbi->pbi_cp))
+		return false;
+
+	*countp = (unsigned int)val;
+	return true;
+}
+
+static prop_object_t
+_prop_binary_decode(struct _prop_binary_internalize *pbi, unsigned int depth)
+{
+	prop_object_t obj, o;
+	unsigned int i, n, idx;
+	uint64_t u;
+
+	if (depth > _PROP_BINARY_MAXDEPTH || pbi->pbi_cp >= pbi->pbi_end)
+		return NULL;
+
+	switch (*pbi->pbi_cp++) {
+	case _PB_FALSE:
+		return prop_bool_create(false);
+	case _PB_TRUE:
+		return prop_bool_create(true);
+	case _PB_UINT:
+		if (_prop_binary_get_varint(pbi, &u) == false)
+			return NULL;
+		return prop_number_create_unsigned_integer(u);
+	case _PB_INT:
+		if (_prop_binary_get_varint(pbi, &u) == false)
+			return NULL;
+		return prop_number_create_integer(
+		    (int64_t)(u >> 1) ^ -(int64_t)(u & 1));
+	case _PB_STRING:
+		if (_prop_binary_get_index(pbi, &idx) == false)
+			return NULL;
+		return prop_string_create_cstring(pbi->pbi_strv[idx]);
+	case _PB_DATA:
+		if (_prop_binary_get_count(pbi, &n) == false)
+			return NULL;
+		obj = prop_data_create_data(pbi->pbi_cp, n);
+		pbi->pbi_cp += n;
+		return obj;
+	case _PB_ARRAY:
+		if (_prop_binary_get_count(pbi, &n) == false)
+			return NULL;
+		if ((obj = prop_array_create_with_capacity(n)) == NULL)
+			return NULL;
+		for (i = 0; i < n; i++) {
+			if ((o = _prop_binary_decode(pbi, depth + 1)) == NULL ||
+			    prop_array_add(obj, o) == false) {
+				if (o != NULL)
+					prop_object_release(o);
+				prop_object_release(obj);
+				return NULL;
+			}
+			prop_object_release(o);
+		}
+		return obj;
+	case _PB_DICT:
+		if (_prop_binary_get_count(pbi, &n) == false)
+			return NULL;
+		if ((obj = prop_dictionary_create_with_capacity(n)) == NULL)
+			return NULL;
+		for (i = 0; i < n; i++) {
+			o = NULL;
+			if (_prop_binary_get_index(pbi, &idx) == false ||
+			    (o = _prop_binary_decode(pbi, depth + 1)) == NULL ||
+			    prop_dictionary_set(obj, pbi->pbi_strv[idx],
+			    o) == false) {
+				if (o != NULL)
+					prop_object_release(o);
+				prop_object_release(obj);
+				return NULL;
+			}
+			prop_object_release(o);
+		}
+		return obj;
+	default:
+		return NULL;
+	}
+}
+
+/*
+ * _prop_object_binary_magic --
+ *	Returns true if `buf' starts with the binary plist magic.
+ */
+bool
+_prop_object_binary_magic(const void *buf, size_t len)
+{
+
+	return (len >= _PROP_BINARY_MAGIC_LEN &&
+	    memcmp(buf, _PROP_BINARY_MAGIC, _PROP_BINARY_MAGIC_LEN) == 0);
+}
+
+/*
+ * _prop_object_internalize_binary --
+ *	Create an object of type `type' from its binary representation.
+ */
+prop_object_t
+_prop_object_internalize_binary(const void *buf, size_t len, prop_type_t type)
+{
+	struct _prop_binary_internalize pbi;
+	prop_object_t obj = NULL;
+	unsigned int i;
+	uint64_t slen;
+
+	if (_prop_object_binary_magic(buf, len) == false) {
+		errno = EINVAL;
+		return NULL;
+	}
+	memset(&pbi, 0, sizeof(pbi));
+	pbi.pbi_cp = (const unsigned char *)buf + _PROP_BINARY_MAGIC_LEN;
+	pbi.pbi_end = (const unsigned char *)buf + len;
+
+	if (_prop_binary_get_count(&pbi, &pbi.pbi_nstrings) == false)
+		goto out;
+	if (pbi.pbi_nstrings > 0) {
+		pbi.pbi_strv = _PROP_MALLOC(pbi.pbi_nstrings *
+		    sizeof(*pbi.pbi_strv), M_TEMP);
+		if (pbi.pbi_strv == NULL)
+			goto out;
+	}
+	/*
+	 * Strings are NUL-terminated in the table, so they can
+	 * be used directly from the input buffer.
+	 */
+	for (i = 0; i < pbi.pbi_nstrings; i++) {
+		if (_prop_binary_get_varint(&pbi, &slen) == false ||
+		    slen >= (uint64_t)(pbi.pbi_end - pbi.pbi_cp) ||
+		    pbi.pbi_cp[slen] != '\0')
+			goto out;
+		pbi.pbi_strv[i] = (const char *)pbi.pbi_cp;
+		pbi.pbi_cp += slen + 1;
+	}
+	obj = _prop_binary_decode(&pbi, 0);
+	if (obj != NULL && prop_object_type(obj) != type) {
+		prop_object_release(obj);
+		obj = NULL;
+	}
+out:
+	if (pbi.pbi_strv != NULL)
+		_PROP_FREE(pbi.pbi_strv, M_TEMP);
+	if (obj == NULL)
+		errno = EINVAL;
+
+	return obj;
+}
+
+#define TEMPLATE(type)								\
+void *										\
+prop ## type ## _externalize_binary(prop ## type ## _t obj, size_t *lenp)	\
+{										\
+	struct _prop_object_externalize_context *ctx;				\
+	char *buf;								\
+										\
+	if ((ctx = _prop_object_externalize_context_alloc()) == NULL)		\
+		return NULL;							\
+	if (_prop_object_externalize_binary(ctx, obj) == false) {		\
+		_PROP_FREE(ctx->poec_buf, M_TEMP);				\
+		_prop_object_externalize_context_free(ctx);			\
+		return NULL;							\
+	}									\
+	buf = ctx->poec_buf;							\
+	*lenp = ctx->poec_len;							\
+	_prop_object_externalize_context_free(ctx);				\
+										\
+	return buf;								\
+}										\
+										\
+bool										\
+prop ## type ## _externalize_binary_to_file(prop ## type ## _t obj,		\
+					    const char *fname)			\
+{										\
+	return _prop_object_externalize_write_file(fname, obj,			\
+	    _prop_object_externalize_binary, false, 0);				\
+}										\
+										\
+bool										\
+prop ## type ## _externalize_binary_to_zfile(prop ## type ## _t obj,		\
+					     const char *fname)			\
+{										\
+	return _prop_object_externalize_write_file(fname, obj,			\
+	    _prop_object_externalize_binary, true, Z_BEST_COMPRESSION);		\
+}
+
+TEMPLATE(_array)
+TEMPLATE(_dictionary)
+
+#undef TEMPLATE
+
+prop_array_t
+prop_array_internalize_binary(const void *buf, size_t len)
+{
+	return _prop_object_internalize_binary(buf, len, PROP_TYPE_ARRAY);
+}
+
+prop_dictionary_t
+prop_dictionary_internalize_binary(const void *buf, size_t len)
+{
+	return _prop_object_internalize_binary(buf, len, PROP_TYPE_DICTIONARY);
+}
+
+bool
+prop_binary_detect(const void *buf, size_t len)
+{
+	return _prop_object_binary_magic(buf, len);
+}
@@ -1383,27 +1383,15 @@ prop_dictionary_internalize(const char *xml)
 bool
 prop_dictionary_externalize_to_file(prop_dictionary_t dict, const char *fname)
 {
-	char *xml;
-	bool rv;
-	int save_errno = 0;	/* XXXGCC -Wuninitialized [mips, ...] */
-
-	xml = prop_dictionary_externalize(dict);
-	if (xml == NULL)
-		return (false);
-	rv = _prop_object_externalize_write_file(fname, xml, strlen(xml),
-	    false);
-	if (rv == false)
-		save_errno = errno;
-	_PROP_FREE(xml, M_TEMP);
-	if (rv == false)
-		errno = save_errno;
 
-	return (rv);
+	return (_prop_object_externalize_write_file(fname, dict,
+	    _prop_object_externalize_xml, false, 0));
 }
 
 /*
  * prop_dictionary_internalize_from_file --
- *	Internalize a dictionary from a file.
+ *	Internalize a dictionary from a file, either in XML or
+ *	in the binary format.
  */
 prop_dictionary_t
 prop_dictionary_internalize_from_file(const char *fname)
@@ -1414,7 +1402,11 @@ prop_dictionary_internalize_from_file(const char *fname)
 	mf = _prop_object_internalize_map_file(fname);
 	if (mf == NULL)
 		return (NULL);
-	dict = prop_dictionary_internalize(mf->poimf_xml);
+	if (_prop_object_binary_magic(mf->poimf_xml, mf->poimf_len))
+		dict = _prop_object_internalize_binary(mf->poimf_xml,
+		    mf->poimf_len, PROP_TYPE_DICTIONARY);
+	else
+		dict = prop_dictionary_internalize(mf->poimf_xml);
 	_prop_object_internalize_unmap_file(mf);
 
 	return (dict);
@@ -141,26 +141,30 @@ _prop_object_externalize_append_cstring(
     struct _prop_object_externalize_context *ctx, const char *cp)
 {
 
-	while (*cp != '\0') {
-		if (_prop_object_externalize_append_char(ctx,
-						(unsigned char) *cp) == false)
-			return (false);
-		cp++;
-	}
-
-	return (true);
+	return (_prop_object_externalize_append_data(ctx, cp, strlen(cp)));
 }
 
 /*
  * _prop_object_externalize_append_encoded_cstring --
  *	Append an encoded C string to the externalize buffer.
+ *	Runs of characters that don't need to be escaped are
+ *	appended in bulk.
  */
 bool
 _prop_object_externalize_append_encoded_cstring(
     struct _prop_object_externalize_context *ctx, const char *cp)
 {
+	size_t len;
 
 	while (*cp != '\0') {
+		len = strcspn(cp, "<>&");
+		if (len > 0) {
+			if (_prop_object_externalize_append_data(ctx,
+					cp, len) == false)
+				return (false);
+			cp += len;
+			continue;
+		}
 		switch (*cp) {
 		case '<':
 			if (_prop_object_externalize_append_cstring(ctx,
@@ -177,11 +181,6 @@ _prop_object_externalize_append_encoded_cstring(
 					"&amp;") == false)
 				return (false);
 			break;
-		default:
-			if (_prop_object_externalize_append_char(ctx,
-					(unsigned char) *cp) == false)
-				return (false);
-			break;
 		}
 		cp++;
 	}
@@ -190,6 +189,128 @@ _prop_object_externalize_append_encoded_cstring(
 }
 
 #define	BUF_EXPAND		256
+#define	BUF_STREAM		65536
+
+#if !defined(_KERNEL) && !defined(_STANDALONE)
+/*
+ * _prop_object_externalize_write --
+ *	Write `len' bytes from `cp' to the output file (or zlib stream)
+ *	of the externalize context.
+ */
+static bool
+_prop_object_externalize_write(struct _prop_object_externalize_context *ctx,
+    const char *cp, size_t len)
+{
+	ssize_t n;
+
+	if (ctx->poec_gzf != NULL) {
+		if (gzwrite(ctx->poec_gzf, cp, (unsigned int)len) != (int)len)
+			return (false);
+		return (true);
+	}
+	while (len > 0) {
+		n = write(ctx->poec_fd, cp, len);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return (false);
+		}
+		cp += n;
+		len -= (size_t)n;
+	}
+
+	return (true);
+}
+
+/*
+ * _prop_object_externalize_flush --
+ *	Write out the contents of the externalize buffer to the
+ *	output file (or zlib stream) and empty it.
+ */
+static bool
+_prop_object_externalize_flush(struct _prop_object_externalize_context *ctx)
+{
+
+	if (ctx->poec_len == 0)
+		return (true);
+
+	if (_prop_object_externalize_write(ctx, ctx->poec_buf,
+	    ctx->poec_len) == false)
+		return (false);
+
+	ctx->poec_len = 0;
+
+	return (true);
+}
+#endif /* !_KERNEL && !_STANDALONE */
+
+/*
+ * _prop_object_externalize_reserve --
+ *	Make room for at least `len' more bytes in the externalize buffer.
+ *	If the context is streaming to a file the buffer is flushed first,
+ *	otherwise it grows geometrically.
+ */
+static bool
+_prop_object_externalize_reserve(
+    struct _prop_object_externalize_context *ctx, size_t len)
+{
+	size_t ncap;
+	char *cp;
+
+#if !defined(_KERNEL) && !defined(_STANDALONE)
+	if (ctx->poec_fd != -1) {
+		if (_prop_object_externalize_flush(ctx) == false)
+			return (false);
+		if (len <= ctx->poec_capacity)
+			return (true);
+	}
+#endif
+	ncap = ctx->poec_capacity;
+	while (ncap - ctx->poec_len < len) {
+		if (ncap > SIZE_MAX / 2)
+			return (false);
+		ncap *= 2;
+	}
+	cp = _PROP_REALLOC(ctx->poec_buf, ncap, M_TEMP);
+	if (cp == NULL)
+		return (false);
+	ctx->poec_capacity = ncap;
+	ctx->poec_buf = cp;
+
+	return (true);
+}
+
+/*
+ * _prop_object_externalize_append_data --
+ *	Append `len' bytes from `cp' to the externalize buffer.
+ */
+bool
+_prop_object_externalize_append_data(
+    struct _prop_object_externalize_context *ctx, const char *cp, size_t len)
+{
+
+	_PROP_ASSERT(ctx->poec_capacity != 0);
+	_PROP_ASSERT(ctx->poec_buf != NULL);
+	_PROP_ASSERT(ctx->poec_len <= ctx->poec_capacity);
+
+#if !defined(_KERNEL) && !defined(_STANDALONE)
+	/*
+	 * When streaming, chunks that don't fit in the buffer
+	 * are written out directly rather than copied.
+	 */
+	if (ctx->poec_fd != -1 && len > ctx->poec_capacity)
+		return (_prop_object_externalize_flush(ctx) &&
+		    _prop_object_externalize_write(ctx, cp, len));
+#endif
+	if (ctx->poec_capacity - ctx->poec_len < len &&
+	    _prop_object_externalize_reserve(ctx, len) == false)
+		return (false);
+
+	memcpy(ctx->poec_buf + ctx->poec_len, cp, len);
+	ctx->poec_len += len;
+
+	return (true);
+}
 
 /*
  * _prop_object_externalize_append_char --
@@ -204,15 +325,9 @@ _prop_object_externalize_append_char(
 	_PROP_ASSERT(ctx->poec_buf != NULL);
 	_PROP_ASSERT(ctx->poec_len <= ctx->poec_capacity);
 
-	if (ctx->poec_len == ctx->poec_capacity) {
-		char *cp = _PROP_REALLOC(ctx->poec_buf,
-					 ctx->poec_capacity + BUF_EXPAND,
-					 M_TEMP);
-		if (cp == NULL)
-			return (false);
-		ctx->poec_capacity = ctx->poec_capacity + BUF_EXPAND;
-		ctx->poec_buf = cp;
-	}
+	if (ctx->poec_len == ctx->poec_capacity &&
+	    _prop_object_externalize_reserve(ctx, 1) == false)
+		return (false);
 
 	ctx->poec_buf[ctx->poec_len++] = c;
 
@@ -243,19 +358,40 @@ _prop_object_externalize_header(struct _prop_object_externalize_context *ctx)
 /*
  * _prop_object_externalize_footer --
  *	Append the standard XML footer to the externalize buffer.  This
- *	also NUL-terminates the buffer.
+ *	also NUL-terminates the buffer, unless it's being streamed to a file.
  */
 bool
 _prop_object_externalize_footer(struct _prop_object_externalize_context *ctx)
 {
 
-	if (_prop_object_externalize_end_tag(ctx, "plist") == false ||
-	    _prop_object_externalize_append_char(ctx, '\0') == false)
+	if (_prop_object_externalize_end_tag(ctx, "plist") == false)
+		return (false);
+#if !defined(_KERNEL) && !defined(_STANDALONE)
+	if (ctx->poec_fd != -1)
+		return (true);
+#endif
+	if (_prop_object_externalize_append_char(ctx, '\0') == false)
 		return (false);
 
 	return (true);
 }
 
+/*
+ * _prop_object_externalize_xml --
+ *	Append the complete XML representation of an object, including
+ *	the standard header and footer, to the externalize buffer.
+ */
+bool
+_prop_object_externalize_xml(struct _prop_object_externalize_context *ctx,
+    prop_object_t obj)
+{
+	struct _prop_object *po = obj;
+
+	return (_prop_object_externalize_header(ctx) &&
+	    (*po->po_type->pot_extern)(ctx, obj) &&
+	    _prop_object_externalize_footer(ctx));
+}
+
 /*
  * _prop_object_externalize_context_alloc --
  *	Allocate an externalize context.
@@ -275,6 +411,10 @@ _prop_object_externalize_context_alloc(void)
 		ctx->poec_len = 0;
 		ctx->poec_capacity = BUF_EXPAND;
 		ctx->poec_depth = 0;
+#if !defined(_KERNEL) && !defined(_STANDALONE)
+		ctx->poec_fd = -1;
+		ctx->poec_gzf = NULL;
+#endif
 	}
 	return (ctx);
 }
@@ -800,28 +940,28 @@ _prop_object_externalize_file_dirname(const char *path, char *result)
 
 /*
  * _prop_object_externalize_write_file --
- *	Write an externalized dictionary to the specified file.
+ *	Externalize an object to the specified file.
  *	The file is written atomically from the caller's perspective,
  *	and the mode set to 0666 modified by the caller's umask.
  *
+ *	The representation produced by `extern' (XML or binary) is
+ *	streamed to the file in BUF_STREAM sized chunks, rather than
+ *	built in memory as a whole.
+ *
  *	The 'compress' argument enables gzip (via zlib) compression
- *	for the file to be written.
+ *	for the file to be written, with the compression level set
+ *	in 'level' (see deflateInit(3)).
  */
 bool
-_prop_object_externalize_write_file(const char *fname, const char *xml,
-    size_t len, bool do_compress)
+_prop_object_externalize_write_file(const char *fname, prop_object_t obj,
+    _prop_object_externalizer_t extern_func, bool do_compress, int level)
 {
-	gzFile gzf = NULL;
-	char tname[PATH_MAX], *otname;
-	int fd;
+	struct _prop_object_externalize_context *ctx;
+	char tname[PATH_MAX], mode[8], *otname;
+	int fd, gzfd = -1;
 	int save_errno;
 	mode_t myumask;
 
-	if (len > SSIZE_MAX) {
-		errno = EFBIG;
-		return (false);
-	}
-
 	/*
 	 * Get the directory name where the file is to be written
 	 * and create the temporary file.
@@ -841,21 +981,59 @@ _prop_object_externalize_write_file(const char *fname, const char *xml,
 		return (false);
 	}
 #endif	
-	if ((fd = mkstemp(tname)) == -1)
+	if ((ctx = _prop_object_externalize_context_alloc()) == NULL)
 		return (false);
 
+	if ((fd = mkstemp(tname)) == -1) {
+		save_errno = errno;
+		_PROP_FREE(ctx->poec_buf, M_TEMP);
+		_prop_object_externalize_context_free(ctx);
+		errno = save_errno;
+		return (false);
+	}
+	ctx->poec_fd = fd;
+
+	/* Use a larger buffer, it's flushed whenever it's full. */
+	otname = _PROP_REALLOC(ctx->poec_buf, BUF_STREAM, M_TEMP);
+	if (otname == NULL)
+		goto bad;
+	ctx->poec_buf = otname;
+	ctx->poec_capacity = BUF_STREAM;
+
 	if (do_compress) {
-		if ((gzf = gzdopen(fd, "a")) == NULL)
+		/*
+		 * zlib owns the descriptor passed to gzdopen(), use a
+		 * duplicate so that the original can still be synced
+		 * once the stream has been finished.
+		 */
+		if (level < Z_NO_COMPRESSION || level > Z_BEST_COMPRESSION)
+			level = Z_DEFAULT_COMPRESSION;
+		if (level == Z_DEFAULT_COMPRESSION)
+			(void)snprintf(mode, sizeof(mode), "wb");
+		else
+			(void)snprintf(mode, sizeof(mode), "wb%d", level);
+
+		if ((gzfd = dup(fd)) == -1)
 			goto bad;
-
-		if (gzsetparams(gzf, Z_BEST_COMPRESSION, Z_DEFAULT_STRATEGY))
+		if ((ctx->poec_gzf = gzdopen(gzfd, mode)) == NULL)
 			goto bad;
+#if ZLIB_VERNUM >= 0x1240
+		(void)gzbuffer(ctx->poec_gzf, BUF_STREAM);
+#endif
+	}
 
-		if (gzwrite(gzf, xml, len) != (ssize_t)len)
-			goto bad;
-	} else {
-		if (write(fd, xml, len) != (ssize_t)len)
+	if ((*extern_func)(ctx, obj) == false ||
+	    _prop_object_externalize_flush(ctx) == false)
+		goto bad;
+
+	if (ctx->poec_gzf != NULL) {
+		gzfd = -1;
+		if (gzclose(ctx->poec_gzf) != Z_OK) {
+			ctx->poec_gzf = NULL;
+			errno = EIO;
 			goto bad;
+		}
+		ctx->poec_gzf = NULL;
 	}
 
 #ifdef HAVE_FDATASYNC
@@ -870,24 +1048,28 @@ _prop_object_externalize_write_file(const char *fname, const char *xml,
 	if (fchmod(fd, 0666 & ~myumask) == -1)
 		goto bad;
 
-	if (do_compress)
-		(void)gzclose(gzf);
-	else
-		(void)close(fd);
+	(void)close(fd);
 	fd = -1;
 
 	if (rename(tname, fname) == -1)
 		goto bad;
 
+	_PROP_FREE(ctx->poec_buf, M_TEMP);
+	_prop_object_externalize_context_free(ctx);
+
 	return (true);
 
  bad:
 	save_errno = errno;
-	if (do_compress && gzf != NULL)
-		(void)gzclose(gzf);
-	else if (fd != -1)
+	if (ctx->poec_gzf != NULL)
+		(void)gzclose(ctx->poec_gzf);
+	else if (gzfd != -1)
+		(void)close(gzfd);
+	if (fd != -1)
 		(void)close(fd);
 	(void) unlink(tname);
+	_PROP_FREE(ctx->poec_buf, M_TEMP);
+	_prop_object_externalize_context_free(ctx);
 	errno = save_errno;
 	return (false);
 }
@@ -921,6 +1103,7 @@ _prop_object_internalize_map_file(const char *fname)
 		_PROP_FREE(mf, M_TEMP);
 		return (NULL);
 	}
+	mf->poimf_len = (size_t)sb.st_size;
 	mf->poimf_mapsize = ((size_t)sb.st_size + pgmask) & ~pgmask;
 	if (mf->poimf_mapsize < (size_t)sb.st_size) {
 		(void) close(fd);
@@ -36,6 +36,7 @@
 #include <lib/libkern/libkern.h>
 #else
 #include <inttypes.h>
+#include <zlib.h>
 #endif
 
 #include "prop_stack.h"
@@ -45,6 +46,10 @@ struct _prop_object_externalize_context {
 	size_t		poec_capacity;		/* capacity of buffer */
 	size_t		poec_len;		/* current length of string */
 	unsigned int	poec_depth;		/* nesting depth */
+#if !defined(_KERNEL) && !defined(_STANDALONE)
+	int		poec_fd;		/* output fd, -1 if none */
+	gzFile		poec_gzf;		/* zlib stream, if any */
+#endif
 };
 
 bool		_prop_object_externalize_start_tag(
@@ -65,10 +70,23 @@ bool		_prop_object_externalize_append_encoded_cstring(
 bool		_prop_object_externalize_append_char(
 				struct _prop_object_externalize_context *,
 				unsigned char);
+bool		_prop_object_externalize_append_data(
+				struct _prop_object_externalize_context *,
+				const char *, size_t);
 bool		_prop_object_externalize_header(
 				struct _prop_object_externalize_context *);
 bool		_prop_object_externalize_footer(
 				struct _prop_object_externalize_context *);
+bool		_prop_object_externalize_xml(
+				struct _prop_object_externalize_context *,
+				prop_object_t);
+bool		_prop_object_externalize_binary(
+				struct _prop_object_externalize_context *,
+				prop_object_t);
+
+typedef bool (*_prop_object_externalizer_t)(
+				struct _prop_object_externalize_context *,
+				prop_object_t);
 
 struct _prop_object_externalize_context *
 	_prop_object_externalize_context_alloc(void);
@@ -149,11 +167,17 @@ void		_prop_object_internalize_context_free(
 
 #if !defined(_KERNEL) && !defined(_STANDALONE)
 bool		_prop_object_externalize_write_file(const char *,
-						    const char *, size_t, bool);
+				prop_object_t, _prop_object_externalizer_t,
+				bool, int);
+
+bool		_prop_object_binary_magic(const void *, size_t);
+prop_object_t	_prop_object_internalize_binary(const void *, size_t,
+						prop_type_t);
 
 struct _prop_object_internalize_mapped_file {
 	char *	poimf_xml;
 	size_t	poimf_mapsize;
+	size_t	poimf_len;	/* real size of the file */
 };
 
 struct _prop_object_internalize_mapped_file *
@@ -31,25 +31,23 @@
 
 #define _READ_CHUNK	8192
 
+#define _PROP_TYPE_array	PROP_TYPE_ARRAY
+#define _PROP_TYPE_dictionary	PROP_TYPE_DICTIONARY
+
 #define TEMPLATE(type)									\
 bool											\
-prop ## type ## _externalize_to_zfile(prop ## type ## _t obj, const char *fname)	\
+prop ## type ## _externalize_to_zfile_level(prop ## type ## _t obj,			\
+					    const char *fname, int level)		\
 {											\
-	char *xml;									\
-	bool rv;									\
-	int save_errno = 0;								\
-											\
-	xml = prop ## type ## _externalize(obj);					\
-	if (xml == NULL)								\
-		return false;								\
-	rv = _prop_object_externalize_write_file(fname, xml, strlen(xml), true);	\
-	if (rv == false)								\
-		save_errno = errno;							\
-	_PROP_FREE(xml, M_TEMP);							\
-	if (rv == false)								\
-		errno = save_errno;							\
+	return _prop_object_externalize_write_file(fname, obj,			\
+	    _prop_object_externalize_xml, true, level);					\
+}											\
 											\
-	return rv;									\
+bool											\
+prop ## type ## _externalize_to_zfile(prop ## type ## _t obj, const char *fname)	\
+{											\
+	return _prop_object_externalize_write_file(fname, obj,			\
+	    _prop_object_externalize_xml, true, Z_BEST_COMPRESSION);			\
 }											\
 											\
 prop ## type ## _t									\
@@ -111,7 +109,11 @@ prop ## type ## _internalize_from_zfile(const char *fname)				\
 			(void)inflateEnd(&strm);					\
 			_PROP_FREE(out, M_TEMP);					\
 			_PROP_FREE(uncomp_xml, M_TEMP);					\
-			obj = prop ## type ## _internalize(mf->poimf_xml);		\
+			if (_prop_object_binary_magic(mf->poimf_xml, mf->poimf_len))	\
+				obj = _prop_object_internalize_binary(mf->poimf_xml,	\
+				    mf->poimf_len, _PROP_TYPE ## type);			\
+			else							\
+				obj = prop ## type ## _internalize(mf->poimf_xml);	\
 			_prop_object_internalize_unmap_file(mf);			\
 			return obj;							\
 		case Z_STREAM_ERROR:							\
@@ -132,7 +134,11 @@ prop ## type ## _internalize_from_zfile(const char *fname)				\
 											\
 	/* we are done */								\
 	(void)inflateEnd(&strm);							\
-	obj = prop ## type ## _internalize(uncomp_xml);					\
+	if (_prop_object_binary_magic(uncomp_xml, (size_t)totalsize))			\
+		obj = _prop_object_internalize_binary(uncomp_xml,			\
+		    (size_t)totalsize, _PROP_TYPE ## type);				\
+	else										\
+		obj = prop ## type ## _internalize(uncomp_xml);				\
 	_PROP_FREE(out, M_TEMP);							\
 	_PROP_FREE(uncomp_xml, M_TEMP);							\
 	_prop_object_internalize_unmap_file(mf);					\
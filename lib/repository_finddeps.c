@@ -168,12 +168,12 @@ find_repo_deps(struct xbps_handle *xhp,
 	       const char *curpkg,		/* current pkgver */
 	       size_t *depth)			/* max recursion depth */
 {
+	const struct xbps_pkgpattern *reqpattern;
 	prop_dictionary_t curpkgd, tmpd;
 	prop_array_t curpkgrdeps, unsorted;
 	pkg_state_t state;
 	size_t i, x;
-	const char *reqpkg, *pkgver_q, *reason = NULL;
-	char *pkgname;
+	const char *reqpkg, *pkgver_q, *pkgname, *reason = NULL;
 	int rv = 0;
 
 	if (*depth >= MAX_DEPTH)
@@ -196,7 +196,12 @@ find_repo_deps(struct xbps_handle *xhp,
 		 * Pass 1: check if required dependency is already installed
 		 * and its version is fully matched.
 		 */
-		if ((pkgname = xbps_pkgpattern_name(reqpkg)) == NULL) {
+		if ((reqpattern = xbps_pkgpattern_cached(xhp, reqpkg)) == NULL) {
+			rv = errno;
+			break;
+		}
+		pkgname = xbps_pkgpattern_compiled_name(reqpattern);
+		if (pkgname == NULL) {
 			rv = EINVAL;
 			xbps_dbg_printf(xhp, "failed to get "
 			    "pkgname from `%s'!", reqpkg);
@@ -222,7 +227,6 @@ find_repo_deps(struct xbps_handle *xhp,
 			tmpd = xbps_find_virtualpkg_dict_installed(xhp,
 					pkgname, false);
 		}
-		free(pkgname);
 		if (tmpd == NULL) {
 			if (errno && errno != ENOENT) {
 				/* error */
@@ -258,7 +262,8 @@ find_repo_deps(struct xbps_handle *xhp,
 				    "`%s'.\n", pkgver_q);
 				continue;
 			}
-			rv = xbps_pkgpattern_match(pkgver_q, reqpkg);
+			rv = xbps_pkgpattern_match_compiled(pkgver_q,
+			    reqpattern);
 			if (rv == 0) {
 				/*
 				 * Package is installed but does not match
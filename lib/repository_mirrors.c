@@ -0,0 +1,348 @@
+/*-
+ * Copyright (c) 2012 Juan Romero Pardines.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "xbps_api_impl.h"
+#include "fetch.h"
+
+/*
+ * Mirror groups.
+ *
+ * A "mirror-group" section in xbps.conf lists mirrors serving the same
+ * repository as one of the "repositories" (its title). The repository
+ * keeps its URI for everything else (metadir, package resolution order,
+ * "repository" objects), but its files are fetched from the mirror
+ * with the best statistics, falling back to the next ones on failure.
+ *
+ * Statistics of every mirror are kept in <metadir>/mirrors.plist:
+ *
+ * 	latency		Time of a HEAD request to the index, in ms.
+ * 	throughput	Download speed of the last files, in bytes/s.
+ * 	failures	Consecutive failed requests.
+ */
+#define MIRRORS_PLIST		"mirrors.plist"
+/* mirrors are ranked by the estimated time to fetch this */
+#define MIRROR_SCORE_SIZE	(1024 * 1024)
+/* penalty for every consecutive failure, in ms */
+#define MIRROR_FAILURE_PENALTY	(60 * 1000)
+
+struct xbps_mirrors {
+	prop_dictionary_t stats;
+	bool modified;
+};
+
+struct mirror_rank {
+	const char *uri;
+	uint64_t score;
+	size_t pos;
+};
+
+static struct xbps_mirrors *
+mirrors_get(struct xbps_handle *xhp)
+{
+	struct xbps_mirrors *m;
+	char *plist;
+
+	if (xhp->mirrors != NULL)
+		return xhp->mirrors;
+
+	if ((m = calloc(1, sizeof(*m))) == NULL)
+		return NULL;
+	if ((plist = xbps_xasprintf("%s/%s", xhp->metadir,
+	    MIRRORS_PLIST)) != NULL) {
+		m->stats = prop_dictionary_internalize_from_zfile(plist);
+		free(plist);
+	}
+	if (m->stats == NULL && (m->stats = prop_dictionary_create()) == NULL) {
+		free(m);
+		return NULL;
+	}
+	xhp->mirrors = m;
+
+	return m;
+}
+
+static cfg_t *
+mirror_group_sec(struct xbps_handle *xhp, const char *repouri)
+{
+	cfg_t *sec;
+	size_t i;
+
+	if (xhp->cfg == NULL)
+		return NULL;
+
+	for (i = 0; i < cfg_size(xhp->cfg, "mirror-group"); i++) {
+		sec = cfg_getnsec(xhp->cfg, "mirror-group", i);
+		if (strcmp(cfg_title(sec), repouri) == 0)
+			return sec;
+	}
+	return NULL;
+}
+
+static uint64_t
+mirror_score(struct xbps_mirrors *m, const char *uri)
+{
+	prop_dictionary_t d;
+	uint64_t latency = 0, throughput = 0, failures = 0, score;
+
+	if (m == NULL || (d = prop_dictionary_get(m->stats, uri)) == NULL)
+		return UINT64_MAX;
+
+	prop_dictionary_get_uint64(d, "latency", &latency);
+	prop_dictionary_get_uint64(d, "throughput", &throughput);
+	prop_dictionary_get_uint64(d, "failures", &failures);
+
+	/* mirrors not measured yet go after the others */
+	if (latency == 0 && throughput == 0)
+		score = UINT64_MAX / 2;
+	else
+		score = latency;
+	if (throughput > 0)
+		score += (uint64_t)MIRROR_SCORE_SIZE * 1000 / throughput;
+	score += failures * MIRROR_FAILURE_PENALTY;
+
+	return score;
+}
+
+static int
+mirror_rank_cmp(const void *a, const void *b)
+{
+	const struct mirror_rank *ra = a, *rb = b;
+
+	if (ra->score != rb->score)
+		return ra->score < rb->score ? -1 : 1;
+	/* same score: keep the order in xbps.conf */
+	return ra->pos < rb->pos ? -1 : 1;
+}
+
+uint64_t HIDDEN
+xbps_mirror_clock(void)
+{
+#ifdef HAVE_CLOCK_GETTIME
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#else
+	struct timeval tv;
+
+	(void)gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+#endif
+}
+
+prop_array_t HIDDEN
+xbps_mirror_group(struct xbps_handle *xhp, const char *repouri)
+{
+	struct xbps_mirrors *m;
+	struct mirror_rank *ranks;
+	prop_array_t array;
+	cfg_t *sec;
+	const char *uri;
+	size_t i, n, nmirrors;
+
+	assert(repouri != NULL);
+
+	if ((array = prop_array_create()) == NULL)
+		return NULL;
+
+	sec = mirror_group_sec(xhp, repouri);
+	nmirrors = sec ? cfg_size(sec, "mirrors") : 0;
+	if (nmirrors == 0) {
+		if (!prop_array_add_cstring_nocopy(array, repouri)) {
+			prop_object_release(array);
+			return NULL;
+		}
+		return array;
+	}
+	if ((ranks = calloc(nmirrors + 1, sizeof(*ranks))) == NULL) {
+		prop_object_release(array);
+		return NULL;
+	}
+	m = mirrors_get(xhp);
+	for (i = n = 0; i <= nmirrors; i++) {
+		uri = i ? cfg_getnstr(sec, "mirrors", i - 1) : repouri;
+		if (i && strcmp(uri, repouri) == 0)
+			continue;
+		ranks[n].uri = uri;
+		ranks[n].score = mirror_score(m, uri);
+		ranks[n].pos = n;
+		n++;
+	}
+	qsort(ranks, n, sizeof(*ranks), mirror_rank_cmp);
+	for (i = 0; i < n; i++) {
+		if (!prop_array_add_cstring_nocopy(array, ranks[i].uri)) {
+			prop_object_release(array);
+			array = NULL;
+			break;
+		}
+	}
+	free(ranks);
+
+	return array;
+}
+
+void HIDDEN
+xbps_mirror_update(struct xbps_handle *xhp,
+		   const char *uri,
+		   uint64_t latency,
+		   uint64_t throughput,
+		   bool ok)
+{
+	struct xbps_mirrors *m;
+	prop_dictionary_t d;
+	uint64_t val;
+
+	assert(uri != NULL);
+
+	if ((m = mirrors_get(xhp)) == NULL)
+		return;
+
+	if ((d = prop_dictionary_get(m->stats, uri)) == NULL) {
+		if ((d = prop_dictionary_create()) == NULL)
+			return;
+		if (!prop_dictionary_set(m->stats, uri, d)) {
+			prop_object_release(d);
+			return;
+		}
+		prop_object_release(d);
+	}
+	if (!ok) {
+		val = 0;
+		prop_dictionary_get_uint64(d, "failures", &val);
+		prop_dictionary_set_uint64(d, "failures", val + 1);
+		m->modified = true;
+		return;
+	}
+	prop_dictionary_set_uint64(d, "failures", 0);
+	/*
+	 * Smooth the measurements, a single slow request shouldn't
+	 * change the order of mirrors.
+	 */
+	if (latency > 0) {
+		if (prop_dictionary_get_uint64(d, "latency", &val) && val > 0)
+			latency = (val + latency) / 2;
+		prop_dictionary_set_uint64(d, "latency", latency);
+	}
+	if (throughput > 0) {
+		if (prop_dictionary_get_uint64(d, "throughput", &val) && val > 0)
+			throughput = (val + throughput) / 2;
+		prop_dictionary_set_uint64(d, "throughput", throughput);
+	}
+	m->modified = true;
+}
+
+/*
+ * Records a successful transfer of `size' bytes from a mirror,
+ * started at `start'.
+ */
+void HIDDEN
+xbps_mirror_update_transfer(struct xbps_handle *xhp,
+			    const char *uri,
+			    uint64_t start,
+			    uint64_t size)
+{
+	uint64_t elapsed;
+
+	elapsed = xbps_mirror_clock() - start;
+	/* too small or too fast to measure anything */
+	if (size < 64 * 1024 || elapsed == 0) {
+		xbps_mirror_update(xhp, uri, 0, 0, true);
+		return;
+	}
+	xbps_mirror_update(xhp, uri, 0, size * 1000 / elapsed, true);
+}
+
+void HIDDEN
+xbps_mirror_probe(struct xbps_handle *xhp, const char *repouri)
+{
+	prop_array_t array;
+	struct url_stat us;
+	const char *uri;
+	char *rpidx;
+	uint64_t start, latency;
+	unsigned int i;
+
+	if ((array = xbps_mirror_group(xhp, repouri)) == NULL)
+		return;
+	if (prop_array_count(array) < 2) {
+		prop_object_release(array);
+		return;
+	}
+	fetchTimeout = xhp->fetch_timeout;
+
+	for (i = 0; i < prop_array_count(array); i++) {
+		prop_array_get_cstring_nocopy(array, i, &uri);
+		if (!xbps_check_is_repository_uri_remote(uri))
+			continue;
+		if ((rpidx = xbps_xasprintf("%s/%s", uri,
+		    XBPS_PKGINDEX)) == NULL)
+			break;
+		start = xbps_mirror_clock();
+		if (fetchStatURL(rpidx, &us, NULL) == -1) {
+			xbps_dbg_printf(xhp, "[mirrors] `%s' failed: %s\n",
+			    uri, xbps_fetch_error_string());
+			xbps_mirror_update(xhp, uri, 0, 0, false);
+		} else {
+			latency = xbps_mirror_clock() - start;
+			xbps_dbg_printf(xhp, "[mirrors] `%s' latency %ju ms\n",
+			    uri, (uintmax_t)latency);
+			xbps_mirror_update(xhp, uri, latency ? latency : 1,
+			    0, true);
+		}
+		free(rpidx);
+	}
+	prop_object_release(array);
+}
+
+void HIDDEN
+xbps_mirrors_release(struct xbps_handle *xhp)
+{
+	struct xbps_mirrors *m = xhp->mirrors;
+	char *plist;
+
+	if (m == NULL)
+		return;
+
+	if (m->modified && xbps_mkpath(xhp->metadir, 0755) == 0 &&
+	    (plist = xbps_xasprintf("%s/%s", xhp->metadir,
+	    MIRRORS_PLIST)) != NULL) {
+		if (!xbps_dictionary_externalize_to_file(xhp, m->stats,
+		    plist, false))
+			xbps_dbg_printf(xhp, "[mirrors] failed to write "
+			    "`%s': %s\n", plist, strerror(errno));
+		free(plist);
+	}
+	prop_object_release(m->stats);
+	free(m);
+	xhp->mirrors = NULL;
+}
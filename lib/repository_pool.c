@@ -78,6 +78,11 @@ xbps_rpool_init(struct xbps_handle *xhp)
 			nmissing++;
 			continue;
 		}
+		/*
+		 * Indexes are never modified once registered, this
+		 * allows walking them without iterators nor locking.
+		 */
+		prop_array_make_immutable(array);
 		/*
 		 * Register repository into the array.
 		 */
@@ -149,13 +154,39 @@ xbps_rpool_release(struct xbps_handle *xhp)
 int
 xbps_rpool_sync(struct xbps_handle *xhp, const char *uri)
 {
-	const char *repouri;
-	size_t i;
+	const char *repouri, **uris = NULL;
+	bool *done = NULL;
+	size_t i, nuris;
 
 	if (xhp->cfg == NULL)
 		return ENOTSUP;
 
-	for (i = 0; i < cfg_size(xhp->cfg, "repositories"); i++) {
+	nuris = cfg_size(xhp->cfg, "repositories");
+	for (i = 0; i < nuris; i++) {
+		repouri = cfg_getnstr(xhp->cfg, "repositories", i);
+		/* If argument was set just process that repository */
+		if (uri && strcmp(repouri, uri))
+			continue;
+		/*
+		 * Measure the latency of its mirrors, if any.
+		 */
+		if (xbps_check_is_repository_uri_remote(repouri))
+			xbps_mirror_probe(xhp, repouri);
+	}
+	/*
+	 * Fetch the index files of all repositories at once.
+	 */
+	if (xhp->fetch_async > 1 && nuris > 0 &&
+	    (uris = calloc(nuris, sizeof(*uris))) != NULL &&
+	    (done = calloc(nuris * 2, sizeof(*done))) != NULL) {
+		for (i = 0; i < nuris; i++) {
+			repouri = cfg_getnstr(xhp->cfg, "repositories", i);
+			if (uri == NULL || strcmp(repouri, uri) == 0)
+				uris[i] = repouri;
+		}
+		xbps_repository_sync_async(xhp, uris, nuris, done);
+	}
+	for (i = 0; i < nuris; i++) {
 		repouri = cfg_getnstr(xhp->cfg, "repositories", i);
 		/* If argument was set just process that repository */
 		if (uri && strcmp(repouri, uri))
@@ -163,7 +194,9 @@ xbps_rpool_sync(struct xbps_handle *xhp, const char *uri)
 		/*
 		 * Fetch repository index.
 		 */
-		if (xbps_repository_sync_pkg_index(xhp, repouri, XBPS_PKGINDEX) == -1) {
+		if ((done == NULL || !done[i * 2]) &&
+		    xbps_repository_sync_pkg_index(xhp, repouri,
+		    XBPS_PKGINDEX) == -1) {
 			xbps_dbg_printf(xhp,
 			    "[rpool] `%s' failed to fetch: %s\n",
 			    repouri, fetchLastErrCode == 0 ? strerror(errno) :
@@ -173,7 +206,8 @@ xbps_rpool_sync(struct xbps_handle *xhp, const char *uri)
 		/*
 		 * Fetch repository files index.
 		 */
-		if (xbps_repository_sync_pkg_index(xhp, repouri,
+		if ((done == NULL || !done[i * 2 + 1]) &&
+		    xbps_repository_sync_pkg_index(xhp, repouri,
 		    XBPS_PKGINDEX_FILES) == -1) {
 			xbps_dbg_printf(xhp,
 			    "[rpool] `%s' failed to fetch: %s\n",
@@ -182,6 +216,9 @@ xbps_rpool_sync(struct xbps_handle *xhp, const char *uri)
 			continue;
 		}
 	}
+	free(uris);
+	free(done);
+
 	return 0;
 }
 
@@ -182,7 +182,7 @@ repo_find_best_pkg_cb(struct xbps_handle *xhp,
 	 * Compare current stored version against new
 	 * version from current package in repository.
 	 */
-	if (xbps_cmpver(repopkgver, rpf->bestpkgver) == 1) {
+	if (xbps_cmpver_cached(xhp, repopkgver, rpf->bestpkgver) == 1) {
 		xbps_dbg_printf(xhp,
 		    "[rpool] Found best match '%s' (%s).\n",
 		    repopkgver, rpi->uri);
@@ -300,6 +300,46 @@ xbps_rpool_find_pkg_exact(struct xbps_handle *xhp, const char *pkgver)
 	return repo_find_pkg(xhp, pkgver, false, EXACT_PKG);
 }
 
+/*
+ * Metadata plists read from remote binary packages are cached in
+ * <cachedir>/metadata, named after the package SHA256 hash; the
+ * package is not read again until its hash changes in the index.
+ */
+static char *
+metadata_cache_path(struct xbps_handle *xhp,
+		    prop_dictionary_t pkgd,
+		    const char *plistf)
+{
+	const char *sha256;
+
+	if (!prop_dictionary_get_cstring_nocopy(pkgd,
+	    "filename-sha256", &sha256))
+		return NULL;
+
+	if (strncmp(plistf, "./", 2) == 0)
+		plistf += 2;
+
+	return xbps_xasprintf("%s/metadata/%s.%s", xhp->cachedir,
+	    sha256, plistf);
+}
+
+static void
+metadata_cache_store(struct xbps_handle *xhp,
+		     prop_dictionary_t plistd,
+		     const char *cachef)
+{
+	char *dir;
+
+	if ((dir = strdup(cachef)) == NULL)
+		return;
+	*strrchr(dir, '/') = '\0';
+	if (xbps_mkpath(dir, 0755) == -1 ||
+	    !xbps_dictionary_externalize_to_file(xhp, plistd, cachef, true))
+		xbps_dbg_printf(xhp, "failed to cache `%s': %s\n",
+		    cachef, strerror(errno));
+	free(dir);
+}
+
 prop_dictionary_t
 xbps_rpool_dictionary_metadata_plist(struct xbps_handle *xhp,
 				     const char *pattern,
@@ -307,7 +347,7 @@ xbps_rpool_dictionary_metadata_plist(struct xbps_handle *xhp,
 {
 	prop_dictionary_t pkgd = NULL, plistd = NULL;
 	const char *repoloc;
-	char *url;
+	char *url, *cachef = NULL;
 
 	assert(pattern != NULL);
 	assert(plistf != NULL);
@@ -334,7 +374,20 @@ xbps_rpool_dictionary_metadata_plist(struct xbps_handle *xhp,
 		errno = EINVAL;
 		goto out;
 	}
+	if (xbps_check_is_repository_uri_remote(url) &&
+	    (cachef = metadata_cache_path(xhp, pkgd, plistf)) != NULL) {
+		plistd = prop_dictionary_internalize_from_zfile(cachef);
+		if (plistd != NULL) {
+			xbps_dbg_printf(xhp, "using cached `%s'\n", cachef);
+			free(cachef);
+			free(url);
+			goto out;
+		}
+	}
 	plistd = xbps_dictionary_metadata_plist_by_url(url, plistf);
+	if (plistd != NULL && cachef != NULL)
+		metadata_cache_store(xhp, plistd, cachef);
+	free(cachef);
 	free(url);
 
 out:
@@ -90,12 +90,15 @@ xbps_repository_sync_pkg_index(struct xbps_handle *xhp,
 			       const char *uri,
 			       const char *plistf)
 {
-	prop_array_t array;
+	prop_array_t array, mirrors = NULL;
 	struct url *url = NULL;
 	struct stat st;
-	const char *fetch_outputdir, *fetchstr = NULL;
+	const char *fetch_outputdir, *mirror, *fetchstr = NULL;
 	char *rpidx, *lrepodir, *uri_fixedp;
 	char *tmp_metafile, *lrepofile;
+	char *lfile;
+	uint64_t start;
+	unsigned int i;
 	int rv = 0;
 	bool only_sync = false;
 
@@ -125,10 +128,9 @@ xbps_repository_sync_pkg_index(struct xbps_handle *xhp,
 		goto out;
 	}
 	/*
-	 * Remote repository plist index full URL.
+	 * Mirrors serving this repository, the best one first.
 	 */
-	rpidx = xbps_xasprintf("%s/%s", uri, plistf);
-	if (rpidx == NULL) {
+	if ((mirrors = xbps_mirror_group(xhp, uri)) == NULL) {
 		rv = -1;
 		goto out;
 	}
@@ -165,9 +167,39 @@ xbps_repository_sync_pkg_index(struct xbps_handle *xhp,
 	xbps_set_cb_state(xhp, XBPS_STATE_REPOSYNC, 0, NULL, NULL,
 	    "Synchronizing %s for `%s'...", plistf, uri);
 	/*
-	 * Download plist index file from repository.
+	 * Download plist index file from repository, trying the
+	 * next mirror if it fails.
 	 */
-	if (xbps_fetch_file(xhp, rpidx, fetch_outputdir, true, NULL) == -1) {
+	for (i = 0; i < prop_array_count(mirrors); i++) {
+		prop_array_get_cstring_nocopy(mirrors, i, &mirror);
+		if (rpidx != NULL)
+			free(rpidx);
+		rpidx = xbps_xasprintf("%s/%s", mirror, plistf);
+		if (rpidx == NULL) {
+			rv = -1;
+			goto out;
+		}
+		start = xbps_mirror_clock();
+		rv = xbps_fetch_file(xhp, rpidx, fetch_outputdir, true, NULL);
+		if (rv != -1) {
+			if (prop_array_count(mirrors) > 1 &&
+			    (lfile = xbps_xasprintf("%s/%s", fetch_outputdir,
+			    plistf)) != NULL) {
+				if (rv == 0 || stat(lfile, &st) == -1)
+					st.st_size = 0;
+				xbps_mirror_update_transfer(xhp, mirror, start,
+				    (uint64_t)st.st_size);
+				free(lfile);
+			}
+			break;
+		}
+		if (prop_array_count(mirrors) > 1) {
+			xbps_dbg_printf(xhp, "[reposync] mirror `%s' failed: "
+			    "%s\n", mirror, xbps_fetch_error_string());
+			xbps_mirror_update(xhp, mirror, 0, 0, false);
+		}
+	}
+	if (rv == -1) {
 		/* reposync error cb */
 		fetchstr = xbps_fetch_error_string();
 		xbps_set_cb_state(xhp, XBPS_STATE_REPOSYNC_FAIL,
@@ -234,6 +266,93 @@ out:
 		fetchFreeURL(url);
 	if (uri_fixedp)
 		free(uri_fixedp);
+	if (mirrors)
+		prop_object_release(mirrors);
 
 	return rv;
 }
+
+/*
+ * Synchronizes at once the index files of remote repositories that
+ * were already synchronized before, with xbps_fetch_files_async().
+ * done[2*i] and done[2*i+1] are set if the package index and the files
+ * index of uris[i] were synchronized; anything else is left to
+ * xbps_repository_sync_pkg_index().
+ */
+void HIDDEN
+xbps_repository_sync_async(struct xbps_handle *xhp,
+			   const char **uris,
+			   size_t nuris,
+			   bool *done)
+{
+	const char *plists[] = { XBPS_PKGINDEX, XBPS_PKGINDEX_FILES };
+	struct xbps_fetch_async_file *files;
+	prop_array_t mirrors;
+	struct stat st;
+	const char *mirror;
+	char *uri_fixedp, *lrepodir;
+	size_t i, j, n = 0, *idx;
+
+	for (i = 0; i < nuris * 2; i++)
+		done[i] = false;
+
+	if ((files = calloc(nuris * 2, sizeof(*files))) == NULL)
+		return;
+	if ((idx = calloc(nuris * 2, sizeof(*idx))) == NULL) {
+		free(files);
+		return;
+	}
+	for (i = 0; i < nuris; i++) {
+		if (uris[i] == NULL ||
+		    !xbps_check_is_repository_uri_remote(uris[i]))
+			continue;
+		if ((uri_fixedp = xbps_get_remote_repo_string(uris[i])) == NULL)
+			continue;
+		lrepodir = xbps_xasprintf("%s/%s", xhp->metadir, uri_fixedp);
+		free(uri_fixedp);
+		if (lrepodir == NULL)
+			continue;
+		/*
+		 * The first synchronization validates the index before
+		 * creating the repodir, leave it to the serial path.
+		 */
+		if (stat(lrepodir, &st) == -1 || !S_ISDIR(st.st_mode) ||
+		    (mirrors = xbps_mirror_group(xhp, uris[i])) == NULL) {
+			free(lrepodir);
+			continue;
+		}
+		prop_array_get_cstring_nocopy(mirrors, 0, &mirror);
+		for (j = 0; j < 2; j++) {
+			files[n].uri = xbps_xasprintf("%s/%s", mirror,
+			    plists[j]);
+			files[n].outputdir = j ? strdup(lrepodir) : lrepodir;
+			if (files[n].uri == NULL || files[n].outputdir == NULL) {
+				free(__UNCONST(files[n].uri));
+				free(__UNCONST(files[n].outputdir));
+				break;
+			}
+			xbps_set_cb_state(xhp, XBPS_STATE_REPOSYNC, 0,
+			    NULL, NULL, "Synchronizing %s for `%s'...",
+			    plists[j], uris[i]);
+			idx[n++] = i * 2 + j;
+		}
+		prop_object_release(mirrors);
+	}
+	if (n > 0 && xbps_fetch_files_async(xhp, files, n, true,
+	    NULL, NULL) == 0) {
+		for (i = 0; i < n; i++) {
+			if (files[i].rv != -1)
+				done[idx[i]] = true;
+			else
+				xbps_dbg_printf(xhp, "[reposync] `%s' failed: "
+				    "%s\n", files[i].uri,
+				    strerror(files[i].error));
+		}
+	}
+	for (i = 0; i < n; i++) {
+		free(__UNCONST(files[i].uri));
+		free(__UNCONST(files[i].outputdir));
+	}
+	free(files);
+	free(idx);
+}
@@ -106,6 +106,268 @@ check_binpkgs_hash(struct xbps_handle *xhp, prop_object_iterator_t iter)
 	return rv;
 }
 
+/*
+ * Binary packages up to this size are fetched with pipelined requests.
+ */
+#define PIPELINE_MAXSIZE	(1024 * 1024)
+
+/*
+ * Fetch small binary packages with pipelined requests, so that many of
+ * them are requested to every server at once. Packages that couldn't
+ * be fetched this way are left to download_binpkgs().
+ */
+static int
+pipeline_binpkgs(struct xbps_handle *xhp, prop_object_iterator_t iter)
+{
+	prop_object_t obj;
+	prop_dictionary_t *pkgds = NULL;
+	const char *pkgname, *version, *repoloc, *filen, *trans, **uris = NULL;
+	char *binfile;
+	uint64_t size;
+	size_t i, n = 0, cnt;
+	bool *done = NULL;
+	int rv = 0;
+
+	cnt = prop_array_count(prop_dictionary_get(xhp->transd, "packages"));
+	if ((uris = calloc(cnt, sizeof(*uris))) == NULL ||
+	    (pkgds = calloc(cnt, sizeof(*pkgds))) == NULL ||
+	    (done = calloc(cnt, sizeof(*done))) == NULL) {
+		rv = ENOMEM;
+		goto out;
+	}
+	while ((obj = prop_object_iterator_next(iter)) != NULL) {
+		prop_dictionary_get_cstring_nocopy(obj, "transaction", &trans);
+		if ((strcmp(trans, "remove") == 0) ||
+		    (strcmp(trans, "configure") == 0))
+			continue;
+
+		prop_dictionary_get_cstring_nocopy(obj, "repository", &repoloc);
+		if (!xbps_check_is_repository_uri_remote(repoloc))
+			continue;
+		size = 0;
+		prop_dictionary_get_uint64(obj, "filename-size", &size);
+		if (size == 0 || size > PIPELINE_MAXSIZE)
+			continue;
+
+		binfile = xbps_path_from_repository_uri(xhp, obj, repoloc);
+		if (binfile == NULL) {
+			rv = EINVAL;
+			goto out;
+		}
+		if (access(binfile, R_OK) == 0) {
+			free(binfile);
+			continue;
+		}
+		uris[n] = binfile;
+		pkgds[n++] = obj;
+	}
+	if (n < 2)
+		goto out;
+
+	if (xbps_mkpath(xhp->cachedir, 0755) == -1) {
+		/* reported by download_binpkgs() */
+		goto out;
+	}
+	for (i = 0; i < n; i++) {
+		prop_dictionary_get_cstring_nocopy(pkgds[i], "pkgname",
+		    &pkgname);
+		prop_dictionary_get_cstring_nocopy(pkgds[i], "version",
+		    &version);
+		prop_dictionary_get_cstring_nocopy(pkgds[i], "repository",
+		    &repoloc);
+		prop_dictionary_get_cstring_nocopy(pkgds[i], "filename",
+		    &filen);
+		xbps_set_cb_state(xhp, XBPS_STATE_DOWNLOAD,
+		    0, pkgname, version,
+		    "Downloading binary package `%s' (from `%s')...",
+		    filen, repoloc);
+	}
+	rv = xbps_fetch_batch(xhp, uris, n, xhp->cachedir, done);
+out:
+	if (uris != NULL) {
+		for (i = 0; i < n; i++)
+			free(__UNCONST(uris[i]));
+	}
+	free(uris);
+	free(pkgds);
+	free(done);
+	prop_object_iterator_reset(iter);
+
+	return rv;
+}
+
+/*
+ * Binary packages bigger than this are left to download_binpkgs() if
+ * they can be fetched in segments.
+ */
+#define ASYNC_SEGMENTS_MINSIZE	(8 * 1024 * 1024)
+
+/*
+ * Downloads at once the remote binary packages not in cachedir with
+ * xbps_fetch_files_async(). Packages that couldn't be fetched are left
+ * to download_binpkgs(), which reports the errors.
+ */
+static int
+async_binpkgs(struct xbps_handle *xhp, prop_object_iterator_t iter)
+{
+	prop_object_t obj;
+	prop_dictionary_t *pkgds = NULL;
+	struct xbps_fetch_async_file *files = NULL;
+	const char *pkgname, *version, *repoloc, *filen, *trans;
+	char *binfile, *partfile;
+	uint64_t size;
+	size_t i, n = 0, cnt;
+	int rv = 0;
+
+	cnt = prop_array_count(prop_dictionary_get(xhp->transd, "packages"));
+	if ((files = calloc(cnt, sizeof(*files))) == NULL ||
+	    (pkgds = calloc(cnt, sizeof(*pkgds))) == NULL) {
+		rv = ENOMEM;
+		goto out;
+	}
+	while ((obj = prop_object_iterator_next(iter)) != NULL) {
+		prop_dictionary_get_cstring_nocopy(obj, "transaction", &trans);
+		if ((strcmp(trans, "remove") == 0) ||
+		    (strcmp(trans, "configure") == 0))
+			continue;
+
+		prop_dictionary_get_cstring_nocopy(obj, "repository", &repoloc);
+		if (!xbps_check_is_repository_uri_remote(repoloc))
+			continue;
+		size = 0;
+		prop_dictionary_get_uint64(obj, "filename-size", &size);
+		if (xhp->fetch_segments > 1 && size > ASYNC_SEGMENTS_MINSIZE)
+			continue;
+
+		binfile = xbps_path_from_repository_uri(xhp, obj, repoloc);
+		if (binfile == NULL) {
+			rv = EINVAL;
+			goto out;
+		}
+		if (access(binfile, R_OK) == 0) {
+			free(binfile);
+			continue;
+		}
+		files[n].uri = binfile;
+		files[n].outputdir = xhp->cachedir;
+		pkgds[n++] = obj;
+	}
+	if (n < 2)
+		goto out;
+
+	if (xbps_mkpath(xhp->cachedir, 0755) == -1) {
+		/* reported by download_binpkgs() */
+		goto out;
+	}
+	for (i = 0; i < n; i++) {
+		prop_dictionary_get_cstring_nocopy(pkgds[i], "pkgname",
+		    &pkgname);
+		prop_dictionary_get_cstring_nocopy(pkgds[i], "version",
+		    &version);
+		prop_dictionary_get_cstring_nocopy(pkgds[i], "repository",
+		    &repoloc);
+		prop_dictionary_get_cstring_nocopy(pkgds[i], "filename",
+		    &filen);
+		xbps_set_cb_state(xhp, XBPS_STATE_DOWNLOAD,
+		    0, pkgname, version,
+		    "Downloading binary package `%s' (from `%s')...",
+		    filen, repoloc);
+	}
+	if ((rv = xbps_fetch_files_async(xhp, files, n, false,
+	    NULL, NULL)) != 0)
+		goto out;
+
+	for (i = 0; i < n; i++) {
+		if (files[i].rv != -1)
+			continue;
+		/* fetched again from scratch by download_binpkgs() */
+		if ((partfile = xbps_xasprintf("%s/%s.part", xhp->cachedir,
+		    strrchr(files[i].uri, '/') + 1)) != NULL) {
+			(void)unlink(partfile);
+			free(partfile);
+		}
+	}
+out:
+	if (files != NULL) {
+		for (i = 0; i < n; i++)
+			free(__UNCONST(files[i].uri));
+	}
+	free(files);
+	free(pkgds);
+	prop_object_iterator_reset(iter);
+
+	return rv;
+}
+
+static int
+fetch_binpkg_uri(struct xbps_handle *xhp,
+		 prop_dictionary_t pkgd,
+		 const char *uri)
+{
+	uint64_t size = 0;
+
+	/*
+	 * Fetch binary package, into the shared cachedir if set.
+	 */
+	if (xhp->shared_cachedir != NULL)
+		return xbps_shared_cache_fetch(xhp, pkgd, uri);
+
+	prop_dictionary_get_uint64(pkgd, "filename-size", &size);
+	return xbps_fetch_file_sized(xhp, uri, xhp->cachedir, false,
+	    NULL, size);
+}
+
+/*
+ * Fetches a binary package from the mirrors of its repository, the
+ * best one first, and tries the next one if it fails.
+ */
+static int
+fetch_binpkg(struct xbps_handle *xhp,
+	     prop_dictionary_t pkgd,
+	     const char *repoloc,
+	     const char *binfile)
+{
+	prop_array_t mirrors;
+	const char *filen, *mirror;
+	char *uri;
+	uint64_t size = 0, start;
+	unsigned int i;
+	int rv = -1;
+
+	if (!xbps_check_is_repository_uri_remote(repoloc) ||
+	    (mirrors = xbps_mirror_group(xhp, repoloc)) == NULL)
+		return fetch_binpkg_uri(xhp, pkgd, binfile);
+
+	if (prop_array_count(mirrors) < 2) {
+		prop_object_release(mirrors);
+		return fetch_binpkg_uri(xhp, pkgd, binfile);
+	}
+	prop_dictionary_get_cstring_nocopy(pkgd, "filename", &filen);
+	prop_dictionary_get_uint64(pkgd, "filename-size", &size);
+
+	for (i = 0; i < prop_array_count(mirrors); i++) {
+		prop_array_get_cstring_nocopy(mirrors, i, &mirror);
+		if ((uri = xbps_xasprintf("%s/%s", mirror, filen)) == NULL) {
+			rv = -1;
+			break;
+		}
+		start = xbps_mirror_clock();
+		rv = fetch_binpkg_uri(xhp, pkgd, uri);
+		free(uri);
+		if (rv != -1) {
+			xbps_mirror_update_transfer(xhp, mirror, start,
+			    rv == 1 ? size : 0);
+			break;
+		}
+		xbps_dbg_printf(xhp, "%s: mirror `%s' failed: %s\n",
+		    filen, mirror, xbps_fetch_error_string());
+		xbps_mirror_update(xhp, mirror, 0, 0, false);
+	}
+	prop_object_release(mirrors);
+
+	return rv;
+}
+
 static int
 download_binpkgs(struct xbps_handle *xhp, prop_object_iterator_t iter)
 {
@@ -158,10 +420,7 @@ download_binpkgs(struct xbps_handle *xhp, prop_object_iterator_t iter)
 		    0, pkgname, version,
 		    "Downloading binary package `%s' (from `%s')...",
 		    filen, repoloc);
-		/*
-		 * Fetch binary package.
-		 */
-		rv = xbps_fetch_file(xhp, binfile, xhp->cachedir, false, NULL);
+		rv = fetch_binpkg(xhp, obj, repoloc, binfile);
 		if (rv == -1) {
 			fetchstr = xbps_fetch_error_string();
 			xbps_set_cb_state(xhp, XBPS_STATE_DOWNLOAD_FAIL,
@@ -184,9 +443,11 @@ download_binpkgs(struct xbps_handle *xhp, prop_object_iterator_t iter)
 int
 xbps_transaction_commit(struct xbps_handle *xhp)
 {
+	prop_array_t pkgs;
 	prop_object_t obj;
 	prop_object_iterator_t iter;
 	size_t i;
+	unsigned int idx, npkgs;
 	const char *pkgname, *version, *pkgver, *tract;
 	int rv = 0;
 	bool update, install, sr;
@@ -194,6 +455,7 @@ xbps_transaction_commit(struct xbps_handle *xhp)
 	assert(prop_object_type(xhp->transd) == PROP_TYPE_DICTIONARY);
 
 	update = install = false;
+	pkgs = prop_dictionary_get(xhp->transd, "packages");
 	iter = xbps_array_iter_from_dict(xhp->transd, "packages");
 	if (iter == NULL)
 		return EINVAL;
@@ -201,6 +463,12 @@ xbps_transaction_commit(struct xbps_handle *xhp)
 	 * Download binary packages (if they come from a remote repository).
 	 */
 	xbps_set_cb_state(xhp, XBPS_STATE_TRANS_DOWNLOAD, 0, NULL, NULL, NULL);
+	if (xhp->fetch_pipeline > 1 && xhp->shared_cachedir == NULL &&
+	    (rv = pipeline_binpkgs(xhp, iter)) != 0)
+		goto out;
+	if (xhp->fetch_async > 1 && xhp->shared_cachedir == NULL &&
+	    (rv = async_binpkgs(xhp, iter)) != 0)
+		goto out;
 	if ((rv = download_binpkgs(xhp, iter)) != 0)
 		goto out;
 	/*
@@ -215,8 +483,9 @@ xbps_transaction_commit(struct xbps_handle *xhp)
 	 */
 	xbps_set_cb_state(xhp, XBPS_STATE_TRANS_RUN, 0, NULL, NULL, NULL);
 
-	i = 0;
+	i = idx = 0;
 	while ((obj = prop_object_iterator_next(iter)) != NULL) {
+		idx++;
 		if ((xhp->transaction_frequency_flush > 0) &&
 		    (++i >= xhp->transaction_frequency_flush)) {
 			rv = xbps_pkgdb_update(xhp, true);
@@ -250,6 +519,19 @@ xbps_transaction_commit(struct xbps_handle *xhp)
 			rv = xbps_configure_pkg(xhp, pkgname, false, false, false);
 			if (rv != 0)
 				goto out;
+		} else if (xhp->transaction_parallel_unpack > 1 &&
+			   strcmp(tract, "install") == 0) {
+			/*
+			 * Install this package and the following
+			 * independent packages concurrently.
+			 */
+			install = true;
+			rv = xbps_transaction_unpack_batch(xhp, pkgs,
+			    idx - 1, &npkgs);
+			if (rv != 0)
+				goto out;
+			for (; npkgs > 1; npkgs--, idx++, i++)
+				(void)prop_object_iterator_next(iter);
 		} else {
 			/*
 			 * Install or update a package.
@@ -181,7 +181,8 @@ xbps_transaction_package_replace(struct xbps_handle *xhp)
 						return errno;
 					}
 				}
-				if (!prop_dictionary_externalize_to_zfile(filesd, buf)) {
+				if (!xbps_dictionary_externalize_to_file(xhp,
+				    filesd, buf, true)) {
 					free(buf);
 					free(dirc);
 					prop_object_release(filesd);
@@ -0,0 +1,321 @@
+/*-
+ * Copyright (c) 2012 Juan Romero Pardines.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "xbps_api_impl.h"
+
+/*
+ * Parallel unpack of independent packages in a transaction.
+ *
+ * Packages to be installed are grouped in batches of consecutive
+ * packages in the sorted transaction; a package ends the batch if it
+ * depends on a package of the batch (directly or through a virtual
+ * package) or if any of its files is also owned by a package of the
+ * batch. Packages in a batch are unpacked by multiple threads, and
+ * registered in transaction order once all of them are unpacked.
+ *
+ * Packages being updated or with the "softreplace" keyword remove or
+ * replace files of installed packages, they are always processed
+ * alone.
+ */
+#define UNPACK_BATCH_PER_THREAD	4
+
+struct unpack_job {
+	prop_dictionary_t pkgd;
+	int rv;
+};
+
+struct unpack_batch {
+	struct xbps_handle *xhp;
+	struct unpack_job *jobs;
+	size_t njobs;
+	size_t next;
+	pthread_mutex_t mtx;
+};
+
+static bool
+unpack_batch_ok(prop_dictionary_t pkgd)
+{
+	const char *tract;
+	bool sr = false;
+
+	prop_dictionary_get_cstring_nocopy(pkgd, "transaction", &tract);
+	prop_dictionary_get_bool(pkgd, "softreplace", &sr);
+
+	return strcmp(tract, "install") == 0 && !sr;
+}
+
+/*
+ * Returns true if pkgd depends on any package in the batch, that is
+ * the npkgs packages from pkgs[idx].
+ */
+static bool
+depends_on_batch(prop_dictionary_t pkgd, prop_array_t pkgs,
+		 unsigned int idx, unsigned int npkgs)
+{
+	prop_array_t rundeps;
+	prop_dictionary_t batchd;
+	const char *pkgver, *pattern;
+	unsigned int i, j;
+
+	rundeps = prop_dictionary_get(pkgd, "run_depends");
+	if (prop_array_count(rundeps) == 0)
+		return false;
+
+	for (j = idx; j < idx + npkgs; j++) {
+		batchd = prop_array_get(pkgs, j);
+		prop_dictionary_get_cstring_nocopy(batchd, "pkgver", &pkgver);
+		if (xbps_match_pkgdep_in_array(rundeps, pkgver))
+			return true;
+		if (prop_dictionary_get(batchd, "provides") == NULL)
+			continue;
+		for (i = 0; i < prop_array_count(rundeps); i++) {
+			prop_array_get_cstring_nocopy(rundeps, i, &pattern);
+			if (xbps_match_virtual_pkg_in_dict(batchd,
+			    pattern, true))
+				return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Adds all files and links of filesd into the paths map, returns
+ * EEXIST if any of them was already there.
+ */
+static int
+batch_add_paths(struct xbps_strmap *paths, prop_dictionary_t filesd)
+{
+	static const char *keys[] = { "files", "conf_files", "links", NULL };
+	prop_array_t array;
+	prop_dictionary_t d;
+	const char *file;
+	unsigned int i;
+	int rv, k;
+
+	for (k = 0; keys[k] != NULL; k++) {
+		array = prop_dictionary_get(filesd, keys[k]);
+		for (i = 0; i < prop_array_count(array); i++) {
+			d = prop_array_get(array, i);
+			if (!prop_dictionary_get_cstring_nocopy(d,
+			    "file", &file))
+				continue;
+			if (xbps_strmap_find(paths, file, NULL))
+				return EEXIST;
+			if ((rv = xbps_strmap_add(paths, file, NULL)) != 0)
+				return rv;
+		}
+	}
+	return 0;
+}
+
+static prop_dictionary_t
+batch_get_filesd(struct xbps_handle *xhp, prop_dictionary_t pkgd)
+{
+	prop_dictionary_t filesd;
+	const char *repoloc;
+	char *binfile;
+
+	prop_dictionary_get_cstring_nocopy(pkgd, "repository", &repoloc);
+	binfile = xbps_path_from_repository_uri(xhp, pkgd, repoloc);
+	if (binfile == NULL)
+		return NULL;
+
+	filesd = xbps_dictionary_metadata_plist_by_url(binfile,
+	    "./files.plist");
+	free(binfile);
+
+	return filesd;
+}
+
+/*
+ * Sets npkgs to the number of consecutive packages from pkgs[idx]
+ * (at least 1, up to maxpkgs) that can be unpacked at once.
+ */
+int HIDDEN
+xbps_transaction_unpack_batch_size(struct xbps_handle *xhp,
+				   prop_array_t pkgs,
+				   unsigned int idx,
+				   unsigned int maxpkgs,
+				   unsigned int *npkgs)
+{
+	struct xbps_strmap *paths;
+	prop_dictionary_t pkgd, filesd;
+	unsigned int n;
+	int rv;
+
+	assert(prop_object_type(pkgs) == PROP_TYPE_ARRAY);
+	assert(idx < prop_array_count(pkgs));
+	assert(npkgs != NULL);
+
+	if ((paths = xbps_strmap_create(0)) == NULL)
+		return ENOMEM;
+
+	for (n = 0; idx + n < prop_array_count(pkgs) && n < maxpkgs; n++) {
+		pkgd = prop_array_get(pkgs, idx + n);
+		if (n > 0 && depends_on_batch(pkgd, pkgs, idx, n))
+			break;
+		filesd = NULL;
+		if (unpack_batch_ok(pkgd))
+			filesd = batch_get_filesd(xhp, pkgd);
+		if (filesd == NULL) {
+			/* can't know its files, unpack it alone */
+			if (n == 0)
+				n++;
+			break;
+		}
+		rv = batch_add_paths(paths, filesd);
+		prop_object_release(filesd);
+		if (rv != 0 && n > 0)
+			break;
+	}
+	xbps_strmap_free(paths);
+	*npkgs = n;
+
+	return 0;
+}
+
+static void *
+unpack_thread(void *arg)
+{
+	struct unpack_batch *ub = arg;
+	size_t i;
+
+	for (;;) {
+		pthread_mutex_lock(&ub->mtx);
+		i = ub->next++;
+		pthread_mutex_unlock(&ub->mtx);
+		if (i >= ub->njobs)
+			break;
+
+		ub->jobs[i].rv = xbps_unpack_binary_pkg(ub->xhp,
+		    ub->jobs[i].pkgd);
+	}
+	return NULL;
+}
+
+static void
+unpack_batch_run(struct unpack_batch *ub, size_t nthreads)
+{
+	pthread_t *thr;
+	size_t i;
+
+	if (nthreads > ub->njobs)
+		nthreads = ub->njobs;
+	if ((thr = calloc(nthreads, sizeof(*thr))) == NULL)
+		nthreads = 1;
+
+	pthread_mutex_init(&ub->mtx, NULL);
+	/* this thread also unpacks packages */
+	for (i = 1; i < nthreads; i++) {
+		if (pthread_create(&thr[i], NULL, unpack_thread, ub))
+			break;
+	}
+	nthreads = i;
+	(void)unpack_thread(ub);
+
+	for (i = 1; i < nthreads; i++)
+		pthread_join(thr[i], NULL);
+
+	pthread_mutex_destroy(&ub->mtx);
+	free(thr);
+}
+
+int HIDDEN
+xbps_transaction_unpack_batch(struct xbps_handle *xhp,
+			      prop_array_t pkgs,
+			      unsigned int idx,
+			      unsigned int *npkgs)
+{
+	struct unpack_batch ub;
+	const char *pkgname, *version;
+	unsigned int maxjobs, njobs;
+	size_t i;
+	int rv = 0;
+
+	assert(prop_object_type(pkgs) == PROP_TYPE_ARRAY);
+	assert(idx < prop_array_count(pkgs));
+	assert(npkgs != NULL);
+
+	maxjobs = xhp->transaction_parallel_unpack * UNPACK_BATCH_PER_THREAD;
+	if (maxjobs == 0)
+		maxjobs = 1;
+
+	/*
+	 * Build the batch of independent packages.
+	 */
+	rv = xbps_transaction_unpack_batch_size(xhp, pkgs, idx, maxjobs,
+	    &njobs);
+	if (rv != 0)
+		return rv;
+
+	memset(&ub, 0, sizeof(ub));
+	ub.xhp = xhp;
+	if ((ub.jobs = calloc(njobs, sizeof(*ub.jobs))) == NULL)
+		return ENOMEM;
+	ub.njobs = njobs;
+	for (i = 0; i < ub.njobs; i++)
+		ub.jobs[i].pkgd = prop_array_get(pkgs, idx + i);
+
+	if (ub.njobs > 1)
+		xbps_dbg_printf(xhp, "[trans] unpacking %zu packages "
+		    "in parallel.\n", ub.njobs);
+
+	for (i = 0; i < ub.njobs; i++) {
+		prop_dictionary_get_cstring_nocopy(ub.jobs[i].pkgd,
+		    "pkgname", &pkgname);
+		prop_dictionary_get_cstring_nocopy(ub.jobs[i].pkgd,
+		    "version", &version);
+		xbps_set_cb_state(xhp, XBPS_STATE_INSTALL, 0,
+		    pkgname, version, NULL);
+	}
+	/*
+	 * Unpack all packages in the batch and register them in order;
+	 * packages unpacked successfully are registered even if any
+	 * other in the batch failed.
+	 */
+	unpack_batch_run(&ub, xhp->transaction_parallel_unpack);
+
+	for (i = 0; i < ub.njobs; i++) {
+		if (ub.jobs[i].rv != 0) {
+			if (rv == 0)
+				rv = ub.jobs[i].rv;
+			continue;
+		}
+		ub.jobs[i].rv = xbps_register_pkg(xhp, ub.jobs[i].pkgd, false);
+		if (ub.jobs[i].rv != 0 && rv == 0)
+			rv = ub.jobs[i].rv;
+	}
+	*npkgs = ub.njobs;
+	free(ub.jobs);
+
+	return rv;
+}
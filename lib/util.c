@@ -231,7 +231,8 @@ xbps_path_from_repository_uri(struct xbps_handle *xhp,
 			      prop_dictionary_t pkg_repod,
 			      const char *repoloc)
 {
-	const char *filen;
+	prop_array_t mirrors;
+	const char *filen, *mirror;
 	char *lbinpkg = NULL;
 
 	assert(prop_object_type(pkg_repod) == PROP_TYPE_DICTIONARY);
@@ -252,6 +253,24 @@ xbps_path_from_repository_uri(struct xbps_handle *xhp,
 		return lbinpkg;
 
 	free(lbinpkg);
+	/*
+	 * Then in the shared cachedir, if set.
+	 */
+	if ((lbinpkg = xbps_shared_cache_path(xhp, pkg_repod)) != NULL) {
+		if (access(lbinpkg, R_OK) == 0)
+			return lbinpkg;
+		free(lbinpkg);
+	}
+	/*
+	 * Remote repositories are fetched from its best mirror.
+	 */
+	if (xbps_check_is_repository_uri_remote(repoloc) &&
+	    (mirrors = xbps_mirror_group(xhp, repoloc)) != NULL) {
+		prop_array_get_cstring_nocopy(mirrors, 0, &mirror);
+		lbinpkg = xbps_xasprintf("%s/%s", mirror, filen);
+		prop_object_release(mirrors);
+		return lbinpkg;
+	}
 	/*
 	 * Local and remote repositories use the same path.
 	 */
@@ -328,3 +347,263 @@ xbps_pkgpattern_match(const char *pkg, const char *pattern)
 	/* no match */
 	return 0;
 }
+
+/*
+ * Cache of precompiled package patterns, indexed by the pattern
+ * string. Dependency strings (run_depends, conflicts, etc) are
+ * matched many times while resolving a transaction, this way they
+ * are only compiled once per handle.
+ */
+struct xbps_pkgpattern_cache {
+	struct xbps_pkgpattern **slots;
+	size_t nslots;
+	size_t nentries;
+};
+
+size_t
+xbps_strhash(const char *str)
+{
+	size_t h = 5381;
+
+	while (*str)
+		h = (h * 33) ^ (unsigned char)*str++;
+
+	return h;
+}
+
+static int
+pkgpattern_cache_grow(struct xbps_pkgpattern_cache *pc)
+{
+	struct xbps_pkgpattern **slots, *pp;
+	const char *name;
+	size_t i, nslots, slot;
+
+	nslots = pc->nslots ? pc->nslots * 2 : 256;
+	if ((slots = calloc(nslots, sizeof(*slots))) == NULL)
+		return ENOMEM;
+
+	for (i = 0; i < pc->nslots; i++) {
+		if ((pp = pc->slots[i]) == NULL)
+			continue;
+		name = xbps_pkgpattern_compiled_pattern(pp);
+		slot = xbps_strhash(name) & (nslots - 1);
+		while (slots[slot] != NULL)
+			slot = (slot + 1) & (nslots - 1);
+		slots[slot] = pp;
+	}
+	free(pc->slots);
+	pc->slots = slots;
+	pc->nslots = nslots;
+
+	return 0;
+}
+
+const struct xbps_pkgpattern HIDDEN *
+xbps_pkgpattern_cached(struct xbps_handle *xhp, const char *pattern)
+{
+	struct xbps_pkgpattern_cache *pc;
+	struct xbps_pkgpattern *pp;
+	size_t slot;
+
+	assert(xhp != NULL);
+	assert(pattern != NULL);
+
+	if ((pc = xhp->pkgpattern_cache) == NULL) {
+		if ((pc = calloc(1, sizeof(*pc))) == NULL)
+			return NULL;
+		xhp->pkgpattern_cache = pc;
+	}
+	if ((pc->nentries + 1) * 2 > pc->nslots) {
+		if ((errno = pkgpattern_cache_grow(pc)) != 0)
+			return NULL;
+	}
+	slot = xbps_strhash(pattern) & (pc->nslots - 1);
+	while ((pp = pc->slots[slot]) != NULL) {
+		if (strcmp(xbps_pkgpattern_compiled_pattern(pp), pattern) == 0)
+			return pp;
+		slot = (slot + 1) & (pc->nslots - 1);
+	}
+	if ((pp = xbps_pkgpattern_compile(pattern)) == NULL)
+		return NULL;
+
+	pc->slots[slot] = pp;
+	pc->nentries++;
+
+	return pp;
+}
+
+void HIDDEN
+xbps_pkgpattern_cache_release(struct xbps_handle *xhp)
+{
+	struct xbps_pkgpattern_cache *pc = xhp->pkgpattern_cache;
+	size_t i;
+
+	if (pc == NULL)
+		return;
+
+	for (i = 0; i < pc->nslots; i++)
+		xbps_pkgpattern_free(pc->slots[i]);
+
+	free(pc->slots);
+	free(pc);
+	xhp->pkgpattern_cache = NULL;
+}
+
+/*
+ * Map of strings to pointers; keys are not copied, they must be valid
+ * while the map is in use. Used to look up package files by path in
+ * constant time.
+ */
+struct xbps_strmap {
+	const char **keys;
+	const void **values;
+	size_t nslots;
+	size_t nentries;
+};
+
+static int
+strmap_grow(struct xbps_strmap *sm, size_t nslots)
+{
+	const char **keys;
+	const void **values;
+	size_t i, slot;
+
+	if ((keys = calloc(nslots, sizeof(*keys))) == NULL)
+		return ENOMEM;
+	if ((values = calloc(nslots, sizeof(*values))) == NULL) {
+		free(keys);
+		return ENOMEM;
+	}
+	for (i = 0; i < sm->nslots; i++) {
+		if (sm->keys[i] == NULL)
+			continue;
+		slot = xbps_strhash(sm->keys[i]) & (nslots - 1);
+		while (keys[slot] != NULL)
+			slot = (slot + 1) & (nslots - 1);
+		keys[slot] = sm->keys[i];
+		values[slot] = sm->values[i];
+	}
+	free(sm->keys);
+	free(sm->values);
+	sm->keys = keys;
+	sm->values = values;
+	sm->nslots = nslots;
+
+	return 0;
+}
+
+struct xbps_strmap HIDDEN *
+xbps_strmap_create(size_t hint)
+{
+	struct xbps_strmap *sm;
+	size_t nslots = 16;
+
+	while (nslots < hint * 2)
+		nslots *= 2;
+
+	if ((sm = calloc(1, sizeof(*sm))) == NULL)
+		return NULL;
+	if ((errno = strmap_grow(sm, nslots)) != 0) {
+		free(sm);
+		return NULL;
+	}
+	return sm;
+}
+
+int HIDDEN
+xbps_strmap_add(struct xbps_strmap *sm, const char *key, const void *value)
+{
+	size_t slot;
+	int rv;
+
+	assert(sm != NULL);
+	assert(key != NULL);
+
+	if ((sm->nentries + 1) * 2 > sm->nslots) {
+		if ((rv = strmap_grow(sm, sm->nslots * 2)) != 0)
+			return rv;
+	}
+	slot = xbps_strhash(key) & (sm->nslots - 1);
+	while (sm->keys[slot] != NULL) {
+		if (strcmp(sm->keys[slot], key) == 0) {
+			sm->values[slot] = value;
+			return 0;
+		}
+		slot = (slot + 1) & (sm->nslots - 1);
+	}
+	sm->keys[slot] = key;
+	sm->values[slot] = value;
+	sm->nentries++;
+
+	return 0;
+}
+
+bool HIDDEN
+xbps_strmap_find(struct xbps_strmap *sm, const char *key, const void **value)
+{
+	size_t slot;
+
+	assert(sm != NULL);
+	assert(key != NULL);
+
+	slot = xbps_strhash(key) & (sm->nslots - 1);
+	while (sm->keys[slot] != NULL) {
+		if (strcmp(sm->keys[slot], key) == 0) {
+			if (value != NULL)
+				*value = sm->values[slot];
+			return true;
+		}
+		slot = (slot + 1) & (sm->nslots - 1);
+	}
+	return false;
+}
+
+void HIDDEN
+xbps_strmap_free(struct xbps_strmap *sm)
+{
+	if (sm == NULL)
+		return;
+
+	free(sm->keys);
+	free(sm->values);
+	free(sm);
+}
+
+/*
+ * Creates a map from the objects in array: strings as keys if key is
+ * NULL, otherwise dictionaries with the string keyed by key mapped
+ * to the string keyed by valkey (if any).
+ */
+struct xbps_strmap HIDDEN *
+xbps_strmap_from_array(prop_array_t array, const char *key, const char *valkey)
+{
+	struct xbps_strmap *sm;
+	prop_object_t obj;
+	const char *str, *val;
+	unsigned int i, cnt;
+
+	cnt = prop_array_count(array);
+	if ((sm = xbps_strmap_create(cnt)) == NULL)
+		return NULL;
+
+	for (i = 0; i < cnt; i++) {
+		obj = prop_array_get(array, i);
+		val = NULL;
+		if (key == NULL) {
+			str = prop_string_cstring_nocopy(obj);
+		} else {
+			if (!prop_dictionary_get_cstring_nocopy(obj, key, &str))
+				str = NULL;
+			if (valkey != NULL)
+				prop_dictionary_get_cstring_nocopy(obj,
+				    valkey, &val);
+		}
+		if (str == NULL)
+			continue;
+		if ((errno = xbps_strmap_add(sm, str, val)) != 0) {
+			xbps_strmap_free(sm);
+			return NULL;
+		}
+	}
+	return sm;
+}
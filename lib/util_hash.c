@@ -180,8 +180,6 @@ xbps_file_hash_check_dictionary(struct xbps_handle *xhp,
 				const char *file)
 {
 	const char *sha256d = NULL;
-	char *buf;
-	int rv;
 
 	assert(prop_object_type(d) == PROP_TYPE_DICTIONARY);
 	assert(key != NULL);
@@ -194,6 +192,24 @@ xbps_file_hash_check_dictionary(struct xbps_handle *xhp,
 		return -1; /* error */
 	}
 
+	return xbps_file_hash_check_rootdir(xhp, file, sha256d);
+}
+
+/*
+ * Checks if file, relative to rootdir, matches the sha256 hash;
+ * returns 0 if hash is matched, -1 on error and 1 if no match.
+ */
+int HIDDEN
+xbps_file_hash_check_rootdir(struct xbps_handle *xhp,
+			     const char *file,
+			     const char *sha256d)
+{
+	char *buf;
+	int rv;
+
+	assert(file != NULL);
+	assert(sha256d != NULL);
+
 	if (strcmp(xhp->rootdir, "/") == 0) {
 		rv = xbps_file_hash_check(file, sha256d);
 	} else {
@@ -27,8 +27,16 @@ uninstall:
 	@printf " [CC]\t\t$@\n"
 	${SILENT}$(CC) $(CPPFLAGS) $(CFLAGS) -c $<
 
+ifdef TEST_STATIC
+# Tests of private functions are linked against libxbps.a.
+$(TEST): $(OBJS)
+	@printf " [CCLD]\t\t$@\n"
+	${SILENT}$(CC) $^ $(CPPFLAGS) -L$(TOPDIR)/lib $(CFLAGS) \
+		$(PROG_CFLAGS) $(STATIC_LIBS) -latf-c -o $@
+else
 $(TEST): $(OBJS)
 	@printf " [CCLD]\t\t$@\n"
 	${SILENT}$(CC) $^ $(CPPFLAGS) -L$(TOPDIR)/lib $(CFLAGS) \
 		$(PROG_CFLAGS) -lprop -lxbps -latf-c -o $@
+endif
 
@@ -24,6 +24,8 @@
  *-
  */
 
+#include <stdio.h>
+#include <string.h>
 #include <atf-c.h>
 #include <xbps_api.h>
 
@@ -47,8 +49,39 @@ ATF_TC_BODY(cmpver_test, tc)
 	ATF_REQUIRE_EQ(xbps_cmpver("foo-1.0.1", "foo-1.0_1"), 1);
 }
 
+ATF_TC(cmpver_cached_test);
+
+ATF_TC_HEAD(cmpver_cached_test, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Test xbps_cmpver_cached conditions");
+}
+
+ATF_TC_BODY(cmpver_cached_test, tc)
+{
+	struct xbps_handle xh;
+	char buf[32];
+
+	memset(&xh, 0, sizeof(xh));
+	ATF_REQUIRE_EQ(xbps_init(&xh), 0);
+
+	ATF_REQUIRE_EQ(xbps_cmpver_cached(&xh, "foo-1.0", "foo-1.0"), 0);
+	ATF_REQUIRE_EQ(xbps_cmpver_cached(&xh, "foo-1.0", "foo-1.0_1"), -1);
+	ATF_REQUIRE_EQ(xbps_cmpver_cached(&xh, "foo-1.0_1", "foo-1.0"), 1);
+	ATF_REQUIRE_EQ(xbps_cmpver_cached(&xh, "foo-2.0rc2", "foo-2.0rc3"), -1);
+	ATF_REQUIRE_EQ(xbps_cmpver_cached(&xh, "foo-1.0.1", "foo-1.0_1"), 1);
+
+	/* same address with a different string must not use stale data */
+	snprintf(buf, sizeof(buf), "foo-1.0");
+	ATF_REQUIRE_EQ(xbps_cmpver_cached(&xh, buf, "foo-1.1"), -1);
+	snprintf(buf, sizeof(buf), "foo-1.2");
+	ATF_REQUIRE_EQ(xbps_cmpver_cached(&xh, buf, "foo-1.1"), 1);
+
+	xbps_end(&xh);
+}
+
 ATF_TP_ADD_TCS(tp)
 {
 	ATF_TP_ADD_TC(tp, cmpver_test);
+	ATF_TP_ADD_TC(tp, cmpver_cached_test);
 	return atf_no_error();
 }
@@ -0,0 +1,172 @@
+/*-
+ * Copyright (c) 2012 Juan Romero Pardines.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *-
+ */
+#include <errno.h>
+#include <string.h>
+#include <atf-c.h>
+#include <xbps_api.h>
+
+static void
+pkgdb_init(struct xbps_handle *xhp, atf_tc_t *tc)
+{
+	/* initialize xbps with pkgdb from test source dir */
+	memset(xhp, 0, sizeof(*xhp));
+	xhp->rootdir = "/tmp";
+	xhp->metadir = atf_tc_get_config_var(tc, "srcdir");
+	ATF_REQUIRE_EQ(xbps_init(xhp), 0);
+}
+
+ATF_TC(pkgdb_get_pkg_revdeps_test);
+ATF_TC_HEAD(pkgdb_get_pkg_revdeps_test, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Test xbps_pkgdb_get_pkg_revdeps");
+}
+ATF_TC_BODY(pkgdb_get_pkg_revdeps_test, tc)
+{
+	struct xbps_handle xh;
+	prop_array_t a;
+	const char *pkgver;
+
+	pkgdb_init(&xh, tc);
+
+	a = xbps_pkgdb_get_pkg_revdeps(&xh, "glibc");
+	ATF_REQUIRE_EQ(prop_object_type(a), PROP_TYPE_ARRAY);
+	ATF_REQUIRE_EQ(prop_array_count(a), 4);
+	prop_array_get_cstring_nocopy(a, 0, &pkgver);
+	ATF_REQUIRE_STREQ(pkgver, "libfoo-1.0_1");
+	prop_array_get_cstring_nocopy(a, 3, &pkgver);
+	ATF_REQUIRE_STREQ(pkgver, "foo-1.0_1");
+	prop_object_release(a);
+
+	a = xbps_pkgdb_get_pkg_revdeps(&xh, "libbaz");
+	ATF_REQUIRE_EQ(prop_array_count(a), 1);
+	prop_array_get_cstring_nocopy(a, 0, &pkgver);
+	ATF_REQUIRE_STREQ(pkgver, "bar-2.0_1");
+	prop_object_release(a);
+
+	a = xbps_pkgdb_get_pkg_revdeps(&xh, "foo");
+	ATF_REQUIRE_EQ(prop_array_count(a), 0);
+	prop_object_release(a);
+
+	/* unexistent package */
+	a = xbps_pkgdb_get_pkg_revdeps(&xh, "blah");
+	ATF_REQUIRE_EQ(a, NULL);
+	ATF_REQUIRE_EQ(errno, ENOENT);
+
+	xbps_end(&xh);
+}
+
+static void
+check_orphans(prop_array_t a, const char **expected, unsigned int cnt)
+{
+	prop_dictionary_t d;
+	const char *pkgver;
+	unsigned int i;
+
+	ATF_REQUIRE_EQ(prop_array_count(a), cnt);
+	for (i = 0; i < cnt; i++) {
+		d = prop_array_get(a, i);
+		prop_dictionary_get_cstring_nocopy(d, "pkgver", &pkgver);
+		ATF_REQUIRE_STREQ(pkgver, expected[i]);
+	}
+}
+
+ATF_TC(find_pkg_orphans_test);
+ATF_TC_HEAD(find_pkg_orphans_test, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Test xbps_find_pkg_orphans");
+}
+ATF_TC_BODY(find_pkg_orphans_test, tc)
+{
+	struct xbps_handle xh;
+	prop_array_t a;
+	const char *expected[] = {
+		"cycb-1.0_1", "cyca-1.0_1", "bar-2.0_1", "libbaz-1.0_1"
+	};
+
+	pkgdb_init(&xh, tc);
+
+	/*
+	 * bar is an orphan and libbaz is only required by bar;
+	 * cyca and cycb only require each other.
+	 */
+	a = xbps_find_pkg_orphans(&xh, NULL);
+	ATF_REQUIRE_EQ(prop_object_type(a), PROP_TYPE_ARRAY);
+	check_orphans(a, expected, 4);
+	prop_object_release(a);
+
+	xbps_end(&xh);
+}
+
+ATF_TC(find_pkg_orphans_user_test);
+ATF_TC_HEAD(find_pkg_orphans_user_test, tc)
+{
+	atf_tc_set_md_var(tc, "descr",
+	    "Test xbps_find_pkg_orphans with user supplied orphans");
+}
+ATF_TC_BODY(find_pkg_orphans_user_test, tc)
+{
+	struct xbps_handle xh;
+	prop_array_t a, orphans_user;
+	const char *expected[] = {
+		"cycb-1.0_1", "cyca-1.0_1", "bar-2.0_1", "libbaz-1.0_1",
+		"libfoo-1.0_1"
+	};
+	const char *expected_virtual[] = {
+		"cycb-1.0_1", "cyca-1.0_1", "libvfoo-1.0_1", "bar-2.0_1",
+		"libbaz-1.0_1"
+	};
+
+	pkgdb_init(&xh, tc);
+
+	/* libfoo is only required by foo, which is going to be removed */
+	orphans_user = prop_array_create();
+	ATF_REQUIRE(orphans_user != NULL);
+	prop_array_add_cstring_nocopy(orphans_user, "foo");
+	a = xbps_find_pkg_orphans(&xh, orphans_user);
+	check_orphans(a, expected, 5);
+	prop_object_release(a);
+	prop_object_release(orphans_user);
+
+	/* libvfoo is only required by the provider of vfoo */
+	orphans_user = prop_array_create();
+	ATF_REQUIRE(orphans_user != NULL);
+	prop_array_add_cstring_nocopy(orphans_user, "vfoo");
+	a = xbps_find_pkg_orphans(&xh, orphans_user);
+	check_orphans(a, expected_virtual, 5);
+	prop_object_release(a);
+	prop_object_release(orphans_user);
+
+	xbps_end(&xh);
+}
+
+ATF_TP_ADD_TCS(tp)
+{
+	ATF_TP_ADD_TC(tp, pkgdb_get_pkg_revdeps_test);
+	ATF_TP_ADD_TC(tp, find_pkg_orphans_test);
+	ATF_TP_ADD_TC(tp, find_pkg_orphans_user_test);
+
+	return atf_no_error();
+}
@@ -54,8 +54,55 @@ ATF_TC_BODY(pkgpattern_match_test, tc)
 	ATF_REQUIRE_EQ(xbps_pkgpattern_match("foo-1.11", "foo-1.[0-2][2-4]?"), 0);
 }
 
+static int
+match_compiled(const char *pkgver, const char *pattern)
+{
+	struct xbps_pkgpattern *pp;
+	int rv;
+
+	pp = xbps_pkgpattern_compile(pattern);
+	ATF_REQUIRE(pp != NULL);
+	rv = xbps_pkgpattern_match_compiled(pkgver, pp);
+	xbps_pkgpattern_free(pp);
+
+	return rv;
+}
+
+ATF_TC(pkgpattern_match_compiled_test);
+
+ATF_TC_HEAD(pkgpattern_match_compiled_test, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Test xbps_pkgpattern_match_compiled");
+}
+
+ATF_TC_BODY(pkgpattern_match_compiled_test, tc)
+{
+	struct xbps_pkgpattern *pp;
+
+	ATF_REQUIRE_EQ(match_compiled("foo-1.0", "foo>=0"), 1);
+	ATF_REQUIRE_EQ(match_compiled("foo-1.0", "foo>=1.0"), 1);
+	ATF_REQUIRE_EQ(match_compiled("foo-1.0", "foo>=1.0<1.0_1"), 1);
+	ATF_REQUIRE_EQ(match_compiled("foo-1.0_2", "foo>=1.0<1.0_1"), 0);
+	ATF_REQUIRE_EQ(match_compiled("foo-1.0", "foo>1.0_1"), 0);
+	ATF_REQUIRE_EQ(match_compiled("foo-1.0", "foo<1.0"), 0);
+	ATF_REQUIRE_EQ(match_compiled("foo-1.0", "foo-1.0"), 1);
+	ATF_REQUIRE_EQ(match_compiled("foobar-1.0", "foo>=0"), 0);
+	ATF_REQUIRE_EQ(match_compiled("foo-1.0", "foo-[0-1].[0-9]*"), 1);
+	ATF_REQUIRE_EQ(match_compiled("foo-1.0", "foo-[1-2].[1-9]*"), 0);
+	ATF_REQUIRE_EQ(match_compiled("foo-1.01", "foo-1.[0-9]?"), 1);
+	ATF_REQUIRE_EQ(match_compiled("foo-1.01", "foo-1.[1-9]?"), 0);
+	ATF_REQUIRE_EQ(match_compiled("foo-1.02", "foo>=1.[0-2][2-4]?"), 1);
+	ATF_REQUIRE_EQ(match_compiled("foo-1.11", "foo-1.[0-2][2-4]?"), 0);
+
+	pp = xbps_pkgpattern_compile("foo>=1.0");
+	ATF_REQUIRE(pp != NULL);
+	ATF_REQUIRE_STREQ(xbps_pkgpattern_compiled_name(pp), "foo");
+	xbps_pkgpattern_free(pp);
+}
+
 ATF_TP_ADD_TCS(tp)
 {
 	ATF_TP_ADD_TC(tp, pkgpattern_match_test);
+	ATF_TP_ADD_TC(tp, pkgpattern_match_compiled_test);
 	return atf_no_error();
 }
@@ -0,0 +1,121 @@
+/*-
+ * Copyright (c) 2012 Juan Romero Pardines.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *-
+ */
+#include <atf-c.h>
+#include <xbps_api.h>
+
+static prop_dictionary_t
+pkgdict_init(void)
+{
+	prop_dictionary_t d;
+	prop_array_t a;
+	prop_data_t data;
+
+	d = prop_dictionary_create();
+	ATF_REQUIRE(d != NULL);
+
+	prop_dictionary_set_cstring_nocopy(d, "pkgname", "xbps");
+	prop_dictionary_set_cstring_nocopy(d, "version", "0.17");
+	prop_dictionary_set_uint64(d, "installed_size", 123456789012ULL);
+	prop_dictionary_set_int64(d, "negative", -42);
+	prop_dictionary_set_bool(d, "automatic-install", true);
+
+	a = prop_array_create();
+	ATF_REQUIRE(a != NULL);
+	prop_array_add_cstring_nocopy(a, "xbps");
+	prop_array_add_cstring_nocopy(a, "libxbps>=0.17");
+	ATF_REQUIRE_EQ(prop_dictionary_set(d, "run_depends", a), true);
+	prop_object_release(a);
+
+	data = prop_data_create_data("\0\1\2\3", 4);
+	ATF_REQUIRE(data != NULL);
+	ATF_REQUIRE_EQ(prop_dictionary_set(d, "data", data), true);
+	prop_object_release(data);
+
+	return d;
+}
+
+ATF_TC(binary_roundtrip_test);
+ATF_TC_HEAD(binary_roundtrip_test, tc)
+{
+	atf_tc_set_md_var(tc, "descr",
+	    "Test prop_dictionary_{externalize,internalize}_binary");
+}
+
+ATF_TC_BODY(binary_roundtrip_test, tc)
+{
+	prop_dictionary_t d, d2;
+	void *buf;
+	size_t len;
+
+	d = pkgdict_init();
+	buf = prop_dictionary_externalize_binary(d, &len);
+	ATF_REQUIRE(buf != NULL);
+	ATF_REQUIRE_EQ(prop_binary_detect(buf, len), true);
+
+	d2 = prop_dictionary_internalize_binary(buf, len);
+	ATF_REQUIRE(d2 != NULL);
+	ATF_REQUIRE_EQ(prop_dictionary_equals(d, d2), true);
+
+	/* truncated input must be rejected */
+	ATF_REQUIRE_EQ(prop_dictionary_internalize_binary(buf, len - 1), NULL);
+	/* an array can't be internalized from a dictionary */
+	ATF_REQUIRE_EQ(prop_array_internalize_binary(buf, len), NULL);
+}
+
+ATF_TC(binary_file_test);
+ATF_TC_HEAD(binary_file_test, tc)
+{
+	atf_tc_set_md_var(tc, "descr",
+	    "Test binary plists detection in the *_internalize_from_file "
+	    "and *_internalize_from_zfile functions");
+}
+
+ATF_TC_BODY(binary_file_test, tc)
+{
+	prop_dictionary_t d, d2;
+
+	d = pkgdict_init();
+
+	ATF_REQUIRE_EQ(
+	    prop_dictionary_externalize_binary_to_file(d, "d.plist"), true);
+	d2 = prop_dictionary_internalize_from_file("d.plist");
+	ATF_REQUIRE_EQ(prop_dictionary_equals(d, d2), true);
+	d2 = prop_dictionary_internalize_from_zfile("d.plist");
+	ATF_REQUIRE_EQ(prop_dictionary_equals(d, d2), true);
+
+	ATF_REQUIRE_EQ(
+	    prop_dictionary_externalize_binary_to_zfile(d, "dz.plist"), true);
+	d2 = prop_dictionary_internalize_from_zfile("dz.plist");
+	ATF_REQUIRE_EQ(prop_dictionary_equals(d, d2), true);
+}
+
+ATF_TP_ADD_TCS(tp)
+{
+	ATF_TP_ADD_TC(tp, binary_roundtrip_test);
+	ATF_TP_ADD_TC(tp, binary_file_test);
+
+	return atf_no_error();
+}
@@ -118,6 +118,37 @@ ATF_TC_BODY(find_pkg_in_array_by_pkgver_test, tc)
 	ATF_REQUIRE_EQ(prop_object_type(dr), PROP_TYPE_DICTIONARY);
 }
 
+ATF_TC(find_pkg_in_immutable_array_test);
+ATF_TC_HEAD(find_pkg_in_immutable_array_test, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Test xbps_find_pkg_in_array_by_* "
+	    "with immutable arrays");
+}
+ATF_TC_BODY(find_pkg_in_immutable_array_test, tc)
+{
+	struct xbps_handle xh;
+	prop_array_t a;
+	prop_dictionary_t dr;
+	const char *pkgname;
+
+	a = prop_array_internalize(arrayxml);
+	ATF_REQUIRE_EQ(prop_object_type(a), PROP_TYPE_ARRAY);
+	prop_array_make_immutable(a);
+
+	memset(&xh, 0, sizeof(xh));
+	xbps_init(&xh);
+	dr = xbps_find_pkg_in_array_by_name(&xh, a, "foo", NULL);
+	ATF_REQUIRE_EQ(prop_object_type(dr), PROP_TYPE_DICTIONARY);
+	prop_dictionary_get_cstring_nocopy(dr, "pkgname", &pkgname);
+	ATF_REQUIRE_STREQ(pkgname, "foo");
+	dr = xbps_find_pkg_in_array_by_pattern(&xh, a, "afoo>=1.0", NULL);
+	ATF_REQUIRE_EQ(prop_object_type(dr), PROP_TYPE_DICTIONARY);
+	dr = xbps_find_pkg_in_array_by_pkgver(&xh, a, "foo-2.0", NULL);
+	ATF_REQUIRE_EQ(prop_object_type(dr), PROP_TYPE_DICTIONARY);
+	dr = xbps_find_pkg_in_array_by_name(&xh, a, "bar", NULL);
+	ATF_REQUIRE_EQ(dr, NULL);
+}
+
 ATF_TC(find_virtualpkg_in_array_by_name_test);
 ATF_TC_HEAD(find_virtualpkg_in_array_by_name_test, tc)
 {
@@ -169,6 +200,7 @@ ATF_TP_ADD_TCS(tp)
 	ATF_TP_ADD_TC(tp, find_pkg_in_array_by_name_test);
 	ATF_TP_ADD_TC(tp, find_pkg_in_array_by_pattern_test);
 	ATF_TP_ADD_TC(tp, find_pkg_in_array_by_pkgver_test);
+	ATF_TP_ADD_TC(tp, find_pkg_in_immutable_array_test);
 	ATF_TP_ADD_TC(tp, find_virtualpkg_in_array_by_name_test);
 	ATF_TP_ADD_TC(tp, find_virtualpkg_in_array_by_pattern_test);
 
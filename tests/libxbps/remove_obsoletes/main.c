@@ -0,0 +1,195 @@
+/*-
+ * Copyright (c) 2012 Juan Romero Pardines.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *-
+ */
+#include <sys/stat.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <atf-c.h>
+#include "xbps_api_impl.h"
+
+/*
+ * xbps_remove_obsoletes() works with paths relative to the current
+ * directory, that is the work directory of every test case.
+ */
+static void
+write_file(const char *file, const char *data)
+{
+	FILE *f;
+
+	ATF_REQUIRE((f = fopen(file, "w")) != NULL);
+	ATF_REQUIRE(fputs(data, f) != EOF);
+	ATF_REQUIRE_EQ(fclose(f), 0);
+}
+
+/*
+ * Adds `file' to the `key' array of `d'; with `sha256' set, the
+ * current hash of the file is also added.
+ */
+static void
+add_entry(prop_dictionary_t d, const char *key, const char *file,
+	  bool sha256)
+{
+	prop_array_t a;
+	prop_dictionary_t obj;
+	char *path, *hash;
+
+	if ((a = prop_dictionary_get(d, key)) == NULL) {
+		a = prop_array_create();
+		ATF_REQUIRE(prop_dictionary_set(d, key, a));
+		prop_object_release(a);
+	}
+	obj = prop_dictionary_create();
+	ATF_REQUIRE(prop_dictionary_set_cstring(obj, "file", file));
+	if (sha256) {
+		path = xbps_xasprintf(".%s", file);
+		ATF_REQUIRE((hash = xbps_file_hash(path)) != NULL);
+		ATF_REQUIRE(prop_dictionary_set_cstring(obj, "sha256", hash));
+		free(hash);
+		free(path);
+	}
+	ATF_REQUIRE(prop_array_add(a, obj));
+	prop_object_release(obj);
+}
+
+static bool
+exists(const char *file)
+{
+	struct stat st;
+
+	return lstat(file, &st) == 0;
+}
+
+ATF_TC(remove_obsoletes_test);
+ATF_TC_HEAD(remove_obsoletes_test, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Test xbps_remove_obsoletes");
+}
+ATF_TC_BODY(remove_obsoletes_test, tc)
+{
+	struct xbps_handle xh;
+	prop_dictionary_t oldd, newd;
+
+	memset(&xh, 0, sizeof(xh));
+	oldd = prop_dictionary_create();
+	newd = prop_dictionary_create();
+
+	ATF_REQUIRE_EQ(mkdir("usr", 0755), 0);
+	ATF_REQUIRE_EQ(mkdir("usr/share", 0755), 0);
+	ATF_REQUIRE_EQ(mkdir("usr/empty", 0755), 0);
+	write_file("usr/keep", "keep");
+	write_file("usr/obsolete", "obsolete");
+	write_file("usr/modified", "modified");
+	write_file("usr/missing", "missing");
+	write_file("usr/nohash", "nohash");
+	ATF_REQUIRE_EQ(symlink("keep", "usr/link"), 0);
+	ATF_REQUIRE_EQ(symlink("missing", "usr/dangling"), 0);
+	ATF_REQUIRE_EQ(symlink("usr/missing", "bin"), 0);
+
+	add_entry(oldd, "files", "/usr/keep", true);
+	add_entry(oldd, "files", "/usr/obsolete", true);
+	add_entry(oldd, "files", "/usr/modified", true);
+	add_entry(oldd, "files", "/usr/missing", true);
+	add_entry(oldd, "files", "/usr/nohash", false);
+	add_entry(oldd, "links", "/usr/link", false);
+	add_entry(oldd, "links", "/usr/dangling", false);
+	add_entry(oldd, "links", "/bin", false);
+	add_entry(oldd, "dirs", "/usr/share", false);
+	add_entry(oldd, "dirs", "/usr/empty", false);
+	add_entry(newd, "files", "/usr/keep", true);
+	add_entry(newd, "dirs", "/usr/share", false);
+
+	write_file("usr/modified", "modified by the user");
+	ATF_REQUIRE_EQ(unlink("usr/missing"), 0);
+
+	ATF_REQUIRE_EQ(xbps_remove_obsoletes(&xh, "foo", "1.1_1",
+	    "foo-1.1_1", oldd, newd), 0);
+
+	/* entries in the new package */
+	ATF_CHECK(exists("usr/keep"));
+	ATF_CHECK(exists("usr/share"));
+	/* obsolete file matching its hash, dangling link and dir */
+	ATF_CHECK(!exists("usr/obsolete"));
+	ATF_CHECK(!exists("usr/dangling"));
+	ATF_CHECK(!exists("usr/empty"));
+	/* modified or unverifiable files, links to files, /usr links */
+	ATF_CHECK(exists("usr/modified"));
+	ATF_CHECK(exists("usr/nohash"));
+	ATF_CHECK(exists("usr/link"));
+	ATF_CHECK(exists("bin"));
+
+	prop_object_release(oldd);
+	prop_object_release(newd);
+}
+
+ATF_TC(remove_obsoletes_threads_test);
+ATF_TC_HEAD(remove_obsoletes_threads_test, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Test xbps_remove_obsoletes with "
+	    "enough obsolete files to check their hashes in parallel");
+}
+ATF_TC_BODY(remove_obsoletes_threads_test, tc)
+{
+	struct xbps_handle xh;
+	prop_dictionary_t oldd, newd;
+	char file[PATH_MAX];
+	int i;
+
+	memset(&xh, 0, sizeof(xh));
+	oldd = prop_dictionary_create();
+	newd = prop_dictionary_create();
+
+	/*
+	 * Hashes are checked by up to one thread per CPU and every
+	 * 32 obsolete files; every other file is modified.
+	 */
+	ATF_REQUIRE_EQ(mkdir("usr", 0755), 0);
+	for (i = 0; i < 512; i++) {
+		snprintf(file, sizeof(file), "/usr/file%d", i);
+		write_file(file + 1, file);
+		add_entry(oldd, "files", file, true);
+		if (i % 2)
+			write_file(file + 1, "modified");
+	}
+	ATF_REQUIRE_EQ(xbps_remove_obsoletes(&xh, "foo", "1.1_1",
+	    "foo-1.1_1", oldd, newd), 0);
+
+	for (i = 0; i < 512; i++) {
+		snprintf(file, sizeof(file), "usr/file%d", i);
+		ATF_CHECK_MSG(exists(file) == (i % 2), "%s", file);
+	}
+	prop_object_release(oldd);
+	prop_object_release(newd);
+}
+
+ATF_TP_ADD_TCS(tp)
+{
+	ATF_TP_ADD_TC(tp, remove_obsoletes_test);
+	ATF_TP_ADD_TC(tp, remove_obsoletes_threads_test);
+
+	return atf_no_error();
+}
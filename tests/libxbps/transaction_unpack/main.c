@@ -0,0 +1,237 @@
+/*-
+ * Copyright (c) 2012 Juan Romero Pardines.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *-
+ */
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atf-c.h>
+#include "xbps_api_impl.h"
+
+static void
+xh_init(struct xbps_handle *xhp)
+{
+	/* binary packages are found in the work directory */
+	memset(xhp, 0, sizeof(*xhp));
+	xhp->cachedir = ".";
+}
+
+/*
+ * Adds pkgver to the transaction pkgs. Its binary package is an empty
+ * file in the work directory, with a files.plist sidecar (read
+ * instead of the archive) that contains `file'.
+ */
+static prop_dictionary_t
+add_pkg(prop_array_t pkgs, const char *pkgver, const char *tract,
+	const char *file)
+{
+	prop_dictionary_t pkgd, filesd, obj;
+	prop_array_t files;
+	struct stat st;
+	FILE *f;
+	char *pkgname, *binpkg, *sidecar;
+
+	ATF_REQUIRE((pkgname = xbps_pkg_name(pkgver)) != NULL);
+	binpkg = xbps_xasprintf("%s.noarch.xbps", pkgver);
+	sidecar = xbps_xasprintf("%s.files.plist", binpkg);
+
+	ATF_REQUIRE((f = fopen(binpkg, "w")) != NULL);
+	ATF_REQUIRE_EQ(fclose(f), 0);
+	ATF_REQUIRE_EQ(stat(binpkg, &st), 0);
+
+	obj = prop_dictionary_create();
+	prop_dictionary_set_cstring(obj, "file", file);
+	files = prop_array_create();
+	prop_array_add(files, obj);
+	filesd = prop_dictionary_create();
+	prop_dictionary_set(filesd, "files", files);
+	prop_dictionary_set_uint64(filesd, "filename-size", st.st_size);
+	prop_dictionary_set_uint64(filesd, "filename-mtime", st.st_mtime);
+	ATF_REQUIRE(prop_dictionary_externalize_to_file(filesd, sidecar));
+	prop_object_release(obj);
+	prop_object_release(files);
+	prop_object_release(filesd);
+
+	pkgd = prop_dictionary_create();
+	prop_dictionary_set_cstring(pkgd, "pkgver", pkgver);
+	prop_dictionary_set_cstring(pkgd, "pkgname", pkgname);
+	prop_dictionary_set_cstring(pkgd, "transaction", tract);
+	prop_dictionary_set_cstring(pkgd, "repository", "/nonexistent");
+	prop_dictionary_set_cstring(pkgd, "filename", binpkg);
+	ATF_REQUIRE(prop_array_add(pkgs, pkgd));
+	prop_object_release(pkgd);
+
+	free(pkgname);
+	free(binpkg);
+	free(sidecar);
+
+	return pkgd;
+}
+
+static void
+add_array_str(prop_dictionary_t d, const char *key, const char *str)
+{
+	prop_array_t a;
+
+	a = prop_array_create();
+	prop_array_add_cstring(a, str);
+	ATF_REQUIRE(prop_dictionary_set(d, key, a));
+	prop_object_release(a);
+}
+
+static unsigned int
+batch_size(struct xbps_handle *xhp, prop_array_t pkgs, unsigned int idx,
+	   unsigned int maxpkgs)
+{
+	unsigned int n = 0;
+
+	ATF_REQUIRE_EQ(xbps_transaction_unpack_batch_size(xhp, pkgs, idx,
+	    maxpkgs, &n), 0);
+	return n;
+}
+
+ATF_TC(unpack_batch_independent_test);
+ATF_TC_HEAD(unpack_batch_independent_test, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Test xbps_transaction_unpack_batch_size "
+	    "with independent packages");
+}
+ATF_TC_BODY(unpack_batch_independent_test, tc)
+{
+	struct xbps_handle xh;
+	prop_array_t pkgs;
+
+	xh_init(&xh);
+	pkgs = prop_array_create();
+	add_pkg(pkgs, "foo-1.0_1", "install", "/usr/bin/foo");
+	add_pkg(pkgs, "bar-1.0_1", "install", "/usr/bin/bar");
+	add_pkg(pkgs, "baz-1.0_1", "install", "/usr/bin/baz");
+
+	ATF_REQUIRE_EQ(batch_size(&xh, pkgs, 0, 8), 3);
+	ATF_REQUIRE_EQ(batch_size(&xh, pkgs, 1, 8), 2);
+	ATF_REQUIRE_EQ(batch_size(&xh, pkgs, 2, 8), 1);
+	/* up to maxpkgs packages */
+	ATF_REQUIRE_EQ(batch_size(&xh, pkgs, 0, 2), 2);
+
+	prop_object_release(pkgs);
+}
+
+ATF_TC(unpack_batch_depends_test);
+ATF_TC_HEAD(unpack_batch_depends_test, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Test xbps_transaction_unpack_batch_size "
+	    "with packages depending on a package of the batch");
+}
+ATF_TC_BODY(unpack_batch_depends_test, tc)
+{
+	struct xbps_handle xh;
+	prop_array_t pkgs;
+	prop_dictionary_t pkgd;
+
+	xh_init(&xh);
+	pkgs = prop_array_create();
+	add_pkg(pkgs, "libfoo-1.0_1", "install", "/usr/lib/libfoo.so.1");
+	add_pkg(pkgs, "bar-1.0_1", "install", "/usr/bin/bar");
+	pkgd = add_pkg(pkgs, "foo-1.0_1", "install", "/usr/bin/foo");
+	add_array_str(pkgd, "run_depends", "libfoo>=1.0");
+	pkgd = add_pkg(pkgs, "vfoo-1.0_1", "install", "/usr/bin/vfoo");
+	add_array_str(pkgd, "provides", "virtual-foo-1.0_1");
+	pkgd = add_pkg(pkgs, "baz-1.0_1", "install", "/usr/bin/baz");
+	add_array_str(pkgd, "run_depends", "virtual-foo>=0");
+
+	/* foo depends on libfoo */
+	ATF_REQUIRE_EQ(batch_size(&xh, pkgs, 0, 8), 2);
+	/* baz depends on virtual-foo, provided by vfoo */
+	ATF_REQUIRE_EQ(batch_size(&xh, pkgs, 2, 8), 2);
+	ATF_REQUIRE_EQ(batch_size(&xh, pkgs, 4, 8), 1);
+
+	prop_object_release(pkgs);
+}
+
+ATF_TC(unpack_batch_files_test);
+ATF_TC_HEAD(unpack_batch_files_test, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Test xbps_transaction_unpack_batch_size "
+	    "with packages sharing a file");
+}
+ATF_TC_BODY(unpack_batch_files_test, tc)
+{
+	struct xbps_handle xh;
+	prop_array_t pkgs;
+
+	xh_init(&xh);
+	pkgs = prop_array_create();
+	add_pkg(pkgs, "foo-1.0_1", "install", "/usr/bin/foo");
+	add_pkg(pkgs, "bar-1.0_1", "install", "/usr/bin/bar");
+	add_pkg(pkgs, "foo-alt-1.0_1", "install", "/usr/bin/foo");
+	add_pkg(pkgs, "baz-1.0_1", "install", "/usr/bin/baz");
+
+	ATF_REQUIRE_EQ(batch_size(&xh, pkgs, 0, 8), 2);
+	ATF_REQUIRE_EQ(batch_size(&xh, pkgs, 1, 8), 3);
+
+	prop_object_release(pkgs);
+}
+
+ATF_TC(unpack_batch_alone_test);
+ATF_TC_HEAD(unpack_batch_alone_test, tc)
+{
+	atf_tc_set_md_var(tc, "descr", "Test xbps_transaction_unpack_batch_size "
+	    "with updated packages and unknown files");
+}
+ATF_TC_BODY(unpack_batch_alone_test, tc)
+{
+	struct xbps_handle xh;
+	prop_array_t pkgs;
+	prop_dictionary_t pkgd;
+
+	xh_init(&xh);
+	pkgs = prop_array_create();
+	add_pkg(pkgs, "foo-1.0_1", "install", "/usr/bin/foo");
+	add_pkg(pkgs, "bar-1.1_1", "update", "/usr/bin/bar");
+	add_pkg(pkgs, "baz-1.0_1", "install", "/usr/bin/baz");
+	pkgd = add_pkg(pkgs, "blah-1.0_1", "install", "/usr/bin/blah");
+	prop_dictionary_set_cstring(pkgd, "filename", "missing.noarch.xbps");
+	add_pkg(pkgs, "qux-1.0_1", "install", "/usr/bin/qux");
+
+	/* updated packages are unpacked alone */
+	ATF_REQUIRE_EQ(batch_size(&xh, pkgs, 0, 8), 1);
+	ATF_REQUIRE_EQ(batch_size(&xh, pkgs, 1, 8), 1);
+	/* so are packages whose files are unknown */
+	ATF_REQUIRE_EQ(batch_size(&xh, pkgs, 2, 8), 1);
+	ATF_REQUIRE_EQ(batch_size(&xh, pkgs, 3, 8), 1);
+	ATF_REQUIRE_EQ(batch_size(&xh, pkgs, 4, 8), 1);
+
+	prop_object_release(pkgs);
+}
+
+ATF_TP_ADD_TCS(tp)
+{
+	ATF_TP_ADD_TC(tp, unpack_batch_independent_test);
+	ATF_TP_ADD_TC(tp, unpack_batch_depends_test);
+	ATF_TP_ADD_TC(tp, unpack_batch_files_test);
+	ATF_TP_ADD_TC(tp, unpack_batch_alone_test);
+
+	return atf_no_error();
+}
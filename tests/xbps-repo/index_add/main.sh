@@ -0,0 +1,86 @@
+#! /usr/bin/env atf-sh
+#
+# xbps-repo(8) index-add -i must write the same index.plist and
+# index-files.plist than a full index-add with the same packages.
+#
+# Every package is registered in two repositories: `full' is updated
+# by index-add and `incr' by index-add -i; both index files are
+# inflated and compared after every run.
+
+# Creates the binary package $1 (pkgver) with a single file, in both
+# repositories: <repo>/noarch/<binpkg> and a symlink to it.
+mkpkg() {
+	rm -rf destdir
+	mkdir -p destdir/usr/share/$1
+	echo "$1" > destdir/usr/share/$1/$1.txt
+	atf_check -o ignore -e ignore \
+		xbps-create -A noarch -n "$1" -s "$1 package" destdir
+	for r in full incr; do
+		mkdir -p $r/noarch
+		cp -p $1.noarch.xbps $r/noarch
+		ln -sf noarch/$1.noarch.xbps $r/$1.noarch.xbps
+	done
+	rm -f $1.noarch.xbps
+}
+
+# Registers the packages $@ (pkgvers) in both repositories and
+# compares their index files.
+index_add() {
+	fargs=
+	iargs=
+	for p in "$@"; do
+		fargs="$fargs $PWD/full/$p.noarch.xbps"
+		iargs="$iargs $PWD/incr/$p.noarch.xbps"
+	done
+	atf_check -o ignore -e ignore \
+		xbps-repo -C $PWD/xbps.conf index-add $fargs
+	atf_check -o ignore -e ignore \
+		xbps-repo -C $PWD/xbps.conf -i index-add $iargs
+	test -f incr/index-state.plist || atf_fail "index-state.plist missing"
+	for f in index.plist index-files.plist; do
+		gzip -dc full/$f > full.plist || atf_fail "full/$f: bad gzip"
+		gzip -dc incr/$f > incr.plist || atf_fail "incr/$f: bad gzip"
+		atf_check cmp full.plist incr.plist
+	done
+}
+
+atf_test_case incremental
+
+incremental_head() {
+	atf_set "descr" "xbps-repo(8) index-add -i: same index files " \
+		"than a full index-add, including segment compaction"
+}
+
+incremental_body() {
+	: > xbps.conf
+	mkdir full incr
+
+	mkpkg foo-1.0_1
+	mkpkg bar-1.0_1
+	mkpkg baz-1.0_1
+	index_add foo-1.0_1 bar-1.0_1 baz-1.0_1
+
+	# Every run appends a segment; once there are more than 10
+	# segments with these small index files, the next run compacts
+	# them. bar is updated (its entry is removed from an existing
+	# segment) and foo is registered again (nothing to do).
+	i=1
+	while [ $i -le 14 ]; do
+		mkpkg pkg$i-1.0_1
+		index_add pkg$i-1.0_1
+		case $i in
+		4)	mkpkg bar-1.1_1
+			index_add bar-1.1_1;;
+		9)	index_add foo-1.0_1;;
+		esac
+		i=$(($i + 1))
+	done
+
+	# Register all packages again, after the compaction.
+	mkpkg baz-1.1_1
+	index_add foo-1.0_1 bar-1.1_1 baz-1.1_1 pkg1-1.0_1 pkg14-1.0_1
+}
+
+atf_init_test_cases() {
+	atf_add_test_case incremental
+}